@@ -220,15 +220,18 @@ int socket_receive(SOCKET socket, void* buffer, int len, const unsigned* timeout
 				return TIO_ERROR_TIMEOUT;
 			}
 
-			tv.tv_sec = *timeout_in_seconds;
+			tv.tv_sec = time_left;
 			tv.tv_usec = 0;
 
 			FD_ZERO(&recvset);
 			FD_SET(socket, &recvset);
 
-			ret = select(0, &recvset, NULL, NULL, (timeout_in_seconds ? &tv : NULL));
+			//
+			// first parameter is ignored on Windows
+			//
+			ret = select((int)socket + 1, &recvset, NULL, NULL, &tv);
 
-			if(ret != 0)
+			if(ret < 0)
 			{
 				pr1_set_last_error_description("Error reading data from server. Server is down or there is a network problem.");
 				return TIO_ERROR_NETWORK;
@@ -261,6 +264,39 @@ int socket_receive(SOCKET socket, void* buffer, int len, const unsigned* timeout
 	return received;
 }
 
+//
+// Waits until the socket has something to read, without consuming anything.
+// A timeout here leaves the stream untouched, so the caller can try again
+//
+int socket_wait_readable(SOCKET socket, unsigned timeout_in_seconds)
+{
+	int ret;
+	fd_set recvset;
+	struct timeval tv;
+
+	tv.tv_sec = timeout_in_seconds;
+	tv.tv_usec = 0;
+
+	FD_ZERO(&recvset);
+	FD_SET(socket, &recvset);
+
+	//
+	// first parameter is ignored on Windows
+	//
+	ret = select((int)socket + 1, &recvset, NULL, NULL, &tv);
+
+	if(ret < 0)
+	{
+		pr1_set_last_error_description("Error reading data from server. Server is down or there is a network problem.");
+		return TIO_ERROR_NETWORK;
+	}
+
+	if(ret == 0)
+		return TIO_ERROR_TIMEOUT;
+
+	return 0;
+}
+
 /*
 int socket_receive_if_available(SOCKET socket, void* buffer, unsigned int len)
 {
@@ -715,9 +751,28 @@ int pr1_message_receive(SOCKET socket, struct PR1_MESSAGE** pr1_message,
 	int result;
 	struct PR1_MESSAGE_HEADER pr1_message_header;
 	void* receive_buffer;
+
+	//
+	// The header timeout is only about waiting for a message to start. Once we
+	// read any byte of it, a timeout leaves the stream in the middle of a message,
+	// so it's a connection error, not a "nothing arrived yet"
+	//
+	if(message_header_timeout_in_seconds)
+	{
+		result = socket_wait_readable(socket, *message_header_timeout_in_seconds);
+
+		if(TIO_FAILED(result))
+			return result;
+	}
 	
 	result = socket_receive(socket, &pr1_message_header, sizeof(struct PR1_MESSAGE_HEADER), message_header_timeout_in_seconds);
 
+	if(result == TIO_ERROR_TIMEOUT)
+	{
+		pr1_set_last_error_description("Timeout receiving message header from server");
+		return TIO_ERROR_NETWORK;
+	}
+
 	if(TIO_FAILED(result))
 		return result;
 
@@ -738,22 +793,27 @@ int pr1_message_receive(SOCKET socket, struct PR1_MESSAGE** pr1_message,
 		pr1_message_header.message_size,
 		message_payload_timeout_in_seconds);
 
-	if((unsigned)result < pr1_message_header.message_size)
+	if(TIO_FAILED(result))
 	{
-		//
-		// We didn't receive the payload before the timeout.
-		// We will consider it to be an error and the connection in invalid state from now on
-		//
 		pr1_message_delete(*pr1_message);
 		*pr1_message = NULL;
+
+		if(result != TIO_ERROR_TIMEOUT)
+			return result;
+
+		pr1_set_last_error_description("Timeout receiving message payload from server");
 		return TIO_ERROR_NETWORK;
 	}
 
-	if(TIO_FAILED(result))
+	if((unsigned)result < pr1_message_header.message_size)
 	{
+		//
+		// We didn't receive the payload before the timeout.
+		// We will consider it to be an error and the connection in invalid state from now on
+		//
 		pr1_message_delete(*pr1_message);
 		*pr1_message = NULL;
-		return result;
+		return TIO_ERROR_NETWORK;
 	}
 
 	pr1_message_parse(*pr1_message);
@@ -1040,6 +1100,7 @@ int tio_connect(const char* host, short port, struct TIO_CONNECTION** connection
 
 	if (server == NULL) {
 		pr1_set_last_error_description("Can't resolve server name.");
+		closesocket(sockfd);
 		return TIO_ERROR_NETWORK;
 	}
 
@@ -1050,6 +1111,7 @@ int tio_connect(const char* host, short port, struct TIO_CONNECTION** connection
 	if (connect(sockfd,(struct sockaddr *) &serv_addr,sizeof(serv_addr)) < 0)
 	{
 		pr1_set_last_error_description("Error while trying to connect to server");
+		closesocket(sockfd);
 		return TIO_ERROR_NETWORK;
 	}
 
@@ -1376,14 +1438,16 @@ void on_event_receive(struct TIO_CONNECTION* connection, struct PR1_MESSAGE* eve
 		tio_dispatch_pending_events(connection, 0xFFFFFFFF);
 }
 
-int register_container(struct TIO_CONNECTION* connection, struct PR1_MESSAGE* message, const char* name, const char* group_name, struct TIO_CONTAINER** container)
+int register_container(struct TIO_CONNECTION* connection, struct PR1_MESSAGE* message, const char* name, const char* group_name, const char* type, struct TIO_CONTAINER** container)
 {
 	struct TIO_CONTAINER* new_container;
 	int name_len;
 	int group_name_len;
+	int type_len;
 
 	char* name_copy;
 	char* group_name_copy;
+	char* type_copy;
 	
 	int handle;
 	struct PR1_MESSAGE_FIELD_HEADER* handle_field;
@@ -1397,8 +1461,9 @@ int register_container(struct TIO_CONNECTION* connection, struct PR1_MESSAGE* me
 
 	name_len = strlen32(name) + 1;
 	group_name_len = group_name ? strlen32(group_name) + 1 : 0;
+	type_len = type ? strlen32(type) + 1 : 0;
 
-	new_container = (struct TIO_CONTAINER*)malloc(sizeof(struct TIO_CONTAINER) + name_len + group_name_len);
+	new_container = (struct TIO_CONTAINER*)malloc(sizeof(struct TIO_CONTAINER) + name_len + group_name_len + type_len);
 
 	name_copy = (char*) &new_container[1];
 	memcpy(name_copy, name, name_len);
@@ -1411,6 +1476,14 @@ int register_container(struct TIO_CONNECTION* connection, struct PR1_MESSAGE* me
 	else
 		group_name_copy = NULL;
 
+	if(type_len)
+	{
+		type_copy = name_copy + name_len + group_name_len;
+		memcpy(type_copy, type, type_len);
+	}
+	else
+		type_copy = NULL;
+
 	new_container->connection = connection;
 	new_container->handle = handle;
 	new_container->event_callback = NULL;
@@ -1419,6 +1492,7 @@ int register_container(struct TIO_CONNECTION* connection, struct PR1_MESSAGE* me
 	new_container->subscription_cookie = NULL;
 	new_container->group_name = group_name_copy;
 	new_container->name = name_copy;
+	new_container->type = type_copy;
 
 	if(handle >= connection->containers_count)
 	{
@@ -1440,11 +1514,14 @@ int on_group_new_container(struct TIO_CONNECTION* connection, struct PR1_MESSAGE
 	int ret = TIO_SUCCESS;
 	struct PR1_MESSAGE_FIELD_HEADER* name_field;
 	struct PR1_MESSAGE_FIELD_HEADER* group_name_field;
+	struct PR1_MESSAGE_FIELD_HEADER* type_field;
 	char* container_name = NULL;
 	char* group_name = NULL;
+	char* container_type = NULL;
 
 	name_field = pr1_message_field_find_by_id(message, MESSAGE_FIELD_ID_CONTAINER_NAME);
 	group_name_field = pr1_message_field_find_by_id(message, MESSAGE_FIELD_ID_GROUP_NAME);
+	type_field = pr1_message_field_find_by_id(message, MESSAGE_FIELD_ID_CONTAINER_TYPE);
 
 	if(name_field == NULL || group_name_field ==  NULL)
 	{
@@ -1454,14 +1531,19 @@ int on_group_new_container(struct TIO_CONNECTION* connection, struct PR1_MESSAGE
 
 	pr1_message_field_get_string_malloc(name_field, &container_name);
 	pr1_message_field_get_string_malloc(group_name_field, &group_name);
+
+	if(type_field)
+		pr1_message_field_get_string_malloc(type_field, &container_type);
 	
-	
-	register_container(connection, message, container_name, group_name, NULL);
+	register_container(connection, message, container_name, group_name, container_type, NULL);
 
 clean_up_and_return:
 	if(container_name)
 		free(container_name);
 
+	if(container_type)
+		free(container_type);
+
 	if(group_name)
 		free(group_name);
 
@@ -1482,8 +1564,9 @@ int tio_receive_next_pending_event(struct TIO_CONNECTION* connection, const unsi
 	check_not_on_network_batch(connection);
 
 	//
-	// In some weird situation (like server sending just the message headed and hanging right
-	// after that) we can wait for twice the timeout value. I don't think it's an issue...
+	// TIO_ERROR_TIMEOUT means no message has started to arrive. If the server stops
+	// in the middle of a message we'll return TIO_ERROR_NETWORK, since the stream
+	// can't be used anymore
 	//
 	result = pr1_message_receive(connection->socket, &received_message, timeout_in_seconds, timeout_in_seconds);
 
@@ -1601,7 +1684,7 @@ int tio_container_send_command_and_get_data_response(
 	struct PR1_MESSAGE* response = NULL;
 	int result;
 
-	BOOL inside_network_batch = !container->connection->wait_for_answer;
+	int inside_network_batch = !container->connection->wait_for_answer;
 
 	//
 	// We must finish the network batch (i.e. get all server
@@ -1681,7 +1764,7 @@ int tio_create_or_open(struct TIO_CONNECTION* connection, unsigned int command_i
 	if(TIO_FAILED(result)) 
 		goto clean_up_and_return;
 
-	register_container(connection, response, name, NULL, container);
+	register_container(connection, response, name, NULL, type, container);
 
 clean_up_and_return:
 	pr1_message_delete(response);
@@ -1741,14 +1824,11 @@ clean_up_and_return:
 
 unsigned long get_n_readable_bytes(SOCKET sock) 
 {
-	unsigned long n = (unsigned long)(-1);
-
+	unsigned n;
 
-	if (ioctlsocket(sock, FIONREAD, &n) < 0)
-	{
-		/* look in WSAGetLastError() for the error code */
+	if(socket_pending_bytes(sock, &n) != 0)
 		return 0;
-	}
+
 	return n;
 }
 
@@ -1885,6 +1965,11 @@ const char* tio_container_name(struct TIO_CONTAINER* container)
 	return container->name;
 }
 
+const char* tio_container_type(struct TIO_CONTAINER* container)
+{
+	return container->type;
+}
+
 int tio_container_input_command(struct TIO_CONTAINER* container, unsigned short command_id, const struct TIO_DATA* key, const struct TIO_DATA* value, const struct TIO_DATA* metadata)
 {
 	struct PR1_MESSAGE* response = NULL;
@@ -2241,10 +2326,10 @@ void tio_begin_network_batch(struct TIO_CONNECTION* connection)
 	connection->wait_for_answer = FALSE;
 }
 
-void tio_finish_network_batch(struct TIO_CONNECTION* connection)
+int tio_finish_network_batch(struct TIO_CONNECTION* connection)
 {
 	struct PR1_MESSAGE* response;
-	int result, a;
+	int result, a, errors = 0;
 	assert(connection->wait_for_answer == FALSE);
 
 	connection->wait_for_answer = TRUE;
@@ -2253,12 +2338,21 @@ void tio_finish_network_batch(struct TIO_CONNECTION* connection)
 	{
 		result = tio_receive_until_not_event(connection, &response);
 
-		if(result > 0)
-			pr1_message_delete(response);
+		if(TIO_FAILED(result))
+		{
+			errors++;
+			continue;
+		}
+
+		if(TIO_FAILED(pr1_message_get_error_code(response)))
+			errors++;
+
+		pr1_message_delete(response);
 	}
 
 	connection->pending_event_count = 0;
-	
+
+	return errors;
 }
 
 
@@ -142,7 +142,10 @@ int tio_connect(const char* host, short port, struct TIO_CONNECTION** connection
 void tio_disconnect(struct TIO_CONNECTION* connection);
 
 void tio_begin_network_batch(struct TIO_CONNECTION* connection);
-void tio_finish_network_batch(struct TIO_CONNECTION* connection);
+//
+// returns the number of commands the server answered with an error
+//
+int tio_finish_network_batch(struct TIO_CONNECTION* connection);
 
 int tio_create(struct TIO_CONNECTION* connection, const char* name, const char* type, struct TIO_CONTAINER** container);
 int tio_open(struct TIO_CONNECTION* connection, const char* name, const char* type, struct TIO_CONTAINER** container);
@@ -155,6 +158,7 @@ int tio_dispatch_pending_events(struct TIO_CONNECTION* connection, unsigned int
 int tio_ping(struct TIO_CONNECTION* connection, char* payload);
 
 const char* tio_container_name(struct TIO_CONTAINER* container);
+const char* tio_container_type(struct TIO_CONTAINER* container);
 
 int tio_container_propset(struct TIO_CONTAINER* container, const struct TIO_DATA* key, const struct TIO_DATA* value);
 int tio_container_propget(struct TIO_CONTAINER* container, const struct TIO_DATA* search_key, struct TIO_DATA* value);
@@ -193,6 +197,96 @@ struct KEY_AND_VALUE
 typedef void (*tio_plugin_start_t)(void* container_manager, struct KEY_AND_VALUE* parameters);
 typedef void (*tio_plugin_stop_t)();
 
+//
+// Plugin API v2. Plugins exporting tio_plugin_start_v2 run it on their own
+// thread. Data is passed as views: pointers are borrowed and only valid
+// during the call or callback that received them, nothing is copied
+// to or from TIO_DATA
+//
+#define TIO_PLUGIN_API_VERSION			2
+
+//
+// sent by dispatch_events after events were dropped because the plugin
+// didn't consume them fast enough. Subscriptions must be reloaded
+//
+#define TIO_EVENT_QUEUE_OVERFLOW		0x24
+
+struct TIO_DATA_VIEW
+{
+	unsigned int data_type;
+	int int_;
+	double double_;
+	const char* string_;
+	unsigned int string_size_;
+};
+
+//
+// command is TIO_COMMAND_SET, INSERT, PUSH_BACK, PUSH_FRONT, DELETE or CLEAR.
+// Unused fields must have TIO_DATA_TYPE_NONE
+//
+struct TIO_PLUGIN_OPERATION
+{
+	unsigned int command;
+	struct TIO_DATA_VIEW key;
+	struct TIO_DATA_VIEW value;
+	struct TIO_DATA_VIEW metadata;
+};
+
+struct TIO_PLUGIN_EVENT
+{
+	void* cookie; /* the subscription cookie */
+	unsigned int event_code;
+	struct TIO_DATA_VIEW key;
+	struct TIO_DATA_VIEW value;
+	struct TIO_DATA_VIEW metadata;
+};
+
+typedef void (*tio_plugin_record_callback_t)(void* /*cookie*/, const struct TIO_DATA_VIEW* /*key*/,
+											 const struct TIO_DATA_VIEW* /*value*/, const struct TIO_DATA_VIEW* /*metadata*/);
+
+typedef void (*tio_plugin_events_callback_t)(void* /*cookie*/, const struct TIO_PLUGIN_EVENT* /*events*/, unsigned int /*count*/);
+
+struct TIO_PLUGIN_API
+{
+	unsigned int version;
+	void* context;
+
+	int (*create)(void* context, const char* name, const char* type, void** container);
+	int (*open)(void* context, const char* name, const char* type, void** container);
+	int (*close)(void* context, void* container);
+
+	//
+	// Applies the operations in order, in a single trip to the server thread.
+	// Returns the number of operations that failed
+	//
+	// Once the server is stopping, batch, subscribe and dispatch_events return
+	// TIO_ERROR_GENERIC. tio_plugin_start_v2 must return then, the server
+	// waits for it
+	//
+	int (*batch)(void* context, void* container, const struct TIO_PLUGIN_OPERATION* operations, unsigned int count);
+
+	int (*get)(void* context, void* container, const struct TIO_DATA_VIEW* search_key, tio_plugin_record_callback_t callback, void* cookie);
+	int (*query)(void* context, void* container, int start, int end, tio_plugin_record_callback_t callback, void* cookie);
+	int (*get_count)(void* context, void* container, int* count);
+
+	//
+	// Events are queued and delivered by dispatch_events, never from the
+	// thread that changed the container. Events already queued are still
+	// delivered after unsubscribe returns
+	//
+	int (*subscribe)(void* context, void* container, const char* start, void* cookie, unsigned int* subscription);
+	int (*unsubscribe)(void* context, void* container, unsigned int subscription);
+
+	//
+	// Waits up to timeout_in_milliseconds for events and delivers up to
+	// max_events of them in a single callback. Returns how many were delivered
+	//
+	int (*dispatch_events)(void* context, unsigned int max_events, unsigned int timeout_in_milliseconds,
+						   tio_plugin_events_callback_t callback, void* cookie);
+};
+
+typedef void (*tio_plugin_start_v2_t)(struct TIO_PLUGIN_API* api, struct KEY_AND_VALUE* parameters);
+
 #ifdef __cplusplus
 } // extern "C" 
 #endif
@@ -80,6 +80,11 @@ struct TIO_CONTAINER
 	const char* group_name;
 	const char* name;
 
+	//
+	// NULL if it was opened without type
+	//
+	const char* type;
+
 	void* wait_and_pop_next_cookie;
 	struct TIO_CONNECTION* connection;
 };
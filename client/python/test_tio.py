@@ -5,6 +5,18 @@ import datetime
 import uuid
 import sys
 import collections
+import os
+import subprocess
+import tempfile
+import shutil
+import socket
+import time
+
+#
+# tests that start their own servers (restart, replication) only run
+# when this points to the tiodb binary
+#
+TIO_SERVER_PATH = os.environ.get('TIO_SERVER_PATH')
 
 class ListReceiveCounter(object):
     def __init__(self, test_case):
@@ -76,6 +88,42 @@ class HubMirror(object):
     def on_event(self, container, event_name, k, v, m):
         self.containers[container.name].on_event(container, event_name, k, v, m)
 
+class TioServerProcess(object):
+    def __init__(self, port, data_path, *args):
+        self.port = port
+        self.data_path = data_path
+        self.args = list(args)
+        self.process = None
+
+    def start(self):
+        command = [TIO_SERVER_PATH, '--port', str(self.port), '--data-path', self.data_path] + self.args
+        self.process = subprocess.Popen(command, stdout=open(os.devnull, 'w'), stderr=subprocess.STDOUT)
+
+        for x in xrange(100):
+            try:
+                socket.create_connection(('localhost', self.port)).close()
+                return
+            except socket.error:
+                time.sleep(0.1)
+
+        raise Exception('server did not start')
+
+    #
+    # no clean shutdown, so a restart is also a crash recovery test
+    #
+    def stop(self):
+        if self.process:
+            self.process.kill()
+            self.process.wait()
+            self.process = None
+
+    def restart(self):
+        self.stop()
+        self.start()
+
+    def connect(self):
+        return tioclient.connect('localhost:%d' % self.port)
+
 class tioTestCase(unittest.TestCase):
     def setUp(self):
         self.tio = tioclient.connect('localhost')
@@ -131,7 +179,7 @@ class PerfomanceTests(tioTestCase):
 
 class ContainerTests(tioTestCase):
     def test_create_all_container_types(self):
-        types = ('volatile_list', 'volatile_map', 'persistent_list', 'persistent_map')
+        types = ('volatile_list', 'volatile_map', 'persistent_list', 'persistent_map', 'btree_map', 'lsm_map')
 
         for t in types:
             self.tio.create(t + 'container', t)
@@ -293,6 +341,38 @@ class ContainerTests(tioTestCase):
         container.wait_and_pop_next(f)
         container.append('xpto')
 
+    def test_wait_and_pop_key_existing(self):
+        popped = []
+        def f(container, event_name, key, value, metadata):
+            popped.append((key, value))
+
+        container = self.tio.create(self.get_me_a_random_container_name(), 'volatile_map')
+        container.set('k', 'v')
+        container.wait_and_pop_key('k', f)
+
+        self.tio.ping()
+        container.dispatch_pending_events()
+
+        self.assertEqual(popped, [('k', 'v')])
+        self.assertEqual(container.get_count(), 0)
+
+    def test_wait_and_pop_key_close(self):
+        def f(container, event_name, key, value, metadata):
+            pass
+
+        name = self.get_me_a_random_container_name()
+        container = self.tio.create(name, 'volatile_map')
+        container.wait_and_pop_key('k', f)
+        container.close()
+
+        #
+        # the closed handle shouldn't take the record
+        #
+        container = self.tio.open(name)
+        container.set('k', 'v')
+
+        self.assertEqual(container.get('k'), 'v')
+
     def test_events(self):
         container = self.tio.create(self.get_me_a_random_container_name(), 'volatile_list')
         mirror = ListMirror(self)
@@ -646,5 +726,157 @@ class ContainerTests(tioTestCase):
 
         self.tio.ReceivePendingAnswers()
         
+@unittest.skipIf(not TIO_SERVER_PATH, 'TIO_SERVER_PATH not set')
+class StorageRestartTests(unittest.TestCase):
+    def setUp(self):
+        self.data_path = tempfile.mkdtemp()
+        #
+        # 1MB memtable, so a few MB of records make lsm flush and compact
+        #
+        self.server = TioServerProcess(2705, self.data_path, '--lsm-memtable-size', '1')
+        self.server.start()
+
+    def tearDown(self):
+        self.server.stop()
+        shutil.rmtree(self.data_path)
+
+    def get_statistic(self, tio, name):
+        statistics = tio.open('__meta__/storage_statistics')
+        try:
+            return int(statistics.get(name))
+        except Exception:
+            return 0
+
+    def wait_for_statistic(self, tio, name, minimum):
+        for x in xrange(100):
+            if self.get_statistic(tio, name) >= minimum:
+                return
+            time.sleep(0.1)
+
+        self.fail('%s never got to %d' % (name, minimum))
+
+    def write_and_check_after_restart(self, container_type, record_count, value_size, wait_for=None, exact_count=True):
+        tio = self.server.connect()
+        container = tio.create('restart_test', container_type)
+        expected = {}
+
+        #
+        # every key is written twice, the second time with a different value
+        #
+        for pass_number in range(2):
+            for x in xrange(record_count):
+                key = 'key%06d' % x
+                value = ('%d-%d-' % (pass_number, x)).ljust(value_size, 'x')
+                container.set(key, value)
+                expected[key] = value
+
+        for x in xrange(0, record_count, 10):
+            key = 'key%06d' % x
+            container.delete(key)
+            del expected[key]
+
+        container.propset('some_property', 'some_value')
+
+        if wait_for:
+            self.wait_for_statistic(tio, *wait_for)
+
+        tio.close()
+
+        self.server.restart()
+
+        tio = self.server.connect()
+        container = tio.open('restart_test')
+
+        #
+        # lsm_map record count is an estimate
+        #
+        if exact_count:
+            self.assertEqual(container.get_count(), len(expected))
+
+        self.assertEqual(container.propget('some_property'), 'some_value')
+
+        records = dict((k, v) for k, v, m in container.query_with_key_and_metadata())
+        self.assertEqual(records, expected)
+
+        for key in sorted(expected.keys())[::97]:
+            self.assertEqual(container.get(key), expected[key])
+
+        return tio
+
+    def test_btree_map_restart(self):
+        #
+        # way more than a page of records, so nodes split and merge
+        #
+        self.write_and_check_after_restart('btree_map', 5000, 200)
+
+    def test_lsm_map_restart(self):
+        self.write_and_check_after_restart('lsm_map', 8000, 400, ('lsm_compactions', 1), exact_count=False)
+
+@unittest.skipIf(not TIO_SERVER_PATH, 'set TIO_SERVER_PATH to the tiodb executable to run these')
+class ReplicationTests(unittest.TestCase):
+    def setUp(self):
+        self.primary_path = tempfile.mkdtemp()
+        self.replica_path = tempfile.mkdtemp()
+        self.primary = TioServerProcess(2706, self.primary_path)
+        self.replica = TioServerProcess(2707, self.replica_path, '--replicate-from', 'localhost:2706')
+        self.primary.start()
+        self.replica.start()
+
+    def tearDown(self):
+        self.replica.stop()
+        self.primary.stop()
+        shutil.rmtree(self.primary_path)
+        shutil.rmtree(self.replica_path)
+
+    def wait_for_replica(self, tio, name, check):
+        for x in xrange(100):
+            try:
+                if check(tio.open(name)):
+                    return
+            except Exception:
+                pass
+            time.sleep(0.1)
+
+        self.fail('"%s" was never replicated' % name)
+
+    def test_replication(self):
+        primary = self.primary.connect()
+        replica = self.replica.connect()
+
+        persistent = primary.create('replicated_map', 'persistent_map')
+        volatile = primary.create('replicated_list', 'volatile_list')
+
+        for x in xrange(100):
+            persistent.set('key%d' % x, 'value%d' % x)
+            volatile.push_back(x)
+
+        self.wait_for_replica(replica, 'replicated_map', lambda c: c.get_count() == 100)
+        self.wait_for_replica(replica, 'replicated_list', lambda c: c.get_count() == 100)
+
+        replicated_map = replica.open('replicated_map')
+        self.assertEqual(replicated_map.get('key42'), 'value42')
+        self.assertEqual(replica.open('replicated_list').get(42), 42)
+
+        #
+        # writes must go to the primary
+        #
+        self.assertRaises(Exception, replicated_map.set, 'key42', 'changed')
+        self.assertRaises(Exception, replicated_map.delete, 'key42')
+        self.assertRaises(Exception, replicated_map.clear)
+        self.assertRaises(Exception, replica.open('replicated_list').push_back, 100)
+        self.assertEqual(replicated_map.get('key42'), 'value42')
+
+        persistent.set('key42', 'changed')
+        persistent.delete('key0')
+
+        self.wait_for_replica(replica, 'replicated_map', lambda c: c.get_count() == 99 and c.get('key42') == 'changed')
+
+        #
+        # local containers can still be changed
+        #
+        local = replica.create('local_map', 'volatile_map')
+        local.set('a', 'b')
+        self.assertEqual(local.get('a'), 'b')
+
 if __name__ == '__main__':
     unittest.main()
\ No newline at end of file
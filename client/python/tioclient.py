@@ -457,7 +457,8 @@ class TioServerConnection(object):
 
                 self.HandleEvent(event)
 
-                if event.name == 'clear' or event.name == 'snapshot_end':
+                # journal subscriptions send a sequence even on clear and snapshot_end
+                if (event.name == 'clear' or event.name == 'snapshot_end') and currentParam + 1 == len(params):
                     event.data = None, None, None
                 else:
                     event.data = self.ReceiveDataAnswer(params, currentParam)
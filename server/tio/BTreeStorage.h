@@ -0,0 +1,1622 @@
+/*
+Tio: The Information Overlord
+Copyright 2010 Rodrigo Strauss (http://www.1bit.com.br)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+
+#include "Container.h"
+#include "OrderedKvStorage.h"
+#include "logdb.h"
+
+namespace tio {
+	namespace BTreeStorage
+	{
+		using OrderedKvStorage::IOrderedKvCursor;
+		using OrderedKvStorage::IOrderedKvTable;
+		using OrderedKvStorage::IOrderedKvDatabase;
+		using OrderedKvStorage::OrderedKvStorageManager;
+
+		//
+		// Page file layout:
+		//
+		//   page 0       BTREE_FILE_HEADER
+		//   page 1..n    tree nodes, overflow pages and free pages
+		//
+		// Every table is a B+tree ordered by key. Internal nodes keep the record
+		// count of each child, so records can also be found by index in O(log n),
+		// and leaves are linked to each other for ordered scans. The catalog,
+		// mapping table names to root pages, is a B+tree as well.
+		//
+		// Changes stay in memory until Commit, which appends the image of every
+		// changed page to the WAL, syncs it and then writes the pages to the page
+		// file without syncing. The page file is only synced on checkpoints, when
+		// the WAL starts over. Pages released by deletes go to a free list and
+		// are reused before the file grows
+		//
+		typedef unsigned int BTREE_PAGE;
+
+		static const BTREE_PAGE BTREE_INVALID_PAGE = 0; // page 0 is the header, never a node
+		static const unsigned int BTREE_PAGE_SIZE = 8192;
+		static const unsigned int BTREE_FILE_MAGIC = 0x45525442; // BTRE
+		static const unsigned int BTREE_WAL_MAGIC = 0x4C415742; // BWAL
+		static const unsigned int BTREE_FORMAT_VERSION = 1;
+
+		//
+		// records bigger than this have their value moved to overflow pages,
+		// so a node always has room for a few records
+		//
+		static const unsigned int BTREE_MAX_KEY_SIZE = BTREE_PAGE_SIZE / 8;
+		static const unsigned int BTREE_MAX_INLINE_RECORD = BTREE_PAGE_SIZE / 4;
+
+		//
+		// nodes smaller than this are merged with a sibling on delete
+		//
+		static const unsigned int BTREE_MIN_NODE_SIZE = BTREE_PAGE_SIZE / 4;
+
+		static const unsigned long long BTREE_WAL_CHECKPOINT_SIZE = 32 * 1024 * 1024;
+
+		struct BTREE_FILE_HEADER
+		{
+			unsigned int magic;
+			unsigned int version;
+			unsigned int pageSize;
+			BTREE_PAGE pageCount;
+			BTREE_PAGE freeListHead;
+			unsigned int freePageCount;
+			BTREE_PAGE catalogRoot;
+			unsigned int tableCount;
+		};
+
+		//
+		// WAL records with a generation different from the WAL header are
+		// leftovers from before the last checkpoint
+		//
+		struct BTREE_WAL_HEADER
+		{
+			unsigned int magic;
+			unsigned int generation;
+		};
+
+		//
+		// followed by pageCount (page number, page image) pairs
+		//
+		struct BTREE_WAL_RECORD
+		{
+			unsigned int magic;
+			unsigned int generation;
+			unsigned int pageCount;
+			unsigned int checksum;
+		};
+
+		inline unsigned int BTreeChecksum(const unsigned char* buffer, size_t size, unsigned int hash = 2166136261U)
+		{
+			for(size_t a = 0 ; a < size ; a++)
+			{
+				hash ^= buffer[a];
+				hash *= 16777619U;
+			}
+
+			return hash;
+		}
+
+		enum BTreePageType
+		{
+			pageTypeFree = 0,
+			pageTypeLeaf = 1,
+			pageTypeInternal = 2,
+			pageTypeOverflow = 3
+		};
+
+		//
+		// Decoded page. Leaves use keys and values, internal nodes use keys, children
+		// and counts (children[i] has the keys smaller than keys[i]). Overflow pages
+		// keep their data in values[0]. next is the next leaf, overflow or free page
+		//
+		struct BTREE_NODE
+		{
+			BTREE_NODE(BTREE_PAGE page, BTreePageType type) :
+				page(page),
+				type(type),
+				dirty(false),
+				next(BTREE_INVALID_PAGE),
+				prev(BTREE_INVALID_PAGE)
+			{}
+
+			BTREE_PAGE page;
+			BTreePageType type;
+			bool dirty;
+			BTREE_PAGE next, prev;
+			vector<string> keys;
+			vector<string> values;
+			vector<BTREE_PAGE> children;
+			vector<unsigned long long> counts;
+		};
+
+		//
+		// leaf item is keySize(2) + valueSize(4), internal item is keySize(2) + child(4) + count(8)
+		//
+		static const size_t BTREE_NODE_HEADER_SIZE = 12;
+		static const size_t BTREE_LEAF_ITEM_OVERHEAD = 6;
+		static const size_t BTREE_INTERNAL_ITEM_OVERHEAD = 14;
+		static const size_t BTREE_OVERFLOW_CAPACITY = BTREE_PAGE_SIZE - BTREE_NODE_HEADER_SIZE - sizeof(unsigned int);
+
+		inline size_t GetNodeSize(const BTREE_NODE& node)
+		{
+			size_t size = BTREE_NODE_HEADER_SIZE;
+
+			if(node.type == pageTypeLeaf)
+			{
+				for(size_t a = 0 ; a < node.keys.size() ; a++)
+					size += BTREE_LEAF_ITEM_OVERHEAD + node.keys[a].size() + node.values[a].size();
+			}
+			else if(node.type == pageTypeInternal)
+			{
+				size += sizeof(BTREE_PAGE) + sizeof(unsigned long long);
+
+				for(size_t a = 0 ; a < node.keys.size() ; a++)
+					size += BTREE_INTERNAL_ITEM_OVERHEAD + node.keys[a].size();
+			}
+			else if(node.type == pageTypeOverflow)
+				size += sizeof(unsigned int) + node.values[0].size();
+
+			return size;
+		}
+
+		class PageWriter
+		{
+			unsigned char* current_;
+			unsigned char* end_;
+		public:
+			PageWriter(unsigned char* buffer, size_t size) : current_(buffer), end_(buffer + size)
+			{}
+
+			template<typename T>
+			void Put(T value)
+			{
+				PutBytes(&value, sizeof(value));
+			}
+
+			void PutBytes(const void* buffer, size_t size)
+			{
+				if(current_ + size > end_)
+					throw std::runtime_error("btree: node doesn't fit the page");
+
+				memcpy(current_, buffer, size);
+				current_ += size;
+			}
+		};
+
+		class PageReader
+		{
+			const unsigned char* current_;
+			const unsigned char* end_;
+		public:
+			PageReader(const unsigned char* buffer, size_t size) : current_(buffer), end_(buffer + size)
+			{}
+
+			template<typename T>
+			T Get()
+			{
+				T value;
+				GetBytes(&value, sizeof(value));
+				return value;
+			}
+
+			void GetBytes(void* buffer, size_t size)
+			{
+				if(current_ + size > end_)
+					throw std::runtime_error("btree: corrupted page");
+
+				memcpy(buffer, current_, size);
+				current_ += size;
+			}
+
+			string GetString(size_t size)
+			{
+				if(current_ + size > end_)
+					throw std::runtime_error("btree: corrupted page");
+
+				string ret((const char*)current_, size);
+				current_ += size;
+				return ret;
+			}
+		};
+
+		inline void EncodeNode(const BTREE_NODE& node, unsigned char* buffer)
+		{
+			memset(buffer, 0, BTREE_PAGE_SIZE);
+
+			PageWriter writer(buffer, BTREE_PAGE_SIZE);
+
+			writer.Put<unsigned char>(static_cast<unsigned char>(node.type));
+			writer.Put<unsigned char>(0);
+			writer.Put<unsigned short>(static_cast<unsigned short>(node.keys.size()));
+			writer.Put<BTREE_PAGE>(node.next);
+			writer.Put<BTREE_PAGE>(node.prev);
+
+			if(node.type == pageTypeLeaf)
+			{
+				for(size_t a = 0 ; a < node.keys.size() ; a++)
+				{
+					writer.Put<unsigned short>(static_cast<unsigned short>(node.keys[a].size()));
+					writer.Put<unsigned int>(static_cast<unsigned int>(node.values[a].size()));
+					writer.PutBytes(node.keys[a].data(), node.keys[a].size());
+					writer.PutBytes(node.values[a].data(), node.values[a].size());
+				}
+			}
+			else if(node.type == pageTypeInternal)
+			{
+				writer.Put<BTREE_PAGE>(node.children[0]);
+				writer.Put<unsigned long long>(node.counts[0]);
+
+				for(size_t a = 0 ; a < node.keys.size() ; a++)
+				{
+					writer.Put<unsigned short>(static_cast<unsigned short>(node.keys[a].size()));
+					writer.Put<BTREE_PAGE>(node.children[a + 1]);
+					writer.Put<unsigned long long>(node.counts[a + 1]);
+					writer.PutBytes(node.keys[a].data(), node.keys[a].size());
+				}
+			}
+			else if(node.type == pageTypeOverflow)
+			{
+				writer.Put<unsigned int>(static_cast<unsigned int>(node.values[0].size()));
+				writer.PutBytes(node.values[0].data(), node.values[0].size());
+			}
+		}
+
+		inline shared_ptr<BTREE_NODE> DecodeNode(BTREE_PAGE page, const unsigned char* buffer)
+		{
+			PageReader reader(buffer, BTREE_PAGE_SIZE);
+
+			BTreePageType type = static_cast<BTreePageType>(reader.Get<unsigned char>());
+			reader.Get<unsigned char>();
+			unsigned short itemCount = reader.Get<unsigned short>();
+
+			shared_ptr<BTREE_NODE> node(new BTREE_NODE(page, type));
+
+			node->next = reader.Get<BTREE_PAGE>();
+			node->prev = reader.Get<BTREE_PAGE>();
+
+			if(type == pageTypeLeaf)
+			{
+				node->keys.reserve(itemCount);
+				node->values.reserve(itemCount);
+
+				for(unsigned short a = 0 ; a < itemCount ; a++)
+				{
+					unsigned short keySize = reader.Get<unsigned short>();
+					unsigned int valueSize = reader.Get<unsigned int>();
+					node->keys.push_back(reader.GetString(keySize));
+					node->values.push_back(reader.GetString(valueSize));
+				}
+			}
+			else if(type == pageTypeInternal)
+			{
+				node->children.push_back(reader.Get<BTREE_PAGE>());
+				node->counts.push_back(reader.Get<unsigned long long>());
+
+				for(unsigned short a = 0 ; a < itemCount ; a++)
+				{
+					unsigned short keySize = reader.Get<unsigned short>();
+					node->children.push_back(reader.Get<BTREE_PAGE>());
+					node->counts.push_back(reader.Get<unsigned long long>());
+					node->keys.push_back(reader.GetString(keySize));
+				}
+			}
+			else if(type == pageTypeOverflow)
+			{
+				unsigned int size = reader.Get<unsigned int>();
+				node->values.push_back(reader.GetString(size));
+			}
+			else if(type != pageTypeFree)
+				throw std::runtime_error("btree: corrupted page");
+
+			return node;
+		}
+
+		//
+		// Page file, WAL and page cache. Nodes are cached decoded. Dirty nodes
+		// are also kept in dirty_ until the commit, so clean nodes can be
+		// evicted at any time, they're equal to what's on disk
+		//
+		class BTreeFile : boost::noncopyable
+		{
+			string fileName_;
+			logdb::File pages_;
+			logdb::File wal_;
+
+			BTREE_FILE_HEADER header_;
+			bool headerDirty_;
+
+			unsigned int walGeneration_;
+			unsigned long long walOffset_;
+
+			typedef std::list<BTREE_PAGE> LruList;
+			typedef std::unordered_map<BTREE_PAGE, pair<shared_ptr<BTREE_NODE>, LruList::iterator> > NodeCache;
+			LruList lru_;
+			NodeCache cache_;
+			size_t maxCachedNodes_;
+
+			typedef std::map<BTREE_PAGE, shared_ptr<BTREE_NODE> > DirtyMap;
+			DirtyMap dirty_;
+
+			unsigned long long cacheHits_, cacheMisses_, commits_, checkpoints_;
+
+			void ReadPage(BTREE_PAGE page, unsigned char* buffer)
+			{
+				pages_.SetPointer(static_cast<logdb::LDB_OFFSET>(page) * BTREE_PAGE_SIZE);
+
+				if(pages_.Read(buffer, BTREE_PAGE_SIZE) != BTREE_PAGE_SIZE)
+					throw std::runtime_error("btree: error reading page " + lexical_cast<string>(page));
+			}
+
+			void WritePage(BTREE_PAGE page, const unsigned char* buffer)
+			{
+				pages_.SetPointer(static_cast<logdb::LDB_OFFSET>(page) * BTREE_PAGE_SIZE);
+
+				if(pages_.Write(buffer, BTREE_PAGE_SIZE) != BTREE_PAGE_SIZE)
+					throw std::runtime_error("btree: error writing page " + lexical_cast<string>(page));
+			}
+
+			void EncodeHeader(unsigned char* buffer)
+			{
+				memset(buffer, 0, BTREE_PAGE_SIZE);
+				memcpy(buffer, &header_, sizeof(header_));
+			}
+
+			void AddToCache(const shared_ptr<BTREE_NODE>& node)
+			{
+				lru_.push_front(node->page);
+				cache_[node->page] = make_pair(node, lru_.begin());
+
+				while(cache_.size() > maxCachedNodes_)
+				{
+					cache_.erase(lru_.back());
+					lru_.pop_back();
+				}
+			}
+
+			//
+			// applies the complete commits found in the WAL to the page file
+			//
+			void ReplayWal()
+			{
+				BTREE_WAL_HEADER walHeader;
+
+				wal_.SetPointer(0);
+
+				if(wal_.Read(&walHeader, sizeof(walHeader)) != sizeof(walHeader) || walHeader.magic != BTREE_WAL_MAGIC)
+				{
+					walGeneration_ = 0;
+					return;
+				}
+
+				walGeneration_ = walHeader.generation;
+
+				unsigned int recovered = 0;
+				vector<unsigned char> buffer;
+
+				for(;;)
+				{
+					BTREE_WAL_RECORD record;
+
+					if(wal_.Read(&record, sizeof(record)) != sizeof(record))
+						break;
+
+					if(record.magic != BTREE_WAL_MAGIC || record.generation != walGeneration_)
+						break;
+
+					size_t size = static_cast<size_t>(record.pageCount) * (sizeof(BTREE_PAGE) + BTREE_PAGE_SIZE);
+					buffer.resize(size);
+
+					if(size == 0 || wal_.Read(&buffer[0], static_cast<DWORD>(size)) != size)
+						break;
+
+					unsigned int checksum = BTreeChecksum((const unsigned char*)&record.pageCount, sizeof(record.pageCount));
+
+					if(BTreeChecksum(&buffer[0], size, checksum) != record.checksum)
+						break;
+
+					for(size_t offset = 0 ; offset < size ; offset += sizeof(BTREE_PAGE) + BTREE_PAGE_SIZE)
+					{
+						BTREE_PAGE page;
+						memcpy(&page, &buffer[offset], sizeof(page));
+						WritePage(page, &buffer[offset + sizeof(page)]);
+					}
+
+					recovered++;
+				}
+
+				if(recovered)
+					std::cout << "btree: " << recovered << " commits recovered from " << fileName_ << ".wal" << std::endl;
+			}
+
+			//
+			// page file has everything the WAL has, so the WAL can start over
+			//
+			void Checkpoint()
+			{
+				pages_.Sync();
+
+				BTREE_WAL_HEADER walHeader;
+				walHeader.magic = BTREE_WAL_MAGIC;
+				walHeader.generation = ++walGeneration_;
+
+				wal_.SetPointer(0);
+
+				if(wal_.Write(&walHeader, sizeof(walHeader)) != sizeof(walHeader))
+					throw std::runtime_error("btree: error writing WAL");
+
+				wal_.Sync();
+
+				walOffset_ = sizeof(walHeader);
+				checkpoints_++;
+			}
+
+		public:
+
+			BTreeFile(const string& fileName, size_t cacheSize) :
+				fileName_(fileName),
+				pages_(0),
+				wal_(0),
+				headerDirty_(false),
+				walGeneration_(0),
+				walOffset_(0),
+				maxCachedNodes_(std::max<size_t>(cacheSize / BTREE_PAGE_SIZE, 64)),
+				cacheHits_(0),
+				cacheMisses_(0),
+				commits_(0),
+				checkpoints_(0)
+			{
+				memset(&header_, 0, sizeof(header_));
+
+				if(!pages_.Create(fileName.c_str()))
+					throw std::runtime_error("btree: error opening " + fileName);
+
+				if(!wal_.Create((fileName + ".wal").c_str()))
+					throw std::runtime_error("btree: error opening " + fileName + ".wal");
+
+				//
+				// WAL is synced once per commit, page file once per checkpoint
+				//
+				pages_.SetSyncOnWrite(false);
+				wal_.SetSyncOnWrite(false);
+
+				ReplayWal();
+				Checkpoint();
+
+				//
+				// page file and WAL may have just been created
+				//
+				logdb::File::SyncDirectory(fileName);
+
+				if(pages_.GetFileSize() == 0)
+				{
+					header_.magic = BTREE_FILE_MAGIC;
+					header_.version = BTREE_FORMAT_VERSION;
+					header_.pageSize = BTREE_PAGE_SIZE;
+					header_.pageCount = 1;
+					header_.catalogRoot = NewNode(pageTypeLeaf)->page;
+
+					Commit();
+					return;
+				}
+
+				vector<unsigned char> buffer(BTREE_PAGE_SIZE);
+				ReadPage(0, &buffer[0]);
+				memcpy(&header_, &buffer[0], sizeof(header_));
+
+				if(header_.magic != BTREE_FILE_MAGIC)
+					throw std::runtime_error("btree: " + fileName + " is not a btree file");
+
+				if(header_.version != BTREE_FORMAT_VERSION || header_.pageSize != BTREE_PAGE_SIZE)
+					throw std::runtime_error("btree: unsupported format for " + fileName);
+			}
+
+			shared_ptr<BTREE_NODE> GetNode(BTREE_PAGE page)
+			{
+				NodeCache::iterator i = cache_.find(page);
+
+				if(i != cache_.end())
+				{
+					cacheHits_++;
+					lru_.splice(lru_.begin(), lru_, i->second.second);
+					return i->second.first;
+				}
+
+				shared_ptr<BTREE_NODE> node;
+				DirtyMap::iterator dirty = dirty_.find(page);
+
+				if(dirty != dirty_.end())
+					node = dirty->second;
+				else
+				{
+					cacheMisses_++;
+
+					if(page == BTREE_INVALID_PAGE || page >= header_.pageCount)
+						throw std::runtime_error("btree: invalid page " + lexical_cast<string>(page));
+
+					unsigned char buffer[BTREE_PAGE_SIZE];
+					ReadPage(page, buffer);
+					node = DecodeNode(page, buffer);
+				}
+
+				AddToCache(node);
+
+				return node;
+			}
+
+			//
+			// must be called before changing the node
+			//
+			void MarkDirty(const shared_ptr<BTREE_NODE>& node)
+			{
+				if(node->dirty)
+					return;
+
+				node->dirty = true;
+				dirty_[node->page] = node;
+				headerDirty_ = true;
+			}
+
+			shared_ptr<BTREE_NODE> NewNode(BTreePageType type)
+			{
+				shared_ptr<BTREE_NODE> node;
+
+				if(header_.freeListHead != BTREE_INVALID_PAGE)
+				{
+					node = GetNode(header_.freeListHead);
+					MarkDirty(node);
+
+					header_.freeListHead = node->next;
+					header_.freePageCount--;
+
+					node->type = type;
+					node->next = node->prev = BTREE_INVALID_PAGE;
+				}
+				else
+				{
+					node.reset(new BTREE_NODE(header_.pageCount++, type));
+					MarkDirty(node);
+					AddToCache(node);
+				}
+
+				if(type == pageTypeOverflow)
+					node->values.resize(1);
+
+				return node;
+			}
+
+			void FreeNode(const shared_ptr<BTREE_NODE>& node)
+			{
+				MarkDirty(node);
+
+				node->type = pageTypeFree;
+				node->keys.clear();
+				node->values.clear();
+				node->children.clear();
+				node->counts.clear();
+				node->prev = BTREE_INVALID_PAGE;
+				node->next = header_.freeListHead;
+
+				header_.freeListHead = node->page;
+				header_.freePageCount++;
+			}
+
+			BTREE_PAGE GetCatalogRoot()
+			{
+				return header_.catalogRoot;
+			}
+
+			unsigned int GetTableCount()
+			{
+				return header_.tableCount;
+			}
+
+			void SetCatalog(BTREE_PAGE root, unsigned int tableCount)
+			{
+				header_.catalogRoot = root;
+				header_.tableCount = tableCount;
+				headerDirty_ = true;
+			}
+
+			bool IsDirty()
+			{
+				return headerDirty_;
+			}
+
+			void Commit()
+			{
+				if(!headerDirty_)
+					return;
+
+				size_t pageCount = dirty_.size() + 1;
+				size_t pageRecordSize = sizeof(BTREE_PAGE) + BTREE_PAGE_SIZE;
+				vector<unsigned char> buffer(sizeof(BTREE_WAL_RECORD) + pageCount * pageRecordSize);
+
+				unsigned char* current = &buffer[sizeof(BTREE_WAL_RECORD)];
+				BTREE_PAGE headerPage = 0;
+
+				memcpy(current, &headerPage, sizeof(headerPage));
+				EncodeHeader(current + sizeof(headerPage));
+				current += pageRecordSize;
+
+				for(DirtyMap::const_iterator i = dirty_.begin() ; i != dirty_.end() ; ++i)
+				{
+					memcpy(current, &i->first, sizeof(i->first));
+					EncodeNode(*i->second, current + sizeof(i->first));
+					current += pageRecordSize;
+				}
+
+				BTREE_WAL_RECORD record;
+				record.magic = BTREE_WAL_MAGIC;
+				record.generation = walGeneration_;
+				record.pageCount = static_cast<unsigned int>(pageCount);
+				record.checksum = BTreeChecksum(&buffer[sizeof(record)], pageCount * pageRecordSize,
+					BTreeChecksum((const unsigned char*)&record.pageCount, sizeof(record.pageCount)));
+
+				memcpy(&buffer[0], &record, sizeof(record));
+
+				wal_.SetPointer(walOffset_);
+
+				if(wal_.Write(&buffer[0], static_cast<DWORD>(buffer.size())) != buffer.size())
+					throw std::runtime_error("btree: error writing WAL");
+
+				wal_.Sync();
+
+				walOffset_ += buffer.size();
+
+				//
+				// changes are durable now, the page file doesn't need to be synced
+				//
+				for(size_t offset = sizeof(record) ; offset < buffer.size() ; offset += pageRecordSize)
+				{
+					BTREE_PAGE page;
+					memcpy(&page, &buffer[offset], sizeof(page));
+					WritePage(page, &buffer[offset + sizeof(page)]);
+				}
+
+				for(DirtyMap::const_iterator i = dirty_.begin() ; i != dirty_.end() ; ++i)
+					i->second->dirty = false;
+
+				dirty_.clear();
+				headerDirty_ = false;
+				commits_++;
+
+				if(walOffset_ > BTREE_WAL_CHECKPOINT_SIZE)
+					Checkpoint();
+			}
+
+			void GetStatistics(std::map<string, string>* statistics)
+			{
+				(*statistics)["btree_pages"] = lexical_cast<string>(header_.pageCount);
+				(*statistics)["btree_free_pages"] = lexical_cast<string>(header_.freePageCount);
+				(*statistics)["btree_tables"] = lexical_cast<string>(header_.tableCount);
+				(*statistics)["btree_cache_nodes"] = lexical_cast<string>(cache_.size());
+				(*statistics)["btree_cache_hits"] = lexical_cast<string>(cacheHits_);
+				(*statistics)["btree_cache_misses"] = lexical_cast<string>(cacheMisses_);
+				(*statistics)["btree_commits"] = lexical_cast<string>(commits_);
+				(*statistics)["btree_checkpoints"] = lexical_cast<string>(checkpoints_);
+				(*statistics)["btree_wal_bytes"] = lexical_cast<string>(walOffset_);
+			}
+		};
+
+		//
+		// position of a record in a leaf. Only valid until the tree changes
+		//
+		struct BTREE_CURSOR
+		{
+			shared_ptr<BTREE_NODE> leaf;
+			size_t index;
+
+			BTREE_CURSOR() : index(0)
+			{}
+
+			bool IsValid() const
+			{
+				return leaf && index < leaf->keys.size();
+			}
+		};
+
+		class BTree : boost::noncopyable
+		{
+			BTreeFile& file_;
+			BTREE_PAGE root_;
+			unsigned long long count_;
+			bool changed_;
+
+			struct SPLIT
+			{
+				SPLIT() : split(false), page(BTREE_INVALID_PAGE), count(0)
+				{}
+
+				bool split;
+				string key;
+				BTREE_PAGE page;
+				unsigned long long count;
+			};
+
+			static const unsigned char valueInline = 0;
+			static const unsigned char valueOverflow = 1;
+
+			void CheckRoot()
+			{
+				if(root_ == BTREE_INVALID_PAGE)
+					throw std::runtime_error("table was deleted");
+			}
+
+			//
+			// Stored values start with a tag. Values that don't fit the node go
+			// to a chain of overflow pages, and the node keeps the first page and
+			// the size
+			//
+			string StoreValue(const string& key, const string& value)
+			{
+				if(key.size() + value.size() + BTREE_LEAF_ITEM_OVERHEAD + 1 <= BTREE_MAX_INLINE_RECORD)
+				{
+					string stored;
+					stored.reserve(value.size() + 1);
+					stored += static_cast<char>(valueInline);
+					stored += value;
+					return stored;
+				}
+
+				BTREE_PAGE first = BTREE_INVALID_PAGE;
+				shared_ptr<BTREE_NODE> previous;
+
+				for(size_t offset = 0 ; offset < value.size() ; offset += BTREE_OVERFLOW_CAPACITY)
+				{
+					shared_ptr<BTREE_NODE> node = file_.NewNode(pageTypeOverflow);
+					node->values[0] = value.substr(offset, BTREE_OVERFLOW_CAPACITY);
+
+					if(previous)
+						previous->next = node->page;
+					else
+						first = node->page;
+
+					previous = node;
+				}
+
+				unsigned int size = static_cast<unsigned int>(value.size());
+
+				string stored(1 + sizeof(first) + sizeof(size), static_cast<char>(valueOverflow));
+				memcpy(&stored[1], &first, sizeof(first));
+				memcpy(&stored[1 + sizeof(first)], &size, sizeof(size));
+
+				return stored;
+			}
+
+			string LoadValue(const string& stored)
+			{
+				if(stored.empty())
+					throw std::runtime_error("btree: corrupted record");
+
+				if(stored[0] == valueInline)
+					return stored.substr(1);
+
+				BTREE_PAGE page;
+				unsigned int size;
+				memcpy(&page, &stored[1], sizeof(page));
+				memcpy(&size, &stored[1 + sizeof(page)], sizeof(size));
+
+				string value;
+				value.reserve(size);
+
+				while(page != BTREE_INVALID_PAGE && value.size() < size)
+				{
+					shared_ptr<BTREE_NODE> node = file_.GetNode(page);
+
+					if(node->type != pageTypeOverflow)
+						throw std::runtime_error("btree: corrupted overflow chain");
+
+					value += node->values[0];
+					page = node->next;
+				}
+
+				return value;
+			}
+
+			void FreeValue(const string& stored)
+			{
+				if(stored.empty() || stored[0] != valueOverflow)
+					return;
+
+				BTREE_PAGE page;
+				memcpy(&page, &stored[1], sizeof(page));
+
+				while(page != BTREE_INVALID_PAGE)
+				{
+					shared_ptr<BTREE_NODE> node = file_.GetNode(page);
+					page = node->next;
+					file_.FreeNode(node);
+				}
+			}
+
+			void FreeSubtree(BTREE_PAGE page)
+			{
+				shared_ptr<BTREE_NODE> node = file_.GetNode(page);
+
+				if(node->type == pageTypeInternal)
+				{
+					for(size_t a = 0 ; a < node->children.size() ; a++)
+						FreeSubtree(node->children[a]);
+				}
+				else
+				{
+					for(size_t a = 0 ; a < node->values.size() ; a++)
+						FreeValue(node->values[a]);
+				}
+
+				file_.FreeNode(node);
+			}
+
+			static size_t ChildIndex(const BTREE_NODE& node, const string& key)
+			{
+				return std::upper_bound(node.keys.begin(), node.keys.end(), key) - node.keys.begin();
+			}
+
+			//
+			// split points are chosen by size, not by item count, since
+			// records can have very different sizes
+			//
+			static size_t FindSplitPoint(const BTREE_NODE& node, size_t itemOverhead)
+			{
+				size_t total = GetNodeSize(node), size = BTREE_NODE_HEADER_SIZE, a = 0;
+
+				for(; a < node.keys.size() - 1 ; a++)
+				{
+					size += itemOverhead + node.keys[a].size() + (node.type == pageTypeLeaf ? node.values[a].size() : 0);
+
+					if(size > total / 2)
+						break;
+				}
+
+				return std::max<size_t>(a, 1);
+			}
+
+			void SplitLeaf(const shared_ptr<BTREE_NODE>& node, SPLIT* split)
+			{
+				size_t middle = FindSplitPoint(*node, BTREE_LEAF_ITEM_OVERHEAD);
+
+				shared_ptr<BTREE_NODE> right = file_.NewNode(pageTypeLeaf);
+
+				right->keys.assign(node->keys.begin() + middle, node->keys.end());
+				right->values.assign(node->values.begin() + middle, node->values.end());
+				node->keys.resize(middle);
+				node->values.resize(middle);
+
+				right->next = node->next;
+				right->prev = node->page;
+
+				if(node->next != BTREE_INVALID_PAGE)
+				{
+					shared_ptr<BTREE_NODE> next = file_.GetNode(node->next);
+					file_.MarkDirty(next);
+					next->prev = right->page;
+				}
+
+				node->next = right->page;
+
+				split->split = true;
+				split->key = right->keys[0];
+				split->page = right->page;
+				split->count = right->keys.size();
+			}
+
+			void SplitInternal(const shared_ptr<BTREE_NODE>& node, SPLIT* split)
+			{
+				size_t middle = FindSplitPoint(*node, BTREE_INTERNAL_ITEM_OVERHEAD);
+
+				shared_ptr<BTREE_NODE> right = file_.NewNode(pageTypeInternal);
+
+				split->split = true;
+				split->key = node->keys[middle];
+				split->page = right->page;
+
+				right->keys.assign(node->keys.begin() + middle + 1, node->keys.end());
+				right->children.assign(node->children.begin() + middle + 1, node->children.end());
+				right->counts.assign(node->counts.begin() + middle + 1, node->counts.end());
+				node->keys.resize(middle);
+				node->children.resize(middle + 1);
+				node->counts.resize(middle + 1);
+
+				split->count = std::accumulate(right->counts.begin(), right->counts.end(), 0ULL);
+			}
+
+			//
+			// returns 1 if the record was added, 0 if it was replaced
+			// and -1 if it already exists and replace is false
+			//
+			int InsertInto(BTREE_PAGE page, const string& key, const string& value, bool replace, SPLIT* split)
+			{
+				shared_ptr<BTREE_NODE> node = file_.GetNode(page);
+				int result;
+
+				if(node->type == pageTypeLeaf)
+				{
+					size_t index = std::lower_bound(node->keys.begin(), node->keys.end(), key) - node->keys.begin();
+
+					if(index < node->keys.size() && node->keys[index] == key)
+					{
+						if(!replace)
+							return -1;
+
+						file_.MarkDirty(node);
+						FreeValue(node->values[index]);
+						node->values[index] = StoreValue(key, value);
+						result = 0;
+					}
+					else
+					{
+						file_.MarkDirty(node);
+						node->keys.insert(node->keys.begin() + index, key);
+						node->values.insert(node->values.begin() + index, StoreValue(key, value));
+						result = 1;
+					}
+
+					if(GetNodeSize(*node) > BTREE_PAGE_SIZE)
+						SplitLeaf(node, split);
+
+					return result;
+				}
+
+				size_t childIndex = ChildIndex(*node, key);
+				SPLIT childSplit;
+
+				result = InsertInto(node->children[childIndex], key, value, replace, &childSplit);
+
+				if(result == 1 || childSplit.split)
+					file_.MarkDirty(node);
+
+				if(result == 1)
+					node->counts[childIndex]++;
+
+				if(childSplit.split)
+				{
+					node->counts[childIndex] -= childSplit.count;
+					node->keys.insert(node->keys.begin() + childIndex, childSplit.key);
+					node->children.insert(node->children.begin() + childIndex + 1, childSplit.page);
+					node->counts.insert(node->counts.begin() + childIndex + 1, childSplit.count);
+
+					if(GetNodeSize(*node) > BTREE_PAGE_SIZE)
+						SplitInternal(node, split);
+				}
+
+				return result;
+			}
+
+			static bool IsEmpty(const BTREE_NODE& node)
+			{
+				return node.type == pageTypeLeaf ? node.keys.empty() : node.children.empty();
+			}
+
+			void RemoveChild(const shared_ptr<BTREE_NODE>& parent, size_t index)
+			{
+				parent->children.erase(parent->children.begin() + index);
+				parent->counts.erase(parent->counts.begin() + index);
+
+				if(!parent->keys.empty())
+					parent->keys.erase(parent->keys.begin() + (index ? index - 1 : 0));
+			}
+
+			void Unlink(const shared_ptr<BTREE_NODE>& leaf)
+			{
+				if(leaf->prev != BTREE_INVALID_PAGE)
+				{
+					shared_ptr<BTREE_NODE> prev = file_.GetNode(leaf->prev);
+					file_.MarkDirty(prev);
+					prev->next = leaf->next;
+				}
+
+				if(leaf->next != BTREE_INVALID_PAGE)
+				{
+					shared_ptr<BTREE_NODE> next = file_.GetNode(leaf->next);
+					file_.MarkDirty(next);
+					next->prev = leaf->prev;
+				}
+			}
+
+			//
+			// removes empty children and merges small ones with a sibling,
+			// when both fit a single page
+			//
+			void RebalanceChild(const shared_ptr<BTREE_NODE>& parent, size_t index)
+			{
+				shared_ptr<BTREE_NODE> child = file_.GetNode(parent->children[index]);
+
+				if(IsEmpty(*child))
+				{
+					if(child->type == pageTypeLeaf)
+						Unlink(child);
+
+					RemoveChild(parent, index);
+					file_.FreeNode(child);
+					return;
+				}
+
+				if(GetNodeSize(*child) >= BTREE_MIN_NODE_SIZE || parent->children.size() < 2)
+					return;
+
+				size_t leftIndex = index + 1 < parent->children.size() ? index : index - 1;
+
+				shared_ptr<BTREE_NODE> left = file_.GetNode(parent->children[leftIndex]);
+				shared_ptr<BTREE_NODE> right = file_.GetNode(parent->children[leftIndex + 1]);
+
+				if(left->type != right->type)
+					throw std::runtime_error("btree: corrupted tree");
+
+				size_t mergedSize = GetNodeSize(*left) + GetNodeSize(*right) - BTREE_NODE_HEADER_SIZE;
+
+				if(left->type == pageTypeInternal)
+					mergedSize += BTREE_INTERNAL_ITEM_OVERHEAD + parent->keys[leftIndex].size() - sizeof(BTREE_PAGE) - sizeof(unsigned long long);
+
+				if(mergedSize > BTREE_PAGE_SIZE)
+					return;
+
+				file_.MarkDirty(left);
+
+				if(left->type == pageTypeLeaf)
+				{
+					left->keys.insert(left->keys.end(), right->keys.begin(), right->keys.end());
+					left->values.insert(left->values.end(), right->values.begin(), right->values.end());
+					Unlink(right);
+				}
+				else
+				{
+					left->keys.push_back(parent->keys[leftIndex]);
+					left->keys.insert(left->keys.end(), right->keys.begin(), right->keys.end());
+					left->children.insert(left->children.end(), right->children.begin(), right->children.end());
+					left->counts.insert(left->counts.end(), right->counts.begin(), right->counts.end());
+				}
+
+				parent->counts[leftIndex] += parent->counts[leftIndex + 1];
+				RemoveChild(parent, leftIndex + 1);
+
+				file_.FreeNode(right);
+			}
+
+			bool EraseFrom(BTREE_PAGE page, const string& key)
+			{
+				shared_ptr<BTREE_NODE> node = file_.GetNode(page);
+
+				if(node->type == pageTypeLeaf)
+				{
+					size_t index = std::lower_bound(node->keys.begin(), node->keys.end(), key) - node->keys.begin();
+
+					if(index == node->keys.size() || node->keys[index] != key)
+						return false;
+
+					file_.MarkDirty(node);
+					FreeValue(node->values[index]);
+					node->keys.erase(node->keys.begin() + index);
+					node->values.erase(node->values.begin() + index);
+
+					return true;
+				}
+
+				size_t childIndex = ChildIndex(*node, key);
+
+				if(!EraseFrom(node->children[childIndex], key))
+					return false;
+
+				file_.MarkDirty(node);
+				node->counts[childIndex]--;
+
+				RebalanceChild(node, childIndex);
+
+				return true;
+			}
+
+			//
+			// root with a single child is replaced by it, so the tree gets shorter
+			//
+			void ShrinkRoot()
+			{
+				for(;;)
+				{
+					shared_ptr<BTREE_NODE> root = file_.GetNode(root_);
+
+					if(root->type != pageTypeInternal)
+						return;
+
+					if(root->children.empty())
+					{
+						file_.MarkDirty(root);
+						root->type = pageTypeLeaf;
+						root->counts.clear();
+						return;
+					}
+
+					if(root->children.size() > 1)
+						return;
+
+					root_ = root->children[0];
+					file_.FreeNode(root);
+				}
+			}
+
+			void Normalize(BTREE_CURSOR* cursor)
+			{
+				while(cursor->leaf && cursor->index >= cursor->leaf->keys.size())
+				{
+					if(cursor->leaf->next == BTREE_INVALID_PAGE)
+					{
+						cursor->leaf.reset();
+						return;
+					}
+
+					cursor->leaf = file_.GetNode(cursor->leaf->next);
+					cursor->index = 0;
+				}
+			}
+
+		public:
+
+			BTree(BTreeFile& file, BTREE_PAGE root, unsigned long long count) :
+				file_(file),
+				root_(root),
+				count_(count),
+				changed_(false)
+			{}
+
+			//
+			// creates an empty tree
+			//
+			BTree(BTreeFile& file) :
+				file_(file),
+				root_(file.NewNode(pageTypeLeaf)->page),
+				count_(0),
+				changed_(true)
+			{}
+
+			BTREE_PAGE GetRoot() const
+			{
+				return root_;
+			}
+
+			unsigned long long GetCount() const
+			{
+				return count_;
+			}
+
+			bool HasChanged() const
+			{
+				return changed_;
+			}
+
+			void ClearChanged()
+			{
+				changed_ = false;
+			}
+
+			bool Find(const string& key, string* value)
+			{
+				CheckRoot();
+
+				shared_ptr<BTREE_NODE> node = file_.GetNode(root_);
+
+				while(node->type == pageTypeInternal)
+					node = file_.GetNode(node->children[ChildIndex(*node, key)]);
+
+				vector<string>::const_iterator i = std::lower_bound(node->keys.begin(), node->keys.end(), key);
+
+				if(i == node->keys.end() || *i != key)
+					return false;
+
+				if(value)
+					*value = LoadValue(node->values[i - node->keys.begin()]);
+
+				return true;
+			}
+
+			//
+			// returns false if the key exists and replace is false
+			//
+			bool Put(const string& key, const string& value, bool replace)
+			{
+				CheckRoot();
+
+				if(key.size() > BTREE_MAX_KEY_SIZE)
+					throw std::invalid_argument("key too long");
+
+				SPLIT split;
+				int result = InsertInto(root_, key, value, replace, &split);
+
+				if(result < 0)
+					return false;
+
+				count_ += result;
+				changed_ = true;
+
+				if(split.split)
+				{
+					shared_ptr<BTREE_NODE> root = file_.NewNode(pageTypeInternal);
+
+					root->keys.push_back(split.key);
+					root->children.push_back(root_);
+					root->children.push_back(split.page);
+					root->counts.push_back(count_ - split.count);
+					root->counts.push_back(split.count);
+
+					root_ = root->page;
+				}
+
+				return true;
+			}
+
+			bool Erase(const string& key)
+			{
+				CheckRoot();
+
+				if(!EraseFrom(root_, key))
+					return false;
+
+				count_--;
+				changed_ = true;
+
+				ShrinkRoot();
+
+				return true;
+			}
+
+			void Clear()
+			{
+				CheckRoot();
+
+				FreeSubtree(root_);
+
+				root_ = file_.NewNode(pageTypeLeaf)->page;
+				count_ = 0;
+				changed_ = true;
+			}
+
+			//
+			// frees all pages, the tree can't be used after that
+			//
+			void Destroy()
+			{
+				CheckRoot();
+
+				FreeSubtree(root_);
+
+				root_ = BTREE_INVALID_PAGE;
+				count_ = 0;
+				changed_ = true;
+			}
+
+			BTREE_CURSOR Seek(unsigned long long index)
+			{
+				CheckRoot();
+
+				BTREE_CURSOR cursor;
+
+				if(index >= count_)
+					return cursor;
+
+				shared_ptr<BTREE_NODE> node = file_.GetNode(root_);
+
+				while(node->type == pageTypeInternal)
+				{
+					size_t a = 0;
+
+					for(; a < node->counts.size() - 1 && index >= node->counts[a] ; a++)
+						index -= node->counts[a];
+
+					node = file_.GetNode(node->children[a]);
+				}
+
+				cursor.leaf = node;
+				cursor.index = static_cast<size_t>(index);
+
+				Normalize(&cursor);
+
+				return cursor;
+			}
+
+			//
+			// first record with key equal or greater than the informed one
+			//
+			BTREE_CURSOR LowerBound(const string& key)
+			{
+				CheckRoot();
+
+				BTREE_CURSOR cursor;
+				shared_ptr<BTREE_NODE> node = file_.GetNode(root_);
+
+				while(node->type == pageTypeInternal)
+					node = file_.GetNode(node->children[ChildIndex(*node, key)]);
+
+				cursor.leaf = node;
+				cursor.index = std::lower_bound(node->keys.begin(), node->keys.end(), key) - node->keys.begin();
+
+				Normalize(&cursor);
+
+				return cursor;
+			}
+
+			bool Next(BTREE_CURSOR* cursor)
+			{
+				if(!cursor->IsValid())
+					return false;
+
+				cursor->index++;
+				Normalize(cursor);
+
+				return cursor->IsValid();
+			}
+
+			void GetRecord(const BTREE_CURSOR& cursor, string* key, string* value)
+			{
+				if(!cursor.IsValid())
+					throw std::invalid_argument("invalid cursor");
+
+				if(key)
+					*key = cursor.leaf->keys[cursor.index];
+
+				if(value)
+					*value = LoadValue(cursor.leaf->values[cursor.index]);
+			}
+		};
+
+		class BTreeKvCursor : public IOrderedKvCursor
+		{
+			shared_ptr<BTree> tree_;
+			BTREE_CURSOR cursor_;
+
+		public:
+			BTreeKvCursor(shared_ptr<BTree> tree, const BTREE_CURSOR& cursor) :
+				tree_(tree),
+				cursor_(cursor)
+			{}
+
+			virtual bool IsValid()
+			{
+				return cursor_.IsValid();
+			}
+
+			virtual void Next()
+			{
+				tree_->Next(&cursor_);
+			}
+
+			virtual void GetRecord(string* key, string* value)
+			{
+				tree_->GetRecord(cursor_, key, value);
+			}
+		};
+
+		class BTreeKvTable : public IOrderedKvTable
+		{
+			shared_ptr<BTree> tree_;
+
+		public:
+			BTreeKvTable(shared_ptr<BTree> tree) : tree_(tree)
+			{}
+
+			virtual unsigned long long GetCount()
+			{
+				return tree_->GetCount();
+			}
+
+			virtual bool Find(const string& key, string* value)
+			{
+				return tree_->Find(key, value);
+			}
+
+			virtual bool Put(const string& key, const string& value, bool replace)
+			{
+				return tree_->Put(key, value, replace);
+			}
+
+			virtual bool Erase(const string& key)
+			{
+				return tree_->Erase(key);
+			}
+
+			virtual void Clear()
+			{
+				tree_->Clear();
+			}
+
+			virtual shared_ptr<IOrderedKvCursor> Seek(unsigned long long index)
+			{
+				return shared_ptr<IOrderedKvCursor>(new BTreeKvCursor(tree_, tree_->Seek(index)));
+			}
+
+			virtual shared_ptr<IOrderedKvCursor> LowerBound(const string& key)
+			{
+				return shared_ptr<IOrderedKvCursor>(new BTreeKvCursor(tree_, tree_->LowerBound(key)));
+			}
+		};
+
+		//
+		// Tables by name. Root page and record count of changed tables are
+		// written to the catalog on commit
+		//
+		class BTreeDatabase : boost::noncopyable, public IOrderedKvDatabase
+		{
+			BTreeFile file_;
+			shared_ptr<BTree> catalog_;
+
+			typedef std::map<string, shared_ptr<BTree> > TableMap;
+			TableMap tables_;
+
+			static string EncodeTableInfo(const BTree& tree)
+			{
+				BTREE_PAGE root = tree.GetRoot();
+				unsigned long long count = tree.GetCount();
+
+				string ret(sizeof(root) + sizeof(count), '\0');
+				memcpy(&ret[0], &root, sizeof(root));
+				memcpy(&ret[sizeof(root)], &count, sizeof(count));
+
+				return ret;
+			}
+
+			void UpdateCatalog()
+			{
+				for(TableMap::iterator i = tables_.begin() ; i != tables_.end() ; ++i)
+				{
+					if(!i->second->HasChanged())
+						continue;
+
+					catalog_->Put(i->first, EncodeTableInfo(*i->second), true);
+					i->second->ClearChanged();
+				}
+
+				if(catalog_->HasChanged())
+				{
+					file_.SetCatalog(catalog_->GetRoot(), static_cast<unsigned int>(catalog_->GetCount()));
+					catalog_->ClearChanged();
+				}
+			}
+
+		public:
+			BTreeDatabase(const string& fileName, size_t cacheSize) :
+				file_(fileName, cacheSize)
+			{
+				catalog_.reset(new BTree(file_, file_.GetCatalogRoot(), file_.GetTableCount()));
+			}
+
+			shared_ptr<BTree> OpenTable(const string& name)
+			{
+				TableMap::iterator i = tables_.find(name);
+
+				if(i != tables_.end())
+					return i->second;
+
+				string info;
+
+				if(!catalog_->Find(name, &info))
+					return shared_ptr<BTree>();
+
+				BTREE_PAGE root;
+				unsigned long long count;
+
+				if(info.size() != sizeof(root) + sizeof(count))
+					throw std::runtime_error("btree: corrupted catalog");
+
+				memcpy(&root, &info[0], sizeof(root));
+				memcpy(&count, &info[sizeof(root)], sizeof(count));
+
+				shared_ptr<BTree> table(new BTree(file_, root, count));
+				tables_[name] = table;
+
+				return table;
+			}
+
+			shared_ptr<BTree> CreateTable(const string& name)
+			{
+				shared_ptr<BTree> table = OpenTable(name);
+
+				if(table)
+					return table;
+
+				table.reset(new BTree(file_));
+				tables_[name] = table;
+
+				return table;
+			}
+
+			virtual shared_ptr<IOrderedKvTable> OpenKvTable(const string& name)
+			{
+				shared_ptr<BTree> table = OpenTable(name);
+
+				if(!table)
+					return shared_ptr<IOrderedKvTable>();
+
+				return shared_ptr<IOrderedKvTable>(new BTreeKvTable(table));
+			}
+
+			virtual shared_ptr<IOrderedKvTable> CreateKvTable(const string& name)
+			{
+				return shared_ptr<IOrderedKvTable>(new BTreeKvTable(CreateTable(name)));
+			}
+
+			virtual void DeleteTable(const string& name)
+			{
+				shared_ptr<BTree> table = OpenTable(name);
+
+				if(!table)
+					return;
+
+				table->Destroy();
+				tables_.erase(name);
+
+				catalog_->Erase(name);
+			}
+
+			virtual vector<string> GetTableList()
+			{
+				UpdateCatalog();
+
+				vector<string> ret;
+
+				for(BTREE_CURSOR i = catalog_->Seek(0) ; i.IsValid() ; catalog_->Next(&i))
+				{
+					string name;
+					catalog_->GetRecord(i, &name, NULL);
+					ret.push_back(name);
+				}
+
+				return ret;
+			}
+
+			virtual bool HasPendingCommit()
+			{
+				return file_.IsDirty();
+			}
+
+			virtual void Commit()
+			{
+				UpdateCatalog();
+				file_.Commit();
+			}
+
+			virtual void DoMaintenance()
+			{
+			}
+
+			virtual void GetStatistics(std::map<string, string>* statistics)
+			{
+				file_.GetStatistics(statistics);
+			}
+		};
+
+		struct BTREE_CONFIG
+		{
+			//
+			// decoded node cache, in bytes
+			//
+			size_t cacheSize;
+
+			BTREE_CONFIG() :
+				cacheSize(64 * 1024 * 1024)
+			{
+			}
+		};
+
+		class BTreeStorageManager: public OrderedKvStorageManager
+		{
+		public:
+
+			BTreeStorageManager(const string& path, const BTREE_CONFIG& config = BTREE_CONFIG()) :
+				OrderedKvStorageManager("btree_map", shared_ptr<IOrderedKvDatabase>(
+					new BTreeDatabase(GetFilePath(path, "tio.btree"), config.cacheSize)))
+			{
+			}
+		};
+	}
+}
@@ -772,5 +772,32 @@ namespace tio { namespace BdbStorage
 		{
 			return CreateOrOpenStorage(type, name, open);
 		}
+
+		virtual bool HasPendingCommit()
+		{
+			return false;
+		}
+
+		virtual void Commit()
+		{
+			ForceCommit();
+		}
+
+		virtual bool HasPendingFlush(unsigned int* maxDelay)
+		{
+			return false;
+		}
+
+		virtual void DoMaintenance()
+		{
+		}
+
+		virtual void GetStatistics(std::map<string, string>* statistics)
+		{
+		}
+
+		virtual void CheckProperty(const string& type, const string& key, const string& value)
+		{
+		}
 	};
 }}
@@ -56,19 +56,61 @@ namespace tio
 
 	void Command::Parse(const char* source)
 	{
-		boost::split(params_, source, boost::is_any_of(separators_));
+		Parse(source, source + strlen(source));
+	}
+
+	void Command::Parse(const char* begin, const char* end)
+	{
+		source_.assign(begin, end);
+
+		//
+		// same as splitting on every separator: consecutive
+		// separators give empty parameters
+		//
+		const char* tokenEnd = std::find_first_of(begin, end, separators_, separators_ + strlen(separators_));
+
+		command_.assign(begin, tokenEnd);
 
-		if(params_.size() == 0)
+		RecycleParameters();
+
+		while(tokenEnd != end)
 		{
-			params_.clear();
-			command_.clear();
-			throw std::invalid_argument("not a command");
+			const char* tokenBegin = tokenEnd + 1;
+			tokenEnd = std::find_first_of(tokenBegin, end, separators_, separators_ + strlen(separators_));
+
+			if(spareParams_.empty())
+			{
+				params_.emplace_back(tokenBegin, tokenEnd);
+				continue;
+			}
+
+			params_.push_back(std::move(spareParams_.back()));
+			spareParams_.pop_back();
+			params_.back().assign(tokenBegin, tokenEnd);
 		}
+	}
+
+	//
+	// moving the strings keeps their buffers, so long
+	// parameters don't allocate again on the next command
+	//
+	void Command::RecycleParameters()
+	{
+		while(!params_.empty())
+		{
+			if(spareParams_.size() < MAX_SPARE_PARAMETERS && params_.back().capacity() <= MAX_SPARE_PARAMETER_CAPACITY)
+				spareParams_.push_back(std::move(params_.back()));
 
-		source_ = source;
+			params_.pop_back();
+		}
+	}
 
-		command_ = params_[0];
-		params_.erase(params_.begin());
+	void Command::Clear()
+	{
+		command_.clear();
+		source_.clear();
+		RecycleParameters();
+		data_.reset();
 	}
 
 	const string& Command::GetCommand() const
@@ -33,14 +33,34 @@ namespace tio
 		typedef vector<string> Parameters;
 	private:
 		Parameters params_;
+
+		//
+		// strings of previous commands, kept to be reused with their buffers.
+		// One huge command shouldn't keep its memory for the whole session,
+		// so only this many strings up to this size are kept
+		//
+		static const size_t MAX_SPARE_PARAMETERS = 64;
+		static const size_t MAX_SPARE_PARAMETER_CAPACITY = 1024;
+		Parameters spareParams_;
 		string command_;
 		string source_;
 		const char* separators_;
 		shared_ptr<tio::Buffer> data_;
 
+		void RecycleParameters();
+
 	public:
 		Command();
 		void Parse(const char* source);
+
+		//
+		// Parses [begin, end), which doesn't need to be null terminated.
+		// Clear keeps the buffers, including the ones of the parameter
+		// strings, so parsing the next command usually doesn't allocate
+		//
+		void Parse(const char* begin, const char* end);
+
+		void Clear();
 		const string& GetSource() const;
 		const string& GetCommand() const;
 		const Parameters& GetParameters() const;
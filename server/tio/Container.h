@@ -649,6 +649,11 @@ namespace tio
 
 	typedef std::function<void(const string&, const TioData&, const TioData&, const TioData&)> EventSink;
 
+	//
+	// same as EventSink, with the event sequence number first
+	//
+	typedef std::function<void(unsigned long long, const string&, const TioData&, const TioData&, const TioData&)> SequencedEventSink;
+
 	static const TioData TIONULL = TioData();
 
 	INTERFACE ITioResultSet
@@ -723,6 +728,38 @@ namespace tio
 		virtual std::vector<string> GetSupportedTypes() = 0;
 
 		virtual std::vector<StorageInfo> GetStorageList() = 0;
+
+		//
+		// group commit. Storage managers can keep changes pending and
+		// make them durable in a single Commit() call
+		//
+		virtual bool HasPendingCommit() = 0;
+		virtual void Commit() = 0;
+
+		//
+		// changes that don't need to be durable before answering the client,
+		// but must be committed in at most maxDelay milliseconds
+		//
+		virtual bool HasPendingFlush(unsigned int* maxDelay) = 0;
+
+		//
+		// called periodically by the server, from the same thread as
+		// every other call. Used for background work like compaction
+		//
+		virtual void DoMaintenance() = 0;
+
+		//
+		// name/value pairs with storage counters (cache hits, etc). Added to
+		// the map, so many managers can report into the same one
+		//
+		virtual void GetStatistics(std::map<string, string>* statistics) = 0;
+
+		//
+		// throws std::invalid_argument if a container of this type wouldn't
+		// accept the property. Lets create check its parameters before
+		// creating anything
+		//
+		virtual void CheckProperty(const string& type, const string& key, const string& value) = 0;
 	};
 
 	INTERFACE ITioContainer
@@ -754,10 +791,27 @@ namespace tio
 		virtual unsigned int Subscribe(EventSink sink, const string& start) = 0;
 		virtual void Unsubscribe(unsigned int cookie) = 0;
 
+		//
+		// Events come with their sequence number. If the events after
+		// lastSequence are still in the journal they're sent, followed by
+		// snapshot_end. If not, or if lastSequence is zero, it sends a full
+		// snapshot instead, preceded by a clear if lastSequence is not zero.
+		// The clear and the snapshot records come with sequence zero, only
+		// snapshot_end has the sequence of the last change, so a client that
+		// disconnects in the middle of a snapshot can't resume from it.
+		// Cookie must be released with Unsubscribe
+		//
+		virtual unsigned int SubscribeJournal(SequencedEventSink sink, unsigned long long lastSequence) = 0;
+
 		virtual string GetType() = 0;
 
+		//
+		// Both return zero if the record was popped right away, or an
+		// id to cancel the pending pop with CancelWaitAndPop
+		//
 		virtual int WaitAndPopNext(EventSink sink) = 0;
-		virtual void CancelWaitAndPopNext(int id) = 0;
+		virtual int WaitAndPopKey(const TioData& key, EventSink sink) = 0;
+		virtual void CancelWaitAndPop(int id) = 0;
 	};
 
 	//
@@ -797,6 +851,21 @@ namespace tio
 	};
 
 
+	//
+	// Event sequence numbers are unique in the process, so an old sequence
+	// never matches a journal of a container that was closed and opened
+	// again. It starts at the current time in microseconds, so sequences
+	// from before a restart are always older than the journals.
+	//
+	inline unsigned long long NextEventSequence()
+	{
+		static std::atomic<unsigned long long> lastSequence(
+			(boost::posix_time::microsec_clock::universal_time() - 
+				boost::posix_time::ptime(boost::gregorian::date(1970, 1, 1))).total_microseconds());
+
+		return ++lastSequence;
+	}
+
 	class Container : 
 		public ITioContainer,
 		boost::noncopyable
@@ -805,6 +874,88 @@ namespace tio
 		shared_ptr<ITioStorage> storage_;
 		tio::recursive_mutex mutex_;
 
+		//
+		// In memory journal of the last events, so sequence subscriptions
+		// can be resumed without a snapshot. It's only started by the first
+		// SubscribeJournal call; containers nobody resumes don't pay for it
+		//
+		struct JOURNAL_EVENT
+		{
+			unsigned long long sequence;
+			string eventName;
+			TioData key, value, metadata;
+		};
+
+		//
+		// journal subscription cookies have this bit set, so
+		// Unsubscribe can tell them from storage cookies
+		//
+		static const unsigned int JOURNAL_COOKIE_FLAG = 0x80000000;
+
+		size_t journalSize_;
+		bool journalStarted_;
+		unsigned int journalStorageCookie_;
+		std::deque<JOURNAL_EVENT> journal_;
+		unsigned long long lastSequence_;
+
+		//
+		// sequence of the last event we don't have anymore. Subscribers
+		// must have seen at least this one to resume
+		//
+		unsigned long long oldestResumableSequence_;
+
+		unsigned int lastJournalCookie_;
+		map<unsigned int, SequencedEventSink> journalSinks_;
+
+		void StartJournal()
+		{
+			if(journalStarted_)
+				return;
+
+			lastSequence_ = NextEventSequence();
+			oldestResumableSequence_ = lastSequence_;
+
+			journalStorageCookie_ = storage_->Subscribe(
+				[this](const string& eventName, const TioData& key, const TioData& value, const TioData& metadata)
+				{
+					OnJournalEvent(eventName, key, value, metadata);
+				},
+				string());
+
+			journalStarted_ = true;
+		}
+
+		void OnJournalEvent(const string& eventName, const TioData& key, const TioData& value, const TioData& metadata)
+		{
+			if(eventName == "snapshot_end")
+				return;
+
+			lastSequence_ = NextEventSequence();
+
+			if(journalSize_ > 0)
+			{
+				journal_.push_back(JOURNAL_EVENT());
+
+				JOURNAL_EVENT& event = journal_.back();
+				event.sequence = lastSequence_;
+				event.eventName = eventName;
+				event.key = key;
+				event.value = value;
+				event.metadata = metadata;
+
+				if(journal_.size() > journalSize_)
+				{
+					oldestResumableSequence_ = journal_.front().sequence;
+					journal_.pop_front();
+				}
+			}
+			else
+				oldestResumableSequence_ = lastSequence_;
+
+			for(map<unsigned int, SequencedEventSink>::iterator i = journalSinks_.begin() ; i != journalSinks_.end() ; ++i)
+				i->second(lastSequence_, eventName, key, value, metadata);
+		}
+
 		unsigned int lastPopperId_;
 
 		struct PopperInfo
@@ -816,6 +967,8 @@ namespace tio
 			unsigned int id;
 		};
 
+		typedef std::list<PopperInfo> PopperList;
+
 		struct FindPopperInfoById
 		{
 			FindPopperInfoById(unsigned int id): id(id) {}
@@ -828,7 +981,18 @@ namespace tio
 			unsigned int id;
 		};
 
-		std::list<PopperInfo> poppers_;
+		//
+		// wnp_next poppers, and wnp_key poppers by key
+		//
+		PopperList poppers_;
+		map<string, PopperList> keyPoppers_;
+
+		//
+		// poppers waiting in both. Protected by the container lock, like
+		// the lists. Writes hold the lock anyway, this only lets them skip
+		// the list and map lookups when nobody is waiting
+		//
+		unsigned int waitingPoppers_;
 
 		inline size_t GetRealRecordNumber(int recNumber)
 		{
@@ -849,15 +1013,23 @@ namespace tio
 
 	public:
 
-		Container(shared_ptr<ITioStorage> storage, shared_ptr<ITioPropertyMap> propertyMap) :
+		Container(shared_ptr<ITioStorage> storage, shared_ptr<ITioPropertyMap> propertyMap, size_t journalSize = 0) :
 			storage_(storage),
 			propertyMap_(propertyMap),
-			lastPopperId_(0)
+			journalSize_(journalSize),
+			journalStarted_(false),
+			journalStorageCookie_(0),
+			lastSequence_(0),
+			oldestResumableSequence_(0),
+			lastJournalCookie_(0),
+			lastPopperId_(0),
+			waitingPoppers_(0)
 		{}
 		
 		~Container()
 		{
-			return;
+			if(journalStarted_)
+				storage_->Unsubscribe(journalStorageCookie_);
 		}
 		
 		virtual string GetName()
@@ -903,7 +1075,7 @@ namespace tio
 			// since it's (supposed to be) a private function
 			//
 
-			if(poppers_.empty())
+			if(waitingPoppers_ == 0 || poppers_.empty())
 				return;
 
 			//
@@ -924,10 +1096,36 @@ namespace tio
 
 			PopperInfo info = poppers_.front();
 			poppers_.pop_front();
+			--waitingPoppers_;
 			
 			info.sink("wnp_next", key, value, metadata);
 		}
 
+		void HandleWaitAndPopKey(const TioData& key, const TioData& value, const TioData& metadata)
+		{
+			//
+			// lock must be held, like HandleWaitAndPopNext
+			//
+			if(waitingPoppers_ == 0 || key.GetDataType() != TioData::String)
+				return;
+
+			map<string, PopperList>::iterator i = keyPoppers_.find(key.AsSz());
+
+			if(i == keyPoppers_.end())
+				return;
+
+			PopperInfo info = i->second.front();
+			i->second.pop_front();
+			--waitingPoppers_;
+
+			if(i->second.empty())
+				keyPoppers_.erase(i);
+
+			storage_->Delete(key, TIONULL, TIONULL);
+
+			info.sink("wnp_key", key, value, metadata);
+		}
+
 				
 		virtual void PushBack(const TioData& key, const TioData& value, const TioData& metadata)
 		{
@@ -948,12 +1146,14 @@ namespace tio
 		{
 			tio::recursive_mutex::scoped_lock lock(mutex_);
 			storage_->Insert(key, value, metadata);
+			HandleWaitAndPopKey(key, value, metadata);
 		}
 
 		virtual void Set(const TioData& key, const TioData& value, const TioData& metadata)
 		{
 			tio::recursive_mutex::scoped_lock lock(mutex_);
 			storage_->Set(key, value, metadata);
+			HandleWaitAndPopKey(key, value, metadata);
 		}
 
 		virtual void Delete(const TioData& key, const TioData& value, const TioData& metadata)
@@ -1000,7 +1200,64 @@ namespace tio
 		virtual void Unsubscribe(unsigned int cookie)
 		{
 			tio::recursive_mutex::scoped_lock lock(mutex_);
-			storage_->Unsubscribe(cookie);
+
+			if(cookie & JOURNAL_COOKIE_FLAG)
+				journalSinks_.erase(cookie);
+			else
+				storage_->Unsubscribe(cookie);
+		}
+
+		virtual unsigned int SubscribeJournal(SequencedEventSink sink, unsigned long long lastSequence)
+		{
+			tio::recursive_mutex::scoped_lock lock(mutex_);
+
+			StartJournal();
+
+			if(lastSequence != 0 && lastSequence >= oldestResumableSequence_ && lastSequence <= lastSequence_)
+			{
+				for(std::deque<JOURNAL_EVENT>::const_iterator i = journal_.begin() ; i != journal_.end() ; ++i)
+				{
+					if(i->sequence > lastSequence)
+						sink(i->sequence, i->eventName, i->key, i->value, i->metadata);
+				}
+
+				sink(lastSequence_, "snapshot_end", TIONULL, TIONULL, TIONULL);
+			}
+			else
+			{
+				unsigned long long snapshotSequence = lastSequence_;
+				bool snapshotEnded = false;
+
+				if(lastSequence != 0)
+					sink(0, "clear", TIONULL, TIONULL, TIONULL);
+
+				//
+				// storages only know how to send snapshots to new subscribers
+				//
+				unsigned int snapshotCookie = storage_->Subscribe(
+					[&sink, &snapshotEnded, snapshotSequence](const string& eventName, const TioData& key, const TioData& value, const TioData& metadata)
+					{
+						if(eventName == "snapshot_end")
+						{
+							snapshotEnded = true;
+							sink(snapshotSequence, eventName, key, value, metadata);
+						}
+						else
+							sink(0, eventName, key, value, metadata);
+					},
+					"0");
+
+				storage_->Unsubscribe(snapshotCookie);
+
+				if(!snapshotEnded)
+					sink(snapshotSequence, "snapshot_end", TIONULL, TIONULL, TIONULL);
+			}
+
+			unsigned int cookie = ++lastJournalCookie_ | JOURNAL_COOKIE_FLAG;
+
+			journalSinks_[cookie] = sink;
+
+			return cookie;
 		}
 
 		virtual int WaitAndPopNext(EventSink sink)
@@ -1027,13 +1284,227 @@ namespace tio
 			else
 			{
 				poppers_.push_back(PopperInfo(sink, ++lastPopperId_));
+				++waitingPoppers_;
 				return lastPopperId_;
 			}
 		}
 
-		virtual void CancelWaitAndPopNext(int id)
+		virtual int WaitAndPopKey(const TioData& key, EventSink sink)
+		{
+			tio::recursive_mutex::scoped_lock lock(mutex_);
+
+			//
+			// we support wait and pop just for string keys
+			//
+			if(key.GetDataType() != TioData::String)
+				throw std::invalid_argument("invalid data type, must be string");
+
+			string keyAsString = key.AsSz();
+			map<string, PopperList>::iterator i = keyPoppers_.find(keyAsString);
+
+			//
+			// if somebody else is waiting for this key, get in line
+			//
+			if(i == keyPoppers_.end())
+			{
+				TioData value, metadata;
+				bool found = true;
+
+				try
+				{
+					storage_->GetRecord(key, NULL, &value, &metadata);
+				}
+				catch(std::invalid_argument&)
+				{
+					found = false;
+				}
+
+				if(found)
+				{
+					storage_->Delete(key, TIONULL, TIONULL);
+
+					sink("wnp_key", key, value, metadata);
+
+					return 0;
+				}
+
+				//
+				// lists are only created here, with a popper, so
+				// an existing list is never empty
+				//
+				i = keyPoppers_.insert(make_pair(keyAsString, PopperList())).first;
+			}
+
+			i->second.push_back(PopperInfo(sink, ++lastPopperId_));
+			++waitingPoppers_;
+			return lastPopperId_;
+		}
+
+		virtual void CancelWaitAndPop(int id)
 		{
+			tio::recursive_mutex::scoped_lock lock(mutex_);
+
+			size_t before = poppers_.size();
 			poppers_.remove_if(FindPopperInfoById(id));
+
+			if(poppers_.size() != before)
+			{
+				--waitingPoppers_;
+				return;
+			}
+
+			for(map<string, PopperList>::iterator i = keyPoppers_.begin() ; i != keyPoppers_.end() ; ++i)
+			{
+				before = i->second.size();
+				i->second.remove_if(FindPopperInfoById(id));
+
+				if(i->second.size() == before)
+					continue;
+
+				--waitingPoppers_;
+
+				if(i->second.empty())
+					keyPoppers_.erase(i);
+
+				return;
+			}
+		}
+	};
+
+	//
+	// On a replica, everybody but the replication gets the containers copied
+	// from the primary through this. Reads go to the container, writes throw
+	//
+	class ReadOnlyContainer : 
+		public ITioContainer,
+		boost::noncopyable
+	{
+		shared_ptr<ITioContainer> container_;
+
+		void ThrowReadOnly()
+		{
+			throw std::invalid_argument("container is replicated from the primary, it can't be changed here");
+		}
+
+	public:
+		explicit ReadOnlyContainer(shared_ptr<ITioContainer> container) :
+			container_(container)
+		{
+		}
+
+		virtual string GetName()
+		{
+			return container_->GetName();
+		}
+
+		virtual size_t GetRecordCount()
+		{
+			return container_->GetRecordCount();
+		}
+
+		virtual string GetType()
+		{
+			return container_->GetType();
+		}
+
+		virtual string Command(const string& command)
+		{
+			ThrowReadOnly();
+			return string();
+		}
+
+		virtual void GetRecord(const TioData& searchKey, TioData* key, TioData* value, TioData* metadata = NULL)
+		{
+			container_->GetRecord(searchKey, key, value, metadata);
+		}
+
+		virtual void PushBack(const TioData& key, const TioData& value, const TioData& metadata = TIONULL)
+		{
+			ThrowReadOnly();
+		}
+
+		virtual void PushFront(const TioData& key, const TioData& value, const TioData& metadata = TIONULL)
+		{
+			ThrowReadOnly();
+		}
+
+		virtual void PopBack(TioData* key, TioData* value, TioData* metadata = NULL)
+		{
+			ThrowReadOnly();
+		}
+
+		virtual void PopFront(TioData* key, TioData* value, TioData* metadata = NULL)
+		{
+			ThrowReadOnly();
+		}
+
+		virtual void Insert(const TioData& key, const TioData& value, const TioData& metadata = TIONULL)
+		{
+			ThrowReadOnly();
+		}
+
+		virtual void Set(const TioData& key, const TioData& value, const TioData& metadata = TIONULL)
+		{
+			ThrowReadOnly();
+		}
+
+		virtual void Delete(const TioData& key, const TioData& value = TIONULL, const TioData& metadata = TIONULL)
+		{
+			ThrowReadOnly();
+		}
+
+		virtual shared_ptr<ITioResultSet> Query(int startOffset, int endOffset, const TioData& query)
+		{
+			return container_->Query(startOffset, endOffset, query);
+		}
+
+		virtual void Clear()
+		{
+			ThrowReadOnly();
+		}
+
+		virtual void SetProperty(const string& key, const string& value)
+		{
+			ThrowReadOnly();
+		}
+
+		virtual string GetProperty(const string& key)
+		{
+			return container_->GetProperty(key);
+		}
+
+		virtual unsigned int Subscribe(EventSink sink, const string& start)
+		{
+			return container_->Subscribe(sink, start);
+		}
+
+		virtual void Unsubscribe(unsigned int cookie)
+		{
+			container_->Unsubscribe(cookie);
+		}
+
+		virtual unsigned int SubscribeJournal(SequencedEventSink sink, unsigned long long lastSequence)
+		{
+			return container_->SubscribeJournal(sink, lastSequence);
+		}
+
+		//
+		// pops change the container too
+		//
+		virtual int WaitAndPopNext(EventSink sink)
+		{
+			ThrowReadOnly();
+			return 0;
+		}
+
+		virtual int WaitAndPopKey(const TioData& key, EventSink sink)
+		{
+			ThrowReadOnly();
+			return 0;
+		}
+
+		virtual void CancelWaitAndPop(int id)
+		{
 		}
 	};
 
@@ -1248,7 +1719,7 @@ namespace tio
 	inline bool IsMapContainer(shared_ptr<ITioContainer> container)
 	{
 		string type = container->GetType();
-		return type == "volatile_map" || type == "persistent_map";
+		return type == "volatile_map" || type == "persistent_map" || type == "btree_map" || type == "lsm_map";
 	}
 
 }
@@ -41,6 +41,18 @@ namespace tio
 		meta_availableTypes_->PushBack(TIONULL, "volatile_map");
 	}
 
+	void ContainerManager::SetJournalSize(size_t journalSize)
+	{
+		tio::recursive_mutex::scoped_lock lock(bigLock_);
+		journalSize_ = journalSize;
+	}
+
+	void ContainerManager::SetJournalKeepOpenTimeout(unsigned int seconds)
+	{
+		tio::recursive_mutex::scoped_lock lock(bigLock_);
+		keepOpenTimeout_ = seconds;
+	}
+
 	void ContainerManager::RegisterStorageManager(const string& type, shared_ptr<ITioStorageManager> manager)
 	{
 		tio::recursive_mutex::scoped_lock lock(bigLock_);
@@ -121,7 +133,7 @@ namespace tio
 			pair_assign(storage, propertyMap) = storageManager->OpenStorage(type, name);
 		}
 
-		shared_ptr<ITioContainer> container(new Container(storage, propertyMap));
+		shared_ptr<ITioContainer> container(new Container(storage, propertyMap, journalSize_));
 
 		openContainers_[name] = container;
 
@@ -132,23 +144,93 @@ namespace tio
 	{
 		tio::recursive_mutex::scoped_lock lock(bigLock_);
 
+		if(replicated_.find(name) != replicated_.end())
+			throw std::invalid_argument("container is replicated from the primary, it can't be deleted here");
+
 		string realType = ResolveAlias(type);
 		shared_ptr<ITioStorageManager> storageManager = GetStorageManagerByType(realType);
 
 		storageManager->DeleteStorage(realType, name);
 
 		meta_containers_->Delete(name);
+
+		keptOpen_.erase(name);
 	}
 
+	void ContainerManager::KeepOpen(const string& name, shared_ptr<ITioContainer> container)
+	{
+		tio::recursive_mutex::scoped_lock lock(bigLock_);
+
+		KEPT_OPEN& keptOpen = keptOpen_[name];
+		keptOpen.container = container;
+		keptOpen.idleSince = boost::posix_time::ptime();
+	}
+
+	void ContainerManager::ReleaseIdleKeptOpen()
+	{
+		boost::posix_time::ptime now = boost::posix_time::second_clock::universal_time();
+
+		for(map<string, KEPT_OPEN>::iterator i = keptOpen_.begin() ; i != keptOpen_.end() ; )
+		{
+			//
+			// sessions with a handle (journal subscribed or not) have a reference too
+			//
+			if(i->second.container.use_count() > 1)
+			{
+				i->second.idleSince = boost::posix_time::ptime();
+				++i;
+			}
+			else if(i->second.idleSince.is_not_a_date_time())
+			{
+				i->second.idleSince = now;
+				++i;
+			}
+			else if(now - i->second.idleSince >= boost::posix_time::seconds(static_cast<long>(keepOpenTimeout_)))
+				keptOpen_.erase(i++);
+			else
+				++i;
+		}
+	}
+
+
+	shared_ptr<ITioContainer> ContainerManager::ProtectReplicated(const string& name, shared_ptr<ITioContainer> container)
+	{
+		tio::recursive_mutex::scoped_lock lock(bigLock_);
+
+		if(replicated_.find(name) == replicated_.end())
+			return container;
+
+		return shared_ptr<ITioContainer>(new ReadOnlyContainer(container));
+	}
 
 	shared_ptr<ITioContainer> ContainerManager::CreateContainer(const string& type, const string& name)
 	{
-		return CreateOrOpen(type, create, name);
+		return ProtectReplicated(name, CreateOrOpen(type, create, name));
 	}
 
 	shared_ptr<ITioContainer> ContainerManager::OpenContainer(const string& type, const string& name)
 	{
-		return CreateOrOpen(type, open, name);
+		return ProtectReplicated(name, CreateOrOpen(type, open, name));
+	}
+
+	shared_ptr<ITioContainer> ContainerManager::CreateReplicatedContainer(const string& type, const string& name)
+	{
+		tio::recursive_mutex::scoped_lock lock(bigLock_);
+
+		shared_ptr<ITioContainer> container = CreateOrOpen(type, create, name);
+
+		replicated_.insert(name);
+
+		return container;
+	}
+
+	void ContainerManager::DeleteReplicatedContainer(const string& type, const string& name)
+	{
+		tio::recursive_mutex::scoped_lock lock(bigLock_);
+
+		replicated_.erase(name);
+
+		DeleteContainer(type, name);
 	}
 
 	void ContainerManager::AddAlias(const string& alias, const string& type)
@@ -166,6 +248,15 @@ namespace tio
 		return GetStorageManagerByType(containerType)->Exists(containerType, containerName);
 	}
 
+	void ContainerManager::CheckProperty(const string& containerType, const string& key, const string& value)
+	{
+		tio::recursive_mutex::scoped_lock lock(bigLock_);
+
+		string type = ResolveAlias(containerType);
+
+		GetStorageManagerByType(type)->CheckProperty(type, key, value);
+	}
+
 	string ContainerManager::ResolveAlias(const string& type)
 	{
 		tio::recursive_mutex::scoped_lock lock(bigLock_);
@@ -180,4 +271,97 @@ namespace tio
 		else
 			return type;
 	}
+
+	bool ContainerManager::HasPendingCommit()
+	{
+		tio::recursive_mutex::scoped_lock lock(bigLock_);
+
+		for(ManagerByType::const_iterator i = managerByType_.begin() ; i != managerByType_.end() ; ++i)
+		{
+			if(i->second->HasPendingCommit())
+				return true;
+		}
+
+		return false;
+	}
+
+	bool ContainerManager::HasPendingFlush(unsigned int* maxDelay)
+	{
+		tio::recursive_mutex::scoped_lock lock(bigLock_);
+
+		bool hasPendingFlush = false;
+
+		for(ManagerByType::const_iterator i = managerByType_.begin() ; i != managerByType_.end() ; ++i)
+		{
+			unsigned int delay;
+
+			if(!i->second->HasPendingFlush(&delay))
+				continue;
+
+			if(!hasPendingFlush || delay < *maxDelay)
+				*maxDelay = delay;
+
+			hasPendingFlush = true;
+		}
+
+		return hasPendingFlush;
+	}
+
+	void ContainerManager::SetOutsideWriteCallback(function<void()> callback)
+	{
+		tio::recursive_mutex::scoped_lock lock(bigLock_);
+		outsideWriteCallback_ = callback;
+	}
+
+	void ContainerManager::OnOutsideWrite()
+	{
+		tio::recursive_mutex::scoped_lock lock(bigLock_);
+
+		if(outsideWriteCallback_)
+			outsideWriteCallback_();
+	}
+
+	void ContainerManager::Commit()
+	{
+		tio::recursive_mutex::scoped_lock lock(bigLock_);
+
+		//
+		// same manager can be registered for more than one type
+		//
+		std::set<ITioStorageManager*> committed;
+
+		for(ManagerByType::const_iterator i = managerByType_.begin() ; i != managerByType_.end() ; ++i)
+		{
+			if(committed.insert(i->second.get()).second)
+				i->second->Commit();
+		}
+	}
+
+	void ContainerManager::DoMaintenance()
+	{
+		tio::recursive_mutex::scoped_lock lock(bigLock_);
+
+		std::set<ITioStorageManager*> done;
+
+		for(ManagerByType::const_iterator i = managerByType_.begin() ; i != managerByType_.end() ; ++i)
+		{
+			if(done.insert(i->second.get()).second)
+				i->second->DoMaintenance();
+		}
+
+		ReleaseIdleKeptOpen();
+	}
+
+	void ContainerManager::GetStatistics(std::map<string, string>* statistics)
+	{
+		tio::recursive_mutex::scoped_lock lock(bigLock_);
+
+		std::set<ITioStorageManager*> done;
+
+		for(ManagerByType::const_iterator i = managerByType_.begin() ; i != managerByType_.end() ; ++i)
+		{
+			if(done.insert(i->second.get()).second)
+				i->second->GetStatistics(statistics);
+		}
+	}
 }
@@ -35,6 +35,38 @@ namespace tio
 
 		OpenContainersMap openContainers_;
 
+		size_t journalSize_;
+
+		//
+		// containers with journal subscribers are kept open even
+		// when nobody has a handle, so they can be resumed later.
+		// Once nobody else has them, they're released after
+		// keepOpenTimeout_ seconds
+		//
+		struct KEPT_OPEN
+		{
+			shared_ptr<ITioContainer> container;
+			boost::posix_time::ptime idleSince;
+		};
+
+		map<string, KEPT_OPEN> keptOpen_;
+
+		//
+		// containers a replica copies from its primary. Only the
+		// replication can change them
+		//
+		std::set<string> replicated_;
+
+		shared_ptr<ITioContainer> ProtectReplicated(const string& name, shared_ptr<ITioContainer> container);
+		unsigned int keepOpenTimeout_;
+
+		void ReleaseIdleKeptOpen();
+
+		//
+		// called after writes that don't come from a session command
+		//
+		function<void()> outsideWriteCallback_;
+
 		enum OperationType
 		{
 			create,
@@ -48,6 +80,23 @@ namespace tio
 		shared_ptr<ITioStorageManager> GetStorageManagerByType(string type);
 	public:
 
+		ContainerManager() :
+			journalSize_(0),
+			keepOpenTimeout_(300)
+		{}
+
+		//
+		// number of events each container keeps for resuming
+		// journal subscriptions
+		//
+		void SetJournalSize(size_t journalSize);
+
+		//
+		// seconds a container stays open for journal resumes
+		// after its last handle is closed
+		//
+		void SetJournalKeepOpenTimeout(unsigned int seconds);
+
 		void AddAlias(const string& alias, const string& type);
 		
 		void RegisterFundamentalStorageManagers( shared_ptr<ITioStorageManager> volatileList, shared_ptr<ITioStorageManager> volatileMap);
@@ -58,8 +107,33 @@ namespace tio
 
 		void DeleteContainer(const string& type, const string& name);
 
+		//
+		// for the replication, the containers it returns can be changed.
+		// Everybody else gets them read only from now on
+		//
+		shared_ptr<ITioContainer> CreateReplicatedContainer(const string& type, const string& name);
+		void DeleteReplicatedContainer(const string& type, const string& name);
+
+		void KeepOpen(const string& name, shared_ptr<ITioContainer> container);
+
 		bool Exists(const string& containerType, const string& containerName);
 
+		void CheckProperty(const string& containerType, const string& key, const string& value);
+
 		string ResolveAlias(const string& type);
+
+		//
+		// Plugins write to containers from their own threads, outside
+		// of any session command. They call OnOutsideWrite after writing
+		// so the server can commit it, like it does after a command
+		//
+		void SetOutsideWriteCallback(function<void()> callback);
+		void OnOutsideWrite();
+
+		bool HasPendingCommit();
+		bool HasPendingFlush(unsigned int* maxDelay);
+		void Commit();
+		void DoMaintenance();
+		void GetStatistics(std::map<string, string>* statistics);
 	};
 }
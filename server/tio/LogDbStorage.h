@@ -83,6 +83,147 @@ namespace tio {
 			}
 		};
 
+		//
+		// Durability is set per container using the "durability" property:
+		//
+		//   sync            every change is synced to disk before the answer
+		//   group           changes are synced in batches, answers are sent after the sync (default)
+		//   periodic[:ms]   changes are synced at most [ms] milliseconds later (default 100ms),
+		//                   answers don't wait
+		//   buffered        changes go to the OS cache, sync happens when someone else commits
+		//
+		enum DurabilityMode
+		{
+			durabilitySync,
+			durabilityGroupCommit,
+			durabilityPeriodic,
+			durabilityBuffered
+		};
+
+		struct DURABILITY_CONFIG
+		{
+			DURABILITY_CONFIG() : mode(durabilityGroupCommit), flushInterval(0)
+			{}
+
+			DurabilityMode mode;
+			unsigned int flushInterval;
+		};
+
+		static const char* DURABILITY_PROPERTY_NAME = "durability";
+		static const unsigned int DEFAULT_PERIODIC_FLUSH_INTERVAL = 100;
+
+		DURABILITY_CONFIG ParseDurability(const string& durability)
+		{
+			DURABILITY_CONFIG config;
+
+			if(durability == "sync")
+				config.mode = durabilitySync;
+			else if(durability == "group")
+				config.mode = durabilityGroupCommit;
+			else if(durability == "buffered")
+				config.mode = durabilityBuffered;
+			else if(durability == "periodic")
+			{
+				config.mode = durabilityPeriodic;
+				config.flushInterval = DEFAULT_PERIODIC_FLUSH_INTERVAL;
+			}
+			else if(boost::starts_with(durability, "periodic:"))
+			{
+				config.mode = durabilityPeriodic;
+
+				try
+				{
+					config.flushInterval = lexical_cast<unsigned int>(durability.substr(sizeof("periodic:") - 1));
+				}
+				catch(boost::bad_lexical_cast&)
+				{
+					throw std::invalid_argument("invalid flush interval");
+				}
+			}
+			else
+				throw std::invalid_argument("invalid durability, should be sync, group, periodic[:ms] or buffered");
+
+			return config;
+		}
+
+		//
+		// Keeps track of what must be done to make changes durable. All containers
+		// share the same file, so a sync for one container syncs everyone
+		//
+		class DurabilityControl
+		{
+			logdb::Ldb& ldb_;
+
+			bool commitNeeded_;
+
+			bool flushNeeded_;
+			boost::posix_time::ptime flushDeadline_;
+
+		public:
+			DurabilityControl(logdb::Ldb& ldb) : 
+				ldb_(ldb),
+				commitNeeded_(false),
+				flushNeeded_(false)
+			{
+			}
+
+			void OnChange(const DURABILITY_CONFIG& config, const logdb::Ldb::TABLE_INFO* tableInfo)
+			{
+				switch(config.mode)
+				{
+				case durabilitySync:
+					ldb_.Commit();
+					break;
+
+				case durabilityGroupCommit:
+					commitNeeded_ = true;
+					break;
+
+				case durabilityPeriodic:
+					{
+						boost::posix_time::ptime deadline = 
+							boost::posix_time::microsec_clock::universal_time() + 
+							boost::posix_time::milliseconds(config.flushInterval);
+
+						if(!flushNeeded_ || deadline < flushDeadline_)
+							flushDeadline_ = deadline;
+
+						flushNeeded_ = true;
+					}
+					break;
+
+				case durabilityBuffered:
+					ldb_.WriteBack(tableInfo);
+					break;
+				}
+			}
+
+			bool HasPendingCommit()
+			{
+				return commitNeeded_;
+			}
+
+			bool HasPendingFlush(unsigned int* maxDelay)
+			{
+				if(!flushNeeded_)
+					return false;
+
+				boost::posix_time::time_duration remaining = 
+					flushDeadline_ - boost::posix_time::microsec_clock::universal_time();
+
+				*maxDelay = remaining.is_negative() ? 0 : static_cast<unsigned int>(remaining.total_milliseconds());
+
+				return true;
+			}
+
+			void Commit()
+			{
+				ldb_.Commit();
+				commitNeeded_ = false;
+				flushNeeded_ = false;
+			}
+		};
+
 		class LogDbVectorStorage : 
 			boost::noncopyable,
 			public std::enable_shared_from_this<LogDbVectorStorage>,
@@ -102,12 +243,26 @@ namespace tio {
 			string type_, name_;
 			EventDispatcher dispatcher_;
 			AccessType accessType_;
+
+			//
+			// shared between data and properties storage of the same container
+			//
+			DurabilityControl& durabilityControl_;
+			shared_ptr<DURABILITY_CONFIG> durability_;
+
+			void OnChange()
+			{
+				durabilityControl_.OnChange(*durability_, tableInfo_);
+			}
+
 		public:
 
 			LogDbVectorStorage(logdb::Ldb& ldb, logdb::Ldb::TABLE_INFO* tableInfo,
-				const string& name, const string& type, AccessType accessType) 
+				const string& name, const string& type, AccessType accessType,
+				DurabilityControl& durabilityControl, shared_ptr<DURABILITY_CONFIG> durability) 
 				: type_(type), name_(name), accessType_(accessType), 
-				ldb_(ldb), tableInfo_(tableInfo)
+				ldb_(ldb), tableInfo_(tableInfo),
+				durabilityControl_(durabilityControl), durability_(durability)
 			{
 
 			}
@@ -151,6 +306,8 @@ namespace tio {
 				if(index == logdb::LDB_INVALID_RECNO)
 					throw std::runtime_error("error appending record");
 
+				OnChange();
+
 				dispatcher_.RaiseEvent("push_back", (int)ldb_.GetRecordCount(tableInfo_), value, metadata);
 			}
 
@@ -163,6 +320,8 @@ namespace tio {
 				ConverterHelper converter(key, value, metadata);
 
 				ldb_.InsertByIndex(tableInfo_,0, NULL, converter.GetLdbValue(), converter.GetLdbMetadata());
+				OnChange();
+
 				dispatcher_.RaiseEvent("push_front", 0, value, metadata);
 			}
 
@@ -174,6 +333,7 @@ namespace tio {
 				ldb_.GetByIndex(tableInfo_, recordIndex, helper.GetLdbKey(), helper.GetLdbValue(), helper.GetLdbMetadata());
 
 				ldb_.DeleteByIndex(tableInfo_, recordIndex);
+				OnChange();
 
 				helper.ToTioData(key, value, metadata);
 			}
@@ -259,6 +419,8 @@ namespace tio {
 					ldb_.Set(tableInfo_, 0, *converter.GetLdbKey(), converter.GetLdbValue(), converter.GetLdbMetadata());
 				}
 
+				OnChange();
+
 				dispatcher_.RaiseEvent("set", key, value, metadata);
 			}
 
@@ -300,6 +462,8 @@ namespace tio {
 					ldb_.Append(tableInfo_, converter.GetLdbKey(), converter.GetLdbValue(), converter.GetLdbMetadata());
 				}
 
+				OnChange();
+
 				dispatcher_.RaiseEvent("insert", key, value, metadata);
 			}
 
@@ -327,12 +491,15 @@ namespace tio {
 						throw std::invalid_argument("invalid index");
 				}
 
+				OnChange();
+
 				dispatcher_.RaiseEvent("delete", key, TIONULL, TIONULL);
 			}
 
 			virtual void Clear()
 			{
 				ldb_.ClearAllRecords(tableInfo_);
+				OnChange();
 			}
 
 			virtual shared_ptr<ITioResultSet> Query(int startOffset, int endOffset, const TioData& query)
@@ -489,6 +656,12 @@ namespace tio {
 				if(key.empty() || value.empty())
 					throw std::invalid_argument("invalid key");
 
+				DURABILITY_CONFIG durability;
+				bool isDurability = (key == DURABILITY_PROPERTY_NAME);
+
+				if(isDurability)
+					durability = ParseDurability(value);
+
 				logdb::LdbData keyData(key.c_str(), key.size(), logdb::LdbData::dontCopyBuffer);
 				logdb::LdbData valueData(value.c_str(), value.size(), logdb::LdbData::dontCopyBuffer);
 
@@ -497,11 +670,376 @@ namespace tio {
 				if(dw == logdb::LDB_INVALID_RECNO)
 					throw std::invalid_argument("internal error");
 
+				OnChange();
+
+				if(isDurability)
+					*durability_ = durability;
+
 				return;
 			}
 		};
 
 
+		struct LOGDB_CONFIG
+		{
+			bool memoryMapped;
+
+			//
+			// number of logdb files new containers are spread over
+			//
+			unsigned int shardCount;
+
+			//
+			// value cache budget for all shards, in bytes. Zero disables it
+			//
+			size_t valueCacheSize;
+			logdb::LdbCachePolicy valueCachePolicy;
+
+			//
+			// table records are only loaded when the container is opened, and
+			// unloaded after nobody has it open for idleTableTimeout seconds.
+			// Zero timeout keeps them loaded
+			//
+			bool lazyLoad;
+			unsigned int idleTableTimeout;
+
+			//
+			// threads used to load tables at startup
+			//
+			unsigned int loadThreads;
+
+			LOGDB_CONFIG() :
+				memoryMapped(false),
+				shardCount(1),
+				valueCacheSize(64 * 1024 * 1024),
+				valueCachePolicy(logdb::cachePolicyClock),
+				lazyLoad(true),
+				idleTableTimeout(300),
+				loadThreads(boost::thread::hardware_concurrency())
+			{
+			}
+		};
+
+		inline logdb::LdbCachePolicy ParseCachePolicy(const string& policy)
+		{
+			if(policy == "clock")
+				return logdb::cachePolicyClock;
+			else if(policy == "lru")
+				return logdb::cachePolicyLru;
+
+			throw std::invalid_argument("invalid cache policy, should be clock or lru");
+		}
+
+		//
+		// One logdb file, with its own durability control and its
+		// own background jobs (compaction and checkpoint)
+		//
+		class LogDbShard : boost::noncopyable
+		{
+			string fileName_;
+			logdb::Ldb ldb_;
+			DurabilityControl durabilityControl_;
+
+			//
+			// compaction starts when file is at least this big
+			// and more than half of the log records are garbage
+			//
+			static const DWORD MIN_COMPACTION_FILE_SIZE = 64 * 1024 * 1024;
+			logdb::LDB_OFFSET minCompactionFileSize_;
+			shared_ptr<logdb::LdbCompactor> compactor_;
+
+			//
+			// checkpoint is written at most once per interval, and only
+			// if enough log records were written since the last one
+			//
+			static const unsigned int CHECKPOINT_INTERVAL_IN_SECONDS = 60;
+			static const DWORD CHECKPOINT_MIN_LOG_RECORDS = 10000;
+			shared_ptr<logdb::LdbCheckpointWriter> checkpointWriter_;
+			boost::posix_time::ptime lastCheckpoint_;
+			unsigned long long lastCheckpointLogRecordCount_;
+
+			//
+			// With more than one dirty shard, the manager commits them at
+			// the same time, each on its own thread. The thread lives as
+			// long as the shard and is only started the first time it's needed
+			//
+			boost::thread commitThread_;
+			boost::mutex commitMutex_;
+			boost::condition_variable commitCondition_;
+			bool commitRequested_;
+			bool commitRunning_;
+			bool commitThreadStopping_;
+			string commitError_;
+
+			void CommitThread()
+			{
+				boost::mutex::scoped_lock lock(commitMutex_);
+
+				for(;;)
+				{
+					while(!commitRequested_ && !commitThreadStopping_)
+						commitCondition_.wait(lock);
+
+					if(commitThreadStopping_)
+						return;
+
+					commitRequested_ = false;
+
+					string error;
+
+					lock.unlock();
+
+					try
+					{
+						durabilityControl_.Commit();
+					}
+					catch(std::exception& ex)
+					{
+						error = ex.what();
+					}
+
+					lock.lock();
+
+					commitError_ = error;
+					commitRunning_ = false;
+					commitCondition_.notify_all();
+				}
+			}
+
+			void DoCheckpoint()
+			{
+				if(checkpointWriter_)
+				{
+					if(!checkpointWriter_->IsDone())
+						return;
+
+					if(!checkpointWriter_->Finish())
+						std::cout << "error writing logdb checkpoint for " << fileName_ << std::endl;
+
+					checkpointWriter_.reset();
+					return;
+				}
+
+				boost::posix_time::ptime now = boost::posix_time::second_clock::universal_time();
+
+				if(now - lastCheckpoint_ < boost::posix_time::seconds(static_cast<long>(CHECKPOINT_INTERVAL_IN_SECONDS)) ||
+					ldb_._totalLogRecordCount - lastCheckpointLogRecordCount_ < CHECKPOINT_MIN_LOG_RECORDS)
+					return;
+
+				//
+				// checkpoint can only point to durable data
+				//
+				durabilityControl_.Commit();
+
+				lastCheckpoint_ = now;
+				lastCheckpointLogRecordCount_ = ldb_._totalLogRecordCount;
+
+				checkpointWriter_.reset(new logdb::LdbCheckpointWriter());
+				checkpointWriter_->Start(ldb_);
+			}
+
+		public:
+			LogDbShard(const string& fileName, const LOGDB_CONFIG& config, size_t valueCacheSize) :
+				fileName_(fileName),
+				durabilityControl_(ldb_),
+				minCompactionFileSize_(MIN_COMPACTION_FILE_SIZE),
+				lastCheckpoint_(boost::posix_time::second_clock::universal_time()),
+				commitRequested_(false),
+				commitRunning_(false),
+				commitThreadStopping_(false)
+			{
+				//
+				// files created before 64 bit offsets must be converted
+				//
+				logdb::LdbV1Migrator::Recover(fileName_);
+
+				if(logdb::LdbV1Migrator::NeedsMigration(fileName_))
+				{
+					std::cout << "converting " << fileName_ << " to logdb format version " << logdb::LDB_FORMAT_VERSION 
+						<< ", old file will be kept as " << fileName_ << ".v1" << std::endl;
+
+					if(!logdb::LdbV1Migrator(fileName_).Migrate())
+						throw std::runtime_error("error converting logdb file");
+				}
+
+				ldb_.SetCheckpointFile(fileName_ + ".checkpoint");
+				ldb_.SetMemoryMapped(config.memoryMapped);
+				ldb_.SetLazyLoad(config.lazyLoad);
+				ldb_.SetLoadThreads(config.loadThreads);
+				ldb_.SetLoadProgressCallback(
+					[this](size_t loadedTables, size_t tableCount)
+					{
+						std::cout << "loading " << fileName_ << ", " << loadedTables << " of " << tableCount << " tables" << std::endl;
+					});
+
+				boost::posix_time::ptime loadStart = boost::posix_time::microsec_clock::universal_time();
+
+				bool b = ldb_.Create(fileName_.c_str());
+
+				if(!b)
+					throw std::runtime_error("error creating logdb file");
+
+				std::cout << fileName_ << " loaded in " 
+					<< (boost::posix_time::microsec_clock::universal_time() - loadStart).total_milliseconds() << "ms"
+					<< (ldb_.LoadedFromCheckpoint() ? " (from checkpoint)" : "") << std::endl;
+
+				const logdb::Ldb::TableLoadTimes& slowestTables = ldb_.GetSlowestTableLoads();
+
+				if(!slowestTables.empty())
+				{
+					std::cout << "slowest tables:";
+
+					for(logdb::Ldb::TableLoadTimes::const_iterator i = slowestTables.begin() ; i != slowestTables.end() ; ++i)
+						std::cout << " " << i->first << " (" << i->second / 1000 << "ms)";
+
+					std::cout << std::endl;
+				}
+
+				if(config.memoryMapped && !ldb_.IsMemoryMapped())
+					std::cout << "could not memory map " << fileName_ << ", using page cache" << std::endl;
+
+				lastCheckpointLogRecordCount_ = ldb_.LoadedFromCheckpoint() ? 0 : ldb_._totalLogRecordCount;
+
+				//
+				// after loading, so the cache isn't filled with keys read by load
+				//
+				ldb_.SetValueCache(valueCacheSize, config.valueCachePolicy);
+
+				//
+				// changes will be synced to disk by Commit(),
+				// one sync for all operations since last commit
+				//
+				ldb_.SetGroupCommit(true);
+			}
+
+			logdb::Ldb& GetLdb()
+			{
+				return ldb_;
+			}
+
+			DurabilityControl& GetDurabilityControl()
+			{
+				return durabilityControl_;
+			}
+
+			bool HasPendingCommit()
+			{
+				return durabilityControl_.HasPendingCommit();
+			}
+
+			bool HasPendingFlush(unsigned int* maxDelay)
+			{
+				return durabilityControl_.HasPendingFlush(maxDelay);
+			}
+
+			~LogDbShard()
+			{
+				if(commitThread_.joinable())
+				{
+					{
+						boost::mutex::scoped_lock lock(commitMutex_);
+						commitThreadStopping_ = true;
+						commitCondition_.notify_all();
+					}
+
+					commitThread_.join();
+				}
+			}
+
+			void Commit()
+			{
+				durabilityControl_.Commit();
+			}
+
+			//
+			// Commit on the shard commit thread. Every StartCommit must be
+			// followed by a FinishCommit, that waits for it and throws
+			// whatever the commit threw
+			//
+			void StartCommit()
+			{
+				boost::mutex::scoped_lock lock(commitMutex_);
+
+				BOOST_ASSERT(!commitRunning_);
+
+				if(!commitThread_.joinable())
+					commitThread_ = boost::thread(&LogDbShard::CommitThread, this);
+
+				commitError_.clear();
+				commitRequested_ = true;
+				commitRunning_ = true;
+				commitCondition_.notify_all();
+			}
+
+			void FinishCommit()
+			{
+				boost::mutex::scoped_lock lock(commitMutex_);
+
+				while(commitRunning_)
+					commitCondition_.wait(lock);
+
+				if(!commitError_.empty())
+					throw std::runtime_error(commitError_);
+			}
+
+			void DoMaintenance()
+			{
+				//
+				// one background job at a time
+				//
+				if(!compactor_)
+				{
+					DoCheckpoint();
+
+					if(checkpointWriter_)
+						return;
+				}
+
+				if(compactor_)
+				{
+					if(!compactor_->IsDone())
+						return;
+
+					logdb::LDB_OFFSET oldSize = ldb_.GetFileSize();
+
+					bool b = compactor_->Finish();
+					compactor_.reset();
+
+					if(b)
+					{
+						minCompactionFileSize_ = MIN_COMPACTION_FILE_SIZE;
+
+						std::cout << "logdb compaction finished for " << fileName_ << ", " << oldSize / (1024 * 1024) << "MB -> " 
+							<< ldb_.GetFileSize() / (1024 * 1024) << "MB" << std::endl;
+					}
+					else
+					{
+						//
+						// don't try again until file grows a little more
+						//
+						minCompactionFileSize_ = oldSize + MIN_COMPACTION_FILE_SIZE;
+
+						std::cout << "logdb compaction failed for " << fileName_ << std::endl;
+					}
+
+					return;
+				}
+
+				if(!ldb_.NeedsCompaction(minCompactionFileSize_))
+					return;
+
+				compactor_.reset(new logdb::LdbCompactor(ldb_, fileName_));
+
+				if(!compactor_->Start())
+				{
+					compactor_.reset();
+					return;
+				}
+
+				std::cout << "logdb compaction started for " << fileName_ << std::endl;
+			}
+		};
+
 		class LogDbStorageManager: public ITioStorageManager
 		{
 			//
@@ -510,11 +1048,156 @@ namespace tio {
 			typedef std::map<string, pair<weak_ptr<ITioStorage>, weak_ptr<ITioPropertyMap> > > StorageMap;
 			StorageMap containers_;
 			string path_;
-			logdb::Ldb ldb_;
+
+			//
+			// containers nobody has open, and since when
+			//
+			typedef std::map<string, boost::posix_time::ptime> IdleMap;
+			IdleMap idleContainers_;
+			unsigned int idleTableTimeout_;
+
+			//
+			// Containers are spread over shards, each one is a separated logdb file.
+			// New containers are hashed into the first newContainerShardCount_ shards.
+			// Shard files beyond that are still loaded, so changing the shard count
+			// doesn't lose containers created before
+			//
+			typedef std::vector< shared_ptr<LogDbShard> > ShardVector;
+			ShardVector shards_;
+			size_t newContainerShardCount_;
+
+			string GetShardFileName(size_t shard)
+			{
+				//
+				// first shard keeps the original name
+				//
+				if(shard == 0)
+					return path_ + "tio.logdb";
+
+				return path_ + "tio." + lexical_cast<string>(shard) + ".logdb";
+			}
+
+			LogDbShard* FindShard(const string& tableName)
+			{
+				for(ShardVector::const_iterator i = shards_.begin() ; i != shards_.end() ; ++i)
+				{
+					if((*i)->GetLdb().OpenTable(tableName))
+						return i->get();
+				}
+
+				return NULL;
+			}
+
+			LogDbShard* GetShardForNewTable(const string& tableName)
+			{
+				LogDbShard* shard = FindShard(tableName);
+
+				if(shard)
+					return shard;
+
+				return shards_[std::hash<string>()(tableName) % newContainerShardCount_].get();
+			}
+
+			//
+			// unloads tables of containers that nobody opened for a while
+			//
+			void UnloadIdleTables()
+			{
+				if(idleTableTimeout_ == 0)
+					return;
+
+				boost::posix_time::ptime now = boost::posix_time::second_clock::universal_time();
+
+				for(StorageMap::iterator i = containers_.begin() ; i != containers_.end() ; )
+				{
+					const string& dataTableName = i->first;
+
+					if(!i->second.first.expired() || !i->second.second.expired())
+					{
+						idleContainers_.erase(dataTableName);
+						++i;
+						continue;
+					}
+
+					IdleMap::iterator idle = idleContainers_.find(dataTableName);
+
+					if(idle == idleContainers_.end())
+					{
+						idleContainers_[dataTableName] = now;
+						++i;
+						continue;
+					}
+
+					if(now - idle->second < boost::posix_time::seconds(static_cast<long>(idleTableTimeout_)))
+					{
+						++i;
+						continue;
+					}
+
+					//
+					// data table name is [container type]|data|[name]
+					//
+					string::size_type typeSize = dataTableName.find('|');
+					string propertiesTableName = GenerateDataTableName("properties", 
+						dataTableName.substr(0, typeSize), dataTableName.substr(typeSize + strlen("|data|")));
+
+					LogDbShard* shard = FindShard(dataTableName);
+
+					if(shard)
+					{
+						logdb::Ldb& ldb = shard->GetLdb();
+						logdb::Ldb::TABLE_INFO* dataTableInfo = ldb.OpenTable(dataTableName);
+						logdb::Ldb::TABLE_INFO* propertiesTableInfo = ldb.OpenTable(propertiesTableName);
+
+						ldb.UnloadTable(dataTableInfo);
+
+						if(propertiesTableInfo)
+							ldb.UnloadTable(propertiesTableInfo);
+
+						//
+						// uncommitted changes, try again later
+						//
+						if(dataTableInfo->loaded || (propertiesTableInfo && propertiesTableInfo->loaded))
+						{
+							++i;
+							continue;
+						}
+					}
+
+					idleContainers_.erase(idle);
+					containers_.erase(i++);
+				}
+			}
+
+			static DURABILITY_CONFIG LoadDurability(logdb::Ldb& ldb, logdb::Ldb::TABLE_INFO* propertiesTableInfo)
+			{
+				if(!propertiesTableInfo)
+					return DURABILITY_CONFIG();
+
+				logdb::LdbData key(DURABILITY_PROPERTY_NAME, (DWORD)strlen(DURABILITY_PROPERTY_NAME), logdb::LdbData::dontCopyBuffer);
+				logdb::LdbData value;
+
+				DWORD dw = ldb.Get(propertiesTableInfo, 0, key, &value, NULL);
+
+				if(dw == logdb::LDB_INVALID_RECNO || value.GetSize() == 0)
+					return DURABILITY_CONFIG();
+
+				try
+				{
+					return ParseDurability(string((const char*)value.GetBuffer(), value.GetSize()));
+				}
+				catch(std::exception&)
+				{
+					return DURABILITY_CONFIG();
+				}
+			}
 
 		public:
 
-			LogDbStorageManager(const string& path) : path_(path)
+			LogDbStorageManager(const string& path, const LOGDB_CONFIG& config = LOGDB_CONFIG()) : 
+				path_(path),
+				idleTableTimeout_(config.idleTableTimeout),
+				newContainerShardCount_(config.shardCount ? config.shardCount : 1)
 			{
 				if(!path_.empty())
 				{
@@ -523,12 +1206,161 @@ namespace tio {
 						path_ += '/'; // works for win32 and *nix
 				}
 
-				path_ += "tio.logdb";
+				size_t shardCount = newContainerShardCount_;
 
-				bool b = ldb_.Create(path_.c_str());
+				while(boost::filesystem::exists(GetShardFileName(shardCount)))
+					shardCount++;
 
-				if(!b)
-					throw std::runtime_error("error creating logdb file");
+				//
+				// cache budget is split evenly, each shard has its own cache
+				//
+				for(size_t shard = 0 ; shard < shardCount ; shard++)
+				{
+					shards_.push_back(shared_ptr<LogDbShard>(
+						new LogDbShard(GetShardFileName(shard), config, config.valueCacheSize / shardCount)));
+				}
+			}
+
+			virtual bool HasPendingCommit()
+			{
+				for(ShardVector::const_iterator i = shards_.begin() ; i != shards_.end() ; ++i)
+				{
+					if((*i)->HasPendingCommit())
+						return true;
+				}
+
+				return false;
+			}
+
+			virtual bool HasPendingFlush(unsigned int* maxDelay)
+			{
+				bool hasPendingFlush = false;
+
+				for(ShardVector::const_iterator i = shards_.begin() ; i != shards_.end() ; ++i)
+				{
+					unsigned int shardDelay;
+
+					if(!(*i)->HasPendingFlush(&shardDelay))
+						continue;
+
+					if(!hasPendingFlush || shardDelay < *maxDelay)
+						*maxDelay = shardDelay;
+
+					hasPendingFlush = true;
+				}
+
+				return hasPendingFlush;
+			}
+
+			virtual void Commit()
+			{
+				std::vector<LogDbShard*> dirtyShards;
+
+				for(ShardVector::const_iterator i = shards_.begin() ; i != shards_.end() ; ++i)
+				{
+					unsigned int maxDelay;
+
+					if((*i)->HasPendingCommit() || (*i)->HasPendingFlush(&maxDelay))
+						dirtyShards.push_back(i->get());
+				}
+
+				if(dirtyShards.empty())
+					return;
+
+				//
+				// each shard is a different file, so they can sync at the same time.
+				// All shards are waited for even if one fails, the first error
+				// goes to the caller
+				//
+				for(size_t a = 1 ; a < dirtyShards.size() ; a++)
+					dirtyShards[a]->StartCommit();
+
+				string error;
+
+				try
+				{
+					dirtyShards[0]->Commit();
+				}
+				catch(std::exception& ex)
+				{
+					error = ex.what();
+				}
+
+				for(size_t a = 1 ; a < dirtyShards.size() ; a++)
+				{
+					try
+					{
+						dirtyShards[a]->FinishCommit();
+					}
+					catch(std::exception& ex)
+					{
+						if(error.empty())
+							error = ex.what();
+					}
+				}
+
+				if(!error.empty())
+					throw std::runtime_error(error);
+			}
+
+			virtual void DoMaintenance()
+			{
+				for(ShardVector::const_iterator i = shards_.begin() ; i != shards_.end() ; ++i)
+					(*i)->DoMaintenance();
+
+				UnloadIdleTables();
+			}
+
+			virtual void CheckProperty(const string& type, const string& key, const string& value)
+			{
+				if(key.empty() || value.empty())
+					throw std::invalid_argument("invalid key");
+
+				if(key == DURABILITY_PROPERTY_NAME)
+					ParseDurability(value);
+			}
+
+			virtual void GetStatistics(std::map<string, string>* statistics)
+			{
+				unsigned long long hits = 0, misses = 0, evictions = 0, entries = 0, bytes = 0, maxBytes = 0;
+				size_t tables = 0, loadedTables = 0;
+
+				for(ShardVector::const_iterator i = shards_.begin() ; i != shards_.end() ; ++i)
+				{
+					logdb::Ldb& ldb = (*i)->GetLdb();
+
+					for(logdb::Ldb::TableMap::const_iterator t = ldb._tables.begin() ; t != ldb._tables.end() ; ++t)
+					{
+						tables++;
+
+						if(t->second.loaded)
+							loadedTables++;
+					}
+
+					const logdb::LdbValueCache& cache = ldb.GetValueCache();
+
+					hits += cache.GetHits();
+					misses += cache.GetMisses();
+					evictions += cache.GetEvictions();
+					entries += cache.GetEntryCount();
+					bytes += cache.GetUsedBytes();
+					maxBytes += cache.GetMaxBytes();
+				}
+
+				(*statistics)["logdb_shards"] = lexical_cast<string>(shards_.size());
+				(*statistics)["logdb_tables"] = lexical_cast<string>(tables);
+				(*statistics)["logdb_loaded_tables"] = lexical_cast<string>(loadedTables);
+				(*statistics)["logdb_cache_hits"] = lexical_cast<string>(hits);
+				(*statistics)["logdb_cache_misses"] = lexical_cast<string>(misses);
+
+				std::stringstream hitRate;
+				hitRate << std::fixed << std::setprecision(1) << (hits + misses ? hits * 100.0 / (hits + misses) : 0.0);
+				(*statistics)["logdb_cache_hit_rate"] = hitRate.str();
+
+				(*statistics)["logdb_cache_evictions"] = lexical_cast<string>(evictions);
+				(*statistics)["logdb_cache_entries"] = lexical_cast<string>(entries);
+				(*statistics)["logdb_cache_bytes"] = lexical_cast<string>(bytes);
+				(*statistics)["logdb_cache_max_bytes"] = lexical_cast<string>(maxBytes);
 			}
 
 			virtual std::vector<string> GetSupportedTypes()
@@ -543,8 +1375,11 @@ namespace tio {
 
 			inline bool Exists(const string& containerType, const string& containerName)
 			{
+				//
+				// containers that were not opened yet aren't in containers_
+				//
 				const string& fullName = GenerateDataTableName("data", containerType, containerName);
-				return key_found(containers_, fullName);
+				return FindShard(fullName) != NULL;
 			}
 
 			inline string GenerateNamelessName()
@@ -567,16 +1402,24 @@ namespace tio {
 			void DeleteStorage(const string& containerType, const string& containerName)
 			{
 				logdb::Ldb::TABLE_INFO* tableInfo;
+				string dataTableName = GenerateDataTableName("data", containerType, containerName);
+
+				LogDbShard* shard = FindShard(dataTableName);
+
+				if(!shard)
+					throw std::invalid_argument("no such data container");
+
+				logdb::Ldb& ldb = shard->GetLdb();
 
 				//
 				// data
 				//
-				tableInfo = ldb_.OpenTable(GenerateDataTableName("data", containerType, containerName));
+				tableInfo = ldb.OpenTable(dataTableName);
 
 				if(!tableInfo)
 					throw std::invalid_argument("no such data container");
 
-				bool b = ldb_.DeleteTable(tableInfo);
+				bool b = ldb.DeleteTable(tableInfo);
 
 				if(!b)
 					throw std::invalid_argument("error deleting data container");
@@ -584,12 +1427,12 @@ namespace tio {
 				//
 				// properties
 				//
-				tableInfo = ldb_.OpenTable(GenerateDataTableName("properties", containerType, containerName));
+				tableInfo = ldb.OpenTable(GenerateDataTableName("properties", containerType, containerName));
 
 				if(!tableInfo)
 					return; // well, we already deleted data, maybe it doesn't have properties, who knows...
 
-				ldb_.DeleteTable(tableInfo);
+				ldb.DeleteTable(tableInfo);
 
 				return;
 			}
@@ -627,38 +1470,59 @@ namespace tio {
 
 				logdb::Ldb::TABLE_INFO* dataTableInfo;
 				logdb::Ldb::TABLE_INFO* propertiesTableInfo;
+				LogDbShard* shard;
 
 				if(create)
 				{
-					dataTableInfo = ldb_.CreateTable(dataTableName);
-					propertiesTableInfo = ldb_.CreateTable(propertiesTableName);
+					shard = GetShardForNewTable(dataTableName);
+
+					dataTableInfo = shard->GetLdb().CreateTable(dataTableName);
+					propertiesTableInfo = shard->GetLdb().CreateTable(propertiesTableName);
 				}
 				else
 				{
-					dataTableInfo = ldb_.OpenTable(dataTableName);
+					shard = FindShard(dataTableName);
 
-					if(!dataTableInfo)
+					if(!shard)
 						throw std::invalid_argument("no such data container");
 
-					propertiesTableInfo = ldb_.OpenTable(propertiesTableName);
-
+					dataTableInfo = shard->GetLdb().OpenTable(dataTableName);
+					propertiesTableInfo = shard->GetLdb().OpenTable(propertiesTableName);
 				}
 
+				logdb::Ldb& ldb = shard->GetLdb();
+
+				//
+				// tables stay loaded while there are containers using them
+				//
+				ldb.LoadTable(dataTableInfo);
+
+				if(propertiesTableInfo)
+					ldb.LoadTable(propertiesTableInfo);
+
+				idleContainers_.erase(dataTableName);
+
+				shared_ptr<DURABILITY_CONFIG> durability(new DURABILITY_CONFIG(LoadDurability(ldb, propertiesTableInfo)));
+
 				shared_ptr<ITioStorage> container = shared_ptr<ITioStorage>(
 					new LogDbVectorStorage(
-					ldb_,
+					ldb,
 					dataTableInfo, 
 					name,
 					type, 
-					accessType));
+					accessType,
+					shard->GetDurabilityControl(),
+					durability));
 
 				shared_ptr<ITioPropertyMap> propertyMap = shared_ptr<ITioPropertyMap>(
 					new LogDbVectorStorage(
-					ldb_,
+					ldb,
 					propertiesTableInfo,
 					name,
 					type,
-					LogDbVectorStorage::Map));
+					LogDbVectorStorage::Map,
+					shard->GetDurabilityControl(),
+					durability));
 
 				StorageMap::mapped_type& p = (i != containers_.end()) ? i->second : containers_[dataTableName];
 
@@ -672,7 +1536,13 @@ namespace tio {
 			{
 				vector<StorageInfo> ret;
 
-				vector<string> names = ldb_.GetTableList();
+				vector<string> names;
+
+				for(ShardVector::const_iterator i = shards_.begin() ; i != shards_.end() ; ++i)
+				{
+					vector<string> shardNames = (*i)->GetLdb().GetTableList();
+					names.insert(names.end(), shardNames.begin(), shardNames.end());
+				}
 
 				for(vector<string>::const_iterator i = names.begin() ; i != names.end() ; ++i)
 				{
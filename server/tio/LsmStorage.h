@@ -0,0 +1,2037 @@
+/*
+Tio: The Information Overlord
+Copyright 2010 Rodrigo Strauss (http://www.1bit.com.br)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+
+#include "Container.h"
+#include "OrderedKvStorage.h"
+#include "logdb.h"
+
+namespace tio {
+	namespace LsmStorage
+	{
+		using OrderedKvStorage::IOrderedKvCursor;
+		using OrderedKvStorage::IOrderedKvTable;
+		using OrderedKvStorage::IOrderedKvDatabase;
+		using OrderedKvStorage::OrderedKvStorageManager;
+
+		//
+		// Write optimized storage. Changes go to the WAL and to a sorted in
+		// memory table (memtable). When the memtable is big enough it's frozen
+		// and written by a background thread as an immutable sorted segment
+		// file, with a sparse index and a bloom filter. Segments of similar
+		// size are merged in background into a bigger one (size tiered
+		// compaction). Deleted records are dropped when the oldest segment
+		// is part of the merge.
+		//
+		// The manifest says which segments are live, which WAL files still
+		// have changes not in a segment, and the tables with their record
+		// counts. It's replaced atomically after each flush or compaction.
+		//
+		// Writes don't read the segments, so record counts are an estimate:
+		// a set of a key that is not in the memtable is a new record unless
+		// a bloom filter says a segment may have it. Merges with the oldest
+		// segment count the records, and the counts are fixed from that.
+		//
+		// All tables share the same memtable and segments, records are keyed
+		// by [table id, big endian][key]. Clearing or deleting a table just
+		// gives it a new id; old records are dropped by the next compaction.
+		//
+		// Files, where [prefix] is [data path]/tio.lsm:
+		//
+		//   [prefix].manifest
+		//   [prefix].[number].wal
+		//   [prefix].[number].seg
+		//
+		static const unsigned int LSM_SEGMENT_MAGIC = 0x47455342; // BSEG
+		static const unsigned int LSM_MANIFEST_MAGIC = 0x464E4D42; // BMNF
+		static const unsigned int LSM_FORMAT_VERSION = 1;
+
+		//
+		// a segment index entry is created for every block of this size
+		//
+		static const size_t LSM_BLOCK_SIZE = 4096;
+
+		static const unsigned int LSM_BLOOM_BITS_PER_KEY = 10;
+		static const unsigned int LSM_BLOOM_HASH_COUNT = 7;
+
+		//
+		// segments are grouped in tiers, each one this many times bigger than
+		// the previous. When this many segments of the same tier are next to
+		// each other they're merged into one of the next tier, so a record
+		// is rewritten once per tier and not on every compaction
+		//
+		static const size_t LSM_COMPACTION_TRIGGER = 4;
+
+		//
+		// memory used by a memtable entry besides key and value
+		//
+		static const size_t LSM_MEMTABLE_ENTRY_OVERHEAD = 64;
+
+		enum LsmWalRecordType
+		{
+			walRecordPut = 1,
+			walRecordDelete = 2,
+			walRecordTable = 3
+		};
+
+		struct LSM_SEGMENT_FOOTER
+		{
+			unsigned int magic;
+			unsigned int version;
+			unsigned long long recordCount;
+			unsigned long long indexOffset;
+			unsigned long long indexCount;
+			unsigned long long bloomOffset;
+			unsigned int bloomSize;
+			unsigned int bloomHashCount;
+		};
+
+		inline unsigned long long LsmHash(const string& key)
+		{
+			unsigned long long hash = 14695981039346656037ULL;
+
+			for(size_t a = 0 ; a < key.size() ; a++)
+			{
+				hash ^= static_cast<unsigned char>(key[a]);
+				hash *= 1099511628211ULL;
+			}
+
+			return hash;
+		}
+
+		inline unsigned int LsmChecksum(const char* buffer, size_t size)
+		{
+			unsigned int hash = 2166136261U;
+
+			for(size_t a = 0 ; a < size ; a++)
+			{
+				hash ^= static_cast<unsigned char>(buffer[a]);
+				hash *= 16777619U;
+			}
+
+			return hash;
+		}
+
+		template<typename T>
+		void AppendValue(string* buffer, T value)
+		{
+			buffer->append((const char*)&value, sizeof(value));
+		}
+
+		inline void AppendString(string* buffer, const string& value)
+		{
+			AppendValue<unsigned int>(buffer, static_cast<unsigned int>(value.size()));
+			buffer->append(value);
+		}
+
+		class LsmBufferReader
+		{
+			const char* current_;
+			const char* end_;
+		public:
+			LsmBufferReader(const char* buffer, size_t size) : current_(buffer), end_(buffer + size)
+			{}
+
+			bool AtEnd() const
+			{
+				return current_ == end_;
+			}
+
+			size_t GetRemaining() const
+			{
+				return end_ - current_;
+			}
+
+			template<typename T>
+			T Get()
+			{
+				T value;
+
+				if(GetRemaining() < sizeof(value))
+					throw std::runtime_error("lsm: corrupted data");
+
+				memcpy(&value, current_, sizeof(value));
+				current_ += sizeof(value);
+				return value;
+			}
+
+			string GetString(size_t size)
+			{
+				if(GetRemaining() < size)
+					throw std::runtime_error("lsm: corrupted data");
+
+				string ret(current_, size);
+				current_ += size;
+				return ret;
+			}
+
+			string GetString()
+			{
+				return GetString(Get<unsigned int>());
+			}
+		};
+
+		inline bool ReadWholeFile(const string& fileName, string* data)
+		{
+			logdb::File file(0);
+
+			if(!file.Open(fileName.c_str()))
+				return false;
+
+			logdb::LDB_OFFSET size = file.GetFileSize();
+			data->resize(static_cast<size_t>(size));
+
+			file.SetPointer(0);
+
+			for(size_t offset = 0 ; offset < data->size() ; )
+			{
+				DWORD chunk = static_cast<DWORD>(std::min<size_t>(data->size() - offset, 16 * 1024 * 1024));
+				DWORD read = file.Read(&(*data)[offset], chunk);
+
+				if(read == 0 || read == static_cast<DWORD>(-1))
+				{
+					data->resize(offset);
+					break;
+				}
+
+				offset += read;
+			}
+
+			file.Close();
+
+			return true;
+		}
+
+		//
+		// [table id, big endian][key], so records are ordered by table and then by key
+		//
+		inline string MakeInternalKey(unsigned int tableId, const string& key)
+		{
+			string ret;
+			ret.reserve(sizeof(tableId) + key.size());
+
+			ret += static_cast<char>((tableId >> 24) & 0xFF);
+			ret += static_cast<char>((tableId >> 16) & 0xFF);
+			ret += static_cast<char>((tableId >> 8) & 0xFF);
+			ret += static_cast<char>(tableId & 0xFF);
+			ret += key;
+
+			return ret;
+		}
+
+		inline unsigned int GetTableId(const string& internalKey)
+		{
+			if(internalKey.size() < sizeof(unsigned int))
+				return 0;
+
+			return (static_cast<unsigned int>(static_cast<unsigned char>(internalKey[0])) << 24) |
+				(static_cast<unsigned int>(static_cast<unsigned char>(internalKey[1])) << 16) |
+				(static_cast<unsigned int>(static_cast<unsigned char>(internalKey[2])) << 8) |
+				static_cast<unsigned int>(static_cast<unsigned char>(internalKey[3]));
+		}
+
+		struct LSM_VALUE
+		{
+			LSM_VALUE() : deleted(false)
+			{}
+
+			string value;
+			bool deleted;
+		};
+
+		typedef std::map<string, LSM_VALUE> MemTable;
+
+		class LsmBloomFilter
+		{
+			vector<unsigned char> bits_;
+			unsigned int hashCount_;
+
+		public:
+			LsmBloomFilter() : hashCount_(0)
+			{}
+
+			void Create(size_t keyCount)
+			{
+				size_t bitCount = std::max<size_t>(keyCount * LSM_BLOOM_BITS_PER_KEY, 64);
+				bits_.assign((bitCount + 7) / 8, 0);
+				hashCount_ = LSM_BLOOM_HASH_COUNT;
+			}
+
+			void Load(const string& bits, unsigned int hashCount)
+			{
+				bits_.assign(bits.begin(), bits.end());
+				hashCount_ = hashCount;
+			}
+
+			//
+			// double hashing, bit i is h1 + i * h2
+			//
+			void Add(unsigned long long hash)
+			{
+				size_t bitCount = bits_.size() * 8;
+				unsigned int h1 = static_cast<unsigned int>(hash), h2 = static_cast<unsigned int>(hash >> 32) | 1;
+
+				for(unsigned int a = 0 ; a < hashCount_ ; a++)
+				{
+					size_t bit = (h1 + a * h2) % bitCount;
+					bits_[bit / 8] |= static_cast<unsigned char>(1 << (bit % 8));
+				}
+			}
+
+			bool MayContain(unsigned long long hash) const
+			{
+				if(bits_.empty())
+					return true;
+
+				size_t bitCount = bits_.size() * 8;
+				unsigned int h1 = static_cast<unsigned int>(hash), h2 = static_cast<unsigned int>(hash >> 32) | 1;
+
+				for(unsigned int a = 0 ; a < hashCount_ ; a++)
+				{
+					size_t bit = (h1 + a * h2) % bitCount;
+
+					if(!(bits_[bit / 8] & (1 << (bit % 8))))
+						return false;
+				}
+
+				return true;
+			}
+
+			const vector<unsigned char>& GetBits() const
+			{
+				return bits_;
+			}
+
+			unsigned int GetHashCount() const
+			{
+				return hashCount_;
+			}
+		};
+
+		//
+		// segment record is [deleted(1)][key size(4)][value size(4)][key][value]
+		//
+		inline void AppendRecord(string* buffer, const string& key, const LSM_VALUE& value)
+		{
+			AppendValue<unsigned char>(buffer, value.deleted ? 1 : 0);
+			AppendValue<unsigned int>(buffer, static_cast<unsigned int>(key.size()));
+			AppendValue<unsigned int>(buffer, static_cast<unsigned int>(value.value.size()));
+			buffer->append(key);
+			buffer->append(value.value);
+		}
+
+		inline void ParseRecord(LsmBufferReader* reader, string* key, LSM_VALUE* value)
+		{
+			value->deleted = reader->Get<unsigned char>() != 0;
+			unsigned int keySize = reader->Get<unsigned int>();
+			unsigned int valueSize = reader->Get<unsigned int>();
+			*key = reader->GetString(keySize);
+			value->value = reader->GetString(valueSize);
+		}
+
+		struct LSM_INDEX_ENTRY
+		{
+			string key;
+			unsigned long long offset;
+		};
+
+		inline bool operator<(const string& key, const LSM_INDEX_ENTRY& entry)
+		{
+			return key < entry.key;
+		}
+
+		//
+		// writes records, that must be added in order, to a new segment file
+		//
+		class LsmSegmentBuilder : boost::noncopyable
+		{
+			logdb::File file_;
+			string buffer_;
+			unsigned long long offset_;
+			vector<LSM_INDEX_ENTRY> index_;
+			vector<unsigned long long> hashes_;
+
+			void WriteBuffer()
+			{
+				if(buffer_.empty())
+					return;
+
+				if(file_.Write(buffer_.data(), static_cast<DWORD>(buffer_.size())) != buffer_.size())
+					throw std::runtime_error("lsm: error writing segment");
+
+				buffer_.clear();
+			}
+
+		public:
+			LsmSegmentBuilder(const string& fileName) :
+				file_(0),
+				offset_(0)
+			{
+				remove(fileName.c_str());
+
+				if(!file_.Create(fileName.c_str()))
+					throw std::runtime_error("lsm: error creating " + fileName);
+
+				file_.SetSyncOnWrite(false);
+			}
+
+			void Add(const string& key, const LSM_VALUE& value)
+			{
+				if(index_.empty() || offset_ - index_.back().offset >= LSM_BLOCK_SIZE)
+				{
+					LSM_INDEX_ENTRY entry;
+					entry.key = key;
+					entry.offset = offset_;
+					index_.push_back(entry);
+				}
+
+				size_t before = buffer_.size();
+				AppendRecord(&buffer_, key, value);
+				offset_ += buffer_.size() - before;
+
+				hashes_.push_back(LsmHash(key));
+
+				if(buffer_.size() > 1024 * 1024)
+					WriteBuffer();
+			}
+
+			unsigned long long GetRecordCount() const
+			{
+				return hashes_.size();
+			}
+
+			void Finish()
+			{
+				LSM_SEGMENT_FOOTER footer;
+				memset(&footer, 0, sizeof(footer));
+
+				footer.magic = LSM_SEGMENT_MAGIC;
+				footer.version = LSM_FORMAT_VERSION;
+				footer.recordCount = hashes_.size();
+				footer.indexOffset = offset_;
+				footer.indexCount = index_.size();
+
+				size_t indexStart = buffer_.size();
+
+				for(vector<LSM_INDEX_ENTRY>::const_iterator i = index_.begin() ; i != index_.end() ; ++i)
+				{
+					AppendString(&buffer_, i->key);
+					AppendValue<unsigned long long>(&buffer_, i->offset);
+				}
+
+				LsmBloomFilter bloom;
+				bloom.Create(hashes_.size());
+
+				for(vector<unsigned long long>::const_iterator i = hashes_.begin() ; i != hashes_.end() ; ++i)
+					bloom.Add(*i);
+
+				footer.bloomOffset = offset_ + (buffer_.size() - indexStart);
+				footer.bloomSize = static_cast<unsigned int>(bloom.GetBits().size());
+				footer.bloomHashCount = bloom.GetHashCount();
+
+				buffer_.append((const char*)&bloom.GetBits()[0], bloom.GetBits().size());
+				AppendValue<LSM_SEGMENT_FOOTER>(&buffer_, footer);
+
+				WriteBuffer();
+
+				file_.Sync();
+				file_.Close();
+			}
+		};
+
+		//
+		// Immutable sorted file. Index and bloom filter stay in memory, so a
+		// lookup reads at most one block. Blocks are read with the informed
+		// file handle, so other threads can read the segment with their own
+		//
+		class LsmSegment : boost::noncopyable
+		{
+			string fileName_;
+			unsigned int number_;
+			logdb::File file_;
+			LSM_SEGMENT_FOOTER footer_;
+			vector<LSM_INDEX_ENTRY> index_;
+			LsmBloomFilter bloom_;
+			unsigned long long fileSize_;
+
+		public:
+			LsmSegment(const string& fileName, unsigned int number) :
+				fileName_(fileName),
+				number_(number),
+				file_(0)
+			{
+				string data;
+
+				if(!file_.Open(fileName.c_str()))
+					throw std::runtime_error("lsm: error opening " + fileName);
+
+				fileSize_ = file_.GetFileSize();
+
+				if(fileSize_ < sizeof(footer_))
+					throw std::runtime_error("lsm: invalid segment " + fileName);
+
+				file_.SetPointer(fileSize_ - sizeof(footer_));
+
+				if(file_.Read(&footer_, sizeof(footer_)) != sizeof(footer_) ||
+					footer_.magic != LSM_SEGMENT_MAGIC || footer_.version != LSM_FORMAT_VERSION ||
+					footer_.indexOffset > footer_.bloomOffset || footer_.bloomOffset + footer_.bloomSize + sizeof(footer_) != fileSize_)
+				{
+					throw std::runtime_error("lsm: invalid segment " + fileName);
+				}
+
+				data.resize(static_cast<size_t>(fileSize_ - sizeof(footer_) - footer_.indexOffset));
+
+				file_.SetPointer(footer_.indexOffset);
+
+				if(!data.empty() && file_.Read(&data[0], static_cast<DWORD>(data.size())) != data.size())
+					throw std::runtime_error("lsm: error reading " + fileName);
+
+				LsmBufferReader reader(data.data(), data.size());
+
+				index_.resize(static_cast<size_t>(footer_.indexCount));
+
+				for(vector<LSM_INDEX_ENTRY>::iterator i = index_.begin() ; i != index_.end() ; ++i)
+				{
+					i->key = reader.GetString();
+					i->offset = reader.Get<unsigned long long>();
+				}
+
+				bloom_.Load(reader.GetString(footer_.bloomSize), footer_.bloomHashCount);
+			}
+
+			const string& GetFileName() const
+			{
+				return fileName_;
+			}
+
+			unsigned int GetNumber() const
+			{
+				return number_;
+			}
+
+			unsigned long long GetRecordCount() const
+			{
+				return footer_.recordCount;
+			}
+
+			unsigned long long GetFileSize() const
+			{
+				return fileSize_;
+			}
+
+			size_t GetBlockCount() const
+			{
+				return index_.size();
+			}
+
+			bool MayContain(unsigned long long hash) const
+			{
+				return bloom_.MayContain(hash);
+			}
+
+			//
+			// block that would have the key
+			//
+			size_t FindBlock(const string& key) const
+			{
+				vector<LSM_INDEX_ENTRY>::const_iterator i = std::upper_bound(index_.begin(), index_.end(), key);
+				return i == index_.begin() ? 0 : (i - index_.begin()) - 1;
+			}
+
+			void ReadBlock(logdb::File& file, size_t block, string* data) const
+			{
+				unsigned long long start = index_[block].offset;
+				unsigned long long end = block + 1 < index_.size() ? index_[block + 1].offset : footer_.indexOffset;
+
+				data->resize(static_cast<size_t>(end - start));
+
+				file.SetPointer(start);
+
+				if(!data->empty() && file.Read(&(*data)[0], static_cast<DWORD>(data->size())) != data->size())
+					throw std::runtime_error("lsm: error reading " + fileName_);
+			}
+
+			//
+			// returns true if the segment has the key, even if it's a delete
+			//
+			bool Find(const string& key, LSM_VALUE* value)
+			{
+				if(index_.empty() || key < index_[0].key)
+					return false;
+
+				string data, recordKey;
+				ReadBlock(file_, FindBlock(key), &data);
+
+				LsmBufferReader reader(data.data(), data.size());
+
+				while(!reader.AtEnd())
+				{
+					ParseRecord(&reader, &recordKey, value);
+
+					if(recordKey == key)
+						return true;
+
+					if(key < recordKey)
+						break;
+				}
+
+				return false;
+			}
+
+			logdb::File& GetFile()
+			{
+				return file_;
+			}
+		};
+
+		class LsmIterator
+		{
+		public:
+			virtual ~LsmIterator()
+			{}
+
+			virtual bool IsValid() = 0;
+			virtual const string& GetKey() = 0;
+			virtual const LSM_VALUE& GetValue() = 0;
+			virtual void Next() = 0;
+		};
+
+		class LsmMemTableIterator : public LsmIterator
+		{
+			MemTable::const_iterator current_, end_;
+
+		public:
+			LsmMemTableIterator(const MemTable& memTable, const string& start) :
+				current_(memTable.lower_bound(start)),
+				end_(memTable.end())
+			{}
+
+			virtual bool IsValid()
+			{
+				return current_ != end_;
+			}
+
+			virtual const string& GetKey()
+			{
+				return current_->first;
+			}
+
+			virtual const LSM_VALUE& GetValue()
+			{
+				return current_->second;
+			}
+
+			virtual void Next()
+			{
+				++current_;
+			}
+		};
+
+		class LsmSegmentIterator : public LsmIterator
+		{
+			shared_ptr<LsmSegment> segment_;
+			logdb::File& file_;
+			size_t block_;
+			string data_;
+			size_t position_;
+			string key_;
+			LSM_VALUE value_;
+			bool valid_;
+
+			void LoadBlock(size_t block)
+			{
+				block_ = block;
+				position_ = 0;
+				segment_->ReadBlock(file_, block, &data_);
+			}
+
+			void ReadNext()
+			{
+				while(position_ >= data_.size())
+				{
+					if(block_ + 1 >= segment_->GetBlockCount())
+					{
+						valid_ = false;
+						return;
+					}
+
+					LoadBlock(block_ + 1);
+				}
+
+				LsmBufferReader reader(data_.data() + position_, data_.size() - position_);
+				ParseRecord(&reader, &key_, &value_);
+				position_ = data_.size() - reader.GetRemaining();
+				valid_ = true;
+			}
+
+		public:
+			LsmSegmentIterator(shared_ptr<LsmSegment> segment, logdb::File& file, const string& start) :
+				segment_(segment),
+				file_(file),
+				block_(0),
+				position_(0),
+				valid_(false)
+			{
+				if(segment_->GetBlockCount() == 0)
+					return;
+
+				LoadBlock(segment_->FindBlock(start));
+				ReadNext();
+
+				while(valid_ && key_ < start)
+					ReadNext();
+			}
+
+			virtual bool IsValid()
+			{
+				return valid_;
+			}
+
+			virtual const string& GetKey()
+			{
+				return key_;
+			}
+
+			virtual const LSM_VALUE& GetValue()
+			{
+				return value_;
+			}
+
+			virtual void Next()
+			{
+				ReadNext();
+			}
+		};
+
+		//
+		// Merges sorted sources, that must be added from the newest to the oldest.
+		// When more than one source has the same key, the newest one wins
+		//
+		class LsmMergeIterator : public LsmIterator
+		{
+			vector< shared_ptr<LsmIterator> > sources_;
+			LsmIterator* current_;
+
+			void FindCurrent()
+			{
+				current_ = NULL;
+
+				for(vector< shared_ptr<LsmIterator> >::const_iterator i = sources_.begin() ; i != sources_.end() ; ++i)
+				{
+					if((*i)->IsValid() && (!current_ || (*i)->GetKey() < current_->GetKey()))
+						current_ = i->get();
+				}
+			}
+
+		public:
+			LsmMergeIterator() : current_(NULL)
+			{}
+
+			void AddSource(shared_ptr<LsmIterator> source)
+			{
+				sources_.push_back(source);
+				FindCurrent();
+			}
+
+			virtual bool IsValid()
+			{
+				return current_ != NULL;
+			}
+
+			virtual const string& GetKey()
+			{
+				return current_->GetKey();
+			}
+
+			virtual const LSM_VALUE& GetValue()
+			{
+				return current_->GetValue();
+			}
+
+			virtual void Next()
+			{
+				string key = current_->GetKey();
+
+				for(vector< shared_ptr<LsmIterator> >::const_iterator i = sources_.begin() ; i != sources_.end() ; ++i)
+				{
+					if((*i)->IsValid() && (*i)->GetKey() == key)
+						(*i)->Next();
+				}
+
+				FindCurrent();
+			}
+		};
+
+		//
+		// Writes a segment in background, from a frozen memtable (flush) or from
+		// other segments (compaction). Records of dead tables are only dropped by
+		// compactions, since a flush doesn't see older segments. Deleted records
+		// are only dropped when the oldest segment is an input, otherwise they
+		// still hide records of older segments
+		//
+		class LsmSegmentJob : boost::noncopyable
+		{
+			shared_ptr<LsmIterator> source_;
+			string fileName_;
+			unsigned int number_;
+			bool compaction_;
+			bool dropDeleted_;
+			std::set<unsigned int> liveTables_;
+
+			//
+			// live records by table id, only when deleted records are dropped
+			//
+			std::map<unsigned int, unsigned long long> tableCounts_;
+
+			//
+			// compaction readers use their own handles
+			//
+			vector< shared_ptr<logdb::File> > files_;
+
+			boost::thread thread_;
+			std::atomic<bool> done_;
+			bool succeeded_;
+			string error_;
+
+			void Run()
+			{
+				try
+				{
+					string tempFileName = fileName_ + ".tmp";
+					LsmSegmentBuilder builder(tempFileName);
+
+					for(; source_->IsValid() ; source_->Next())
+					{
+						const LSM_VALUE& value = source_->GetValue();
+
+						if(compaction_ && !liveTables_.count(GetTableId(source_->GetKey())))
+							continue;
+
+						if(dropDeleted_)
+						{
+							if(value.deleted)
+								continue;
+
+							tableCounts_[GetTableId(source_->GetKey())]++;
+						}
+
+						builder.Add(source_->GetKey(), value);
+					}
+
+					builder.Finish();
+
+					boost::filesystem::rename(tempFileName, fileName_);
+
+					logdb::File::SyncDirectory(fileName_);
+
+					succeeded_ = true;
+				}
+				catch(std::exception& ex)
+				{
+					error_ = ex.what();
+				}
+
+				source_.reset();
+				files_.clear();
+
+				done_ = true;
+			}
+
+		public:
+			//
+			// flush
+			//
+			LsmSegmentJob(shared_ptr<const MemTable> memTable, const string& fileName, unsigned int number) :
+				source_(new LsmMemTableIterator(*memTable, string())),
+				fileName_(fileName),
+				number_(number),
+				compaction_(false),
+				dropDeleted_(false),
+				done_(false),
+				succeeded_(false)
+			{
+			}
+
+			//
+			// compaction, inputs must be ordered from the oldest to the newest
+			//
+			LsmSegmentJob(const vector< shared_ptr<LsmSegment> >& inputs, const std::set<unsigned int>& liveTables,
+				bool dropDeleted, const string& fileName, unsigned int number) :
+				fileName_(fileName),
+				number_(number),
+				compaction_(true),
+				dropDeleted_(dropDeleted),
+				liveTables_(liveTables),
+				done_(false),
+				succeeded_(false)
+			{
+				shared_ptr<LsmMergeIterator> merge(new LsmMergeIterator());
+
+				for(vector< shared_ptr<LsmSegment> >::const_reverse_iterator i = inputs.rbegin() ; i != inputs.rend() ; ++i)
+				{
+					shared_ptr<logdb::File> file(new logdb::File(0));
+
+					if(!file->Open((*i)->GetFileName().c_str()))
+						throw std::runtime_error("lsm: error opening " + (*i)->GetFileName());
+
+					files_.push_back(file);
+					merge->AddSource(shared_ptr<LsmIterator>(new LsmSegmentIterator(*i, *file, string())));
+				}
+
+				source_ = merge;
+			}
+
+			~LsmSegmentJob()
+			{
+				if(thread_.joinable())
+					thread_.join();
+			}
+
+			void Start()
+			{
+				thread_ = boost::thread(boost::bind(&LsmSegmentJob::Run, this));
+			}
+
+			bool IsDone()
+			{
+				return done_;
+			}
+
+			bool Finish()
+			{
+				thread_.join();
+				return succeeded_;
+			}
+
+			const string& GetError() const
+			{
+				return error_;
+			}
+
+			bool HasTableCounts() const
+			{
+				return dropDeleted_;
+			}
+
+			const std::map<unsigned int, unsigned long long>& GetTableCounts() const
+			{
+				return tableCounts_;
+			}
+
+			const string& GetFileName() const
+			{
+				return fileName_;
+			}
+
+			unsigned int GetNumber() const
+			{
+				return number_;
+			}
+		};
+
+		struct LSM_TABLE
+		{
+			LSM_TABLE() : id(0), count(0)
+			{}
+
+			//
+			// zero if the table was deleted
+			//
+			unsigned int id;
+
+			//
+			// estimate, see LsmDatabase
+			//
+			unsigned long long count;
+		};
+
+		struct LSM_TABLE_SNAPSHOT
+		{
+			string name;
+			unsigned int id;
+			unsigned long long count;
+		};
+
+		typedef vector<LSM_TABLE_SNAPSHOT> LsmTablesSnapshot;
+		typedef std::map<unsigned int, long long> LsmCountAdjustments;
+
+		inline unsigned long long AdjustCount(unsigned long long count, long long adjustment)
+		{
+			if(adjustment < 0 && static_cast<unsigned long long>(-adjustment) > count)
+				return 0;
+
+			return count + adjustment;
+		}
+
+		inline void AdjustCounts(LsmTablesSnapshot* tables, const LsmCountAdjustments& adjustments)
+		{
+			for(LsmTablesSnapshot::iterator i = tables->begin() ; i != tables->end() ; ++i)
+			{
+				LsmCountAdjustments::const_iterator adjustment = adjustments.find(i->id);
+
+				if(adjustment != adjustments.end())
+					i->count = AdjustCount(i->count, adjustment->second);
+			}
+		}
+
+		//
+		// user records of a table, skipping deleted ones
+		//
+		class LsmTableCursor : public IOrderedKvCursor
+		{
+			LsmMergeIterator iterator_;
+			unsigned int tableId_;
+
+			void SkipDeleted()
+			{
+				while(iterator_.IsValid() && GetTableId(iterator_.GetKey()) == tableId_ && iterator_.GetValue().deleted)
+					iterator_.Next();
+			}
+
+		public:
+			LsmTableCursor(unsigned int tableId) : tableId_(tableId)
+			{}
+
+			void AddSource(shared_ptr<LsmIterator> source)
+			{
+				iterator_.AddSource(source);
+			}
+
+			void Start()
+			{
+				SkipDeleted();
+			}
+
+			virtual bool IsValid()
+			{
+				return iterator_.IsValid() && GetTableId(iterator_.GetKey()) == tableId_;
+			}
+
+			string GetKey()
+			{
+				return iterator_.GetKey().substr(sizeof(unsigned int));
+			}
+
+			const string& GetValue()
+			{
+				return iterator_.GetValue().value;
+			}
+
+			virtual void Next()
+			{
+				iterator_.Next();
+				SkipDeleted();
+			}
+
+			virtual void GetRecord(string* key, string* value)
+			{
+				if(key)
+					*key = GetKey();
+
+				if(value)
+					*value = GetValue();
+			}
+		};
+
+		class LsmDatabase : boost::noncopyable, public IOrderedKvDatabase
+		{
+			string prefix_;
+			size_t memTableSize_;
+
+			shared_ptr<MemTable> memTable_;
+			size_t memTableBytes_;
+
+			//
+			// frozen memtable being written to a segment
+			//
+			shared_ptr<const MemTable> immutable_;
+
+			//
+			// oldest to newest
+			//
+			typedef vector< shared_ptr<LsmSegment> > SegmentVector;
+			SegmentVector segments_;
+
+			typedef std::map<string, shared_ptr<LSM_TABLE> > TableMap;
+			TableMap tables_;
+			std::unordered_map<unsigned int, shared_ptr<LSM_TABLE> > tablesById_;
+			unsigned int nextTableId_;
+
+			unsigned int nextSegmentNumber_;
+
+			logdb::File wal_;
+			unsigned int walNumber_;
+			unsigned int firstLiveWal_;
+			string walBuffer_;
+			unsigned long long walBytes_;
+
+			//
+			// what was last written to the manifest
+			//
+			LsmTablesSnapshot manifestTables_;
+			unsigned int manifestNextTableId_;
+
+			shared_ptr<LsmSegmentJob> flushJob_;
+			unsigned int flushWalNumber_;
+			LsmTablesSnapshot flushTables_;
+			unsigned int flushNextTableId_;
+
+			//
+			// record counts when each segment was the newest one, by segment
+			// number. A merge with the oldest segment compares it to the real
+			// count to fix the estimate
+			//
+			std::map<unsigned int, LsmTablesSnapshot> segmentTables_;
+
+			shared_ptr<LsmSegmentJob> compactionJob_;
+			SegmentVector compactionInputs_;
+
+			//
+			// position of the first input in segments_. Flushes only add
+			// segments to the end, so it doesn't change while the job runs
+			//
+			size_t compactionStart_;
+
+			unsigned long long commits_, flushes_, compactions_, bloomSkips_, segmentLookups_;
+
+			string GetWalFileName(unsigned int number)
+			{
+				return prefix_ + "." + lexical_cast<string>(number) + ".wal";
+			}
+
+			string GetSegmentFileName(unsigned int number)
+			{
+				return prefix_ + "." + lexical_cast<string>(number) + ".seg";
+			}
+
+			string GetManifestFileName()
+			{
+				return prefix_ + ".manifest";
+			}
+
+			LsmTablesSnapshot GetTablesSnapshot()
+			{
+				LsmTablesSnapshot ret;
+				ret.reserve(tables_.size());
+
+				for(TableMap::const_iterator i = tables_.begin() ; i != tables_.end() ; ++i)
+				{
+					LSM_TABLE_SNAPSHOT snapshot;
+					snapshot.name = i->first;
+					snapshot.id = i->second->id;
+					snapshot.count = i->second->count;
+					ret.push_back(snapshot);
+				}
+
+				return ret;
+			}
+
+			void WriteManifest()
+			{
+				string data;
+
+				AppendValue<unsigned int>(&data, LSM_MANIFEST_MAGIC);
+				AppendValue<unsigned int>(&data, LSM_FORMAT_VERSION);
+				AppendValue<unsigned int>(&data, nextSegmentNumber_);
+				AppendValue<unsigned int>(&data, manifestNextTableId_);
+				AppendValue<unsigned int>(&data, firstLiveWal_);
+
+				AppendValue<unsigned int>(&data, static_cast<unsigned int>(segments_.size()));
+
+				for(SegmentVector::const_iterator i = segments_.begin() ; i != segments_.end() ; ++i)
+					AppendValue<unsigned int>(&data, (*i)->GetNumber());
+
+				AppendValue<unsigned int>(&data, static_cast<unsigned int>(manifestTables_.size()));
+
+				for(LsmTablesSnapshot::const_iterator i = manifestTables_.begin() ; i != manifestTables_.end() ; ++i)
+				{
+					AppendString(&data, i->name);
+					AppendValue<unsigned int>(&data, i->id);
+					AppendValue<unsigned long long>(&data, i->count);
+				}
+
+				AppendValue<unsigned int>(&data, LsmChecksum(data.data(), data.size()));
+
+				string tempFileName = GetManifestFileName() + ".tmp";
+
+				remove(tempFileName.c_str());
+
+				logdb::File file(0);
+
+				if(!file.Create(tempFileName.c_str()))
+					throw std::runtime_error("lsm: error creating " + tempFileName);
+
+				file.SetSyncOnWrite(false);
+
+				if(file.Write(data.data(), static_cast<DWORD>(data.size())) != data.size())
+					throw std::runtime_error("lsm: error writing " + tempFileName);
+
+				file.Sync();
+				file.Close();
+
+				boost::filesystem::rename(tempFileName, GetManifestFileName());
+
+				logdb::File::SyncDirectory(GetManifestFileName());
+			}
+
+			void LoadManifest()
+			{
+				string data;
+
+				if(!ReadWholeFile(GetManifestFileName(), &data))
+					return;
+
+				if(data.size() < sizeof(unsigned int) ||
+					LsmChecksum(data.data(), data.size() - sizeof(unsigned int)) != *(const unsigned int*)(data.data() + data.size() - sizeof(unsigned int)))
+				{
+					throw std::runtime_error("lsm: corrupted manifest " + GetManifestFileName());
+				}
+
+				LsmBufferReader reader(data.data(), data.size() - sizeof(unsigned int));
+
+				if(reader.Get<unsigned int>() != LSM_MANIFEST_MAGIC || reader.Get<unsigned int>() != LSM_FORMAT_VERSION)
+					throw std::runtime_error("lsm: unsupported manifest " + GetManifestFileName());
+
+				nextSegmentNumber_ = reader.Get<unsigned int>();
+				nextTableId_ = manifestNextTableId_ = reader.Get<unsigned int>();
+				firstLiveWal_ = reader.Get<unsigned int>();
+
+				unsigned int segmentCount = reader.Get<unsigned int>();
+
+				for(unsigned int a = 0 ; a < segmentCount ; a++)
+				{
+					unsigned int number = reader.Get<unsigned int>();
+					segments_.push_back(shared_ptr<LsmSegment>(new LsmSegment(GetSegmentFileName(number), number)));
+				}
+
+				unsigned int tableCount = reader.Get<unsigned int>();
+
+				for(unsigned int a = 0 ; a < tableCount ; a++)
+				{
+					LSM_TABLE_SNAPSHOT snapshot;
+					snapshot.name = reader.GetString();
+					snapshot.id = reader.Get<unsigned int>();
+					snapshot.count = reader.Get<unsigned long long>();
+
+					manifestTables_.push_back(snapshot);
+
+					shared_ptr<LSM_TABLE> table(new LSM_TABLE());
+					table->id = snapshot.id;
+					table->count = snapshot.count;
+
+					tables_[snapshot.name] = table;
+					tablesById_[snapshot.id] = table;
+				}
+
+				if(!segments_.empty())
+					segmentTables_[segments_.back()->GetNumber()] = manifestTables_;
+			}
+
+			//
+			// record is [size(4)][checksum(4)][type(1)][key][value], size and
+			// checksum cover from type to the end
+			//
+			void AppendWal(LsmWalRecordType type, const string& key, const string& value)
+			{
+				size_t start = walBuffer_.size();
+
+				AppendValue<unsigned int>(&walBuffer_, 0);
+				AppendValue<unsigned int>(&walBuffer_, 0);
+				AppendValue<unsigned char>(&walBuffer_, static_cast<unsigned char>(type));
+				AppendString(&walBuffer_, key);
+				walBuffer_.append(value);
+
+				size_t dataStart = start + sizeof(unsigned int) * 2;
+				unsigned int size = static_cast<unsigned int>(walBuffer_.size() - dataStart);
+				unsigned int checksum = LsmChecksum(walBuffer_.data() + dataStart, size);
+
+				memcpy(&walBuffer_[start], &size, sizeof(size));
+				memcpy(&walBuffer_[start + sizeof(size)], &checksum, sizeof(checksum));
+			}
+
+			void ReplayWal(unsigned int number, const string& data)
+			{
+				LsmBufferReader reader(data.data(), data.size());
+				size_t records = 0;
+
+				while(reader.GetRemaining() >= sizeof(unsigned int) * 2)
+				{
+					unsigned int size = reader.Get<unsigned int>();
+					unsigned int checksum = reader.Get<unsigned int>();
+
+					if(size == 0 || size > reader.GetRemaining())
+						break;
+
+					string record = reader.GetString(size);
+
+					if(LsmChecksum(record.data(), record.size()) != checksum)
+						break;
+
+					LsmBufferReader recordReader(record.data(), record.size());
+
+					LsmWalRecordType type = static_cast<LsmWalRecordType>(recordReader.Get<unsigned char>());
+					string key = recordReader.GetString();
+					string value = recordReader.GetString(recordReader.GetRemaining());
+
+					if(type == walRecordTable)
+					{
+						unsigned int id;
+
+						if(value.size() != sizeof(id))
+							break;
+
+						memcpy(&id, value.data(), sizeof(id));
+						ApplyTable(key, id);
+					}
+					else
+						Apply(key, value, type == walRecordDelete);
+
+					records++;
+				}
+
+				if(records)
+					std::cout << "lsm: " << records << " records recovered from " << GetWalFileName(number) << std::endl;
+			}
+
+			void OpenWal()
+			{
+				string fileName = GetWalFileName(walNumber_);
+
+				wal_.Close();
+
+				remove(fileName.c_str());
+
+				if(!wal_.Create(fileName.c_str()))
+					throw std::runtime_error("lsm: error creating " + fileName);
+
+				//
+				// records synced to the WAL are only there after a crash
+				// if the WAL itself is in the directory
+				//
+				logdb::File::SyncDirectory(fileName);
+
+				wal_.SetSyncOnWrite(false);
+				wal_.SetPointer(0);
+			}
+
+			void ApplyTable(const string& name, unsigned int id)
+			{
+				TableMap::iterator i = tables_.find(name);
+
+				if(i != tables_.end())
+				{
+					tablesById_.erase(i->second->id);
+
+					if(id == 0)
+					{
+						i->second->id = 0;
+						i->second->count = 0;
+						tables_.erase(i);
+						return;
+					}
+				}
+				else if(id == 0)
+					return;
+				else
+					i = tables_.insert(make_pair(name, shared_ptr<LSM_TABLE>(new LSM_TABLE()))).first;
+
+				i->second->id = id;
+				i->second->count = 0;
+				tablesById_[id] = i->second;
+
+				if(id >= nextTableId_)
+					nextTableId_ = id + 1;
+			}
+
+			//
+			// returns true if the record exists and isn't deleted
+			//
+			bool Lookup(const string& key, LSM_VALUE* value)
+			{
+				MemTable::const_iterator i = memTable_->find(key);
+
+				if(i != memTable_->end())
+				{
+					*value = i->second;
+					return !value->deleted;
+				}
+
+				if(immutable_)
+				{
+					i = immutable_->find(key);
+
+					if(i != immutable_->end())
+					{
+						*value = i->second;
+						return !value->deleted;
+					}
+				}
+
+				unsigned long long hash = LsmHash(key);
+
+				for(SegmentVector::const_reverse_iterator segment = segments_.rbegin() ; segment != segments_.rend() ; ++segment)
+				{
+					if(!(*segment)->MayContain(hash))
+					{
+						bloomSkips_++;
+						continue;
+					}
+
+					segmentLookups_++;
+
+					if((*segment)->Find(key, value))
+						return !value->deleted;
+				}
+
+				return false;
+			}
+
+			//
+			// memtables have the answer, segments are checked only with the
+			// bloom filters. A false positive makes a new record look like
+			// an existing one
+			//
+			bool MayExist(const string& key)
+			{
+				MemTable::const_iterator i = memTable_->find(key);
+
+				if(i != memTable_->end())
+					return !i->second.deleted;
+
+				if(immutable_)
+				{
+					i = immutable_->find(key);
+
+					if(i != immutable_->end())
+						return !i->second.deleted;
+				}
+
+				unsigned long long hash = LsmHash(key);
+
+				for(SegmentVector::const_reverse_iterator segment = segments_.rbegin() ; segment != segments_.rend() ; ++segment)
+				{
+					if((*segment)->MayContain(hash))
+						return true;
+				}
+
+				return false;
+			}
+
+			//
+			// deletes are only applied (and logged) for records that exist
+			//
+			void Apply(const string& key, const string& value, bool deleted)
+			{
+				std::unordered_map<unsigned int, shared_ptr<LSM_TABLE> >::iterator table = tablesById_.find(GetTableId(key));
+
+				if(table != tablesById_.end())
+				{
+					if(deleted)
+						table->second->count = AdjustCount(table->second->count, -1);
+					else if(!MayExist(key))
+						table->second->count++;
+				}
+
+				pair<MemTable::iterator, bool> inserted = memTable_->insert(make_pair(key, LSM_VALUE()));
+				LSM_VALUE& entry = inserted.first->second;
+
+				if(inserted.second)
+					memTableBytes_ += key.size() + LSM_MEMTABLE_ENTRY_OVERHEAD;
+
+				memTableBytes_ += value.size();
+				memTableBytes_ -= std::min<size_t>(memTableBytes_, entry.value.size());
+
+				entry.value = deleted ? string() : value;
+				entry.deleted = deleted;
+			}
+
+			void StartFlush()
+			{
+				//
+				// records of the frozen memtable must be in the old WAL
+				//
+				Commit();
+
+				flushWalNumber_ = ++walNumber_;
+				OpenWal();
+
+				flushTables_ = GetTablesSnapshot();
+				flushNextTableId_ = nextTableId_;
+
+				immutable_ = memTable_;
+				memTable_.reset(new MemTable());
+				memTableBytes_ = 0;
+
+				StartFlushJob();
+			}
+
+			void StartFlushJob()
+			{
+				unsigned int number = nextSegmentNumber_++;
+				flushJob_.reset(new LsmSegmentJob(immutable_, GetSegmentFileName(number), number));
+				flushJob_->Start();
+			}
+
+			void FinishFlush()
+			{
+				shared_ptr<LsmSegmentJob> job = flushJob_;
+				flushJob_.reset();
+
+				if(!job->Finish())
+				{
+					std::cout << "lsm: error flushing memtable: " << job->GetError() << std::endl;
+					return;
+				}
+
+				segments_.push_back(shared_ptr<LsmSegment>(new LsmSegment(job->GetFileName(), job->GetNumber())));
+				segmentTables_[job->GetNumber()] = flushTables_;
+
+				immutable_.reset();
+
+				unsigned int oldFirstLiveWal = firstLiveWal_;
+
+				firstLiveWal_ = flushWalNumber_;
+				manifestTables_ = flushTables_;
+				manifestNextTableId_ = flushNextTableId_;
+
+				WriteManifest();
+
+				for(unsigned int a = oldFirstLiveWal ; a < firstLiveWal_ ; a++)
+					remove(GetWalFileName(a).c_str());
+
+				flushes_++;
+			}
+
+			//
+			// tables has the estimated counts when the newest input was written,
+			// and counts the real ones. The difference is the error of the
+			// estimate, still there in the current counts and in the counts of
+			// the newer segments
+			//
+			void FixTableCounts(LsmTablesSnapshot& tables, const std::map<unsigned int, unsigned long long>& counts)
+			{
+				LsmCountAdjustments adjustments;
+
+				for(LsmTablesSnapshot::const_iterator i = tables.begin() ; i != tables.end() ; ++i)
+				{
+					std::map<unsigned int, unsigned long long>::const_iterator count = counts.find(i->id);
+					unsigned long long realCount = count != counts.end() ? count->second : 0;
+
+					if(realCount != i->count)
+						adjustments[i->id] = static_cast<long long>(realCount) - static_cast<long long>(i->count);
+				}
+
+				if(adjustments.empty())
+					return;
+
+				AdjustCounts(&tables, adjustments);
+				AdjustCounts(&manifestTables_, adjustments);
+				AdjustCounts(&flushTables_, adjustments);
+
+				for(std::map<unsigned int, LsmTablesSnapshot>::iterator i = segmentTables_.begin() ; i != segmentTables_.end() ; ++i)
+					AdjustCounts(&i->second, adjustments);
+
+				for(LsmCountAdjustments::const_iterator i = adjustments.begin() ; i != adjustments.end() ; ++i)
+				{
+					std::unordered_map<unsigned int, shared_ptr<LSM_TABLE> >::iterator table = tablesById_.find(i->first);
+
+					if(table != tablesById_.end())
+						table->second->count = AdjustCount(table->second->count, i->second);
+				}
+			}
+
+			size_t GetTier(unsigned long long size)
+			{
+				size_t tier = 0;
+
+				//
+				// a flushed segment can be a little bigger than the memtable limit
+				//
+				for(unsigned long long limit = memTableSize_ * 2ULL ; size > limit ; limit *= LSM_COMPACTION_TRIGGER)
+					tier++;
+
+				return tier;
+			}
+
+			//
+			// merges the newest run of segments of the same tier. Older segments
+			// smaller than that (left by big flushes) join the run, otherwise
+			// they'd stay below bigger segments and never be merged
+			//
+			void StartCompaction()
+			{
+				size_t end = segments_.size();
+
+				while(end > 0)
+				{
+					size_t tier = GetTier(segments_[end - 1]->GetFileSize());
+					size_t start = end - 1;
+
+					while(start > 0 && GetTier(segments_[start - 1]->GetFileSize()) <= tier)
+						start--;
+
+					if(end - start >= LSM_COMPACTION_TRIGGER)
+					{
+						std::set<unsigned int> liveTables;
+
+						for(TableMap::const_iterator i = tables_.begin() ; i != tables_.end() ; ++i)
+							liveTables.insert(i->second->id);
+
+						compactionStart_ = start;
+						compactionInputs_.assign(segments_.begin() + start, segments_.begin() + end);
+
+						unsigned int number = nextSegmentNumber_++;
+						compactionJob_.reset(new LsmSegmentJob(compactionInputs_, liveTables, start == 0, GetSegmentFileName(number), number));
+						compactionJob_->Start();
+						return;
+					}
+
+					end = start;
+				}
+			}
+
+			void FinishCompaction()
+			{
+				shared_ptr<LsmSegmentJob> job = compactionJob_;
+				compactionJob_.reset();
+
+				SegmentVector inputs;
+				inputs.swap(compactionInputs_);
+
+				if(!job->Finish())
+				{
+					std::cout << "lsm: compaction error: " << job->GetError() << std::endl;
+					return;
+				}
+
+				//
+				// merged segment takes the place of the inputs
+				//
+				SegmentVector::iterator first = segments_.begin() + compactionStart_;
+				first = segments_.erase(first, first + inputs.size());
+				segments_.insert(first, shared_ptr<LsmSegment>(new LsmSegment(job->GetFileName(), job->GetNumber())));
+
+				LsmTablesSnapshot tables;
+				std::map<unsigned int, LsmTablesSnapshot>::iterator newestInput = segmentTables_.find(inputs.back()->GetNumber());
+
+				if(newestInput != segmentTables_.end())
+					tables.swap(newestInput->second);
+
+				for(SegmentVector::const_iterator i = inputs.begin() ; i != inputs.end() ; ++i)
+					segmentTables_.erase((*i)->GetNumber());
+
+				if(job->HasTableCounts() && !tables.empty())
+					FixTableCounts(tables, job->GetTableCounts());
+
+				segmentTables_[job->GetNumber()].swap(tables);
+
+				WriteManifest();
+
+				for(SegmentVector::const_iterator i = inputs.begin() ; i != inputs.end() ; ++i)
+					remove((*i)->GetFileName().c_str());
+
+				compactions_++;
+			}
+
+		public:
+
+			LsmDatabase(const string& prefix, size_t memTableSize) :
+				prefix_(prefix),
+				memTableSize_(memTableSize),
+				memTable_(new MemTable()),
+				memTableBytes_(0),
+				nextTableId_(1),
+				nextSegmentNumber_(1),
+				wal_(0),
+				walNumber_(1),
+				firstLiveWal_(1),
+				walBytes_(0),
+				manifestNextTableId_(1),
+				flushWalNumber_(0),
+				flushNextTableId_(0),
+				compactionStart_(0),
+				commits_(0),
+				flushes_(0),
+				compactions_(0),
+				bloomSkips_(0),
+				segmentLookups_(0)
+			{
+				LoadManifest();
+
+				//
+				// WAL files not flushed yet, in order
+				//
+				walNumber_ = firstLiveWal_;
+
+				for(;;)
+				{
+					string data;
+
+					if(!ReadWholeFile(GetWalFileName(walNumber_), &data))
+						break;
+
+					ReplayWal(walNumber_, data);
+					walNumber_++;
+				}
+
+				OpenWal();
+
+				//
+				// no manifest yet, so the WAL file created above is found on next start
+				//
+				if(!boost::filesystem::exists(GetManifestFileName()))
+					WriteManifest();
+			}
+
+			~LsmDatabase()
+			{
+				try
+				{
+					Commit();
+
+					if(flushJob_)
+						FinishFlush();
+
+					if(compactionJob_)
+						FinishCompaction();
+				}
+				catch(std::exception& ex)
+				{
+					std::cout << "lsm: error closing " << prefix_ << ": " << ex.what() << std::endl;
+				}
+			}
+
+			shared_ptr<LSM_TABLE> OpenTable(const string& name)
+			{
+				TableMap::const_iterator i = tables_.find(name);
+
+				if(i == tables_.end())
+					return shared_ptr<LSM_TABLE>();
+
+				return i->second;
+			}
+
+			//
+			// defined after LsmKvTable
+			//
+			virtual shared_ptr<IOrderedKvTable> OpenKvTable(const string& name);
+			virtual shared_ptr<IOrderedKvTable> CreateKvTable(const string& name);
+
+			shared_ptr<LSM_TABLE> CreateTable(const string& name)
+			{
+				shared_ptr<LSM_TABLE> table = OpenTable(name);
+
+				if(table)
+					return table;
+
+				unsigned int id = nextTableId_;
+				string idData((const char*)&id, sizeof(id));
+
+				AppendWal(walRecordTable, name, idData);
+				ApplyTable(name, id);
+
+				return OpenTable(name);
+			}
+
+			//
+			// gives the table a new id, old records will be dropped by compaction
+			//
+			void ClearTable(const string& name)
+			{
+				if(!OpenTable(name))
+					return;
+
+				unsigned int id = nextTableId_;
+				string idData((const char*)&id, sizeof(id));
+
+				AppendWal(walRecordTable, name, idData);
+				ApplyTable(name, id);
+			}
+
+			virtual void DeleteTable(const string& name)
+			{
+				if(!OpenTable(name))
+					return;
+
+				unsigned int id = 0;
+				string idData((const char*)&id, sizeof(id));
+
+				AppendWal(walRecordTable, name, idData);
+				ApplyTable(name, id);
+			}
+
+			virtual vector<string> GetTableList()
+			{
+				vector<string> ret;
+
+				for(TableMap::const_iterator i = tables_.begin() ; i != tables_.end() ; ++i)
+					ret.push_back(i->first);
+
+				return ret;
+			}
+
+			bool Find(const LSM_TABLE& table, const string& key, string* value)
+			{
+				if(table.id == 0)
+					throw std::runtime_error("table was deleted");
+
+				LSM_VALUE found;
+
+				if(!Lookup(MakeInternalKey(table.id, key), &found))
+					return false;
+
+				if(value)
+					*value = found.value;
+
+				return true;
+			}
+
+			//
+			// returns false if the key exists and replace is false
+			//
+			bool Put(const LSM_TABLE& table, const string& key, const string& value, bool replace)
+			{
+				if(table.id == 0)
+					throw std::runtime_error("table was deleted");
+
+				string internalKey = MakeInternalKey(table.id, key);
+
+				if(!replace)
+				{
+					LSM_VALUE found;
+
+					if(Lookup(internalKey, &found))
+						return false;
+				}
+
+				AppendWal(walRecordPut, internalKey, value);
+				Apply(internalKey, value, false);
+
+				if(memTableBytes_ > memTableSize_ && !immutable_)
+					StartFlush();
+
+				return true;
+			}
+
+			bool Erase(const LSM_TABLE& table, const string& key)
+			{
+				if(table.id == 0)
+					throw std::runtime_error("table was deleted");
+
+				string internalKey = MakeInternalKey(table.id, key);
+				LSM_VALUE found;
+
+				if(!Lookup(internalKey, &found))
+					return false;
+
+				AppendWal(walRecordDelete, internalKey, string());
+				Apply(internalKey, string(), true);
+
+				return true;
+			}
+
+			//
+			// cursor on the first record with key equal or greater than start
+			//
+			shared_ptr<LsmTableCursor> Seek(const LSM_TABLE& table, const string& start)
+			{
+				if(table.id == 0)
+					throw std::runtime_error("table was deleted");
+
+				string internalKey = MakeInternalKey(table.id, start);
+				shared_ptr<LsmTableCursor> cursor(new LsmTableCursor(table.id));
+
+				cursor->AddSource(shared_ptr<LsmIterator>(new LsmMemTableIterator(*memTable_, internalKey)));
+
+				if(immutable_)
+					cursor->AddSource(shared_ptr<LsmIterator>(new LsmMemTableIterator(*immutable_, internalKey)));
+
+				for(SegmentVector::const_reverse_iterator i = segments_.rbegin() ; i != segments_.rend() ; ++i)
+				{
+					cursor->AddSource(shared_ptr<LsmIterator>(
+						new LsmSegmentIterator(*i, (*i)->GetFile(), internalKey)));
+				}
+
+				cursor->Start();
+
+				return cursor;
+			}
+
+			virtual bool HasPendingCommit()
+			{
+				return !walBuffer_.empty();
+			}
+
+			//
+			// one write and one sync for all changes since the last commit
+			//
+			virtual void Commit()
+			{
+				if(walBuffer_.empty())
+					return;
+
+				if(wal_.Write(walBuffer_.data(), static_cast<DWORD>(walBuffer_.size())) != walBuffer_.size())
+					throw std::runtime_error("lsm: error writing WAL");
+
+				wal_.Sync();
+
+				walBytes_ += walBuffer_.size();
+				walBuffer_.clear();
+
+				commits_++;
+			}
+
+			virtual void DoMaintenance()
+			{
+				if(flushJob_ && flushJob_->IsDone())
+					FinishFlush();
+
+				//
+				// last flush failed, try again
+				//
+				if(immutable_ && !flushJob_)
+					StartFlushJob();
+
+				if(compactionJob_ && compactionJob_->IsDone())
+					FinishCompaction();
+
+				if(!compactionJob_)
+					StartCompaction();
+			}
+
+			virtual void GetStatistics(std::map<string, string>* statistics)
+			{
+				unsigned long long segmentBytes = 0, segmentRecords = 0;
+
+				for(SegmentVector::const_iterator i = segments_.begin() ; i != segments_.end() ; ++i)
+				{
+					segmentBytes += (*i)->GetFileSize();
+					segmentRecords += (*i)->GetRecordCount();
+				}
+
+				(*statistics)["lsm_tables"] = lexical_cast<string>(tables_.size());
+				(*statistics)["lsm_memtable_bytes"] = lexical_cast<string>(memTableBytes_);
+				(*statistics)["lsm_memtable_records"] = lexical_cast<string>(memTable_->size());
+				(*statistics)["lsm_segments"] = lexical_cast<string>(segments_.size());
+				(*statistics)["lsm_segment_bytes"] = lexical_cast<string>(segmentBytes);
+				(*statistics)["lsm_segment_records"] = lexical_cast<string>(segmentRecords);
+				(*statistics)["lsm_commits"] = lexical_cast<string>(commits_);
+				(*statistics)["lsm_flushes"] = lexical_cast<string>(flushes_);
+				(*statistics)["lsm_compactions"] = lexical_cast<string>(compactions_);
+				(*statistics)["lsm_bloom_skips"] = lexical_cast<string>(bloomSkips_);
+				(*statistics)["lsm_segment_lookups"] = lexical_cast<string>(segmentLookups_);
+				(*statistics)["lsm_wal_bytes"] = lexical_cast<string>(walBytes_);
+			}
+		};
+
+		class LsmKvTable : public IOrderedKvTable
+		{
+			LsmDatabase& db_;
+			shared_ptr<LSM_TABLE> table_;
+			string name_;
+
+		public:
+			LsmKvTable(LsmDatabase& db, shared_ptr<LSM_TABLE> table, const string& name) :
+				db_(db),
+				table_(table),
+				name_(name)
+			{}
+
+			virtual unsigned long long GetCount()
+			{
+				return table_->count;
+			}
+
+			virtual bool Find(const string& key, string* value)
+			{
+				return db_.Find(*table_, key, value);
+			}
+
+			virtual bool Put(const string& key, const string& value, bool replace)
+			{
+				return db_.Put(*table_, key, value, replace);
+			}
+
+			virtual bool Erase(const string& key)
+			{
+				return db_.Erase(*table_, key);
+			}
+
+			virtual void Clear()
+			{
+				db_.ClearTable(name_);
+			}
+
+			//
+			// records aren't counted by position, an index means a scan
+			//
+			virtual shared_ptr<IOrderedKvCursor> Seek(unsigned long long index)
+			{
+				shared_ptr<LsmTableCursor> cursor = db_.Seek(*table_, string());
+
+				for(unsigned long long a = 0 ; a < index && cursor->IsValid() ; a++)
+					cursor->Next();
+
+				return cursor;
+			}
+
+			virtual shared_ptr<IOrderedKvCursor> LowerBound(const string& key)
+			{
+				return db_.Seek(*table_, key);
+			}
+		};
+
+		inline shared_ptr<IOrderedKvTable> LsmDatabase::OpenKvTable(const string& name)
+		{
+			shared_ptr<LSM_TABLE> table = OpenTable(name);
+
+			if(!table)
+				return shared_ptr<IOrderedKvTable>();
+
+			return shared_ptr<IOrderedKvTable>(new LsmKvTable(*this, table, name));
+		}
+
+		inline shared_ptr<IOrderedKvTable> LsmDatabase::CreateKvTable(const string& name)
+		{
+			return shared_ptr<IOrderedKvTable>(new LsmKvTable(*this, CreateTable(name), name));
+		}
+
+		struct LSM_CONFIG
+		{
+			//
+			// memtable is written to a new segment when it gets bigger than this, in bytes
+			//
+			size_t memTableSize;
+
+			LSM_CONFIG() :
+				memTableSize(32 * 1024 * 1024)
+			{
+			}
+		};
+
+		class LsmStorageManager: public OrderedKvStorageManager
+		{
+		public:
+
+			LsmStorageManager(const string& path, const LSM_CONFIG& config = LSM_CONFIG()) :
+				OrderedKvStorageManager("lsm_map", shared_ptr<IOrderedKvDatabase>(
+					new LsmDatabase(GetFilePath(path, "tio.lsm"), config.memTableSize)))
+			{
+			}
+		};
+	}
+}
@@ -230,6 +230,31 @@ namespace MemoryStorage
 			return ret;
 		}
 
+		virtual bool HasPendingCommit()
+		{
+			return false;
+		}
+
+		virtual void Commit()
+		{
+		}
+
+		virtual bool HasPendingFlush(unsigned int* maxDelay)
+		{
+			return false;
+		}
+
+		virtual void DoMaintenance()
+		{
+		}
+
+		virtual void GetStatistics(std::map<string, string>* statistics)
+		{
+		}
+
+		virtual void CheckProperty(const string& type, const string& key, const string& value)
+		{
+		}
 	};
 } //namespace MemoryStorage 
 } //namespace tio
@@ -0,0 +1,581 @@
+/*
+Tio: The Information Overlord
+Copyright 2010 Rodrigo Strauss (http://www.1bit.com.br)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+
+#include "Container.h"
+
+namespace tio {
+	namespace OrderedKvStorage
+	{
+		using std::make_tuple;
+
+		//
+		// Map containers on top of an ordered key/value database (btree_map,
+		// lsm_map). The database only stores strings, the map storage and the
+		// storage manager here are the same for all of them.
+		//
+		// A database has tables by name. Container data goes to the
+		// [container type]|data|[name] table and properties to
+		// [container type]|properties|[name]
+		//
+		//
+		// every commit syncs the database WAL, there are no durability
+		// modes to choose from like logdb has, so the property is refused
+		// instead of being stored and ignored
+		//
+		inline void CheckPropertyName(const string& key)
+		{
+			if(key.empty())
+				throw std::invalid_argument("invalid key");
+
+			if(key == "durability")
+				throw std::invalid_argument("\"durability\" not supported by this container, every commit is synced");
+		}
+
+		INTERFACE IOrderedKvCursor
+		{
+			virtual ~IOrderedKvCursor()
+			{}
+
+			virtual bool IsValid() = 0;
+			virtual void Next() = 0;
+			virtual void GetRecord(string* key, string* value) = 0;
+		};
+
+		INTERFACE IOrderedKvTable
+		{
+			virtual ~IOrderedKvTable()
+			{}
+
+			//
+			// can be an estimate, cursors are the ones that know where the table ends
+			//
+			virtual unsigned long long GetCount() = 0;
+
+			virtual bool Find(const string& key, string* value) = 0;
+
+			//
+			// returns false if the key exists and replace is false
+			//
+			virtual bool Put(const string& key, const string& value, bool replace) = 0;
+
+			//
+			// returns false if the key doesn't exist
+			//
+			virtual bool Erase(const string& key) = 0;
+
+			virtual void Clear() = 0;
+
+			//
+			// cursor on the record at this position / on the first record
+			// with key equal or greater than the informed one
+			//
+			virtual shared_ptr<IOrderedKvCursor> Seek(unsigned long long index) = 0;
+			virtual shared_ptr<IOrderedKvCursor> LowerBound(const string& key) = 0;
+		};
+
+		INTERFACE IOrderedKvDatabase
+		{
+			virtual ~IOrderedKvDatabase()
+			{}
+
+			//
+			// empty pointer if the table doesn't exist
+			//
+			virtual shared_ptr<IOrderedKvTable> OpenKvTable(const string& name) = 0;
+			virtual shared_ptr<IOrderedKvTable> CreateKvTable(const string& name) = 0;
+
+			virtual void DeleteTable(const string& name) = 0;
+			virtual vector<string> GetTableList() = 0;
+
+			virtual bool HasPendingCommit() = 0;
+			virtual void Commit() = 0;
+			virtual void DoMaintenance() = 0;
+			virtual void GetStatistics(std::map<string, string>* statistics) = 0;
+		};
+
+		//
+		// record value is [value size][value][metadata], null fields have zero size
+		//
+		inline string EncodeRecord(const TioData& value, const TioData& metadata)
+		{
+			unsigned int valueSize = value ? static_cast<unsigned int>(value.GetSerializedSize()) : 0;
+			size_t metadataSize = metadata ? metadata.GetSerializedSize() : 0;
+
+			string ret(sizeof(valueSize) + valueSize + metadataSize, '\0');
+
+			memcpy(&ret[0], &valueSize, sizeof(valueSize));
+
+			if(value)
+				value.Serialize(&ret[sizeof(valueSize)], valueSize);
+
+			if(metadata)
+				metadata.Serialize(&ret[sizeof(valueSize) + valueSize], metadataSize);
+
+			return ret;
+		}
+
+		inline void DecodeRecord(const string& record, TioData* value, TioData* metadata)
+		{
+			unsigned int valueSize;
+
+			if(record.size() < sizeof(valueSize))
+				throw std::runtime_error("corrupted record");
+
+			memcpy(&valueSize, record.data(), sizeof(valueSize));
+
+			if(record.size() < sizeof(valueSize) + valueSize)
+				throw std::runtime_error("corrupted record");
+
+			if(value)
+				value->Deserialize(record.data() + sizeof(valueSize), valueSize);
+
+			if(metadata)
+				metadata->Deserialize(record.data() + sizeof(valueSize) + valueSize,
+					record.size() - sizeof(valueSize) - valueSize);
+		}
+
+		class OrderedKvMapStorage :
+			boost::noncopyable,
+			public ITioStorage,
+			public ITioPropertyMap
+		{
+			shared_ptr<IOrderedKvTable> table_;
+			string name_, type_;
+			EventDispatcher dispatcher_;
+
+			static string GetKeyString(const TioData& key)
+			{
+				if(!key || key.GetDataType() != TioData::String)
+					throw std::invalid_argument("invalid key");
+
+				return string(key.AsSz(), key.GetSize());
+			}
+
+			void GetCursorRecord(IOrderedKvCursor& cursor, TioData* key, TioData* value, TioData* metadata)
+			{
+				string keyString, record;
+
+				cursor.GetRecord(&keyString, &record);
+
+				if(key)
+					key->Set(keyString.c_str(), keyString.size());
+
+				DecodeRecord(record, value, metadata);
+			}
+
+		public:
+
+			OrderedKvMapStorage(shared_ptr<IOrderedKvTable> table, const string& name, const string& type) :
+				table_(table),
+				name_(name),
+				type_(type)
+			{
+			}
+
+			virtual string GetName()
+			{
+				return name_;
+			}
+
+			virtual string GetType()
+			{
+				return type_;
+			}
+
+			virtual string Command(const string& command)
+			{
+				throw std::invalid_argument("\"command\" not supported");
+			}
+
+			virtual size_t GetRecordCount()
+			{
+				return static_cast<size_t>(table_->GetCount());
+			}
+
+			virtual void PushBack(const TioData& key, const TioData& value, const TioData& metadata)
+			{
+				throw std::invalid_argument("\"push_back\" not supported by this container");
+			}
+
+			virtual void PushFront(const TioData& key, const TioData& value, const TioData& metadata)
+			{
+				throw std::invalid_argument("\"push_front\" not supported by this container");
+			}
+
+			virtual void PopBack(TioData* key, TioData* value, TioData* metadata)
+			{
+				throw std::invalid_argument("\"pop_back\" not supported by this container");
+			}
+
+			virtual void PopFront(TioData* key, TioData* value, TioData* metadata)
+			{
+				throw std::invalid_argument("\"pop_front\" not supported by this container");
+			}
+
+			virtual void Set(const TioData& key, const TioData& value, const TioData& metadata)
+			{
+				table_->Put(GetKeyString(key), EncodeRecord(value, metadata), true);
+
+				dispatcher_.RaiseEvent("set", key, value, metadata);
+			}
+
+			virtual void Insert(const TioData& key, const TioData& value, const TioData& metadata)
+			{
+				if(!table_->Put(GetKeyString(key), EncodeRecord(value, metadata), false))
+					throw std::invalid_argument("already exists");
+
+				dispatcher_.RaiseEvent("insert", key, value, metadata);
+			}
+
+			virtual void Delete(const TioData& key, const TioData& value, const TioData& metadata)
+			{
+				if(!table_->Erase(GetKeyString(key)))
+					throw std::invalid_argument("key not found");
+
+				dispatcher_.RaiseEvent("delete", key, value, metadata);
+			}
+
+			virtual void Clear()
+			{
+				table_->Clear();
+
+				dispatcher_.RaiseEvent("clear", TIONULL, TIONULL, TIONULL);
+			}
+
+			//
+			// records are ordered by key, so a query is a seek to the first
+			// record followed by a scan
+			//
+			virtual shared_ptr<ITioResultSet> Query(int startOffset, int endOffset, const TioData& query)
+			{
+				if(!query.IsNull())
+					throw std::runtime_error("this container supports only querystr=null");
+
+				//
+				// record count can be an estimate, a query to the end goes
+				// until the last record
+				//
+				bool toEnd = (endOffset == 0 && startOffset >= 0);
+
+				VectorResultSet::ContainerT resultSetItems;
+
+				if(!toEnd)
+				{
+					NormalizeQueryLimits(&startOffset, &endOffset, static_cast<int>(table_->GetCount()));
+					resultSetItems.reserve(endOffset - startOffset);
+				}
+
+				shared_ptr<IOrderedKvCursor> cursor = table_->Seek(startOffset);
+
+				for(int a = startOffset ; (toEnd || a < endOffset) && cursor->IsValid() ; a++, cursor->Next())
+				{
+					TioData key, value, metadata;
+					GetCursorRecord(*cursor, &key, &value, &metadata);
+					resultSetItems.push_back(make_tuple(key, value, metadata));
+				}
+
+				return shared_ptr<ITioResultSet>(
+					new VectorResultSet(std::move(resultSetItems), TIONULL));
+			}
+
+			virtual void GetRecord(const TioData& searchKey, TioData* key, TioData* value, TioData* metadata)
+			{
+				if(searchKey.GetDataType() == TioData::Int)
+				{
+					unsigned int index = NormalizeIndex(searchKey.AsInt(), static_cast<int>(table_->GetCount()));
+
+					shared_ptr<IOrderedKvCursor> cursor = table_->Seek(index);
+
+					if(!cursor->IsValid())
+						throw std::invalid_argument("invalid index");
+
+					GetCursorRecord(*cursor, key, value, metadata);
+					return;
+				}
+
+				string record;
+
+				if(!table_->Find(GetKeyString(searchKey), &record))
+					throw std::invalid_argument("key not found");
+
+				if(key)
+					*key = searchKey;
+
+				DecodeRecord(record, value, metadata);
+			}
+
+			//
+			// start can be a numeric index or a key. Since records are
+			// ordered, a key that doesn't exist starts on the next one
+			//
+			virtual unsigned int Subscribe(EventSink sink, const string& start)
+			{
+				if(start.empty())
+				{
+					sink("snapshot_end", TIONULL, TIONULL, TIONULL);
+					return dispatcher_.Subscribe(sink);
+				}
+
+				shared_ptr<IOrderedKvCursor> cursor;
+				bool isNumeric = false;
+				int index = 0;
+
+				try
+				{
+					index = lexical_cast<int>(start);
+					isNumeric = true;
+				}
+				catch(std::exception&)
+				{
+				}
+
+				if(isNumeric)
+				{
+					unsigned long long count = table_->GetCount();
+					cursor = table_->Seek(count ? NormalizeIndex(index, static_cast<int>(count)) : 0);
+				}
+				else
+					cursor = table_->LowerBound(start);
+
+				for(; cursor->IsValid() ; cursor->Next())
+				{
+					TioData key, value, metadata;
+					GetCursorRecord(*cursor, &key, &value, &metadata);
+					sink("set", key, value, metadata);
+				}
+
+				sink("snapshot_end", TIONULL, TIONULL, TIONULL);
+				return dispatcher_.Subscribe(sink);
+			}
+
+			virtual void Unsubscribe(unsigned int cookie)
+			{
+				dispatcher_.Unsubscribe(cookie);
+			}
+
+			//
+			// ITioPropertyMap, used for the properties table
+			//
+			virtual string Get(const string& key)
+			{
+				string value;
+
+				if(key.empty() || !table_->Find(key, &value))
+					throw std::invalid_argument("invalid key");
+
+				return value;
+			}
+
+			virtual void Set(const string& key, const string& value)
+			{
+				CheckPropertyName(key);
+
+				table_->Put(key, value, true);
+			}
+		};
+
+		class OrderedKvStorageManager: public ITioStorageManager
+		{
+			//
+			// weak_ptr so we'll keep storage open just for cache
+			//
+			typedef std::map<string, pair<weak_ptr<ITioStorage>, weak_ptr<ITioPropertyMap> > > StorageMap;
+			StorageMap containers_;
+			string type_;
+			shared_ptr<IOrderedKvDatabase> db_;
+
+			void CheckType(const string& type)
+			{
+				if(type != type_)
+					throw std::invalid_argument("storage type not supported");
+			}
+
+			string GenerateTableName(const string& tableType, const string& containerType, const string& containerName)
+			{
+				return containerType + "|" + tableType + "|" + containerName;
+			}
+
+		protected:
+
+			//
+			// path of a database file in the data path
+			//
+			static string GetFilePath(string path, const string& fileName)
+			{
+				if(!path.empty())
+				{
+					char last = *path.rbegin();
+					if(last != '\\' && last != '/')
+						path += '/'; // works for win32 and *nix
+				}
+
+				return path + fileName;
+			}
+
+			OrderedKvStorageManager(const string& type, shared_ptr<IOrderedKvDatabase> db) :
+				type_(type),
+				db_(db)
+			{
+			}
+
+		public:
+
+			virtual bool HasPendingCommit()
+			{
+				return db_->HasPendingCommit();
+			}
+
+			virtual bool HasPendingFlush(unsigned int* maxDelay)
+			{
+				return false;
+			}
+
+			virtual void Commit()
+			{
+				db_->Commit();
+			}
+
+			virtual void DoMaintenance()
+			{
+				db_->DoMaintenance();
+			}
+
+			virtual void GetStatistics(std::map<string, string>* statistics)
+			{
+				db_->GetStatistics(statistics);
+			}
+
+			virtual void CheckProperty(const string& type, const string& key, const string& value)
+			{
+				CheckPropertyName(key);
+			}
+
+			virtual std::vector<string> GetSupportedTypes()
+			{
+				std::vector<string> ret;
+
+				ret.push_back(type_);
+
+				return ret;
+			}
+
+			virtual bool Exists(const string& containerType, const string& containerName)
+			{
+				return !!db_->OpenKvTable(GenerateTableName("data", containerType, containerName));
+			}
+
+			virtual void DeleteStorage(const string& containerType, const string& containerName)
+			{
+				string dataTableName = GenerateTableName("data", containerType, containerName);
+
+				if(!db_->OpenKvTable(dataTableName))
+					throw std::invalid_argument("no such data container");
+
+				db_->DeleteTable(dataTableName);
+				db_->DeleteTable(GenerateTableName("properties", containerType, containerName));
+
+				containers_.erase(dataTableName);
+			}
+
+			pair<shared_ptr<ITioStorage>, shared_ptr<ITioPropertyMap> >
+				CreateOrOpenStorage(const string& type, const string& name, bool create)
+			{
+				typedef pair<shared_ptr<ITioStorage>, shared_ptr<ITioPropertyMap>> ReturnType;
+				CheckType(type);
+
+				if(name.empty())
+					throw std::invalid_argument("invalid name");
+
+				string dataTableName = GenerateTableName("data", type, name);
+				string propertiesTableName = GenerateTableName("properties", type, name);
+
+				StorageMap::iterator i = containers_.find(dataTableName);
+
+				if(i != containers_.end() && !i->second.first.expired() && !i->second.second.expired())
+					return ReturnType(i->second.first.lock(), i->second.second.lock());
+
+				shared_ptr<IOrderedKvTable> dataTable, propertiesTable;
+
+				if(create)
+					dataTable = db_->CreateKvTable(dataTableName);
+				else
+				{
+					dataTable = db_->OpenKvTable(dataTableName);
+
+					if(!dataTable)
+						throw std::invalid_argument("no such data container");
+				}
+
+				propertiesTable = db_->CreateKvTable(propertiesTableName);
+
+				shared_ptr<ITioStorage> container(new OrderedKvMapStorage(dataTable, name, type));
+				shared_ptr<ITioPropertyMap> propertyMap(new OrderedKvMapStorage(propertiesTable, name, type));
+
+				StorageMap::mapped_type& p = containers_[dataTableName];
+
+				p.first = container;
+				p.second = propertyMap;
+
+				return ReturnType(container, propertyMap);
+			}
+
+			virtual vector<StorageInfo> GetStorageList()
+			{
+				vector<StorageInfo> ret;
+				vector<string> names = db_->GetTableList();
+
+				for(vector<string>::const_iterator i = names.begin() ; i != names.end() ; ++i)
+				{
+					//
+					// should be [container type]|[table type]|[name], the name
+					// can have '|' on it so only the first two are separators
+					//
+					string::size_type typeEnd = i->find('|');
+
+					if(typeEnd == string::npos)
+						continue;
+
+					string::size_type tableTypeEnd = i->find('|', typeEnd + 1);
+
+					if(tableTypeEnd == string::npos || i->compare(typeEnd + 1, tableTypeEnd - typeEnd - 1, "data") != 0)
+						continue;
+
+					StorageInfo si;
+					si.type = i->substr(0, typeEnd);
+					si.name = i->substr(tableTypeEnd + 1);
+
+					ret.push_back(si);
+				}
+
+				return ret;
+			}
+
+			virtual pair<shared_ptr<ITioStorage>, shared_ptr<ITioPropertyMap> >
+				OpenStorage(const string& type, const string& name)
+			{
+				return CreateOrOpenStorage(type, name, false);
+			}
+
+			virtual pair<shared_ptr<ITioStorage>, shared_ptr<ITioPropertyMap> >
+				CreateStorage(const string& type, const string& name)
+			{
+				return CreateOrOpenStorage(type, name, true);
+			}
+		};
+	}
+}
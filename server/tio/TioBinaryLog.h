@@ -0,0 +1,61 @@
+/*
+Tio: The Information Overlord
+Copyright 2010 Rodrigo Strauss (http://www.1bit.com.br)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+
+//
+// Binary transaction log format, written by the server with --log-format binary
+// and read by tools/tiologreplay. Everything is little endian.
+//
+// File starts with TIO_BINARY_LOG_MAGIC, followed by records. Each record is a
+// TIO_BINARY_LOG_RECORD followed by three fields (key, value and metadata),
+// each one a TIO_BINARY_LOG_FIELD followed by the field data. Strings are
+// stored without terminator, ints as 4 bytes and doubles as 8 bytes.
+//
+// Commands are the TIO_COMMAND_* codes. Handles are global, assigned on
+// the create record, that has the container name as key and the container
+// type as value. group_add has the group name as key and the container name
+// as value.
+//
+#define TIO_BINARY_LOG_MAGIC "TIOBLOG1"
+#define TIO_BINARY_LOG_MAGIC_SIZE 8
+
+struct TIO_BINARY_LOG_RECORD
+{
+	//
+	// whole record, including this header
+	//
+	unsigned int size;
+	unsigned short command;
+	unsigned short reserved;
+	unsigned int handle;
+	unsigned int reserved2;
+
+	//
+	// microseconds since 1970-01-01 UTC
+	//
+	unsigned long long timestamp;
+};
+
+struct TIO_BINARY_LOG_FIELD
+{
+	//
+	// TIO_DATA_TYPE_*
+	//
+	unsigned short data_type;
+	unsigned short reserved;
+	unsigned int size;
+};
@@ -0,0 +1,631 @@
+/*
+Tio: The Information Overlord
+Copyright 2010 Rodrigo Strauss (http://www.1bit.com.br)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+
+#include "ContainerManager.h"
+#include "TioTcpSession.h"
+#include "../../client/c/tioclient.h"
+
+//
+// Plugin API v2 (see TIO_PLUGIN_API on tioclient.h).
+//
+// Every plugin runs on its own thread. Reads go straight to the container,
+// changes are sent in batches to the server thread, so events reach the
+// sessions from the thread they expect. Plugin subscriptions don't call the
+// plugin under the container lock: the events are copied to a bounded queue
+// and the plugin thread takes them with dispatch_events
+//
+namespace tio
+{
+	using std::shared_ptr;
+	using std::string;
+	using std::vector;
+	using std::map;
+
+	inline void DataViewToTioData(const TIO_DATA_VIEW& view, TioData* data)
+	{
+		switch(view.data_type)
+		{
+		case TIO_DATA_TYPE_STRING:
+			data->Set(view.string_, view.string_size_);
+			break;
+		case TIO_DATA_TYPE_INT:
+			data->Set(view.int_);
+			break;
+		case TIO_DATA_TYPE_DOUBLE:
+			data->Set(view.double_);
+			break;
+		}
+	}
+
+	inline void TioDataToDataView(const TioData& data, TIO_DATA_VIEW* view)
+	{
+		view->data_type = TIO_DATA_TYPE_NONE;
+		view->int_ = 0;
+		view->double_ = 0;
+		view->string_ = NULL;
+		view->string_size_ = 0;
+
+		switch(data.GetDataType())
+		{
+		case TioData::String:
+			view->data_type = TIO_DATA_TYPE_STRING;
+			view->string_ = data.AsSz();
+			view->string_size_ = static_cast<unsigned int>(data.GetSize());
+			break;
+		case TioData::Int:
+			view->data_type = TIO_DATA_TYPE_INT;
+			view->int_ = data.AsInt();
+			break;
+		case TioData::Double:
+			view->data_type = TIO_DATA_TYPE_DOUBLE;
+			view->double_ = data.AsDouble();
+			break;
+		default:
+			break;
+		}
+	}
+
+	//
+	// Events waiting for a plugin thread. Container sinks only copy the event
+	// and return. If the plugin doesn't keep up and the queue is full, new
+	// events are dropped and the plugin gets a TIO_EVENT_QUEUE_OVERFLOW
+	//
+	class PluginEventQueue
+	{
+	public:
+		struct EVENT
+		{
+			void* cookie;
+			unsigned int eventCode;
+			string eventName;
+			TioData key, value, metadata;
+		};
+
+	private:
+		std::deque<EVENT> pending_;
+		size_t maxSize_;
+		bool overflowed_;
+		bool stopped_;
+
+		boost::mutex mutex_;
+		boost::condition_variable hasEvents_;
+
+	public:
+		explicit PluginEventQueue(size_t maxSize) :
+			maxSize_(maxSize),
+			overflowed_(false),
+			stopped_(false)
+		{
+		}
+
+		void Push(void* cookie, const string& eventName, const TioData& key, const TioData& value, const TioData& metadata)
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+
+			if(stopped_)
+				return;
+
+			if(pending_.size() >= maxSize_)
+			{
+				overflowed_ = true;
+				return;
+			}
+
+			pending_.push_back(EVENT());
+
+			EVENT& event = pending_.back();
+			event.cookie = cookie;
+			event.eventCode = EventNameToEventCode(eventName);
+			event.eventName = eventName;
+			event.key = key;
+			event.value = value;
+			event.metadata = metadata;
+
+			if(pending_.size() == 1)
+				hasEvents_.notify_one();
+		}
+
+		//
+		// Wakes up whoever is waiting on Pop. From now on, new events are
+		// dropped and Pop doesn't wait anymore
+		//
+		void Stop()
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+			stopped_ = true;
+			hasEvents_.notify_all();
+		}
+
+		//
+		// Waits up to timeout for events and takes all of them at once.
+		// events must be empty, it's swapped with the queue. Returns
+		// false if the queue was stopped
+		//
+		bool Pop(std::deque<EVENT>* events, unsigned int timeoutInMilliseconds)
+		{
+			BOOST_ASSERT(events->empty());
+
+			boost::mutex::scoped_lock lock(mutex_);
+
+			if(pending_.empty() && !overflowed_ && !stopped_ && timeoutInMilliseconds)
+				hasEvents_.timed_wait(lock, boost::posix_time::milliseconds(timeoutInMilliseconds));
+
+			if(stopped_)
+				return false;
+
+			events->swap(pending_);
+
+			if(overflowed_)
+			{
+				events->push_back(EVENT());
+				events->back().cookie = NULL;
+				events->back().eventCode = TIO_EVENT_QUEUE_OVERFLOW;
+				events->back().eventName = "overflow";
+
+				overflowed_ = false;
+			}
+
+			return true;
+		}
+	};
+
+	class NativePlugin : public boost::noncopyable
+	{
+		tio_plugin_start_v2_t startFunction_;
+		ContainerManager& containerManager_;
+		asio::io_service& io_service_;
+
+		map<string, string> parameters_;
+		vector<KEY_AND_VALUE> keysAndValues_;
+
+		TIO_PLUGIN_API api_;
+
+		PluginEventQueue eventQueue_;
+
+		//
+		// only touched by the plugin thread
+		//
+		std::deque<PluginEventQueue::EVENT> deliveringEvents_;
+		vector<TIO_PLUGIN_EVENT> eventViews_;
+
+		boost::thread thread_;
+
+		//
+		// set by Stop. The io_service isn't running anymore, so
+		// batches would wait forever for it
+		//
+		std::atomic<bool> stopping_;
+
+		//
+		// container sinks point to us, they're removed on Stop
+		//
+		typedef std::list< std::pair<shared_ptr<ITioContainer>, unsigned int> > SubscriptionList;
+		SubscriptionList subscriptions_;
+		boost::mutex subscriptionsMutex_;
+
+		static NativePlugin* FromContext(void* context)
+		{
+			return static_cast<NativePlugin*>(context);
+		}
+
+		static const shared_ptr<ITioContainer>& FromHandle(void* container)
+		{
+			return *static_cast<shared_ptr<ITioContainer>*>(container);
+		}
+
+		static int Create(void* context, const char* name, const char* type, void** container)
+		{
+			try
+			{
+				shared_ptr<ITioContainer> created = FromContext(context)->containerManager_.CreateContainer(type, name);
+				*container = new shared_ptr<ITioContainer>(created);
+			}
+			catch(std::exception&)
+			{
+				return TIO_ERROR_GENERIC;
+			}
+
+			return TIO_SUCCESS;
+		}
+
+		static int Open(void* context, const char* name, const char* type, void** container)
+		{
+			try
+			{
+				shared_ptr<ITioContainer> opened = FromContext(context)->containerManager_.OpenContainer(type ? string(type) : string(), name);
+				*container = new shared_ptr<ITioContainer>(opened);
+			}
+			catch(std::exception&)
+			{
+				return TIO_ERROR_NO_SUCH_OBJECT;
+			}
+
+			return TIO_SUCCESS;
+		}
+
+		static int Close(void* context, void* container)
+		{
+			delete static_cast<shared_ptr<ITioContainer>*>(container);
+			return TIO_SUCCESS;
+		}
+
+		//
+		// batch operations copied out of the plugin buffer, so they don't
+		// depend on the plugin waiting for the io_service
+		//
+		struct BATCH_OPERATION
+		{
+			unsigned int command;
+			TioData key, value, metadata;
+		};
+
+		static int ApplyOperations(ITioContainer* container, const vector<BATCH_OPERATION>& operations)
+		{
+			int failed = 0;
+
+			for(vector<BATCH_OPERATION>::const_iterator i = operations.begin() ; i != operations.end() ; ++i)
+			{
+				const TioData& key = i->key;
+				const TioData& value = i->value;
+				const TioData& metadata = i->metadata;
+
+				try
+				{
+					switch(i->command)
+					{
+					case TIO_COMMAND_SET:
+						container->Set(key, value, metadata);
+						break;
+					case TIO_COMMAND_INSERT:
+						container->Insert(key, value, metadata);
+						break;
+					case TIO_COMMAND_PUSH_BACK:
+						container->PushBack(key, value, metadata);
+						break;
+					case TIO_COMMAND_PUSH_FRONT:
+						container->PushFront(key, value, metadata);
+						break;
+					case TIO_COMMAND_DELETE:
+						container->Delete(key, value, metadata);
+						break;
+					case TIO_COMMAND_CLEAR:
+						container->Clear();
+						break;
+					default:
+						failed++;
+					}
+				}
+				catch(std::exception&)
+				{
+					failed++;
+				}
+			}
+
+			return failed;
+		}
+
+		static int Batch(void* context, void* container, const TIO_PLUGIN_OPERATION* operations, unsigned int count)
+		{
+			NativePlugin* plugin = FromContext(context);
+			shared_ptr<ITioContainer> target = FromHandle(container);
+
+			if(plugin->stopping_)
+				return TIO_ERROR_GENERIC;
+
+			//
+			// if we stop waiting (Stop was called), the handler can still run
+			// later, after the plugin released the operations, the container
+			// handle or even the plugin. So it only uses copies of them
+			//
+			shared_ptr< vector<BATCH_OPERATION> > batch(new vector<BATCH_OPERATION>(count));
+
+			for(unsigned int a = 0 ; a < count ; a++)
+			{
+				BATCH_OPERATION& operation = (*batch)[a];
+
+				operation.command = operations[a].command;
+				DataViewToTioData(operations[a].key, &operation.key);
+				DataViewToTioData(operations[a].value, &operation.value);
+				DataViewToTioData(operations[a].metadata, &operation.metadata);
+			}
+
+			ContainerManager* containerManager = &plugin->containerManager_;
+
+			shared_ptr< boost::promise<int> > failed(new boost::promise<int>());
+			boost::unique_future<int> result = failed->get_future();
+
+			//
+			// Like a session command, the batch is committed before we return
+			//
+			plugin->io_service_.post(
+				[containerManager, target, batch, failed]()
+				{
+					int result = ApplyOperations(target.get(), *batch);
+
+					if(containerManager->HasPendingCommit())
+						containerManager->Commit();
+
+					failed->set_value(result);
+				});
+
+			while(!result.timed_wait(boost::posix_time::milliseconds(100)))
+			{
+				if(plugin->stopping_)
+					return TIO_ERROR_GENERIC;
+			}
+
+			return result.get();
+		}
+
+		static int Get(void* context, void* container, const TIO_DATA_VIEW* search_key, tio_plugin_record_callback_t callback, void* cookie)
+		{
+			TioData searchKey, key, value, metadata;
+			TIO_DATA_VIEW keyView, valueView, metadataView;
+
+			DataViewToTioData(*search_key, &searchKey);
+
+			try
+			{
+				FromHandle(container)->GetRecord(searchKey, &key, &value, &metadata);
+			}
+			catch(std::exception&)
+			{
+				return TIO_ERROR_NO_SUCH_OBJECT;
+			}
+
+			TioDataToDataView(key, &keyView);
+			TioDataToDataView(value, &valueView);
+			TioDataToDataView(metadata, &metadataView);
+
+			callback(cookie, &keyView, &valueView, &metadataView);
+
+			return TIO_SUCCESS;
+		}
+
+		static int Query(void* context, void* container, int start, int end, tio_plugin_record_callback_t callback, void* cookie)
+		{
+			shared_ptr<ITioResultSet> resultSet;
+
+			try
+			{
+				resultSet = FromHandle(container)->Query(start, end, TIONULL);
+			}
+			catch(std::exception&)
+			{
+				return TIO_ERROR_GENERIC;
+			}
+
+			TioData key, value, metadata;
+			TIO_DATA_VIEW keyView, valueView, metadataView;
+
+			while(resultSet->GetRecord(&key, &value, &metadata))
+			{
+				TioDataToDataView(key, &keyView);
+				TioDataToDataView(value, &valueView);
+				TioDataToDataView(metadata, &metadataView);
+
+				callback(cookie, &keyView, &valueView, &metadataView);
+
+				resultSet->MoveNext();
+			}
+
+			return TIO_SUCCESS;
+		}
+
+		static int GetCount(void* context, void* container, int* count)
+		{
+			try
+			{
+				*count = static_cast<int>(FromHandle(container)->GetRecordCount());
+			}
+			catch(std::exception&)
+			{
+				return TIO_ERROR_GENERIC;
+			}
+
+			return TIO_SUCCESS;
+		}
+
+		static int Subscribe(void* context, void* container, const char* start, void* cookie, unsigned int* subscription)
+		{
+			NativePlugin* plugin = FromContext(context);
+			const shared_ptr<ITioContainer>& target = FromHandle(container);
+
+			if(plugin->stopping_)
+				return TIO_ERROR_GENERIC;
+
+			try
+			{
+				*subscription = target->Subscribe(
+					[plugin, cookie](const string& eventName, const TioData& key, const TioData& value, const TioData& metadata)
+					{
+						plugin->eventQueue_.Push(cookie, eventName, key, value, metadata);
+					},
+					start ? string(start) : string());
+			}
+			catch(std::exception&)
+			{
+				return TIO_ERROR_GENERIC;
+			}
+
+			boost::mutex::scoped_lock lock(plugin->subscriptionsMutex_);
+
+			//
+			// Stop may have run while we subscribed
+			//
+			if(plugin->stopping_)
+			{
+				target->Unsubscribe(*subscription);
+				return TIO_ERROR_GENERIC;
+			}
+
+			plugin->subscriptions_.push_back(std::make_pair(target, *subscription));
+
+			return TIO_SUCCESS;
+		}
+
+		static int Unsubscribe(void* context, void* container, unsigned int subscription)
+		{
+			NativePlugin* plugin = FromContext(context);
+			const shared_ptr<ITioContainer>& target = FromHandle(container);
+
+			{
+				boost::mutex::scoped_lock lock(plugin->subscriptionsMutex_);
+
+				for(SubscriptionList::iterator i = plugin->subscriptions_.begin() ; i != plugin->subscriptions_.end() ; ++i)
+				{
+					if(i->first == target && i->second == subscription)
+					{
+						plugin->subscriptions_.erase(i);
+						break;
+					}
+				}
+			}
+
+			try
+			{
+				target->Unsubscribe(subscription);
+			}
+			catch(std::exception&)
+			{
+				return TIO_ERROR_GENERIC;
+			}
+
+			return TIO_SUCCESS;
+		}
+
+		static int DispatchEvents(void* context, unsigned int max_events, unsigned int timeout_in_milliseconds,
+			tio_plugin_events_callback_t callback, void* cookie)
+		{
+			NativePlugin* plugin = FromContext(context);
+			std::deque<PluginEventQueue::EVENT>& events = plugin->deliveringEvents_;
+
+			if(events.empty() && !plugin->eventQueue_.Pop(&events, timeout_in_milliseconds))
+				return TIO_ERROR_GENERIC;
+
+			unsigned int count = std::min<unsigned int>(max_events, static_cast<unsigned int>(events.size()));
+
+			if(count == 0)
+				return 0;
+
+			plugin->eventViews_.resize(count);
+
+			for(unsigned int a = 0 ; a < count ; a++)
+			{
+				const PluginEventQueue::EVENT& event = events[a];
+				TIO_PLUGIN_EVENT& view = plugin->eventViews_[a];
+
+				view.cookie = event.cookie;
+				view.event_code = event.eventCode;
+				TioDataToDataView(event.key, &view.key);
+				TioDataToDataView(event.value, &view.value);
+				TioDataToDataView(event.metadata, &view.metadata);
+			}
+
+			callback(cookie, &plugin->eventViews_[0], count);
+
+			events.erase(events.begin(), events.begin() + count);
+
+			return count;
+		}
+
+		void Run()
+		{
+			startFunction_(&api_, &keysAndValues_[0]);
+		}
+
+	public:
+		NativePlugin(tio_plugin_start_v2_t startFunction, ContainerManager& containerManager, asio::io_service& io_service,
+			const map<string, string>& parameters, size_t eventQueueSize = 100 * 1000) :
+			startFunction_(startFunction),
+			containerManager_(containerManager),
+			io_service_(io_service),
+			parameters_(parameters),
+			eventQueue_(eventQueueSize),
+			stopping_(false)
+		{
+			for(map<string, string>::const_iterator i = parameters_.begin() ; i != parameters_.end() ; ++i)
+			{
+				KEY_AND_VALUE kv;
+				kv.key = i->first.c_str();
+				kv.value = i->second.c_str();
+				keysAndValues_.push_back(kv);
+			}
+
+			// last one must have key = NULL
+			KEY_AND_VALUE last = {NULL, NULL};
+			keysAndValues_.push_back(last);
+
+			api_.version = TIO_PLUGIN_API_VERSION;
+			api_.context = this;
+			api_.create = &NativePlugin::Create;
+			api_.open = &NativePlugin::Open;
+			api_.close = &NativePlugin::Close;
+			api_.batch = &NativePlugin::Batch;
+			api_.get = &NativePlugin::Get;
+			api_.query = &NativePlugin::Query;
+			api_.get_count = &NativePlugin::GetCount;
+			api_.subscribe = &NativePlugin::Subscribe;
+			api_.unsubscribe = &NativePlugin::Unsubscribe;
+			api_.dispatch_events = &NativePlugin::DispatchEvents;
+		}
+
+		~NativePlugin()
+		{
+			Stop();
+		}
+
+		void Start()
+		{
+			thread_ = boost::thread(boost::bind(&NativePlugin::Run, this));
+		}
+
+		//
+		// Must be called after the io_service stopped running. Pending and new
+		// batches, subscribes and dispatch_events fail, so the plugin can return
+		// from tio_plugin_start_v2, and we wait for it
+		//
+		void Stop()
+		{
+			if(stopping_.exchange(true))
+				return;
+
+			eventQueue_.Stop();
+
+			{
+				boost::mutex::scoped_lock lock(subscriptionsMutex_);
+
+				for(SubscriptionList::iterator i = subscriptions_.begin() ; i != subscriptions_.end() ; ++i)
+				{
+					try
+					{
+						i->first->Unsubscribe(i->second);
+					}
+					catch(std::exception&)
+					{
+					}
+				}
+
+				subscriptions_.clear();
+			}
+
+			if(thread_.joinable())
+				thread_.join();
+		}
+	};
+}
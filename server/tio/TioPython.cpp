@@ -3,6 +3,7 @@
 #if TIO_PYTHON_PLUGIN_SUPPORT
 #include "TioPython.h"
 #include "ContainerManager.h"
+#include "TioPlugin.h"
 
 namespace tio
 {
@@ -15,6 +16,38 @@ namespace tio
 
 	python::object g_pythonContainerManager;
 
+	//
+	// told about every write, so the server commits them
+	//
+	ContainerManager* g_containerManager = NULL;
+
+	void OnPythonWrite()
+	{
+		if(g_containerManager)
+			g_containerManager->OnOutsideWrite();
+	}
+
+	//
+	// The main thread releases the GIL after loading the plugins. Container
+	// operations called from Python release it while they run, and anything
+	// calling into Python from C++ must take it
+	//
+	class ScopedGILRelease : public boost::noncopyable
+	{
+		PyThreadState* state_;
+	public:
+		ScopedGILRelease() : state_(PyEval_SaveThread()) {}
+		~ScopedGILRelease() { PyEval_RestoreThread(state_); }
+	};
+
+	class ScopedGILAcquire : public boost::noncopyable
+	{
+		PyGILState_STATE state_;
+	public:
+		ScopedGILAcquire() : state_(PyGILState_Ensure()) {}
+		~ScopedGILAcquire() { PyGILState_Release(state_); }
+	};
+
 	template<typename T, typename TDerived>
 	class PythonWrapperImpl
 	{
@@ -136,6 +169,204 @@ namespace tio
 		}
 	};
 
+	//
+	// Python objects kept by C++ code can be released by any thread,
+	// so the deleter takes the GIL
+	//
+	template<typename T>
+	shared_ptr<T> MakePythonShared(T* p)
+	{
+		return shared_ptr<T>(p, [](T* p) { ScopedGILAcquire gil; delete p; });
+	}
+
+	//
+	// Batched subscriptions. Container sinks only copy events to a queue, and
+	// a single thread delivers them, taking the GIL once per batch. Callbacks
+	// get the container and a list of (event_name, key, value, metadata) tuples.
+	// The subscription map is protected by the GIL
+	//
+	class PythonEventDispatcher
+	{
+		struct SUBSCRIPTION
+		{
+			shared_ptr<ITioContainer> container;
+			unsigned int cookie;
+			python::object containerWrapper;
+			python::object callback;
+			unsigned int maxEvents;
+		};
+
+		map<void*, shared_ptr<SUBSCRIPTION> > subscriptions_;
+		PluginEventQueue eventQueue_;
+		boost::thread thread_;
+		bool started_;
+
+		PythonEventDispatcher() :
+			eventQueue_(100 * 1000),
+			started_(false)
+		{
+		}
+
+		void Deliver(std::deque<PluginEventQueue::EVENT>& events)
+		{
+			ScopedGILAcquire gil;
+
+			std::deque<PluginEventQueue::EVENT>::const_iterator i = events.begin();
+
+			while(i != events.end())
+			{
+				if(!i->cookie)
+				{
+					//
+					// overflow, we don't know which subscriptions lost events
+					//
+					python::list batch;
+					batch.append(python::make_tuple(i->eventName, python::object(), python::object(), python::object()));
+
+					//
+					// callbacks can subscribe or unsubscribe, don't iterate the map while calling them
+					//
+					vector< shared_ptr<SUBSCRIPTION> > all;
+
+					for(map<void*, shared_ptr<SUBSCRIPTION> >::const_iterator s = subscriptions_.begin() ; s != subscriptions_.end() ; ++s)
+						all.push_back(s->second);
+
+					for(vector< shared_ptr<SUBSCRIPTION> >::const_iterator s = all.begin() ; s != all.end() ; ++s)
+						Call(**s, batch);
+
+					++i;
+					continue;
+				}
+
+				map<void*, shared_ptr<SUBSCRIPTION> >::const_iterator s = subscriptions_.find(i->cookie);
+
+				if(s == subscriptions_.end())
+				{
+					// unsubscribed while the event was queued
+					++i;
+					continue;
+				}
+
+				//
+				// consecutive events of the same subscription go in the same call.
+				// We keep a reference, the callback can unsubscribe
+				//
+				shared_ptr<SUBSCRIPTION> subscription = s->second;
+				void* cookie = s->first;
+				python::list batch;
+				unsigned int count = 0;
+
+				for( ; i != events.end() && i->cookie == cookie && count < subscription->maxEvents ; ++i, ++count)
+				{
+					batch.append(python::make_tuple(
+						i->eventName,
+						TioDataToPythonObject(i->key),
+						TioDataToPythonObject(i->value),
+						TioDataToPythonObject(i->metadata)));
+				}
+
+				Call(*subscription, batch);
+			}
+		}
+
+		static void Call(const SUBSCRIPTION& subscription, const python::list& batch)
+		{
+			try
+			{
+				subscription.callback(subscription.containerWrapper, batch);
+			}
+			catch(python::error_already_set&)
+			{
+				PyErr_Print();
+			}
+		}
+
+		void Run()
+		{
+			std::deque<PluginEventQueue::EVENT> events;
+
+			for(;;)
+			{
+				eventQueue_.Pop(&events, 1000);
+
+				if(events.empty())
+					continue;
+
+				Deliver(events);
+
+				events.clear();
+			}
+		}
+
+	public:
+		static PythonEventDispatcher& GetInstance()
+		{
+			static PythonEventDispatcher instance;
+			return instance;
+		}
+
+		//
+		// called from Python, with the GIL
+		//
+		unsigned int Subscribe(shared_ptr<ITioContainer> container, python::object containerWrapper, python::object callback, unsigned int maxEvents)
+		{
+			if(!started_)
+			{
+				thread_ = boost::thread(boost::bind(&PythonEventDispatcher::Run, this));
+				started_ = true;
+			}
+
+			shared_ptr<SUBSCRIPTION> subscription = MakePythonShared(new SUBSCRIPTION());
+			subscription->container = container;
+			subscription->containerWrapper = containerWrapper;
+			subscription->callback = callback;
+			subscription->maxEvents = maxEvents ? maxEvents : 1;
+
+			void* key = subscription.get();
+			PluginEventQueue* eventQueue = &eventQueue_;
+
+			subscriptions_[key] = subscription;
+
+			try
+			{
+				ScopedGILRelease noGil;
+
+				subscription->cookie = container->Subscribe(
+					[eventQueue, key](const string& eventName, const TioData& k, const TioData& v, const TioData& m)
+					{
+						eventQueue->Push(key, eventName, k, v, m);
+					},
+					"0");
+			}
+			catch(std::exception&)
+			{
+				subscriptions_.erase(key);
+				throw;
+			}
+
+			return subscription->cookie;
+		}
+
+		//
+		// called from Python, with the GIL. Works for regular subscriptions too
+		//
+		void Unsubscribe(shared_ptr<ITioContainer> container, unsigned int cookie)
+		{
+			for(map<void*, shared_ptr<SUBSCRIPTION> >::iterator i = subscriptions_.begin() ; i != subscriptions_.end() ; ++i)
+			{
+				if(i->second->container == container && i->second->cookie == cookie)
+				{
+					subscriptions_.erase(i);
+					break;
+				}
+			}
+
+			ScopedGILRelease noGil;
+
+			container->Unsubscribe(cookie);
+		}
+	};
+
 	class TioContainerWrapper : public PythonWrapperImpl< shared_ptr<ITioContainer>, TioContainerWrapper>
 	{
 	public:
@@ -164,6 +395,8 @@ namespace tio
 					.def("propset", &TioContainerWrapper::GetProperty)
 					.def("subscribe", &TioContainerWrapper::Subscribe)
 					.def("subscribe", &TioContainerWrapper::Subscribe1)
+					.def("subscribe_batch", &TioContainerWrapper::SubscribeBatch, (arg("callback"), arg("max_events")))
+					.def("subscribe_batch", &TioContainerWrapper::SubscribeBatch1, (arg("callback")))
 					.def("unsubscribe", &TioContainerWrapper::Unsubscribe)
 
 					.def("values", &TioContainerWrapper::Values)
@@ -182,14 +415,22 @@ namespace tio
 			return containerType;
 		}
 
-		static void PythonCallbackBridge(python::object container, python::object callback, const string& eventFilter, const string& eventName, 
+		struct PYTHON_CALLBACK
+		{
+			python::object container;
+			python::object callback;
+		};
+
+		static void PythonCallbackBridge(shared_ptr<PYTHON_CALLBACK> pythonCallback, const string& eventFilter, const string& eventName, 
 			const TioData& key, const TioData& value, const TioData& metadata)
 		{
 			if(eventFilter.empty() == false && eventFilter != eventName)
 				return;
 
-			callback(
-				container,
+			ScopedGILAcquire gil;
+
+			pythonCallback->callback(
+				pythonCallback->container,
 				eventName,
 				TioDataToPythonObject(key),
 				TioDataToPythonObject(value),
@@ -198,9 +439,15 @@ namespace tio
 
 		int Subscribe(python::object callback, const string& eventFilter, python::object start)
 		{
-			return wrapped_->Subscribe(
-				boost::bind(&TioContainerWrapper::PythonCallbackBridge, python::object(this), callback, eventFilter == "*" ? string() : eventFilter, _1, _2, _3, _4),
-				"0");
+			shared_ptr<PYTHON_CALLBACK> pythonCallback = MakePythonShared(new PYTHON_CALLBACK());
+			pythonCallback->container = python::object(this);
+			pythonCallback->callback = callback;
+
+			EventSink sink = boost::bind(&TioContainerWrapper::PythonCallbackBridge, pythonCallback, eventFilter == "*" ? string() : eventFilter, _1, _2, _3, _4);
+
+			ScopedGILRelease noGil;
+
+			return wrapped_->Subscribe(sink, "0");
 		}
 
 		int Subscribe1(python::object callback)
@@ -208,28 +455,44 @@ namespace tio
 			return Subscribe(callback, string(), python::object());
 		}
 
+		int SubscribeBatch(python::object callback, unsigned int maxEvents)
+		{
+			return PythonEventDispatcher::GetInstance().Subscribe(wrapped_, python::object(this), callback, maxEvents);
+		}
+
+		int SubscribeBatch1(python::object callback)
+		{
+			return SubscribeBatch(callback, 1000);
+		}
+
 		void Unsubscribe(unsigned int cookie)
 		{
-			wrapped_->Unsubscribe(cookie);
+			PythonEventDispatcher::GetInstance().Unsubscribe(wrapped_, cookie);
 		}
 
 		void Clear()
 		{
+			ScopedGILRelease noGil;
 			wrapped_->Clear();
+			OnPythonWrite();
 		}
 
 		string GetProperty(const string& key)
 		{
+			ScopedGILRelease noGil;
 			return wrapped_->GetProperty(key);
 		}
 
 		void SetProperty(const string& key, const string& value)
 		{
-			return wrapped_->SetProperty(key, value);
+			ScopedGILRelease noGil;
+			wrapped_->SetProperty(key, value);
+			OnPythonWrite();
 		}
 
 		int GetRecordCount()
 		{
+			ScopedGILRelease noGil;
 			return wrapped_->GetRecordCount();
 		}
 		/*
@@ -241,9 +504,15 @@ namespace tio
         return self.manager.Query(self.handle, startOffset, endOffset)
 		*/
 
+		shared_ptr<ITioResultSet> QueryWithoutGIL(unsigned start, unsigned end)
+		{
+			ScopedGILRelease noGil;
+			return wrapped_->Query(start, end, TIONULL);
+		}
+
 		python::object Values()
 		{
-			shared_ptr<ITioResultSet> resultSet = wrapped_->Query(0, 0, TIONULL);
+			shared_ptr<ITioResultSet> resultSet = QueryWithoutGIL(0, 0);
 
 			TioData value;
 			python::list ret;
@@ -259,7 +528,7 @@ namespace tio
 
 		python::object Keys()
 		{
-			shared_ptr<ITioResultSet> resultSet = wrapped_->Query(0, 0, TIONULL);
+			shared_ptr<ITioResultSet> resultSet = QueryWithoutGIL(0, 0);
 
 			TioData key;
 			python::list ret;
@@ -280,16 +549,20 @@ namespace tio
 
 		python::object Query(unsigned start, unsigned end)
 		{
-			shared_ptr<ITioResultSet> resultSet = wrapped_->Query(start, end, TIONULL);
+			shared_ptr<ITioResultSet> resultSet = QueryWithoutGIL(start, end);
 
 			return TioResultSetWrapper::CreateWrapper(resultSet);
 		}
 
 		python::object GetRecord(python::object searchKey)
 		{
+			TioData search = PythonObjectToTioData(searchKey);
 			TioData key, value, metadata;
 			
-			wrapped_->GetRecord(PythonObjectToTioData(searchKey), &key, &value, &metadata);
+			{
+				ScopedGILRelease noGil;
+				wrapped_->GetRecord(search, &key, &value, &metadata);
+			}
 
 			return python::make_tuple(
 				TioDataToPythonObject(key),
@@ -299,9 +572,13 @@ namespace tio
 
 		python::object GetRecordValue(python::object searchKey)
 		{
+			TioData search = PythonObjectToTioData(searchKey);
 			TioData key, value;
 			
-			wrapped_->GetRecord(PythonObjectToTioData(searchKey), &key, &value, NULL);
+			{
+				ScopedGILRelease noGil;
+				wrapped_->GetRecord(search, &key, &value, NULL);
+			}
 
 			return TioDataToPythonObject(value);
 		}
@@ -310,7 +587,11 @@ namespace tio
 		{
 			TioData key, value, metadata;
 			
-			wrapped_->PopBack(&key, &value, &metadata);
+			{
+				ScopedGILRelease noGil;
+				wrapped_->PopBack(&key, &value, &metadata);
+				OnPythonWrite();
+			}
 
 			return python::make_tuple(
 				TioDataToPythonObject(key),
@@ -322,7 +603,11 @@ namespace tio
 		{
 			TioData key, value, metadata;
 			
-			wrapped_->PopFront(&key, &value, &metadata);
+			{
+				ScopedGILRelease noGil;
+				wrapped_->PopFront(&key, &value, &metadata);
+				OnPythonWrite();
+			}
 
 			return python::make_tuple(
 				TioDataToPythonObject(key),
@@ -330,73 +615,84 @@ namespace tio
 				TioDataToPythonObject(metadata));
 		}
 
+		//
+		// Python objects are converted while we still have the GIL
+		//
 		void PushFront(python::object key, python::object value, python::object metadata)
 		{
-			wrapped_->PushFront(
-				PythonObjectToTioData(key),
-				PythonObjectToTioData(value),
-				PythonObjectToTioData(metadata));
+			TioData k = PythonObjectToTioData(key), v = PythonObjectToTioData(value), m = PythonObjectToTioData(metadata);
+			ScopedGILRelease noGil;
+			wrapped_->PushFront(k, v, m);
+			OnPythonWrite();
 		}
 
 		void PushBack2(python::object value, python::object metadata)
 		{
-			wrapped_->PushBack(
-				TIONULL,
-				PythonObjectToTioData(value),
-				PythonObjectToTioData(metadata));
+			TioData v = PythonObjectToTioData(value), m = PythonObjectToTioData(metadata);
+			ScopedGILRelease noGil;
+			wrapped_->PushBack(TIONULL, v, m);
+			OnPythonWrite();
 		}
 
 		void PushBack1(python::object value)
 		{
-			wrapped_->PushBack(TIONULL, PythonObjectToTioData(value));
+			TioData v = PythonObjectToTioData(value);
+			ScopedGILRelease noGil;
+			wrapped_->PushBack(TIONULL, v);
+			OnPythonWrite();
 		}
 
 		void Insert(python::object key, python::object value, python::object metadata)
 		{
-			wrapped_->Insert(
-				PythonObjectToTioData(key),
-				PythonObjectToTioData(value),
-				PythonObjectToTioData(metadata));
+			TioData k = PythonObjectToTioData(key), v = PythonObjectToTioData(value), m = PythonObjectToTioData(metadata);
+			ScopedGILRelease noGil;
+			wrapped_->Insert(k, v, m);
+			OnPythonWrite();
 		}
 
 		void Insert1(python::object key, python::object value)
 		{
-			wrapped_->Insert(
-				PythonObjectToTioData(key),
-				PythonObjectToTioData(value));
+			TioData k = PythonObjectToTioData(key), v = PythonObjectToTioData(value);
+			ScopedGILRelease noGil;
+			wrapped_->Insert(k, v);
+			OnPythonWrite();
 		}
 
 		void Set3(python::object key, python::object value, python::object metadata)
 		{
-			wrapped_->Set(
-				PythonObjectToTioData(key),
-				PythonObjectToTioData(value),
-				PythonObjectToTioData(metadata));
+			TioData k = PythonObjectToTioData(key), v = PythonObjectToTioData(value), m = PythonObjectToTioData(metadata);
+			ScopedGILRelease noGil;
+			wrapped_->Set(k, v, m);
+			OnPythonWrite();
 		}
 
 		void Set2(python::object key, python::object value)
 		{
-			wrapped_->Set(
-				PythonObjectToTioData(key),
-				PythonObjectToTioData(value),
-				TIONULL);
+			TioData k = PythonObjectToTioData(key), v = PythonObjectToTioData(value);
+			ScopedGILRelease noGil;
+			wrapped_->Set(k, v, TIONULL);
+			OnPythonWrite();
 		}
 
 		void Delete1(python::object key)
 		{
-			wrapped_->Delete(PythonObjectToTioData(key));
+			TioData k = PythonObjectToTioData(key);
+			ScopedGILRelease noGil;
+			wrapped_->Delete(k);
+			OnPythonWrite();
 		}
 
 		void Delete(python::object key, python::object value, python::object metadata)
 		{
-			wrapped_->Delete(
-				PythonObjectToTioData(key),
-				PythonObjectToTioData(value),
-				PythonObjectToTioData(metadata));
+			TioData k = PythonObjectToTioData(key), v = PythonObjectToTioData(value), m = PythonObjectToTioData(metadata);
+			ScopedGILRelease noGil;
+			wrapped_->Delete(k, v, m);
+			OnPythonWrite();
 		}
 
 		string GetName()
 		{
+			ScopedGILRelease noGil;
 			return wrapped_->GetName();
 		}
 	};
@@ -418,29 +714,42 @@ namespace tio
 
 		python::object CreateContainer(string name, string type)
 		{
-			return TioContainerWrapper::CreateWrapper(
-				wrapped_->CreateContainer(type, name));
+			shared_ptr<ITioContainer> container;
+
+			{
+				ScopedGILRelease noGil;
+				container = wrapped_->CreateContainer(type, name);
+			}
+
+			return TioContainerWrapper::CreateWrapper(container);
 		}
 
 		python::object OpenContainer2(string name, string type)
 		{
-			return TioContainerWrapper::CreateWrapper(
-				wrapped_->OpenContainer(type, name));
+			shared_ptr<ITioContainer> container;
+
+			{
+				ScopedGILRelease noGil;
+				container = wrapped_->OpenContainer(type, name);
+			}
+
+			return TioContainerWrapper::CreateWrapper(container);
 		}
 
 		python::object OpenContainer1(string name)
 		{
-			return TioContainerWrapper::CreateWrapper(
-				wrapped_->OpenContainer(string(), name));
+			return OpenContainer2(name, string());
 		}
 
 		void DeleteContainer(const string& name, const string& type)
 		{
+			ScopedGILRelease noGil;
 			wrapped_->DeleteContainer(type, name);
 		}
 
 		bool Exists(string name, string type)
 		{
+			ScopedGILRelease noGil;
 			return wrapped_->Exists(type, name);
 		}
 	};
@@ -452,10 +761,12 @@ namespace tio
 	{
 		Py_SetProgramName(const_cast<char*>(programName));
 		Py_Initialize();
+		PyEval_InitThreads();
 		PyRun_SimpleString("print 'Python support initialized:'");
 
 		try
 		{
+			g_containerManager = containerManager;
 			g_pythonContainerManager = TioContainerManagerWrapper::CreateWrapper(containerManager);
 		}
 		catch(boost::python::error_already_set&)
@@ -496,6 +807,11 @@ namespace tio
 				throw std::runtime_error(string("Error loading python plugin ") + pluginPath);
 			}
 		}
+
+		//
+		// from now on, threads calling Python take the GIL when they need it
+		//
+		PyEval_SaveThread();
 	}
 
 }
@@ -0,0 +1,515 @@
+/*
+Tio: The Information Overlord
+Copyright 2010 Rodrigo Strauss (http://www.1bit.com.br)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+
+#include "ContainerManager.h"
+#include "../../client/c/tioclient.h"
+
+//
+// Primary/replica replication.
+//
+// The primary keeps every container, except the __meta__ ones, in the
+// TIO_REPLICATION_GROUP group. It's filled the first time someone subscribes
+// to it, and containers created after that are added as they appear. A replica
+// is a regular binary protocol client subscribing to this group with snapshot,
+// so it gets the current data of every container followed by every change,
+// in the order the primary applied them.
+//
+// The primary also changes TIO_REPLICATION_HEARTBEAT every second with its
+// clock, so replicas can tell how far behind they are. It assumes both
+// machines have their clocks in sync.
+//
+#define TIO_REPLICATION_GROUP "__replication__"
+#define TIO_REPLICATION_HEARTBEAT "__meta__/replication_heartbeat"
+#define TIO_REPLICATION_STATUS "__meta__/replication"
+
+namespace tio
+{
+	using std::shared_ptr;
+	using std::string;
+	using std::vector;
+	using std::map;
+
+	//
+	// microseconds since 1970-01-01 UTC
+	//
+	inline long long GetReplicationTimestamp()
+	{
+		static const boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
+
+		return (boost::posix_time::microsec_clock::universal_time() - epoch).total_microseconds();
+	}
+
+	struct REPLICATION_CONFIG
+	{
+		//
+		// empty if this server is not a replica
+		//
+		string primaryHost;
+		unsigned short primaryPort;
+
+		//
+		// seconds between reconnection attempts
+		//
+		unsigned int reconnectInterval;
+
+		REPLICATION_CONFIG() :
+			primaryPort(2605),
+			reconnectInterval(1)
+		{
+		}
+	};
+
+	//
+	// Replica side. A thread receives the changes from the primary and posts
+	// them to the io_service, where they're applied to local containers, so
+	// local subscribers are notified from the same thread as always. Everything
+	// received while the previous batch was being applied is applied together,
+	// with a single commit.
+	//
+	// After every (re)connection, the local copy of each container is cleared
+	// before the snapshot is applied, so local subscribers will see a clear
+	// followed by the whole container. Containers deleted on the primary while
+	// we were disconnected are kept.
+	//
+	// Once a container was copied, local sessions and plugins get it read
+	// only. Writes to it answer an error, they must go to the primary.
+	//
+	// Replication status, including the lag, is in TIO_REPLICATION_STATUS.
+	//
+	class ReplicationFollower : boost::noncopyable
+	{
+		enum EventType
+		{
+			EventType_Change,
+			EventType_ContainerDeleted,
+			EventType_Connected,
+			EventType_Disconnected
+		};
+
+		struct REPLICATED_EVENT
+		{
+			EventType eventType;
+			unsigned int eventCode;
+			string containerName;
+			string containerType;
+
+			//
+			// first event of this container since we connected
+			//
+			bool firstEvent;
+
+			TioData key, value, metadata;
+
+			REPLICATED_EVENT() :
+				eventType(EventType_Change),
+				eventCode(0),
+				firstEvent(false)
+			{
+			}
+		};
+
+		boost::asio::io_service& io_service_;
+		ContainerManager& containerManager_;
+		REPLICATION_CONFIG config_;
+		string primaryName_;
+
+		boost::thread thread_;
+		std::atomic<bool> stop_;
+
+		//
+		// shared between the replication thread and the io_service
+		//
+		boost::mutex pendingMutex_;
+		vector<REPLICATED_EVENT> pending_;
+		bool applyScheduled_;
+
+		//
+		// replication thread only. Events are collected here by
+		// the client callbacks
+		//
+		vector<REPLICATED_EVENT> received_;
+		std::set<void*> knownContainers_;
+
+		//
+		// io_service only
+		//
+		shared_ptr<ITioContainer> status_;
+		map<string, shared_ptr<ITioContainer> > containers_;
+		bool heartbeatSnapshotDone_;
+		unsigned long long appliedEvents_;
+		unsigned long long failedEvents_;
+		unsigned int connections_;
+
+		static void ToTioData(const TIO_DATA* source, TioData* destination)
+		{
+			if(!source)
+				return;
+
+			switch(source->data_type)
+			{
+			case TIO_DATA_TYPE_STRING:
+				destination->Set(source->string_, source->string_size_);
+				break;
+			case TIO_DATA_TYPE_INT:
+				destination->Set(source->int_);
+				break;
+			case TIO_DATA_TYPE_DOUBLE:
+				destination->Set(source->double_);
+				break;
+			}
+		}
+
+		static void OnGroupEvent(int result, void* handle, void* cookie, unsigned int eventCode,
+			const char* groupName, const char* containerName, const TIO_DATA* key, const TIO_DATA* value, const TIO_DATA* metadata)
+		{
+			ReplicationFollower* self = static_cast<ReplicationFollower*>(cookie);
+			const char* containerType = tio_container_type(static_cast<TIO_CONTAINER*>(handle));
+
+			self->received_.push_back(REPLICATED_EVENT());
+
+			REPLICATED_EVENT& event = self->received_.back();
+
+			event.eventCode = eventCode;
+			event.containerName = containerName;
+			event.containerType = containerType ? containerType : "";
+			event.firstEvent = self->knownContainers_.insert(handle).second;
+
+			ToTioData(key, &event.key);
+			ToTioData(value, &event.value);
+			ToTioData(metadata, &event.metadata);
+		}
+
+		//
+		// the group only adds containers, deletions come from
+		// the primary's __meta__/containers
+		//
+		static void OnPrimaryContainersEvent(int result, void* handle, void* cookie, unsigned int eventCode,
+			const char* groupName, const char* containerName, const TIO_DATA* key, const TIO_DATA* value, const TIO_DATA* metadata)
+		{
+			ReplicationFollower* self = static_cast<ReplicationFollower*>(cookie);
+
+			if(eventCode != TIO_COMMAND_DELETE || !key || key->data_type != TIO_DATA_TYPE_STRING)
+				return;
+
+			self->received_.push_back(REPLICATED_EVENT());
+
+			REPLICATED_EVENT& event = self->received_.back();
+
+			event.eventType = EventType_ContainerDeleted;
+			event.containerName.assign(key->string_, key->string_size_);
+		}
+
+		void PostEvent(EventType eventType, const string& error)
+		{
+			received_.push_back(REPLICATED_EVENT());
+			received_.back().eventType = eventType;
+			received_.back().value = error;
+
+			PostReceived();
+		}
+
+		void PostReceived()
+		{
+			if(received_.empty())
+				return;
+
+			boost::mutex::scoped_lock lock(pendingMutex_);
+
+			if(pending_.empty())
+				pending_.swap(received_);
+			else
+			{
+				std::move(received_.begin(), received_.end(), std::back_inserter(pending_));
+				received_.clear();
+			}
+
+			if(applyScheduled_)
+				return;
+
+			applyScheduled_ = true;
+
+			io_service_.post([this]()
+				{
+					ApplyPending();
+				});
+		}
+
+		int Connect(TIO_CONNECTION** connection)
+		{
+			TIO_CONTAINER* primaryContainers;
+			int result;
+
+			result = tio_connect(config_.primaryHost.c_str(), config_.primaryPort, connection);
+
+			if(TIO_FAILED(result))
+				return result;
+
+			result = tio_open(*connection, "__meta__/containers", NULL, &primaryContainers);
+
+			if(TIO_FAILED(result))
+				return result;
+
+			result = tio_container_subscribe(primaryContainers, NULL, &ReplicationFollower::OnPrimaryContainersEvent, this);
+
+			if(TIO_FAILED(result))
+				return result;
+
+			result = tio_group_set_subscription_callback(*connection, &ReplicationFollower::OnGroupEvent, this);
+
+			if(TIO_FAILED(result))
+				return result;
+
+			return tio_group_subscribe(*connection, TIO_REPLICATION_GROUP, "0");
+		}
+
+		void Run()
+		{
+			while(!stop_)
+			{
+				TIO_CONNECTION* connection = NULL;
+				int result = Connect(&connection);
+
+				if(!TIO_FAILED(result))
+				{
+					PostEvent(EventType_Connected, string());
+
+					for(;;)
+					{
+						unsigned int timeout = 1;
+
+						if(stop_)
+							break;
+
+						//
+						// a timeout means nothing arrived. A message that stops in the
+						// middle comes as a network error, and we'll resync from scratch
+						//
+						result = tio_receive_next_pending_event(connection, &timeout);
+
+						if(result == TIO_ERROR_TIMEOUT)
+							continue;
+
+						if(TIO_FAILED(result))
+							break;
+
+						tio_dispatch_pending_events(connection, 0xFFFFFFFF);
+
+						PostReceived();
+					}
+				}
+
+				string error = tio_get_last_error_description();
+
+				if(connection)
+					tio_disconnect(connection);
+
+				received_.clear();
+				knownContainers_.clear();
+
+				PostEvent(EventType_Disconnected, error);
+
+				for(unsigned int a = 0 ; a < config_.reconnectInterval * 10 && !stop_ ; a++)
+					boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+			}
+		}
+
+		shared_ptr<ITioContainer> GetLocalContainer(const REPLICATED_EVENT& event)
+		{
+			shared_ptr<ITioContainer>& container = containers_[event.containerName];
+
+			if(!container)
+				container = containerManager_.CreateReplicatedContainer(event.containerType, event.containerName);
+
+			return container;
+		}
+
+		void ApplyHeartbeat(const REPLICATED_EVENT& event)
+		{
+			if(event.eventCode == TIO_EVENT_SNAPSHOT_END)
+			{
+				heartbeatSnapshotDone_ = true;
+				return;
+			}
+
+			//
+			// the snapshot has an old value, it would show a lag
+			// that doesn't exist
+			//
+			if(!heartbeatSnapshotDone_ || event.eventCode != TIO_COMMAND_SET || event.value.GetDataType() != TioData::String)
+				return;
+
+			long long primaryTime = lexical_cast<long long>(event.value.AsSz());
+			long long lag = (GetReplicationTimestamp() - primaryTime) / 1000;
+
+			status_->Set("lag_ms", lexical_cast<string>(lag < 0 ? 0 : lag), TIONULL);
+			status_->Set("last_heartbeat", event.value, TIONULL);
+		}
+
+		void ApplyChange(const REPLICATED_EVENT& event)
+		{
+			if(event.containerName == TIO_REPLICATION_HEARTBEAT)
+			{
+				ApplyHeartbeat(event);
+				return;
+			}
+
+			shared_ptr<ITioContainer> container = GetLocalContainer(event);
+
+			if(event.firstEvent)
+				container->Clear();
+
+			switch(event.eventCode)
+			{
+			case TIO_COMMAND_SET:
+				container->Set(event.key, event.value, event.metadata);
+				break;
+			case TIO_COMMAND_INSERT:
+				container->Insert(event.key, event.value, event.metadata);
+				break;
+			case TIO_COMMAND_PUSH_BACK:
+				container->PushBack(TIONULL, event.value, event.metadata);
+				break;
+			case TIO_COMMAND_PUSH_FRONT:
+				container->PushFront(TIONULL, event.value, event.metadata);
+				break;
+			//
+			// pop_back and pop_front also come as delete, with the record index
+			//
+			case TIO_COMMAND_DELETE:
+				container->Delete(event.key, TIONULL, TIONULL);
+				break;
+			case TIO_COMMAND_CLEAR:
+				container->Clear();
+				break;
+			case TIO_EVENT_SNAPSHOT_END:
+				return;
+			default:
+				throw std::runtime_error(string("unsupported event code ") + lexical_cast<string>(event.eventCode));
+			}
+
+			appliedEvents_++;
+		}
+
+		void ApplyContainerDeleted(const REPLICATED_EVENT& event)
+		{
+			map<string, shared_ptr<ITioContainer> >::iterator i = containers_.find(event.containerName);
+
+			if(i == containers_.end())
+				return;
+
+			string containerType = i->second->GetType();
+
+			containers_.erase(i);
+
+			containerManager_.DeleteReplicatedContainer(containerType, event.containerName);
+		}
+
+		void ApplyPending()
+		{
+			vector<REPLICATED_EVENT> events;
+
+			{
+				boost::mutex::scoped_lock lock(pendingMutex_);
+				events.swap(pending_);
+				applyScheduled_ = false;
+			}
+
+			for(vector<REPLICATED_EVENT>::const_iterator i = events.begin() ; i != events.end() ; ++i)
+			{
+				const REPLICATED_EVENT& event = *i;
+
+				try
+				{
+					switch(event.eventType)
+					{
+					case EventType_Change:
+						ApplyChange(event);
+						break;
+					case EventType_ContainerDeleted:
+						ApplyContainerDeleted(event);
+						break;
+					case EventType_Connected:
+						connections_++;
+						heartbeatSnapshotDone_ = false;
+						status_->Set("state", "connected", TIONULL);
+						status_->Set("connections", lexical_cast<string>(connections_), TIONULL);
+						std::cout << "replicating from " << primaryName_ << std::endl;
+						break;
+					case EventType_Disconnected:
+						status_->Set("state", "disconnected", TIONULL);
+						status_->Set("last_error", event.value, TIONULL);
+						break;
+					}
+				}
+				catch(std::exception& ex)
+				{
+					failedEvents_++;
+					std::cout << "replication error on \"" << event.containerName << "\": " << ex.what() << std::endl;
+				}
+			}
+
+			status_->Set("applied_events", lexical_cast<string>(appliedEvents_), TIONULL);
+			status_->Set("failed_events", lexical_cast<string>(failedEvents_), TIONULL);
+
+			unsigned int maxFlushDelay;
+
+			if(containerManager_.HasPendingCommit() || containerManager_.HasPendingFlush(&maxFlushDelay))
+				containerManager_.Commit();
+		}
+
+	public:
+
+		ReplicationFollower(boost::asio::io_service& io_service, ContainerManager& containerManager, const REPLICATION_CONFIG& config) :
+			io_service_(io_service),
+			containerManager_(containerManager),
+			config_(config),
+			stop_(false),
+			applyScheduled_(false),
+			heartbeatSnapshotDone_(false),
+			appliedEvents_(0),
+			failedEvents_(0),
+			connections_(0)
+		{
+			primaryName_ = config_.primaryHost + ":" + lexical_cast<string>(config_.primaryPort);
+
+			status_ = containerManager_.CreateContainer("volatile_map", TIO_REPLICATION_STATUS);
+			status_->Set("role", "replica", TIONULL);
+			status_->Set("primary", primaryName_, TIONULL);
+			status_->Set("state", "disconnected", TIONULL);
+		}
+
+		~ReplicationFollower()
+		{
+			Stop();
+		}
+
+		void Start()
+		{
+			thread_ = boost::thread(boost::bind(&ReplicationFollower::Run, this));
+		}
+
+		void Stop()
+		{
+			if(!thread_.joinable())
+				return;
+
+			stop_ = true;
+			thread_.join();
+		}
+	};
+}
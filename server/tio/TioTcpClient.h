@@ -187,7 +187,17 @@ namespace tio
 			throw std::runtime_error("not implemented");
 
 		}
-		virtual void CancelWaitAndPopNext(int id)
+		virtual int WaitAndPopKey(const TioData& key, EventSink sink)
+		{
+			throw std::runtime_error("not implemented");
+		}
+
+		virtual void CancelWaitAndPop(int id)
+		{
+			throw std::runtime_error("not implemented");
+		}
+
+		virtual unsigned int SubscribeJournal(SequencedEventSink sink, unsigned long long lastSequence)
 		{
 			throw std::runtime_error("not implemented");
 		}
@@ -77,56 +77,172 @@ namespace tio
 		MakeAnswerEnd(stream);
 	}
 
-	inline void SerializeData(const TioData& key, const TioData& value, const TioData& metadata, ostream& stream)
+	//
+	// Text representation of a TioData, without allocating. Strings point
+	// to the TioData buffer, numbers are formatted in our own buffer, the
+	// same way ostream does (doubles with 6 significant digits)
+	//
+	struct TextData
 	{
-		if(!key && !value && !metadata)
-			return;
+		char buffer[32];
+		const char* text;
+		size_t size;
+
+		TextData() : text(buffer), size(0) {}
+
+		explicit TextData(const TioData& data)
+		{
+			Set(data);
+		}
+
+		void Set(const TioData& data)
+		{
+			std::to_chars_result result;
+
+			text = buffer;
+			size = 0;
+
+			switch(data.GetDataType())
+			{
+			case TioData::Int:
+				result = std::to_chars(buffer, buffer + sizeof(buffer), data.AsInt());
+				size = result.ptr - buffer;
+				break;
+			case TioData::Double:
+				result = std::to_chars(buffer, buffer + sizeof(buffer), data.AsDouble(), std::chars_format::general, 6);
+				size = result.ptr - buffer;
+				break;
+			case TioData::String:
+				text = reinterpret_cast<const char*>(data.AsRaw());
+				size = data.GetSize();
+				break;
+			default:
+				break;
+			}
+		}
+	};
+
+	//
+	// Upper bound of the text size of a TioData, to reserve buffers
+	//
+	inline size_t GetTextSizeHint(const TioData& data)
+	{
+		return data.GetDataType() == TioData::String ? data.GetSize() : sizeof(TextData::buffer);
+	}
+
+	template<typename T>
+	inline void AppendNumber(string* out, T number)
+	{
+		char buffer[32];
+		std::to_chars_result result = std::to_chars(buffer, buffer + sizeof(buffer), number);
+		out->append(buffer, result.ptr);
+	}
+
+	//
+	// Parses a whole token as a number. Unlike lexical_cast, it doesn't
+	// need a string, so it can parse straight from the receive buffer.
+	// from_chars doesn't take a leading '+', lexical_cast did
+	//
+	template<typename T>
+	inline T ParseNumber(const char* begin, const char* end)
+	{
+		if(begin != end && *begin == '+' && end - begin > 1 && begin[1] != '-')
+			++begin;
+
+		T number;
+		std::from_chars_result result = std::from_chars(begin, end, number);
 
-		stringstream buffer;
-		string keyString, valueString, metadataString;
+		if(result.ec != std::errc() || result.ptr != end || begin == end)
+			throw std::invalid_argument("invalid number");
 
+		return number;
+	}
+
+	template<typename T>
+	inline T ParseNumber(const string& str)
+	{
+		return ParseNumber<T>(str.c_str(), str.c_str() + str.size());
+	}
+
+	//
+	// Appends the field list (" key string 3 value int 2") and then the data lines.
+	// Events and query items don't send empty strings, answers do.
+	// A non zero sequence is sent as an extra field
+	//
+	inline void AppendDataFields(string* out, const TioData& key, const TioData& value, const TioData& metadata, 
+		bool skipEmptyStrings, unsigned long long sequence = 0)
+	{
 		const TioData* data[] = {&key, &value, &metadata};
-		const char* names[] = {"key", "value", "metadata"};
-		string* strings[] = {&keyString, &valueString, &metadataString};
+		const char* names[] = {" key ", " value ", " metadata "};
+		TextData text[3];
+		bool send[3];
 
 		for(int a = 0 ; a < 3 ; a++)
 		{
-			const TioData* currentData = data[a];
-			string* currentString = strings[a];
-			const char* currentName = names[a];
+			send[a] = !data[a]->Empty();
 
-			if(!currentData || currentData->Empty())
+			if(!send[a])
 				continue;
 
-			buffer.str("");
+			text[a].Set(*data[a]);
 
-			buffer << *currentData;
+			if(skipEmptyStrings && text[a].size == 0)
+			{
+				send[a] = false;
+				continue;
+			}
 
-			*currentString = buffer.str();
+			out->append(names[a]);
+			out->append(GetDataTypeAsString(*data[a]));
+			out->push_back(' ');
+			AppendNumber(out, text[a].size);
+		}
+
+		char sequenceBuffer[32];
+		size_t sequenceSize = 0;
+
+		if(sequence)
+		{
+			sequenceSize = std::to_chars(sequenceBuffer, sequenceBuffer + sizeof(sequenceBuffer), sequence).ptr - sequenceBuffer;
 
-			stream << " " << currentName 
-				   << " " << GetDataTypeAsString(*currentData)
-				   << " " << currentString->length();
+			out->append(" sequence int ");
+			AppendNumber(out, sequenceSize);
 		}
 
-		stream << "\r\n";
+		out->append("\r\n");
 
 		for(int a = 0 ; a < 3 ; a++)
 		{
-			const TioData* currentData = data[a];
-			const string* currentString = strings[a];
-
-			if(!currentData || currentData->Empty())
+			if(!send[a])
 				continue;
 
-			stream << *currentString << "\r\n";
+			out->append(text[a].text, text[a].size);
+			out->append("\r\n");
+		}
+
+		if(sequenceSize)
+		{
+			out->append(sequenceBuffer, sequenceSize);
+			out->append("\r\n");
 		}
 	}
 
+	inline void SerializeData(const TioData& key, const TioData& value, const TioData& metadata, ostream& stream)
+	{
+		if(!key && !value && !metadata)
+			return;
+
+		string buffer;
+
+		AppendDataFields(&buffer, key, value, metadata, false);
+
+		stream.write(buffer.c_str(), static_cast<std::streamsize>(buffer.size()));
+	}
+
 	inline void MakeEventAnswer(const string& eventName, unsigned int handle, 
 		const TioData& key, const TioData& value, const TioData& metadata, ostream& stream)
 	{
-		stream << "event " << lexical_cast<string>(handle) << " " << eventName;
+		stream << "event " << handle << " " << eventName;
 
 		SerializeData(key, value, metadata, stream);
 	}
@@ -152,17 +268,15 @@ namespace tio
 
 	inline void SetTioData(TioData* tioData, const FieldInfo& fieldInfo, const unsigned char* buffer)
 	{
-		string str(buffer, buffer + fieldInfo.size);
+		const char* begin = reinterpret_cast<const char*>(buffer);
+		const char* end = begin + fieldInfo.size;
 
-		//
-		// TODO: replace lexical_cast with something else, it's very slow
-		//
 		if(fieldInfo.type == "int")
-			tioData->Set(lexical_cast<int>(str));
+			tioData->Set(ParseNumber<int>(begin, end));
 		else if(fieldInfo.type == "double")
-			tioData->Set(lexical_cast<double>(str));
+			tioData->Set(ParseNumber<double>(begin, end));
 		else if(fieldInfo.type == "string")
-			tioData->Set(str.c_str(), str.size());
+			tioData->Set(begin, fieldInfo.size);
 		else
 			throw std::invalid_argument("invalid data type");
 	}
@@ -234,7 +348,7 @@ namespace tio
 			//
 			// field size
 			//
-			fieldInfo.size = lexical_cast<size_t>(*begin);
+			fieldInfo.size = ParseNumber<size_t>(*begin);
 
 			//
 			// +2 for \r\n
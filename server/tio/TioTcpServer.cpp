@@ -65,6 +65,113 @@ namespace tio
 	}
 
 
+	//
+	// Session output is held while the command runs. If the command
+	// changed persistent data, answers will only be sent after the
+	// data is on disk. All commands processed until the commit callback
+	// runs will share the same commit
+	//
+	void TioTcpServer::OnCommandFinished(shared_ptr<TioTcpSession> session)
+	{
+		unsigned int maxFlushDelay;
+
+		if(containerManager_.HasPendingFlush(&maxFlushDelay))
+			ScheduleFlush(maxFlushDelay);
+
+		if(!containerManager_.HasPendingCommit())
+		{
+			session->ReleaseOutput();
+			return;
+		}
+
+		sessionsWaitingCommit_.insert(session);
+
+		if(commitScheduled_)
+			return;
+
+		commitScheduled_ = true;
+
+		PostCallback([this]()
+			{
+				CommitPendingWrites();
+			});
+	}
+
+	void TioTcpServer::CommitPendingWrites()
+	{
+		commitScheduled_ = false;
+
+		containerManager_.Commit();
+
+		SessionsSet sessions;
+		sessions.swap(sessionsWaitingCommit_);
+
+		for(SessionsSet::iterator i = sessions.begin() ; i != sessions.end() ; ++i)
+			(*i)->ReleaseOutput();
+	}
+
+	//
+	// Writes that don't come from a session command (Python plugins, v1 native
+	// plugins) don't go through OnCommandFinished. Plugins report them with
+	// ContainerManager::OnOutsideWrite, from any thread, and the commit is
+	// posted to run right after. The maintenance tick calls it too, for
+	// anything that wasn't reported
+	//
+	void TioTcpServer::OnOutsideWrite()
+	{
+		if(otherWritesCommitPosted_.exchange(true))
+			return;
+
+		PostCallback([this]()
+			{
+				otherWritesCommitPosted_ = false;
+				CommitOtherWrites();
+			});
+	}
+
+	void TioTcpServer::CommitOtherWrites()
+	{
+		unsigned int maxFlushDelay;
+
+		if(containerManager_.HasPendingFlush(&maxFlushDelay))
+			ScheduleFlush(maxFlushDelay);
+
+		if(containerManager_.HasPendingCommit() && !commitScheduled_)
+			CommitPendingWrites();
+	}
+
+	void TioTcpServer::ScheduleFlush(unsigned int maxDelay)
+	{
+		boost::posix_time::ptime flushTime = 
+			boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(maxDelay);
+
+		if(flushScheduled_ && flushTime_ <= flushTime)
+			return;
+
+		flushScheduled_ = true;
+		flushTime_ = flushTime;
+
+		//
+		// if there is a pending wait, it will be canceled
+		//
+		flushTimer_.expires_at(flushTime_);
+		flushTimer_.async_wait(
+			[this](const error_code& err)
+			{
+				OnFlushTimer(err);
+			});
+	}
+
+	void TioTcpServer::OnFlushTimer(const error_code& err)
+	{
+		if(err == asio::error::operation_aborted)
+			return;
+
+		flushScheduled_ = false;
+
+		containerManager_.Commit();
+	}
+
 	void TioTcpServer::OnClientFailed(shared_ptr<TioTcpSession> client, const error_code& err)
 	{
 		//
@@ -103,50 +210,47 @@ namespace tio
 		metaContainers_.sessions->Delete(lexical_cast<string>(client->id()), TIONULL, TIONULL);
 		
 
-#if 0
-		//
-		// remove all 'wait and pop next' references to this session
-		//
-		for(PoppersMap::iterator i = nextPoppers_.begin() ; i != nextPoppers_.end() ; ++i)
-		{
-			deque<PopperInfo> q = i->second;
-			size_t x = 0;
-
-			while(x != q.size())
-			{
-				if(q[x].session == client.get())
-					q.erase(q.begin() + x);
-				else
-					++x;
-			}
-		}
-#endif
 	}
 
 
 	TioTcpServer::TioTcpServer(ContainerManager& containerManager, 
 			asio::io_service& io_service, 
 			const tcp::endpoint& endpoint,
-			const std::string& logFilePath) :
+			const TRANSACTION_LOG_CONFIG& logConfig) :
 		containerManager_(containerManager),
 		acceptor_(io_service, endpoint),
 		io_service_(io_service),
 		lastSessionID_(0),
 		lastQueryID_(0),
-		serverPaused_(false)
+		serverPaused_(false),
+		lastCommandSampling_(0),
+		replicationSourceStarted_(false),
+		commitScheduled_(false),
+		otherWritesCommitPosted_(false),
+		flushTimer_(io_service),
+		flushScheduled_(false),
+		maintenanceTimer_(io_service)
 	{
 		LoadDispatchMap();
 		InitializeMetaContainers();
 
-		if(!logFilePath.empty())
+		containerManager_.SetOutsideWriteCallback(
+			[this]()
+			{
+				OnOutsideWrite();
+			});
+
+		if(!logConfig.filePath.empty())
 		{
-			string finalFilePath = logFilePath;
+			string finalFilePath = logConfig.filePath;
 
 			auto now = boost::posix_time::second_clock::local_time();
 
 			//
 			// Given c:\tio.log this will change it
-			// to something like c:\tio_20120526.log
+			// to something like c:\tio_20120526.log, or
+			// c:\tio_20120526_binary.log for binary logs, so
+			// restarting with another format doesn't mix them
 			//
 
 			std::string::reverse_iterator ri;
@@ -157,6 +261,9 @@ namespace tio
 				std::setw(2) << now.date().month() <<
 				std::setw(2) << now.date().day();
 
+			if(logConfig.binary)
+				dateString << "_binary";
+
 			ri = std::find(finalFilePath.rbegin(), finalFilePath.rend(), '.');
 
 			if(ri != finalFilePath.rend())
@@ -164,7 +271,7 @@ namespace tio
 			else
 				finalFilePath += dateString.str();
 
-			logger_.Start(finalFilePath);
+			logger_.Start(finalFilePath, logConfig);
 		}
 	}
 
@@ -195,6 +302,16 @@ namespace tio
 		metaContainers_.sessions = containerManager_.CreateContainer("volatile_map", "__meta__/sessions");
 
 		metaContainers_.sessionLastCommand = containerManager_.CreateContainer("volatile_map", "__meta__/session_last_command");
+
+		//
+		// storage counters, updated by maintenance timer
+		//
+		metaContainers_.storageStatistics = containerManager_.CreateContainer("volatile_map", "__meta__/storage_statistics");
+	}
+
+	void TioTcpServer::SetLastCommandSampling(unsigned int sampling)
+	{
+		lastCommandSampling_ = sampling;
 	}
 
 	Auth& TioTcpServer::GetAuth()
@@ -250,7 +367,10 @@ namespace tio
 		DoAccept();
 	}
 
-	shared_ptr<ITioContainer> TioTcpServer::GetContainerAndParametersFromRequest(const PR1_MESSAGE* message, shared_ptr<TioTcpSession> session, TioData* key, TioData* value, TioData* metadata)
+	//
+	// the container is owned by the session handle, the pointer is good while the command runs
+	//
+	ITioContainer* TioTcpServer::GetContainerAndParametersFromRequest(const PR1_MESSAGE* message, shared_ptr<TioTcpSession> session, TioData* key, TioData* value, TioData* metadata)
 	{
 		int handle;
 
@@ -259,7 +379,7 @@ namespace tio
 		if(!handle)
 			throw std::runtime_error("handle?");
 
-		return session->GetRegisteredContainer(handle);
+		return session->GetRegisteredContainer(handle).get();
 	}
 
 	
@@ -421,7 +541,7 @@ namespace tio
 				{
 					TioData searchKey;
 
-					shared_ptr<ITioContainer> container = GetContainerAndParametersFromRequest(message, session, &searchKey, NULL, NULL);
+					ITioContainer* container = GetContainerAndParametersFromRequest(message, session, &searchKey, NULL, NULL);
 
 					TioData key, value, metadata;
 
@@ -443,7 +563,7 @@ namespace tio
 				case TIO_COMMAND_POP_FRONT:
 				case TIO_COMMAND_POP_BACK:
 				{
-					shared_ptr<ITioContainer> container = GetContainerAndParametersFromRequest(message, session, NULL, NULL, NULL);
+					ITioContainer* container = GetContainerAndParametersFromRequest(message, session, NULL, NULL, NULL);
 
 					TioData key, value, metadata;
 
@@ -454,7 +574,7 @@ namespace tio
 					else
 						throw std::runtime_error("INTERNAL ERROR");
 
-					logger_.LogMessage(container.get(), message);
+					logger_.LogMessage(container, message);
 
 					session->SendBinaryAnswer(&key, &value, &metadata);
 				}
@@ -470,7 +590,7 @@ namespace tio
 				{
 					TioData key, value, metadata;
 
-					shared_ptr<ITioContainer> container = GetContainerAndParametersFromRequest(message, session, &key, &value, &metadata);
+					ITioContainer* container = GetContainerAndParametersFromRequest(message, session, &key, &value, &metadata);
 
 					if(command == TIO_COMMAND_PUSH_BACK)
 						container->PushBack(key, value, metadata);
@@ -494,7 +614,7 @@ namespace tio
 					else
 						throw std::runtime_error("INTERNAL ERROR");
 
-					logger_.LogMessage(container.get(), message);
+					logger_.LogMessage(container, message);
 
 					session->SendBinaryAnswer();
 				}
@@ -502,7 +622,7 @@ namespace tio
 
 				case TIO_COMMAND_COUNT:
 				{
-					shared_ptr<ITioContainer> container = GetContainerAndParametersFromRequest(message, session, NULL, NULL, NULL);
+					ITioContainer* container = GetContainerAndParametersFromRequest(message, session, NULL, NULL, NULL);
 
 					int count = container->GetRecordCount();
 
@@ -517,7 +637,7 @@ namespace tio
 					{
 						int start, end, maxRecords;
 
-						shared_ptr<ITioContainer> container = GetContainerAndParametersFromRequest(message, session, NULL, NULL, NULL);
+						ITioContainer* container = GetContainerAndParametersFromRequest(message, session, NULL, NULL, NULL);
 					
 						if(!Pr1MessageGetField(message, MESSAGE_FIELD_ID_START_RECORD, &start))
 							start = 0;
@@ -603,13 +723,7 @@ namespace tio
 
 						Pr1MessageGetField(message, MESSAGE_FIELD_ID_START_RECORD, &start);
 
-						b = groupManager_.SubscribeGroup(&containerManager_, groupName, session, start);
-
-						if(!b)
-						{
-							session->SendBinaryErrorAnswer(TIO_ERROR_NO_SUCH_OBJECT, "group not found");
-							break;
-						}
+						SubscribeGroup(groupName, session, start);
 					}
 					break;
 
@@ -707,7 +821,12 @@ namespace tio
 			MakeAnswer(error, answer, "invalid command");
 		}
 
-		if(*moreDataSize == 0)
+		if(*moreDataSize != 0)
+			return;
+
+		session->RecordCommand(cmd);
+
+		if(lastCommandSampling_ && session->GetCommandCount() % lastCommandSampling_ == 0)
 		{
 			metaContainers_.sessionLastCommand->Set(
 				lexical_cast<string>(session->id()),
@@ -760,6 +879,7 @@ namespace tio
 
 		dispatchMap_["subscribe"] = &TioTcpServer::OnCommand_SubscribeUnsubscribe;
 		dispatchMap_["unsubscribe"] = &TioTcpServer::OnCommand_SubscribeUnsubscribe;
+		dispatchMap_["journal_subscribe"] = &TioTcpServer::OnCommand_JournalSubscribe;
 
 		dispatchMap_["command"] = &TioTcpServer::OnCommand_CustomCommand;
 		
@@ -768,6 +888,8 @@ namespace tio
 		dispatchMap_["pause"] = &TioTcpServer::OnCommand_PauseResume;
 		dispatchMap_["resume"] = &TioTcpServer::OnCommand_PauseResume;
 
+		dispatchMap_["last_commands"] = &TioTcpServer::OnCommand_LastCommands;
+
 		dispatchMap_["set_permission"] = &TioTcpServer::OnCommand_SetPermission;
 
 		dispatchMap_["query"] = &TioTcpServer::OnCommand_Query;
@@ -1066,7 +1188,7 @@ namespace tio
 
 		try
 		{
-			groupManager_.SubscribeGroup(&containerManager_, groupName, session, start);
+			SubscribeGroup(groupName, session, start);
 		}
 		catch (std::exception& ex)
 		{
@@ -1344,66 +1466,6 @@ namespace tio
 		}
 		
 		MakeAnswer(success, answer);
-
-		return;
-
-		/*
-		bool popped = false;
-
-		{
-			tio::recursive_mutex::scoped_lock lock(nextPoppersMutex_);
-
-			deque<NextPopperInfo>& q = nextPoppers_[GetFullQualifiedName(container)];
-
-			//
-			// if there are other poppers (or no data), will go to the queue
-			//
-			if(q.size() || container->GetRecordCount() == 0)
-			{
-				q.push_back(NextPopperInfo(session, handle));
-				popped = false;
-			}
-			else
-				popped = true;
-		}
-
-		if(!popped)
-		{
-			MakeAnswer(success, answer);
-			return;
-		}
-		
-		TioData key, value, metadata;
-		
-		//
-		// We checked container for records before, but now we're multithreaded baby, 
-		// maybe the records are gone by now.
-		//
-		try
-		{
-			container->PopFront(&key, &value, &metadata);
-			popped = true;
-
-		}
-		catch(std::exception&)
-		{
-			//
-			// Not able to pop. Send to the queue
-			// 
-			tio::recursive_mutex::scoped_lock lock(nextPoppersMutex_);
-			nextPoppers_[GetFullQualifiedName(container)].push_back(NextPopperInfo(session, handle));
-
-			popped = false;
-		}
-
-		//
-		// send answer before the event
-		//
-		MakeAnswer(success, answer);
-
-		if(popped)
-			MakeEventAnswer("wnp_next", handle, key, value, metadata, answer);
-		*/
 	}
 
 
@@ -1412,7 +1474,7 @@ namespace tio
 		try
 		{
 			string containerName, containerType;
-			shared_ptr<ITioContainer> container;
+			ITioContainer* container = NULL;
 			TioData key, value, metadata;
 			unsigned int handle;
 
@@ -1439,67 +1501,9 @@ namespace tio
 				return;
 			}
 
-			string fullQualifiedName = GetFullQualifiedName(container);
-			bool popNow = false;
-
-			{
-				tio::recursive_mutex::scoped_lock lock(keyPoppersPerContainerMutex_);
-				
-				KeyPoppersPerContainerMap::iterator i = keyPoppersPerContainer_.find(fullQualifiedName);
-
-				if(i == keyPoppersPerContainer_.end() || i->second.size() == 0)
-				{
-					//
-					// no... let's see if the wanted key is here
-					//
-				
-					try
-					{
-						//
-						// I tried to avoid accessing a container inside a lock, but I must
-						// hold the lock on the situation
-						// 
-						container->GetRecord(key, NULL, &value, &metadata);
-						popNow = true;
-					}
-					catch (std::invalid_argument)
-					{
-						popNow = false;			
-					}
-				}
-			}
-				
-			if(popNow)	
-			{
-				//
-				// send answer before the event
-				//
-				MakeAnswer(success, answer);
-
-				try
-				{
-					container->Delete(key);
-				}
-				catch(std::exception&)
-				{
-					// if the record was delete meanwhile, it's not a problem
-				}
-
-				MakeEventAnswer("wnp_key", handle, key, value, metadata, answer);
-			}
-			else
-			{
-				//
-				// there are other pops waiting. He'll need to stay in the queue and pray
-				//
-				string keyAsString = key.AsSz();
-				{
-					tio::recursive_mutex::scoped_lock lock(keyPoppersPerContainerMutex_);
-					keyPoppersPerContainer_[fullQualifiedName][keyAsString].push_back(KeyPopperInfo(session, handle, keyAsString));
-				}
+			session->WaitAndPopKey(handle, key);
 
-				MakeAnswer(success, answer);
-			}
+			MakeAnswer(success, answer);
 		}
 		catch (std::exception& e)
 		{
@@ -1516,14 +1520,14 @@ namespace tio
 			return;
 		}
 
-		shared_ptr<ITioContainer> container;
+		ITioContainer* container;
 
 		try
 		{
 			unsigned int handle;
 
 			handle = lexical_cast<unsigned int>(cmd.GetParameters()[0]);
-			container = session->GetRegisteredContainer(handle);
+			container = session->GetRegisteredContainer(handle).get();
 		}
 		catch(std::exception&)
 		{
@@ -1538,7 +1542,17 @@ namespace tio
 
 		command.erase(command.end() - 1);
 
-		string result = container->Command(command);
+		string result;
+
+		try
+		{
+			result = container->Command(command);
+		}
+		catch(std::exception& ex)
+		{
+			MakeAnswer(error, answer, ex.what());
+			return;
+		}
 
 		MakeAnswer(success, answer, result);
 
@@ -1553,14 +1567,14 @@ namespace tio
 			return;
 		}
 
-		shared_ptr<ITioContainer> container;
+		ITioContainer* container;
 
 		try
 		{
 			unsigned int handle;
 
 			handle = lexical_cast<unsigned int>(cmd.GetParameters()[0]);
-			container = session->GetRegisteredContainer(handle);
+			container = session->GetRegisteredContainer(handle).get();
 		}
 		catch(std::exception&)
 		{
@@ -1568,7 +1582,15 @@ namespace tio
 			return;
 		}
 
-		container->Clear();
+		try
+		{
+			container->Clear();
+		}
+		catch(std::exception& ex)
+		{
+			MakeAnswer(error, answer, ex.what());
+			return;
+		}
 
 		MakeAnswer(success, answer);
 	}
@@ -1582,14 +1604,14 @@ namespace tio
 			return;
 		}
 	
-		shared_ptr<ITioContainer> container;
+		ITioContainer* container;
 
 		try
 		{
 			unsigned int handle;
 
 			handle = lexical_cast<unsigned int>(cmd.GetParameters()[0]);
-			container = session->GetRegisteredContainer(handle);
+			container = session->GetRegisteredContainer(handle).get();
 		}
 		catch(std::exception&)
 		{
@@ -1625,11 +1647,7 @@ namespace tio
 
 		try
 		{
-			string containerName, containerType;
-
-			session->GetRegisteredContainer(handle, &containerName, &containerType);
-
-			if(!CheckObjectAccess(containerType, containerName, cmd.GetCommand(), answer, session))
+			if(!CheckHandleAccess(handle, cmd.GetCommand(), answer, session))
 				return;
 
 			string start;
@@ -1670,6 +1688,61 @@ namespace tio
 		}	
 	}
 
+	void TioTcpServer::OnCommand_JournalSubscribe(Command& cmd, ostream& answer, size_t* moreDataSize, shared_ptr<TioTcpSession> session)
+	{
+		//
+		// journal_subscribe handle [last_sequence]
+		//
+		// Events come with a sequence field. Sending the last sequence
+		// received resumes the subscription from there, if the container
+		// journal still has it. Otherwise the client gets a clear and the
+		// full snapshot. Use unsubscribe to cancel
+		//
+		if(!CheckParameterCount(cmd, 1, exact) && !CheckParameterCount(cmd, 2, exact))
+		{
+			MakeAnswer(error, answer, "invalid parameter count");
+			return;
+		}
+
+		unsigned int handle;
+		unsigned long long lastSequence = 0;
+
+		try
+		{
+			handle = lexical_cast<unsigned int>(cmd.GetParameters()[0]);
+
+			if(cmd.GetParameters().size() == 2)
+				lastSequence = lexical_cast<unsigned long long>(cmd.GetParameters()[1]);
+		}
+		catch(boost::bad_lexical_cast&)
+		{
+			MakeAnswer(error, answer, "invalid parameter");
+			return;
+		}
+
+		try
+		{
+			string containerName;
+
+			shared_ptr<ITioContainer> container = session->GetRegisteredContainer(handle, &containerName);
+
+			if(!CheckHandleAccess(handle, cmd.GetCommand(), answer, session))
+				return;
+
+			containerManager_.KeepOpen(containerName, container);
+
+			//
+			// session will send the answer
+			//
+			session->JournalSubscribe(handle, lastSequence);
+		}
+		catch (std::exception& e)
+		{
+			MakeAnswer(error, answer, e.what());
+			return;
+		}	
+	}
+
 	void TioTcpServer::OnCommand_Ping(Command& cmd, ostream& answer, size_t* moreDataSize, shared_ptr<TioTcpSession> session)
 	{
 		MakeAnswer(cmd.GetParameters().begin(), cmd.GetParameters().end(), success, answer, "pong");
@@ -1689,6 +1762,30 @@ namespace tio
 		return false;
 	}
 
+	bool TioTcpServer::CheckHandleAccess(unsigned int handle, const string& command, ostream& answer, shared_ptr<TioTcpSession> session)
+	{
+		unsigned int authGeneration = auth_.GetGeneration();
+		bool allowed;
+
+		if(!session->GetCachedAccess(handle, authGeneration, &allowed))
+		{
+			string containerName, containerType;
+
+			session->GetRegisteredContainer(handle, &containerName, &containerType);
+
+			allowed = auth_.CheckObjectAccess(containerType, containerName, command, session->GetTokens()) == Auth::allow;
+
+			if(!auth_.HasCommandRules(containerType, containerName))
+				session->SetCachedAccess(handle, authGeneration, allowed);
+		}
+
+		if(allowed)
+			return true;
+
+		MakeAnswer(error, answer, "access denied");
+		return false;
+	}
+
 	bool TioTcpServer::CheckObjectAccess(const string& objectType, const string& objectName, const string& command, ostream& answer, shared_ptr<TioTcpSession> session)
 	{
 		if(auth_.CheckObjectAccess(objectType, objectName, command, session->GetTokens()) == Auth::allow)
@@ -1804,6 +1901,62 @@ namespace tio
 
 	}
 
+	void TioTcpServer::OnCommand_LastCommands(Command& cmd, ostream& answer, size_t* moreDataSize, shared_ptr<TioTcpSession> session)
+	{
+		//
+		// last_commands [session_id]
+		//
+		// Answers the last commands a session sent, oldest first, one per line.
+		// Without session id, the current session
+		//
+		if(!CheckParameterCount(cmd, 0, exact) && !CheckParameterCount(cmd, 1, exact))
+		{
+			MakeAnswer(error, answer, "invalid parameter count");
+			return;
+		}
+
+		shared_ptr<TioTcpSession> target = session;
+
+		if(cmd.GetParameters().size() == 1)
+		{
+			unsigned int sessionId;
+
+			try
+			{
+				sessionId = lexical_cast<unsigned int>(cmd.GetParameters()[0]);
+			}
+			catch(boost::bad_lexical_cast&)
+			{
+				MakeAnswer(error, answer, "invalid session id");
+				return;
+			}
+
+			if(!CheckCommandAccess(cmd.GetCommand(), answer, session))
+				return;
+
+			target.reset();
+
+			tio::recursive_mutex::scoped_lock lock(sessionsMutex_);
+
+			for(auto i = sessions_.begin() ; i != sessions_.end() ; ++i)
+			{
+				if((*i)->id() == sessionId)
+				{
+					target = *i;
+					break;
+				}
+			}
+
+			if(!target)
+			{
+				MakeAnswer(error, answer, "no such session");
+				return;
+			}
+		}
+
+		MakeDataAnswer(TioData(static_cast<int>(target->id())), TioData(target->GetLastCommands()), TIONULL, answer);
+	}
+
 	void TioTcpServer::OnCommand_Auth(Command& cmd, ostream& answer, size_t* moreDataSize, shared_ptr<TioTcpSession> session)
 	{
 		if(!CheckParameterCount(cmd, 3, exact))
@@ -1879,6 +2032,9 @@ namespace tio
 		// create name type [params]
 		// open name [type] [params]
 		//
+		// create params are property=value pairs, they will be
+		// set as container properties. Ex: create x persistent_map durability=sync
+		//
 		if(!CheckParameterCount(cmd, 1, at_least))
 		{
 			MakeAnswer(error, answer, "invalid parameter count");
@@ -1909,7 +2065,32 @@ namespace tio
 				if(!CheckCommandAccess(cmd.GetCommand(), answer, session))
 					return;
 
+				//
+				// every parameter is checked before creating, so a bad
+				// one doesn't leave a container created with defaults
+				//
+				vector< pair<string, string> > properties;
+
+				for(size_t a = 2 ; a < cmd.GetParameters().size() ; a++)
+				{
+					const string& param = cmd.GetParameters()[a];
+					string::size_type separator = param.find('=');
+
+					if(separator == string::npos || separator == 0)
+					{
+						MakeAnswer(error, answer, "invalid create parameter, should be property=value");
+						return;
+					}
+
+					properties.push_back(make_pair(param.substr(0, separator), param.substr(separator + 1)));
+
+					containerManager_.CheckProperty(containerType, properties.back().first, properties.back().second);
+				}
+
 				container = containerManager_.CreateContainer(containerType, containerName);
+
+				for(vector< pair<string, string> >::const_iterator i = properties.begin() ; i != properties.end() ; ++i)
+					container->SetProperty(i->first, i->second);
 			}
 			else
 			{
@@ -2046,7 +2227,7 @@ namespace tio
 		Command& cmd, 
 		string* containerType,
 		string* containerName,
-		shared_ptr<ITioContainer>* container,
+		ITioContainer** container,
 		TioData* key, 
 		TioData* value, 
 		TioData* metadata,
@@ -2063,7 +2244,7 @@ namespace tio
 			unsigned int h;
 
 			h = lexical_cast<unsigned int>(cmd.GetParameters()[0]);
-			*container = session->GetRegisteredContainer(h, containerName, containerType);
+			*container = session->GetRegisteredContainer(h, containerName, containerType).get();
 
 			if(handle)
 				*handle = h;
@@ -2099,15 +2280,11 @@ namespace tio
 
 			BOOST_ASSERT(cmd.GetCommand() == "pop_back" || cmd.GetCommand() == "pop_front");
 
-			string containerName, containerType;
+			unsigned int handle = lexical_cast<unsigned int>(cmd.GetParameters()[0]);
 
-			shared_ptr<ITioContainer> container = 
-				session->GetRegisteredContainer(
-					lexical_cast<unsigned int>(cmd.GetParameters()[0]), 
-					&containerName, 
-					&containerType);
+			const shared_ptr<ITioContainer>& container = session->GetRegisteredContainer(handle);
 			
-			if(!CheckObjectAccess(containerType, containerName, cmd.GetCommand(), answer, session))
+			if(!CheckHandleAccess(handle, cmd.GetCommand(), answer, session))
 				return;
 
 			TioData key, value, metadata;
@@ -2131,21 +2308,22 @@ namespace tio
 	{
 		try
 		{
-			string containerName, containerType;
-			shared_ptr<ITioContainer> container;
+			ITioContainer* container = NULL;
 			TioData key, value, metadata;
+			unsigned int handle;
 
 			size_t dataSize = ParseDataCommand(
 				cmd,
-				&containerType,
-				&containerName,
+				NULL,
+				NULL,
 				&container,
 				&key,
 				&value,
 				&metadata, 
-				session);
+				session,
+				&handle);
 
-			if(!CheckObjectAccess(containerType, containerName, cmd.GetCommand(), answer, session))
+			if(!CheckHandleAccess(handle, cmd.GetCommand(), answer, session))
 				return;
 
 			if(dataSize != 0)
@@ -2208,144 +2386,26 @@ namespace tio
 		return;
 	}	
 
-	void TioTcpServer::HandleKeyValueWaitAndPop(shared_ptr<ITioContainer> container, 
-		const TioData& key, const TioData& value, const TioData& metadata)
-	{
-		//
-		// we support wait and pop just for string keys
-		//
-		if(key.GetDataType() != TioData::String)
-			return;
-
-		{
-			//
-			// TODO: find a way to not hold this lock for so long
-			// 
-			tio::recursive_mutex::scoped_lock lock(keyPoppersPerContainerMutex_);
-			//
-			// support for "wait and pop key" (wnp_key)
-			//
-			KeyPoppersPerContainerMap::iterator i = keyPoppersPerContainer_.find(GetFullQualifiedName(container));
-
-			if(i == keyPoppersPerContainer_.end())
-				return;
-
-			//
-			// anyone waiting for this key?
-			//
-			KeyPoppersByKey& thisKeyPoppers = i->second;
-			KeyPoppersByKey::iterator iByKey = thisKeyPoppers.find(key.AsSz());
-
-			//
-			// anyone waiting to pop?
-			//
-			if(iByKey != thisKeyPoppers.end() && !iByKey->second.empty())
-			{
-				deque<KeyPopperInfo>& q = iByKey->second;
-
-				//
-				// find first popper still alive
-				//
-				bool pop = false;
-
-				while(!q.empty())
-				{
-					KeyPopperInfo popper = q.front(); // not a reference because we'll pop right now
-					q.pop_front();
-
-					if(popper.session.expired())
-						continue;
-
-					stringstream eventStream;
-
-					MakeEventAnswer("wnp_key", popper.handle, key, value, metadata, eventStream);
-
-					popper.session.lock()->SendAnswer(eventStream);
-
-					pop = true;
-					break;
-				}
-
-				if(q.empty())
-					thisKeyPoppers.erase(iByKey);
-
-				if(pop)
-					container->Delete(key);
-			}
-		}
-	}
-
-	void TioTcpServer::HandlePushBackWaitAndPop(
-		shared_ptr<ITioContainer> container, 
-		const TioData& key, 
-		const TioData& value, 
-		const TioData& metadata)
-	{
-		//
-		// TODO: BIGLOCK
-		// 
-		tio::recursive_mutex::scoped_lock lock(nextPoppersMutex_);
-
-		NextPoppersMap::iterator i = nextPoppers_.find(GetFullQualifiedName(container));
-
-		//
-		// anyone waiting to pop?
-		//
-		if(i == nextPoppers_.end() || i->second.empty())
-			return;
-		
-		deque<NextPopperInfo>& q = i->second;
-
-		//
-		// find first popper still alive
-		//
-		bool pop = false;
-
-		while(!q.empty())
-		{
-			NextPopperInfo popper = q.front(); // not a reference because we'll pop right now
-			q.pop_front();
-
-			if(popper.session.expired())
-				continue;
-
-			stringstream eventStream;
-
-			MakeEventAnswer("wnp_next", popper.handle, key, value, metadata, eventStream);
-
-			popper.session.lock()->SendAnswer(eventStream);
-
-			pop = true;
-			break;
-		}
-
-		if(q.empty())
-			nextPoppers_.erase(i);
-
-		if(pop)
-			container->PopFront(NULL, NULL, NULL);
-	}
-		
-
 	void TioTcpServer::OnAnyDataCommand(Command& cmd, ostream& answer, size_t* moreDataSize, shared_ptr<TioTcpSession> session)
 	{
 		try
 		{
-			string containerName, containerType;
-			shared_ptr<ITioContainer> container;
+			ITioContainer* container = NULL;
 			TioData key, value, metadata;
+			unsigned int handle;
 
 			size_t dataSize = ParseDataCommand(
 				cmd,
-				&containerType,
-				&containerName,
+				NULL,
+				NULL,
 				&container,
 				&key,
 				&value,
 				&metadata, 
-				session);
+				session,
+				&handle);
 
-			if(!CheckObjectAccess(containerType, containerName, cmd.GetCommand(), answer, session))
+			if(!CheckHandleAccess(handle, cmd.GetCommand(), answer, session))
 				return;
 
 			if(dataSize != 0)
@@ -2355,32 +2415,11 @@ namespace tio
 			}
 		
 			if(cmd.GetCommand() == "insert")
-			{
 				container->Insert(key, value, metadata);
-				MakeAnswer(success, answer);
-
-				HandleKeyValueWaitAndPop(container, key, value, metadata);
-
-				//
-				// we already sent the answer, so, time to return
-				//
-				return;
-			}
 
 			else if(cmd.GetCommand() == "set")
-			{
 				container->Set(key, value, metadata);
 
-				MakeAnswer(success, answer);
-				
-				HandleKeyValueWaitAndPop(container, key, value, metadata);
-
-				//
-				// we already sent the answer, so, time to return
-				//
-				return;
-			}
-
 			else if(cmd.GetCommand() == "pop_back")
 			{
 				container->PopBack(&key, &value, &metadata);
@@ -2400,19 +2439,8 @@ namespace tio
 			}
 
 			else if(cmd.GetCommand() == "push_back")
-			{
 				container->PushBack(key, value, metadata);
 
-				MakeAnswer(success, answer);
-
-				HandlePushBackWaitAndPop(container, key, value, metadata);
-
-				//
-				// we already sent the answer, so, time to return
-				//
-				return;
-			}
-
 			else if(cmd.GetCommand() == "push_front")
 				container->PushFront(key, value, metadata);
 
@@ -2431,15 +2459,16 @@ namespace tio
 
 			else if(cmd.GetCommand() == "set_property")
 			{
-				try
-				{
-					container->SetProperty(key.AsSz(), value.AsSz());
-				}
-				catch (std::exception&)
+				if(key.GetDataType() != TioData::String || value.GetDataType() != TioData::String)
 				{
 					MakeAnswer(error, answer, "key and value must be strings");
 					return;
-				}	
+				}
+
+				//
+				// storage errors (like a refused property) go to the client as they are
+				//
+				container->SetProperty(key.AsSz(), value.AsSz());
 			}
 
 			else if(cmd.GetCommand() == "get_property")
@@ -2471,9 +2500,139 @@ namespace tio
 		MakeAnswer(success, answer);
 	}
 	
+	TioTcpServer::~TioTcpServer()
+	{
+		containerManager_.SetOutsideWriteCallback(function<void()>());
+	}
+
 	void TioTcpServer::Start()
 	{
 		DoAccept();
+		ScheduleMaintenance();
+	}
+
+	void TioTcpServer::ScheduleMaintenance()
+	{
+		maintenanceTimer_.expires_from_now(boost::posix_time::seconds(1));
+		maintenanceTimer_.async_wait(
+			[this](const error_code& err)
+			{
+				if(err)
+					return;
+
+				containerManager_.DoMaintenance();
+
+				CommitOtherWrites();
+
+				UpdateStorageStatistics();
+
+				if(replicationSourceStarted_)
+					UpdateReplicationHeartbeat();
+
+				ScheduleMaintenance();
+			});
+	}
+
+	void TioTcpServer::UpdateStorageStatistics()
+	{
+		std::map<string, string> statistics;
+
+		containerManager_.GetStatistics(&statistics);
+
+		//
+		// only changed values, so subscribers aren't flooded every second
+		//
+		for(std::map<string, string>::const_iterator i = statistics.begin() ; i != statistics.end() ; ++i)
+		{
+			string& last = lastStorageStatistics_[i->first];
+
+			if(last == i->second)
+				continue;
+
+			metaContainers_.storageStatistics->Set(i->first, i->second, TIONULL);
+			last = i->second;
+		}
+	}
+
+	void TioTcpServer::SubscribeGroup(const string& groupName, shared_ptr<TioTcpSession> session, const string& start)
+	{
+		if(groupName == TIO_REPLICATION_GROUP)
+			StartReplicationSource();
+
+		groupManager_.SubscribeGroup(&containerManager_, groupName, session, start);
+	}
+
+	void TioTcpServer::StartReplicationSource()
+	{
+		if(replicationSourceStarted_)
+			return;
+
+		replicationSourceStarted_ = true;
+
+		std::cout << "replication primary started" << std::endl;
+
+		metaContainers_.replicationHeartbeat = containerManager_.CreateContainer("volatile_map", TIO_REPLICATION_HEARTBEAT);
+		UpdateReplicationHeartbeat();
+
+		groupManager_.AddContainer(&containerManager_, TIO_REPLICATION_GROUP, metaContainers_.replicationHeartbeat);
+
+		//
+		// snapshot gives us the existing containers, and we'll be
+		// notified about the new ones
+		//
+		shared_ptr<ITioContainer> containers = containerManager_.OpenContainer("volatile_map", "__meta__/containers");
+
+		containers->Subscribe(
+			[this](const string& eventName, const TioData& key, const TioData& value, const TioData& metadata)
+			{
+				OnReplicationContainersEvent(eventName, key, value);
+			},
+			"0");
+	}
+
+	void TioTcpServer::OnReplicationContainersEvent(const string& eventName, const TioData& key, const TioData& value)
+	{
+		if(key.GetDataType() != TioData::String)
+			return;
+
+		string containerName = key.AsSz();
+
+		if(boost::starts_with(containerName, "__meta__/"))
+			return;
+
+		//
+		// __meta__/containers is changed while the container is being created, so
+		// we'll only open it after the current command is done
+		//
+		if(eventName == "set" && value.GetDataType() == TioData::String)
+		{
+			string containerType = value.AsSz();
+
+			PostCallback([this, containerName, containerType]()
+				{
+					try
+					{
+						shared_ptr<ITioContainer> container = containerManager_.OpenContainer(containerType, containerName);
+						groupManager_.AddContainer(&containerManager_, TIO_REPLICATION_GROUP, container);
+					}
+					catch(std::exception& ex)
+					{
+						std::cout << "error replicating container \"" << containerName << "\": " << ex.what() << std::endl;
+					}
+				});
+		}
+		else if(eventName == "delete")
+		{
+			PostCallback([this, containerName]()
+				{
+					groupManager_.RemoveContainer(TIO_REPLICATION_GROUP, containerName);
+				});
+		}
+	}
+
+	void TioTcpServer::UpdateReplicationHeartbeat()
+	{
+		metaContainers_.replicationHeartbeat->Set("time", lexical_cast<string>(GetReplicationTimestamp()), TIONULL);
 	}
 
 	string TioTcpServer::GetFullQualifiedName(shared_ptr<ITioContainer> container)
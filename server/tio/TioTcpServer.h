@@ -24,6 +24,8 @@ Copyright 2010 Rodrigo Strauss (http://www.1bit.com.br)
 #include "TioTcpSession.h"
 #include "auth.h"
 #include "logdb.h"
+#include "TioBinaryLog.h"
+#include "TioReplication.h"
 
 namespace tio
 {
@@ -48,11 +50,20 @@ namespace tio
 			weak_ptr<TioTcpSession> session;
 			string start;
 
-			SubscriberInfo(){}
+			//
+			// While the subscription is still sending the containers that
+			// were in the group when it started, this is the name of the
+			// last one sent. Containers added after it will be sent anyway
+			//
+			bool catchingUp;
+			string lastSent;
+
+			SubscriberInfo() : catchingUp(false) {}
 
 			SubscriberInfo(shared_ptr<TioTcpSession> session, string start)
 				: session(session)
 				, start(start)
+				, catchingUp(true)
 			{
 			}
 		};
@@ -68,6 +79,12 @@ namespace tio
 
 			map<unsigned, SubscriberInfo> subscribers_;
 
+			//
+			// max containers sent to a subscriber before giving
+			// the io thread back to other sessions
+			//
+			static const int SUBSCRIPTION_BATCH_SIZE = 100;
+
 			void SendNewContainerToSubscriber(const shared_ptr<ITioContainer> container, const shared_ptr<TioTcpSession>& session, const string& start)
 			{
 				if(!session->IsValid())
@@ -78,8 +95,6 @@ namespace tio
 
 				if(session->UsesBinaryProtocol())
 				{
-					unsigned handle = session->RegisterContainer(containerName, container);
-
 					auto answer = Pr1CreateMessage();
 
 					Pr1MessageAddField(answer.get(), MESSAGE_FIELD_ID_COMMAND, TIO_COMMAND_NEW_GROUP_CONTAINER);
@@ -109,6 +124,62 @@ namespace tio
 				}
 			}
 
+			//
+			// Sends the containers the subscriber didn't get yet, a batch at a time.
+			// It stops when the session has too much data to send and continues when
+			// the client reads it, so a huge group doesn't hold the io thread
+			// neither fills the session memory
+			//
+			void DoPendingSubscriptions(const shared_ptr<TioTcpSession>& session)
+			{
+				BOOST_ASSERT(valid_);
+
+				auto subscriber = subscribers_.find(session->id());
+
+				if(subscriber == subscribers_.end() || !session->IsValid())
+					return;
+
+				SubscriberInfo& subscriberInfo = subscriber->second;
+
+				if(!subscriberInfo.catchingUp || subscriberInfo.session.lock() != session)
+					return;
+
+				auto i = subscriberInfo.lastSent.empty() ? 
+					containers_.begin() : 
+					containers_.upper_bound(subscriberInfo.lastSent);
+
+				for(int howMany = 0 ; i != containers_.end() ; ++i, ++howMany)
+				{
+					if(session->IsPendingSendSizeTooBig())
+					{
+						session->RegisterLowPendingBytesCallback(
+							[this](const shared_ptr<TioTcpSession>& session)
+							{
+								this->DoPendingSubscriptions(session);
+							});
+
+						return;
+					}
+
+					if(howMany == SUBSCRIPTION_BATCH_SIZE)
+					{
+						session->PostCallback(
+							[this](const shared_ptr<TioTcpSession>& session)
+							{
+								this->DoPendingSubscriptions(session);
+							});
+
+						return;
+					}
+
+					subscriberInfo.lastSent = i->first;
+					SendNewContainerToSubscriber(i->second, session, subscriberInfo.start);
+				}
+
+				subscriberInfo.catchingUp = false;
+				subscriberInfo.lastSent.clear();
+			}
+
 		public:
 
 			GroupInfo(ContainerManager* containerManager, const string& name)
@@ -132,6 +203,7 @@ namespace tio
 				std::swap(containerListContainer_, rhv.containerListContainer_);
 				std::swap(containers_, rhv.containers_);
 				std::swap(subscribers_, rhv.subscribers_);
+				valid_ = true;
 			}
 
 			void AddContainer(shared_ptr<ITioContainer> container)
@@ -151,12 +223,32 @@ namespace tio
 						continue;
 
 					//
-					// TODO: respect start parameter, we need to save this with session ptr
+					// DoPendingSubscriptions didn't get there yet, it will send it
 					//
+					if(subscriberInfo.catchingUp && 
+						(subscriberInfo.lastSent.empty() || container->GetName() > subscriberInfo.lastSent))
+						continue;
+
 					SendNewContainerToSubscriber(container, session, subscriberInfo.start);
 				}
 			}
 
+			//
+			// sessions already subscribed will keep receiving its events
+			//
+			bool RemoveContainer(const string& containerName)
+			{
+				ContainersMap::iterator i = containers_.find(containerName);
+
+				if(i == containers_.end())
+					return false;
+
+				containers_.erase(i);
+				containerListContainer_->Delete(containerName, TIONULL, TIONULL);
+
+				return true;
+			}
+
 			void Subscribe(const shared_ptr<TioTcpSession>& session, const string& start)
 			{
 				session->RegisterContainer(containerListName_, containerListContainer_);
@@ -170,52 +262,10 @@ namespace tio
 					session->SendAnswer("answer ok\r\n");
 				}
 
-				for(auto i = containers_.begin() ; i != containers_.end() ; ++i)
-				{
-					SendNewContainerToSubscriber(i->second, session, start);
-				}
-
 				subscribers_[session->id()] = SubscriberInfo(session, start);
-			}
-
-			/*
-			void DoPendingSubscriptions(const shared_ptr<TioTcpSession>& session, ContainersMap::const_iterator i, const string& start)
-			{
-				if(i == containers_.begin())
-					std::cout << "DoPendingSubscriptions start, " << containers_.size() << " containers" << std::endl; 
-
-				Timer timer;
-				timer.Start();
-				int howMany = 0;
-
-				for( ; i != containers_.end() ; ++i)
-				{
-					SendNewContainerToSubscriber(i->second, session, start);
-					howMany++;
-
-					if(session->IsPendingSendSizeTooBig())
-					{
-						session->RegisterLowPendingBytesCallback(
-							[this, i, start](const shared_ptr<TioTcpSession>& session)
-							{
-								BOOST_ASSERT(valid_);
-								// don't know why, but ++i triggers a const error...
-								auto i2 = i;
-								++i2;
-								this->DoPendingSubscriptions(session, i2, start);
-							});
 
-						return;
-					}
-				}
-
-				long long elapsedMicro = timer.ElapsedInMicroseconds();
-				long long elapsedInSeconds = elapsedMicro / (1000 * 1000);
-				double persec = (containers_.size() * 1000 * 1000) / static_cast<double>(elapsedMicro);
-
-				std::cout << howMany << " snapshots, " << elapsedInSeconds << " seconds, " << persec << " snapshots per second" << std::endl;
+				DoPendingSubscriptions(session);
 			}
-			*/
 		};
 
 		typedef map<string, GroupInfo> GroupMap;
@@ -240,7 +290,12 @@ namespace tio
 
 		bool RemoveContainer(const string& groupName, const string& containerName)
 		{
-			return false;
+			auto i = groups_.find(groupName);
+
+			if(i == groups_.end())
+				return false;
+
+			return i->second.RemoveContainer(containerName);
 		}
 		
 		bool SubscribeGroup(ContainerManager* containerManager, const string& groupName, const shared_ptr<TioTcpSession>& session, const string& start)
@@ -251,15 +306,231 @@ namespace tio
 	};
 
 
+	struct TRANSACTION_LOG_CONFIG
+	{
+		//
+		// empty if there is no transaction log
+		//
+		string filePath;
+
+		//
+		// milliseconds between writes
+		//
+		unsigned int flushInterval;
+
+		//
+		// TioBinaryLog.h format instead of text
+		//
+		bool binary;
+
+		TRANSACTION_LOG_CONFIG() :
+			flushInterval(100),
+			binary(false)
+		{
+		}
+	};
+
+	//
+	// Transaction log. Records are formatted on the io thread and handed to
+	// a writer thread through a lock free queue. The writer wakes every flush
+	// interval and writes everything pending with a single write and sync
+	//
 	class BinaryProtocolLogger
 	{
+		struct LOG_RECORD
+		{
+			LOG_RECORD* next;
+			string line;
+		};
+
 		map<string, unsigned> globalContainerHandle_;
 		int lastGlobalHandle_;
 		logdb::File f_;
+		string fileName_;
+		unsigned int flushInterval_;
+		bool binary_;
+
+		//
+		// writer thread only. Errors are reported when writes
+		// start failing and when they work again
+		//
+		bool writeFailed_;
+
+		//
+		// multiple producers, single consumer. Producers push on the head,
+		// the writer takes the whole list at once and reverses it
+		//
+		std::atomic<LOG_RECORD*> pending_;
+
+		boost::thread writerThread_;
+		boost::mutex stopMutex_;
+		boost::condition_variable stopCondition_;
+		bool stop_;
+
+		void RawLog(string& what)
+		{
+			LOG_RECORD* record = new LOG_RECORD();
+			record->line.swap(what);
+			record->next = pending_.load(std::memory_order_relaxed);
+
+			while(!pending_.compare_exchange_weak(record->next, record, std::memory_order_release, std::memory_order_relaxed))
+				;
+		}
+
+		void WritePending()
+		{
+			LOG_RECORD* records = pending_.exchange(NULL, std::memory_order_acquire);
+			LOG_RECORD* ordered = NULL;
+
+			//
+			// nothing was written, nothing to sync
+			//
+			if(!records)
+				return;
+
+			while(records)
+			{
+				LOG_RECORD* next = records->next;
+				records->next = ordered;
+				ordered = records;
+				records = next;
+			}
+
+			string buffer;
+			bool failed = false;
+
+			while(ordered)
+			{
+				LOG_RECORD* next = ordered->next;
+				buffer.append(ordered->line);
+				delete ordered;
+				ordered = next;
+
+				if(buffer.size() >= 4 * 1024 * 1024 || (!ordered && !buffer.empty()))
+				{
+					if(f_.Write(buffer.c_str(), static_cast<DWORD>(buffer.size())) != buffer.size())
+						failed = true;
+
+					buffer.clear();
+				}
+			}
+
+			f_.Sync();
+
+			if(failed && !writeFailed_)
+				std::cout << "error writing transaction log " << fileName_ << ", records are being lost" << std::endl;
+			else if(!failed && writeFailed_)
+				std::cout << "transaction log " << fileName_ << " is being written again" << std::endl;
+
+			writeFailed_ = failed;
+		}
+
+		void WriterThread()
+		{
+			boost::mutex::scoped_lock lock(stopMutex_);
+
+			while(!stop_)
+			{
+				stopCondition_.timed_wait(lock, boost::posix_time::milliseconds(flushInterval_));
+
+				lock.unlock();
+				WritePending();
+				lock.lock();
+			}
+		}
+
+		//
+		// lexical_cast is too slow for every logged field
+		//
+		static void AppendInteger(string* lineLog, long long value)
+		{
+			char buffer[24];
+			char* begin = buffer + sizeof(buffer);
+			unsigned long long absolute = value < 0 ? 0ULL - static_cast<unsigned long long>(value) : value;
+
+			do
+			{
+				*--begin = static_cast<char>('0' + absolute % 10);
+				absolute /= 10;
+			} while(absolute);
+
+			if(value < 0)
+				*--begin = '-';
+
+			lineLog->append(begin, buffer + sizeof(buffer) - begin);
+		}
+
+		static void AppendField(string* lineLog, const string& value)
+		{
+			lineLog->append(",s");
+			AppendInteger(lineLog, value.size());
+			lineLog->append(",");
+			lineLog->append(value);
+		}
+
+		static void AppendBinaryField(string* record, const TioData& data)
+		{
+			TIO_BINARY_LOG_FIELD field;
+			int intValue;
+			double doubleValue;
+			const void* buffer = NULL;
+
+			field.reserved = 0;
+			field.size = 0;
+
+			switch(data.GetDataType())
+			{
+			case TioData::String:
+				field.data_type = TIO_DATA_TYPE_STRING;
+				field.size = static_cast<unsigned int>(data.GetSize());
+				buffer = data.AsSz();
+				break;
+			case TioData::Int:
+				field.data_type = TIO_DATA_TYPE_INT;
+				intValue = data.AsInt();
+				field.size = sizeof(intValue);
+				buffer = &intValue;
+				break;
+			case TioData::Double:
+				field.data_type = TIO_DATA_TYPE_DOUBLE;
+				doubleValue = data.AsDouble();
+				field.size = sizeof(doubleValue);
+				buffer = &doubleValue;
+				break;
+			default:
+				field.data_type = TIO_DATA_TYPE_NONE;
+			}
+
+			record->append((const char*)&field, sizeof(field));
 
-		void RawLog(const string& what)
+			if(buffer)
+				record->append((const char*)buffer, field.size);
+		}
+
+		void LogBinaryRecord(int command, unsigned int handle, const TioData& key, const TioData& value, const TioData& metadata)
 		{
-			f_.Write(what.c_str(), what.size());
+			static const boost::posix_time::ptime epoch(boost::gregorian::date(1970, 1, 1));
+
+			string record;
+			TIO_BINARY_LOG_RECORD header;
+
+			header.size = 0;
+			header.command = static_cast<unsigned short>(command);
+			header.reserved = 0;
+			header.handle = handle;
+			header.reserved2 = 0;
+			header.timestamp = (boost::posix_time::microsec_clock::universal_time() - epoch).total_microseconds();
+
+			record.append((const char*)&header, sizeof(header));
+
+			AppendBinaryField(&record, key);
+			AppendBinaryField(&record, value);
+			AppendBinaryField(&record, metadata);
+
+			unsigned int size = static_cast<unsigned int>(record.size());
+			memcpy(&record[0], &size, sizeof(size));
+
+			RawLog(record);
 		}
 
 	public:
@@ -267,13 +538,58 @@ namespace tio
 		BinaryProtocolLogger()
 			: lastGlobalHandle_(0)
 			, f_()
+			, flushInterval_(100)
+			, binary_(false)
+			, writeFailed_(false)
+			, pending_(NULL)
+			, stop_(false)
 		{
 		}
 
-		void Start(const std::string& logFilePath)
+		~BinaryProtocolLogger()
 		{
-			f_.Create(logFilePath.c_str());
+			Stop();
+		}
+
+		void Start(const std::string& logFilePath, const TRANSACTION_LOG_CONFIG& config)
+		{
+			fileName_ = logFilePath;
+
+			if(!f_.Create(logFilePath.c_str()))
+				throw std::runtime_error("error opening transaction log " + logFilePath);
+
+			f_.SetSyncOnWrite(false);
 			f_.SetPointer(f_.GetFileSize());
+
+			flushInterval_ = config.flushInterval;
+			binary_ = config.binary;
+
+			if(binary_ && f_.GetFileSize() == 0)
+			{
+				if(f_.Write(TIO_BINARY_LOG_MAGIC, TIO_BINARY_LOG_MAGIC_SIZE) != TIO_BINARY_LOG_MAGIC_SIZE)
+					throw std::runtime_error("error writing transaction log " + logFilePath);
+			}
+
+			writerThread_ = boost::thread(boost::bind(&BinaryProtocolLogger::WriterThread, this));
+		}
+
+		//
+		// writes everything still pending
+		//
+		void Stop()
+		{
+			if(!writerThread_.joinable())
+				return;
+
+			{
+				boost::mutex::scoped_lock lock(stopMutex_);
+				stop_ = true;
+			}
+
+			stopCondition_.notify_one();
+			writerThread_.join();
+
+			WritePending();
 		}
 
 		void SerializeTioData(string* lineLog, const TioData& data)
@@ -287,21 +603,21 @@ namespace tio
 				break;
 			case TioData::String:
 				lineLog->append(",s");
-				lineLog->append(lexical_cast<string>(data.GetSize()));
+				AppendInteger(lineLog, data.GetSize());
 				lineLog->append(",");
 				lineLog->append(data.AsSz(), data.GetSize());
 				break;
 			case TioData::Int:
+				AppendInteger(&serialized, data.AsInt());
 				lineLog->append(",i");
-				serialized = lexical_cast<string>(data.AsInt());
-				lineLog->append(lexical_cast<string>(serialized.length()));
+				AppendInteger(lineLog, serialized.length());
 				lineLog->append(",");
 				lineLog->append(serialized);
 				break;
 			case TioData::Double:
 				lineLog->append(",d");
 				serialized = lexical_cast<string>(data.AsDouble());
-				lineLog->append(lexical_cast<string>(serialized.length()));
+				AppendInteger(lineLog, serialized.length());
 				lineLog->append(",");
 				lineLog->append(serialized);
 				break;
@@ -359,20 +675,19 @@ namespace tio
 					string containerType = container->GetType();
 					
 					globalHandle = ++lastGlobalHandle_;
-					logLine.append(",create,");
-					logLine.append(lexical_cast<string>(globalHandle));
 
-					logLine.append(",s");
-					logLine.append(lexical_cast<string>(containerName.size()));
-					logLine.append(",");
+					if(binary_)
+					{
+						LogBinaryRecord(TIO_COMMAND_CREATE, globalHandle, containerName, containerType, TIONULL);
+						return;
+					}
 
-					logLine.append(containerName);
+					logLine.append(",create,");
+					AppendInteger(&logLine, globalHandle);
 
-					logLine.append(",s");
-					logLine.append(lexical_cast<string>(containerType.size()));
-					logLine.append(",");
+					AppendField(&logLine, containerName);
+					AppendField(&logLine, containerType);
 
-					logLine.append(containerType);
 					logLine.append("\n");
 
 					RawLog(logLine);
@@ -422,20 +737,18 @@ namespace tio
 					if(!b)
 						break;
 
-					
+					if(binary_)
+					{
+						LogBinaryRecord(command, globalHandle, groupName, containerName, TIONULL);
+						return;
+					}
+
 					logLine.append(",group_add,");
-					logLine.append(lexical_cast<string>(globalHandle));
+					AppendInteger(&logLine, globalHandle);
 
-					logLine.append(",s");
-					logLine.append(lexical_cast<string>(groupName.size()));
-					logLine.append(",");
-					logLine.append(groupName);
+					AppendField(&logLine, groupName);
+					AppendField(&logLine, containerName);
 
-					logLine.append(",s");
-					logLine.append(lexical_cast<string>(containerName.size()));
-					logLine.append(",");
-					logLine.append(containerName);
-					
 					logLine.append("\n");
 
 					RawLog(logLine);
@@ -455,8 +768,14 @@ namespace tio
 
 			Pr1MessageGetHandleKeyValueAndMetadata(message, &handle, &key, &value, &metadata);
 
+			if(binary_)
+			{
+				LogBinaryRecord(command, globalHandle, key, value, metadata);
+				return;
+			}
+
 			logLine.append(",");
-			logLine.append(lexical_cast<string>(globalHandle));
+			AppendInteger(&logLine, globalHandle);
 
 			SerializeTioData(&logLine, key);
 			SerializeTioData(&logLine, value);
@@ -497,51 +816,12 @@ namespace tio
 			shared_ptr<ITioContainer> users;
 			shared_ptr<ITioContainer> sessions;
 			shared_ptr<ITioContainer> sessionLastCommand;
+			shared_ptr<ITioContainer> storageStatistics;
+			shared_ptr<ITioContainer> replicationHeartbeat;
 		};
 
-		struct KeyPopperInfo
-		{
-			unsigned int handle;
-			weak_ptr<TioTcpSession> session;
-			string key;
-
-			KeyPopperInfo()
-			{
-				handle = 0;
-			}
-
-			KeyPopperInfo(shared_ptr<TioTcpSession> session, unsigned int handle, const string& key)
-			{
-				this->session = session;
-				this->handle = handle;
-				this->key = key;
-			}
-		};
-
-		typedef map< string /* key */, deque<KeyPopperInfo> > KeyPoppersByKey;
-		typedef map< string /* full qualified name*/, KeyPoppersByKey  > KeyPoppersPerContainerMap;
-		
-		
-		KeyPoppersPerContainerMap keyPoppersPerContainer_;
-		tio::recursive_mutex keyPoppersPerContainerMutex_;
-
 
-		struct NextPopperInfo
-		{
-			unsigned int handle;
-			weak_ptr<TioTcpSession> session;
 
-			NextPopperInfo()
-			{
-				handle = 0;
-			}
-
-			NextPopperInfo(shared_ptr<TioTcpSession> session, unsigned int handle)
-			{
-				this->session = session;
-				this->handle = handle;
-			}
-		};
 		
 		// map<diff handle, DiffSessionInfo >
 		typedef map< unsigned int, DiffSessionInfo > DiffSessions;
@@ -552,10 +832,6 @@ namespace tio
 		unsigned int lastQueryID_;
 		unsigned int lastDiffID_;
 
-		typedef map< string, deque<NextPopperInfo> > NextPoppersMap;
-		NextPoppersMap nextPoppers_;
-		tio::recursive_mutex nextPoppersMutex_;
-
 		typedef void (tio::TioTcpServer::* CommandCallbackFunction)(tio::Command &,std::ostream &,size_t *,std::shared_ptr<TioTcpSession>);
 
 		typedef std::map<string, CommandCallbackFunction> CommandFunctionMap;
@@ -564,6 +840,12 @@ namespace tio
 		Auth auth_;
 
 		bool serverPaused_;
+
+		//
+		// __meta__/session_last_command is updated every N commands of
+		// each session. Zero disables it
+		//
+		unsigned int lastCommandSampling_;
 		
 		tcp::acceptor acceptor_;
 		asio::io_service& io_service_;
@@ -575,17 +857,53 @@ namespace tio
 		ContainerManager& containerManager_;
 
 		MetaContainers metaContainers_;
+		std::map<string, string> lastStorageStatistics_;
 
 		BinaryProtocolLogger logger_;
 
 		GroupManager groupManager_;
+
+		//
+		// we're a replication primary after the first subscription to TIO_REPLICATION_GROUP
+		//
+		bool replicationSourceStarted_;
+		void StartReplicationSource();
+		void OnReplicationContainersEvent(const string& eventName, const TioData& key, const TioData& value);
+		void UpdateReplicationHeartbeat();
+		void SubscribeGroup(const string& groupName, shared_ptr<TioTcpSession> session, const string& start);
+
+		//
+		// sessions waiting for the next group commit to get their answers
+		//
+		SessionsSet sessionsWaitingCommit_;
+		bool commitScheduled_;
+		std::atomic<bool> otherWritesCommitPosted_;
+
+		//
+		// flushes changes of containers with periodic durability
+		//
+		asio::deadline_timer flushTimer_;
+		bool flushScheduled_;
+		boost::posix_time::ptime flushTime_;
 				
 		void DoAccept();
+		void CommitPendingWrites();
+		void OnOutsideWrite();
+		void CommitOtherWrites();
+		void ScheduleFlush(unsigned int maxDelay);
+		void OnFlushTimer(const error_code& err);
+
+		//
+		// storage background work, like logdb compaction
+		//
+		asio::deadline_timer maintenanceTimer_;
+		void ScheduleMaintenance();
+		void UpdateStorageStatistics();
 		void OnAccept(shared_ptr<TioTcpSession> client, const error_code& err);
 		
 		pair<shared_ptr<ITioContainer>, int> GetRecordBySpec(const string& spec, shared_ptr<TioTcpSession> session);
 
-		size_t ParseDataCommand(Command& cmd, string* containerType, string* containerName, shared_ptr<ITioContainer>* container, 
+		size_t ParseDataCommand(Command& cmd, string* containerType, string* containerName, ITioContainer** container, 
 			TioData* key, TioData* value, TioData* metadata, shared_ptr<TioTcpSession> session, unsigned int* handle = NULL);
 
 		void LoadDispatchMap();
@@ -618,6 +936,7 @@ namespace tio
 		void OnCommand_GetRecordCount(Command& cmd, ostream& answer, size_t* moreDataSize, shared_ptr<TioTcpSession> session);
 
 		void OnCommand_SubscribeUnsubscribe(Command& cmd, ostream& answer, size_t* moreDataSize, shared_ptr<TioTcpSession> session);
+		void OnCommand_JournalSubscribe(Command& cmd, ostream& answer, size_t* moreDataSize, shared_ptr<TioTcpSession> session);
 
 		void OnCommand_WnpNext(Command& cmd, ostream& answer, size_t* moreDataSize, shared_ptr<TioTcpSession> session);
 		void OnCommand_WnpKey(Command& cmd, ostream& answer, size_t* moreDataSize, shared_ptr<TioTcpSession> session);
@@ -625,6 +944,7 @@ namespace tio
 		string GetFullQualifiedName(shared_ptr<ITioContainer> container);
 
 		void OnCommand_PauseResume(Command& cmd, ostream& answer, size_t* moreDataSize, shared_ptr<TioTcpSession> session);
+		void OnCommand_LastCommands(Command& cmd, ostream& answer, size_t* moreDataSize, shared_ptr<TioTcpSession> session);
 
 		void OnCommand_Auth(Command& cmd, ostream& answer, size_t* moreDataSize, shared_ptr<TioTcpSession> session);
 		void OnCommand_SetPermission(Command& cmd, ostream& answer, size_t* moreDataSize, shared_ptr<TioTcpSession> session);
@@ -640,33 +960,40 @@ namespace tio
 		bool CheckCommandAccess(const string& command, ostream& answer, shared_ptr<TioTcpSession> session);
 		bool CheckObjectAccess(const string& objectType, const string& objectName, const string& command, ostream& answer, shared_ptr<TioTcpSession> session);
 
+		//
+		// same as CheckObjectAccess for the handle container, but
+		// the decision is cached in the session
+		//
+		bool CheckHandleAccess(unsigned int handle, const string& command, ostream& answer, shared_ptr<TioTcpSession> session);
+
 		string GetConfigValue(const string& key);
 
 		void InitializeMetaContainers();
 
-		shared_ptr<ITioContainer> GetContainerAndParametersFromRequest(const PR1_MESSAGE* message, shared_ptr<TioTcpSession> session, TioData* key, TioData* value, TioData* metadata);
+		ITioContainer* GetContainerAndParametersFromRequest(const PR1_MESSAGE* message, shared_ptr<TioTcpSession> session, TioData* key, TioData* value, TioData* metadata);
 
 		unsigned int GenerateSessionId();
 		unsigned int GenerateDiffId();
 
-		void HandlePushBackWaitAndPop( shared_ptr<ITioContainer> container, const TioData& key, const TioData& value, const TioData& metadata);
-
-		void HandleKeyValueWaitAndPop(shared_ptr<ITioContainer> container, 
-			const TioData& key, const TioData& value, const TioData& metadata);
-
 	public:
-		TioTcpServer(ContainerManager& containerManager,asio::io_service& io_service, const tcp::endpoint& endpoint, const std::string& logFilePath);
+		TioTcpServer(ContainerManager& containerManager,asio::io_service& io_service, const tcp::endpoint& endpoint,
+			const TRANSACTION_LOG_CONFIG& logConfig);
+		~TioTcpServer();
+
 		void OnClientFailed(shared_ptr<TioTcpSession> client, const error_code& err);
 		void OnCommand(Command& cmd, ostream& answer, size_t* moreDataSize, shared_ptr<TioTcpSession> session);
 
 		void PostCallback(function<void()> callback);
 		
 		void OnBinaryCommand(shared_ptr<TioTcpSession> session, PR1_MESSAGE* message);
+		void OnCommandFinished(shared_ptr<TioTcpSession> session);
 
 		void Start();
 
 		Auth& GetAuth();
 		unsigned CreateNewQueryId();
+
+		void SetLastCommandSampling(unsigned int sampling);
 	};
 
 	void StartServer();
@@ -56,19 +56,24 @@ namespace tio
 	int TioTcpSession::PENDING_SEND_SIZE_SMALL_THRESHOLD = 1024;
 #endif
 
+	const unsigned int TioTcpSession::LAST_COMMANDS_SIZE;
+
 	std::ostream& TioTcpSession::logstream_ = std::cout;
 	
 	TioTcpSession::TioTcpSession(asio::io_service& io_service, TioTcpServer& server, unsigned int id) :
 		io_service_(io_service),
 		socket_(io_service),
 		server_(server),
-		lastHandle_(0),
+		handleCount_(0),
 		valid_(true),
         pendingSendSize_(0),
 		maxPendingSendingSize_(0),
 		sentBytes_(0),
 		id_(id),
-		binaryProtocol_(false)
+		binaryProtocol_(false),
+		outputHeld_(false),
+		textWriteInProgress_(false),
+		commandCount_(0)
 	{
 		return;
 	}
@@ -77,7 +82,7 @@ namespace tio
 	{
 		BOOST_ASSERT(subscriptions_.empty());
 		BOOST_ASSERT(diffs_.empty());
-		BOOST_ASSERT(handles_.empty());
+		BOOST_ASSERT(handleCount_ == 0);
 		BOOST_ASSERT(poppers_.empty());
 
 		logstream_ << "session " << id_ << " just died" << endl;
@@ -164,6 +169,33 @@ namespace tio
 		return binaryProtocol_;
 	}
 
+	void TioTcpSession::RecordCommand(const Command& cmd)
+	{
+		lastCommands_[commandCount_ % LAST_COMMANDS_SIZE].assign(cmd.GetSource());
+		commandCount_++;
+	}
+
+	unsigned int TioTcpSession::GetCommandCount() const
+	{
+		return commandCount_;
+	}
+
+	string TioTcpSession::GetLastCommands() const
+	{
+		string commands;
+		unsigned int count = std::min<unsigned int>(commandCount_, LAST_COMMANDS_SIZE);
+
+		for(unsigned int a = commandCount_ - count ; a != commandCount_ ; a++)
+		{
+			if(!commands.empty())
+				commands.push_back('\n');
+
+			commands.append(lastCommands_[a % LAST_COMMANDS_SIZE]);
+		}
+
+		return commands;
+	}
+
 	tcp::socket& TioTcpSession::GetSocket()
 	{
 		return socket_;
@@ -187,17 +219,19 @@ namespace tio
 		if(CheckError(err))
 			return;
 
+		HoldOutput();
+
 		server_.OnBinaryCommand(shared_from_this(), message);
 
+		server_.OnCommandFinished(shared_from_this());
+
 		ReadBinaryProtocolMessage();
 	}
 
 	void TioTcpSession::OnPopEvent(unsigned int handle, const string& eventName, const TioData& key, const TioData& value, const TioData& metadata)
 	{
-		WaitAndPopNextMap::iterator i = poppers_.find(handle);
-		
-		if(i != poppers_.end())
-			poppers_.erase(i);
+		if(eventName == "wnp_next")
+			poppers_.erase(handle);
 
 		if(binaryProtocol_)
 			SendBinaryEvent(handle, key, value, metadata, eventName);
@@ -236,6 +270,43 @@ namespace tio
 
 	}
 
+	void TioTcpSession::WaitAndPopKey(unsigned int handle, const TioData& key)
+	{
+		shared_ptr<ITioContainer> container = GetRegisteredContainer(handle);
+
+		auto shared_this = shared_from_this();
+
+		//
+		// we only know the id after WaitAndPopKey returns. If the key is
+		// already there the sink runs inside the call, and the event is
+		// posted so the answer goes before it
+		//
+		shared_ptr<unsigned int> popId(new unsigned int(0));
+		shared_ptr<bool> calling(new bool(true));
+		
+		*popId = container->WaitAndPopKey(key,
+			[shared_this, handle, popId, calling](const string& eventName, const TioData& key, const TioData& value, const TioData& metadata)
+			{
+				if(*calling)
+				{
+					shared_this->PostCallback(
+						[handle, eventName, key, value, metadata](shared_ptr<TioTcpSession> session)
+						{
+							session->OnPopEvent(handle, eventName, key, value, metadata);
+						});
+					return;
+				}
+
+				shared_this->keyPoppers_.erase(make_pair(handle, *popId));
+				shared_this->OnPopEvent(handle, eventName, key, value, metadata);
+			});
+
+		*calling = false;
+
+		if(*popId)
+			keyPoppers_.insert(make_pair(handle, *popId));
+	}
+
 	void TioTcpSession::OnBinaryProtocolMessageHeader(shared_ptr<PR1_MESSAGE_HEADER> header, const error_code& err)
 	{
 		if(CheckError(err))
@@ -275,7 +346,7 @@ namespace tio
 
 	void TioTcpSession::ReadCommand()
 	{
-		currentCommand_ = Command();
+		currentCommand_.Clear();
 
 		auto shared_this = shared_from_this();
 
@@ -291,19 +362,22 @@ namespace tio
 		if(CheckError(err))
 			return;
 
-		string str;
-		stringstream answer;
+		stringstream& answer = ResetAnswer();
 		bool moreDataToRead = false;
 		size_t moreDataSize = 0;
-		istream stream (&buf_);
 
-		getline(stream, str);
+		//
+		// parse the line right from the receive buffer. "read" includes the \n
+		//
+		const char* lineBegin = asio::buffer_cast<const char*>(buf_.data());
+		const char* lineEnd = lineBegin + read - 1;
 
 		//
 		// can happen if client send binary data
 		//
-		if(str.empty())
+		if(lineEnd == lineBegin)
 		{
+			buf_.consume(read);
 			ReadCommand();
 			return;
 		}
@@ -311,12 +385,14 @@ namespace tio
 		//
 		// delete last \r if any
 		//
-		if(*(str.end() - 1) == '\r')
-			str.erase(str.end() - 1);
+		if(*(lineEnd - 1) == '\r')
+			--lineEnd;
 
 		BOOST_ASSERT(currentCommand_.GetCommand().empty());
 		
-		currentCommand_.Parse(str.c_str());
+		currentCommand_.Parse(lineBegin, lineEnd);
+
+		buf_.consume(read);
 
 		//
 		// Check for protocol change. 
@@ -335,9 +411,11 @@ namespace tio
 		}
 
 #ifdef _TIO_DEBUG
-		cout << "<< " << str << endl;
+		cout << "<< " << currentCommand_.GetSource() << endl;
 #endif
 
+		HoldOutput();
+
 		server_.OnCommand(currentCommand_, answer, &moreDataSize, shared_from_this());
 		
 		if(moreDataSize)
@@ -369,7 +447,7 @@ namespace tio
 			moreDataToRead = true;
 		}
 	
-		if(!answer.str().empty())
+		if(answer.tellp() > 0)
 		{
 			#ifdef _TIO_DEBUG
 			string xx;
@@ -381,6 +459,8 @@ namespace tio
 			SendAnswer(answer);
 		}
 
+		server_.OnCommandFinished(shared_from_this());
+
 		if(!moreDataToRead)
 			ReadCommand();
 		
@@ -393,7 +473,7 @@ namespace tio
 		
 		BOOST_ASSERT(buf_.size() >= dataSize);
 
-		stringstream answer;
+		stringstream& answer = ResetAnswer();
 		size_t moreDataSize = 0;
 
 		//
@@ -404,12 +484,16 @@ namespace tio
 
 		buf_.sgetn((char*)dataBuffer->GetRawBuffer(), static_cast<std::streamsize>(dataSize));
 
+		HoldOutput();
+
 		server_.OnCommand(currentCommand_, answer, &moreDataSize, shared_from_this());
 
 		BOOST_ASSERT(moreDataSize == 0);
 
 		SendAnswer(answer);
 
+		server_.OnCommandFinished(shared_from_this());
+
 		#ifdef _TIO_DEBUG
 		string xx;
 		getline(answer, xx);
@@ -420,6 +504,17 @@ namespace tio
 	}
 
 
+	//
+	// the stream is reused between commands. libstdc++ keeps the
+	// string capacity on str(), so answers stop allocating once it grew
+	//
+	stringstream& TioTcpSession::ResetAnswer()
+	{
+		answer_.str(string());
+		answer_.clear();
+		return answer_;
+	}
+
 	void TioTcpSession::SendAnswer(stringstream& answer)
 	{
 		BOOST_ASSERT(answer.str().size() > 0);
@@ -433,56 +528,20 @@ namespace tio
 	}
 
 
-	string TioDataToString(const TioData& data)
-	{
-		if(!data)
-			return string();
-
-		stringstream stream;
-
-		stream << data;
-
-		return stream.str();
-	}
-
-	void TioTcpSession::SendTextEvent(unsigned int handle, const TioData& key, const TioData& value, const TioData& metadata, const string& eventName )
+	void TioTcpSession::SendTextEvent(unsigned int handle, const TioData& key, const TioData& value, const TioData& metadata, const string& eventName, unsigned long long sequence)
 	{
-		stringstream answer;
-
-		string keyString, valueString, metadataString;
-
-		if(key)
-			keyString = TioDataToString(key);
-
-		if(value)
-			valueString = TioDataToString(value);
+		string answer;
 
-		if(metadata)
-			metadataString = TioDataToString(metadata);
+		answer.reserve(64 + eventName.size() + GetTextSizeHint(key) + GetTextSizeHint(value) + GetTextSizeHint(metadata));
 
-		answer << "event " << handle << " " << eventName;
+		answer.append("event ");
+		AppendNumber(&answer, handle);
+		answer.push_back(' ');
+		answer.append(eventName);
 
-		if(!keyString.empty())
-			answer << " key " << GetDataTypeAsString(key) << " " << keyString.length();
+		AppendDataFields(&answer, key, value, metadata, true, sequence);
 
-		if(!valueString.empty())
-			answer << " value " << GetDataTypeAsString(value) << " " << valueString.length();
-
-		if(!metadataString.empty())
-			answer << " metadata " << GetDataTypeAsString(metadata) << " " << metadataString.length();
-
-		answer << "\r\n";
-
-		if(!keyString.empty())
-			answer << keyString << "\r\n";
-
-		if(!valueString.empty())
-			answer << valueString << "\r\n";
-
-		if(!metadataString.empty())
-			answer << metadataString << "\r\n";
-
-		SendString(answer.str());
+		SendString(answer);
 	}
 
 	
@@ -809,51 +868,17 @@ namespace tio
 	void TioTcpSession::SendResultSetItem(unsigned int queryID, 
 		const TioData& key, const TioData& value, const TioData& metadata)
 	{
-		stringstream answer;
+		string answer;
 
-		/*
-		if(itemType == "last");
-		{
-			answer << "query " << queryID << " end";
-			SendString(answer.str());
-			return;
-		}
-		*/
+		answer.reserve(64 + GetTextSizeHint(key) + GetTextSizeHint(value) + GetTextSizeHint(metadata));
 
-		string keyString, valueString, metadataString;
+		answer.append("query ");
+		AppendNumber(&answer, queryID);
+		answer.append(" item");
 
-		if(key)
-			keyString = TioDataToString(key);
+		AppendDataFields(&answer, key, value, metadata, true);
 
-		if(value)
-			valueString = TioDataToString(value);
-
-		if(metadata)
-			metadataString = TioDataToString(metadata);
-
-		answer << "query " << queryID << " item";
-
-		if(!keyString.empty())
-			answer << " key " << GetDataTypeAsString(key) << " " << keyString.length();
-
-		if(!valueString.empty())
-			answer << " value " << GetDataTypeAsString(value) << " " << valueString.length();
-
-		if(!metadataString.empty())
-			answer << " metadata " << GetDataTypeAsString(metadata) << " " << metadataString.length();
-
-		answer << "\r\n";
-
-		if(!keyString.empty())
-			answer << keyString << "\r\n";
-
-		if(!valueString.empty())
-			answer << valueString << "\r\n";
-
-		if(!metadataString.empty())
-			answer << metadataString << "\r\n";
-
-		SendString(answer.str());
+		SendString(answer);
 	}
 
     void TioTcpSession::SendString(const string& str)
@@ -861,7 +886,7 @@ namespace tio
 		if(!valid_)
 			return;
 
-        if(pendingSendSize_)
+        if(textWriteInProgress_ || outputHeld_)
         {
 			//
 			// If there is too much data pending, the client is not 
@@ -875,12 +900,13 @@ namespace tio
 				return;
 			}
 
+			IncreasePendingSendSize(str.size());
             pendingSendData_.push(str);
             return;
         }
-        else
-            SendStringNow(str);
 
+		IncreasePendingSendSize(str.size());
+		SendStringNow(str);
     }
 
 	void TioTcpSession::SendStringNow(const string& str)
@@ -893,7 +919,7 @@ namespace tio
 		char* buffer = new char[answerSize];
 		memcpy(buffer, str.c_str(), answerSize);
 
-		IncreasePendingSendSize(answerSize);
+		textWriteInProgress_ = true;
 
 		auto shared_this = shared_from_this();
 
@@ -910,7 +936,9 @@ namespace tio
 	{
 		delete[] buffer;
 
-        pendingSendSize_ -= bufferSize;
+		textWriteInProgress_ = false;
+
+		DecreasePendingSendSize(bufferSize);
 
 		sentBytes_ += sent;
 
@@ -934,6 +962,31 @@ namespace tio
 		return;
 	}
 
+	void TioTcpSession::HoldOutput()
+	{
+		outputHeld_ = true;
+	}
+
+	void TioTcpSession::ReleaseOutput()
+	{
+		if(!outputHeld_)
+			return;
+
+		outputHeld_ = false;
+
+		if(binaryProtocol_)
+		{
+			SendPendingBinaryData();
+			return;
+		}
+
+		if(!textWriteInProgress_ && !pendingSendData_.empty())
+		{
+			SendStringNow(pendingSendData_.front());
+			pendingSendData_.pop();
+		}
+	}
+
 	void TioTcpSession::InvalidateConnection(const error_code& err)
 	{
 		if(!IsValid())
@@ -994,49 +1047,125 @@ namespace tio
 			int handle, popId;
 			pair_assign(handle, popId) = *i;
 
-			GetRegisteredContainer(handle)->CancelWaitAndPopNext(popId);
+			GetRegisteredContainer(handle)->CancelWaitAndPop(popId);
 		}
 
 		poppers_.clear();
 
+		for(WaitAndPopKeySet::const_iterator i = keyPoppers_.begin() ;  i != keyPoppers_.end() ; ++i)
+			GetRegisteredContainer(i->first)->CancelWaitAndPop(i->second);
+
+		keyPoppers_.clear();
+
 		StopDiffs();
 
-		handles_.clear();
+		handleSlots_.clear();
+		freeHandleSlots_.clear();
+		handleCount_ = 0;
 	}
 
 	unsigned int TioTcpSession::RegisterContainer(const string& containerName, shared_ptr<ITioContainer> container)
 	{
-		unsigned int handle = ++lastHandle_;
-		handles_[handle] = make_pair(container, containerName);
-		return handle;
+		unsigned int slotIndex;
+
+		if(!freeHandleSlots_.empty())
+		{
+			slotIndex = freeHandleSlots_.back();
+			freeHandleSlots_.pop_back();
+		}
+		else
+		{
+			if(handleSlots_.size() == HANDLE_SLOT_MASK)
+				throw std::runtime_error("too many handles");
+
+			slotIndex = static_cast<unsigned int>(handleSlots_.size());
+			handleSlots_.push_back(HANDLE_SLOT());
+		}
+
+		HANDLE_SLOT& slot = handleSlots_[slotIndex];
+
+		slot.container = container;
+		slot.containerName = containerName;
+
+		handleCount_++;
+
+		return (slot.generation << HANDLE_SLOT_BITS) | (slotIndex + 1);
 	}
 
-	shared_ptr<ITioContainer> TioTcpSession::GetRegisteredContainer(unsigned int handle, string* containerName, string* containerType)
+	TioTcpSession::HANDLE_SLOT* TioTcpSession::FindHandleSlot(unsigned int handle)
 	{
-		HandleMap::iterator i = handles_.find(handle);
+		unsigned int slotIndex = (handle & HANDLE_SLOT_MASK) - 1;
+
+		if(slotIndex >= handleSlots_.size())
+			return NULL;
+
+		HANDLE_SLOT& slot = handleSlots_[slotIndex];
+
+		if(!slot.container || slot.generation != (handle >> HANDLE_SLOT_BITS))
+			return NULL;
+
+		return &slot;
+	}
 
-		if(i == handles_.end())
+	const shared_ptr<ITioContainer>& TioTcpSession::GetRegisteredContainer(unsigned int handle, string* containerName, string* containerType)
+	{
+		HANDLE_SLOT* slot = FindHandleSlot(handle);
+
+		if(!slot)
 			throw std::invalid_argument("invalid handle");
 
 		if(containerName)
-			*containerName = i->second.second;
+			*containerName = slot->containerName;
 
 		if(containerType)
-			*containerType = i->second.first->GetType();
+			*containerType = slot->container->GetType();
 
-		return i->second.first;
+		return slot->container;
 	}
 
 	void TioTcpSession::CloseContainerHandle(unsigned int handle)
 	{
-		HandleMap::iterator i = handles_.find(handle);
-
-		if(i == handles_.end())
+		if(!FindHandleSlot(handle))
 			throw std::invalid_argument("invalid handle");
 
 		Unsubscribe(handle);
 
-		handles_.erase(i);
+		//
+		// pending pops must go, or the container would pop a record
+		// for a handle that doesn't exist anymore
+		//
+		WaitAndPopNextMap::iterator popper = poppers_.find(handle);
+
+		if(popper != poppers_.end())
+		{
+			GetRegisteredContainer(handle)->CancelWaitAndPop(popper->second);
+			poppers_.erase(popper);
+		}
+
+		for(WaitAndPopKeySet::iterator i = keyPoppers_.lower_bound(make_pair(handle, 0u)) ;
+			i != keyPoppers_.end() && i->first == handle ; )
+		{
+			GetRegisteredContainer(handle)->CancelWaitAndPop(i->second);
+			keyPoppers_.erase(i++);
+		}
+
+		//
+		// Unsubscribe can send events, look for the slot again
+		//
+		HANDLE_SLOT* slot = FindHandleSlot(handle);
+
+		slot->container.reset();
+		slot->containerName.clear();
+		slot->access = HANDLE_ACCESS();
+		slot->generation = (slot->generation + 1) & HANDLE_GENERATION_MASK;
+
+		//
+		// a wrapped generation would make handles closed long ago valid again
+		//
+		if(slot->generation != 0)
+			freeHandleSlots_.push_back((handle & HANDLE_SLOT_MASK) - 1);
+
+		handleCount_--;
 	}
 
 	void TioTcpSession::Subscribe(unsigned int handle, const string& start, int filterEnd, bool sendAnswer)
@@ -1145,6 +1274,41 @@ namespace tio
 	}
 
 
+	void TioTcpSession::JournalSubscribe(unsigned int handle, unsigned long long lastSequence)
+	{
+		shared_ptr<ITioContainer> container = GetRegisteredContainer(handle);
+
+		if(subscriptions_.find(handle) != subscriptions_.end())
+		{
+			SendString("answer error already subscribed\r\n");
+			return;
+		}
+
+		shared_ptr<SUBSCRIPTION_INFO> subscriptionInfo(new SUBSCRIPTION_INFO(handle));
+		subscriptionInfo->container = container;
+
+		subscriptions_[handle] = subscriptionInfo;
+
+		try
+		{
+			auto shared_this = shared_from_this();
+
+			subscriptionInfo->cookie = container->SubscribeJournal(
+				[shared_this, handle](unsigned long long sequence, const string& eventName, const TioData& key, const TioData& value, const TioData& metadata)
+				{
+					if(shared_this->valid_)
+						shared_this->SendTextEvent(handle, key, value, metadata, eventName, sequence);
+				}, lastSequence);
+
+			SendString("answer ok\r\n");
+		}
+		catch(std::exception& ex)
+		{
+			subscriptions_.erase(handle);
+			SendString(string("answer error ") + ex.what() + "\r\n");
+		}
+	}
+
 	void TioTcpSession::BinarySubscribe(unsigned int handle, const string& start, bool sendAnswer)
 	{
 		shared_ptr<ITioContainer> container = GetRegisteredContainer(handle);
@@ -1367,6 +1531,32 @@ namespace tio
 	void TioTcpSession::AddToken(const string& token)
 	{
 		tokens_.push_back(token);
+
+		for(std::deque<HANDLE_SLOT>::iterator i = handleSlots_.begin() ; i != handleSlots_.end() ; ++i)
+			i->access = HANDLE_ACCESS();
+	}
+
+	bool TioTcpSession::GetCachedAccess(unsigned int handle, unsigned int authGeneration, bool* allowed)
+	{
+		HANDLE_SLOT* slot = FindHandleSlot(handle);
+
+		if(!slot || slot->access.authGeneration != authGeneration)
+			return false;
+
+		*allowed = slot->access.allowed;
+
+		return true;
+	}
+
+	void TioTcpSession::SetCachedAccess(unsigned int handle, unsigned int authGeneration, bool allowed)
+	{
+		HANDLE_SLOT* slot = FindHandleSlot(handle);
+
+		if(!slot)
+			return;
+
+		slot->access.authGeneration = authGeneration;
+		slot->access.allowed = allowed;
 	}
 
 	int EventNameToEventCode(const string& eventName)
@@ -1385,6 +1575,8 @@ namespace tio
 			return TIO_COMMAND_INSERT;
 		else if(eventName == "wnp_next")
 			return TIO_COMMAND_WAIT_AND_POP_NEXT;
+		else if(eventName == "wnp_key")
+			return TIO_COMMAND_WAIT_AND_POP_KEY;
 		else if(eventName == "snapshot_end")
 			return TIO_EVENT_SNAPSHOT_END;
 
@@ -1407,6 +1599,8 @@ namespace tio
 			return TIO_COMMAND_INSERT;
 		else if(eventName == "wnp_next")
 			return TIO_COMMAND_WAIT_AND_POP_NEXT;
+		else if(eventName == "wnp_key")
+			return TIO_COMMAND_WAIT_AND_POP_KEY;
 		else if(eventName == "snapshot_end")
 			return TIO_EVENT_SNAPSHOT_END;
 
@@ -1445,7 +1639,7 @@ namespace tio
 
 	void TioTcpSession::SendPendingBinaryData()
 	{
-		if(!beingSendData_.empty())
+		if(outputHeld_ || !beingSendData_.empty())
 			return;
 
 		if(pendingBinarySendData_.empty())
@@ -1478,11 +1672,17 @@ namespace tio
 			pendingBinarySendData_.pop_front();
 		}
 
+		//
+		// send buffer is reused, so we can't start another write
+		// until this one is done
+		//
+		beingSendData_.push_back(asio::buffer(binarySendBuffer_.get(), bufferSpaceUsed));
+
 		auto shared_this = shared_from_this();
 
 		asio::async_write(
 			socket_,
-			asio::buffer(binarySendBuffer_.get(), bufferSpaceUsed),
+			beingSendData_,
 			[shared_this](const error_code& err, size_t sent)
 		{
 			shared_this->OnBinaryMessageSent(err, sent);
@@ -1491,6 +1691,8 @@ namespace tio
 
 	void TioTcpSession::OnBinaryMessageSent(const error_code& err, size_t sent)
 	{
+		beingSendData_.clear();
+
 		if(CheckError(err))
 		{
 			//std::cerr << "ERROR sending binary data: " << err << std::endl;
@@ -1535,6 +1737,12 @@ namespace tio
 		}
 	}
 
+	void TioTcpSession::PostCallback(std::function<void(shared_ptr<TioTcpSession>)> callback)
+	{
+		auto shared_this = shared_from_this();
+		server_.PostCallback([shared_this, callback]{callback(shared_this); });
+	}
+
 	void TioTcpSession::SendBinaryMessage(const shared_ptr<PR1_MESSAGE>& message)
 	{
 		if(!valid_)
@@ -180,6 +180,11 @@ inline bool Pr1MessageGetField(const PR1_MESSAGE* message, unsigned int fieldId,
 		return answer;
 	}
 
+	//
+	// binary protocol event code (TIO_COMMAND_*) for an event name, zero if unknown
+	//
+	int EventNameToEventCode(const string& eventName);
+
 	
 	using std::shared_ptr;
 	using std::weak_ptr;
@@ -349,24 +354,80 @@ inline bool Pr1MessageGetField(const PR1_MESSAGE* message, unsigned int fieldId,
 
 		Command currentCommand_;
 
-		asio::streambuf buf_;
+		//
+		// text protocol answers are built here, reused across commands
+		//
+		stringstream answer_;
+		stringstream& ResetAnswer();
 
-		typedef std::map<unsigned int, pair<shared_ptr<ITioContainer>, string> > HandleMap;
+		asio::streambuf buf_;
 
 		//               handle             container                  subscription cookie
 		typedef std::map<unsigned int, pair<shared_ptr<ITioContainer>, unsigned int> > DiffMap;
-
-		HandleMap handles_;
 		
 		DiffMap diffs_;
 
-		unsigned int lastHandle_;
+		//
+		// Access decision of a handle, so auth rules aren't checked on every
+		// command. Only cached for containers whose rules are the same for
+		// every command, the others are checked every time. Valid while
+		// neither the auth generation nor the session tokens change. Auth
+		// generations start at 1, so zero means nothing cached
+		//
+		struct HANDLE_ACCESS
+		{
+			unsigned int authGeneration;
+			bool allowed;
+
+			HANDLE_ACCESS() : authGeneration(0), allowed(false) {}
+		};
+
+		//
+		// Handles index a slot table, so resolving them doesn't search anything.
+		// The low bits are the slot index plus one, the high bits are the slot
+		// generation, so a closed handle is not mistaken for the one that
+		// reused its slot. Handles stay positive, since the binary protocol
+		// sends them as int. It's a deque because references to slots must
+		// stay valid while it grows
+		//
+		static const unsigned int HANDLE_SLOT_BITS = 20;
+		static const unsigned int HANDLE_SLOT_MASK = (1 << HANDLE_SLOT_BITS) - 1;
+		//
+		// 11 bits of generation. A slot is retired instead of wrapping to a
+		// generation it already had, so an old handle never resolves to a
+		// container opened later
+		//
+		static const unsigned int HANDLE_GENERATION_MASK = (1 << (31 - HANDLE_SLOT_BITS)) - 1;
+
+		struct HANDLE_SLOT
+		{
+			unsigned int generation;
+			shared_ptr<ITioContainer> container;
+			string containerName;
+			HANDLE_ACCESS access;
+
+			HANDLE_SLOT() : generation(0) {}
+		};
+
+		std::deque<HANDLE_SLOT> handleSlots_;
+		vector<unsigned int> freeHandleSlots_;
+		size_t handleCount_;
+
+		HANDLE_SLOT* FindHandleSlot(unsigned int handle);
 		int sentBytes_;
         int pendingSendSize_;
 		int maxPendingSendingSize_;
 
 		bool binaryProtocol_;
 
+		//
+		// while output is held, answers and events are queued and only
+		// sent after ReleaseOutput(). Used to answer after group commit
+		//
+		bool outputHeld_;
+
+		bool textWriteInProgress_;
+
 		static std::ostream& logstream_;
 
 		std::queue<std::function<void (shared_ptr<TioTcpSession>)>> lowPendingBytesThresholdCallbacks_;
@@ -409,8 +470,20 @@ inline bool Pr1MessageGetField(const PR1_MESSAGE* message, unsigned int fieldId,
 		typedef std::map<unsigned int, unsigned int > WaitAndPopNextMap;
 		WaitAndPopNextMap poppers_;
 
+		//                     handle        pop id
+		typedef std::set< pair<unsigned int, unsigned int> > WaitAndPopKeySet;
+		WaitAndPopKeySet keyPoppers_;
+
 		vector<string> tokens_;
 
+		//
+		// last command lines received, without data, for diagnostics.
+		// The strings are reused, so recording a command doesn't allocate
+		//
+		static const unsigned int LAST_COMMANDS_SIZE = 16;
+		string lastCommands_[LAST_COMMANDS_SIZE];
+		unsigned int commandCount_;
+
 		bool valid_;
 
 		static int PENDING_SEND_SIZE_BIG_THRESHOLD;
@@ -440,6 +513,9 @@ inline bool Pr1MessageGetField(const PR1_MESSAGE* message, unsigned int fieldId,
 
 		void SendPendingBinaryData();
 
+		void HoldOutput();
+		void ReleaseOutput();
+
 		void OnBinaryMessageSent(const error_code& err, size_t sent);
 
 		void IncreasePendingSendSize(int size)
@@ -455,6 +531,11 @@ inline bool Pr1MessageGetField(const PR1_MESSAGE* message, unsigned int fieldId,
 
 		void DecreasePendingSendSize(int size);
 
+		//
+		// runs the callback later on the io thread
+		//
+		void PostCallback(std::function<void (shared_ptr<TioTcpSession>)> callback);
+
 		int pendingSendSize()
 		{
 			return pendingSendSize_;
@@ -513,6 +594,14 @@ inline bool Pr1MessageGetField(const PR1_MESSAGE* message, unsigned int fieldId,
 		unsigned int id();
 		bool UsesBinaryProtocol() const;
 
+		void RecordCommand(const Command& cmd);
+		unsigned int GetCommandCount() const;
+
+		//
+		// last commands received, oldest first, one per line
+		//
+		string GetLastCommands() const;
+
 		void SendResultSet(shared_ptr<ITioResultSet> resultSet, unsigned int queryID);
 
 		void SendResultSetStart(unsigned int queryID);
@@ -529,22 +618,29 @@ inline bool Pr1MessageGetField(const PR1_MESSAGE* message, unsigned int fieldId,
 		void SendAnswer(const string& answer);
 
 		unsigned int RegisterContainer(const string& containerName, shared_ptr<ITioContainer> container);
-		shared_ptr<ITioContainer> GetRegisteredContainer(unsigned int handle, string* containerName = NULL, string* containerType = NULL);
+		//
+		// The reference is valid until the handle is closed
+		//
+		const shared_ptr<ITioContainer>& GetRegisteredContainer(unsigned int handle, string* containerName = NULL, string* containerType = NULL);
 		void CloseContainerHandle(unsigned int handle);
 
 		void OnEvent(shared_ptr<SUBSCRIPTION_INFO> subscriptionInfo, const string& eventName, const TioData& key, const TioData& value, const TioData& metadata);
 		void OnPopEvent(unsigned int handle, const string& eventName, const TioData& key, const TioData& value, const TioData& metadata);
 
-		void SendTextEvent(unsigned int handle, const TioData& key, const TioData& value, const TioData& metadata, const string& eventName);
+		void SendTextEvent(unsigned int handle, const TioData& key, const TioData& value, const TioData& metadata, const string& eventName, unsigned long long sequence = 0);
 		void SendEvent(shared_ptr<SUBSCRIPTION_INFO> subscriptionInfo, const string& eventName, const TioData& key, const TioData& value, const TioData& metadata);
 
 		void Subscribe(unsigned int handle, const string& start, int filterEnd, bool sendAnswer=true);
 		void BinarySubscribe(unsigned int handle, const string& start, bool sendAnswer);
+		void JournalSubscribe(unsigned int handle, unsigned long long lastSequence);
 		void Unsubscribe(unsigned int handle);
 
 		const vector<string>& GetTokens();
 		void AddToken(const string& token);
 
+		bool GetCachedAccess(unsigned int handle, unsigned int authGeneration, bool* allowed);
+		void SetCachedAccess(unsigned int handle, unsigned int authGeneration, bool allowed);
+
 		shared_ptr<ITioContainer> GetDiffDestinationContainer(unsigned int handle);
 		void SetupDiffContainer(unsigned int handle, shared_ptr<ITioContainer> destinationContainer);
 		void StopDiffs();
@@ -561,6 +657,7 @@ inline bool Pr1MessageGetField(const PR1_MESSAGE* message, unsigned int fieldId,
 		void SendBinaryEvent( int handle, const TioData& key, const TioData& value, const TioData& metadata, const string& eventName );
 		void SendBinaryResultSet(shared_ptr<ITioResultSet> resultSet, unsigned int queryID, function<bool(const TioData& key)> filterFunction, unsigned maxRecords);
 		void BinaryWaitAndPopNext(unsigned int handle);
+		void WaitAndPopKey(unsigned int handle, const TioData& key);
 		bool ShouldSendEvent(const shared_ptr<SUBSCRIPTION_INFO>& subscriptionInfo, string eventName, const TioData& key, const TioData& value, const TioData& metadata, std::vector<EXTRA_EVENT>* extraEvents);
 		bool commandRunning_;
 
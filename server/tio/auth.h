@@ -67,6 +67,12 @@ private:
 	CommandRules commandRules_;
 	RuleResult commandDefaultRule_;
 
+	//
+	// changes every time a rule changes, so
+	// cached decisions know they're stale
+	//
+	unsigned int generation_;
+
 	bool FindRuleForTokens(const COMMAND::Tokens& commandTokens, const vector<string>& tokens)
 	{	
 		BOOST_FOREACH(const string& token, tokens)
@@ -94,6 +100,12 @@ public:
 	{
 		objectDefaultRule_ = allow;
 		commandDefaultRule_ = allow;
+		generation_ = 1;
+	}
+
+	unsigned int GetGeneration() const
+	{
+		return generation_;
 	}
 
 	void AddObjectRule(const string& objectType, const string& objectName, 
@@ -107,6 +119,8 @@ public:
 			cmd.allows.insert(token);
 		else if(RuleResult == deny)
 			cmd.denies.insert(token);
+
+		++generation_;
 	}
 
 	void SetObjectDefaultRule(const string& objectType, const string& objectName, RuleResult defaultRule)
@@ -116,11 +130,15 @@ public:
 		OBJECT& obj = objectRules_[fullQualifiedName];
 
 		obj.defaultRule = defaultRule;
+
+		++generation_;
 	}
 
 	void SetDefaultRule(RuleResult defaultRule)
 	{
 		objectDefaultRule_ = defaultRule;
+
+		++generation_;
 	}
 
 	RuleResult CheckCommandAccess(const string& command, const vector<string>& tokens)
@@ -134,6 +152,22 @@ public:
 	}
 
 	
+	//
+	// false if every command gets the same decision for this object,
+	// so it can be checked once and cached for all of them
+	//
+	bool HasCommandRules(const string& objectType, const string& objectName) const
+	{
+		ObjectRules::const_iterator iobj = objectRules_.find(objectType + "/" + objectName);
+
+		if(iobj == objectRules_.end())
+			return false;
+
+		const OBJECT::CommandMap& commands = iobj->second.commands;
+
+		return !commands.empty() && !(commands.size() == 1 && commands.begin()->first == "*");
+	}
+
 	RuleResult CheckObjectAccess(const string& objectType, const string& objectName, 
 		const string& command, const string& token)
 	{
@@ -18,14 +18,24 @@ Copyright 2010 Rodrigo Strauss (http://www.1bit.com.br)
 
 #include <map>
 #include <list>
+#include <set>
+#include <unordered_map>
 #include <vector>
 #include <string>
+#include <algorithm>
 #include <iostream>
 
 #include <sstream>
+#include <atomic>
+#include <functional>
+#include <memory>
 
 namespace logdb
 {
+	//
+	// file offsets are 64 bits since format version 2
+	//
+	typedef unsigned long long LDB_OFFSET;
 	
 #ifdef _WIN32
 	class File
@@ -87,16 +97,20 @@ namespace logdb
 			return written;
 		}
 
-		void SetPointer(DWORD offset)
+		void SetPointer(LDB_OFFSET offset)
 		{
 			ASSERT(IsValid());
-			SetFilePointer(h, offset, 0, FILE_BEGIN);
+			LARGE_INTEGER distance;
+			distance.QuadPart = offset;
+			SetFilePointerEx(h, distance, NULL, FILE_BEGIN);
 		}
 
-		DWORD GetFileSize()
+		LDB_OFFSET GetFileSize()
 		{
 			ASSERT(IsValid());
-			return ::GetFileSize(h, NULL);
+			LARGE_INTEGER size;
+			::GetFileSizeEx(h, &size);
+			return size.QuadPart;
 		}
 
 		void FlushMetadata()
@@ -104,6 +118,40 @@ namespace logdb
 			ASSERT(IsValid());
 			FlushFileBuffers(h);
 		}
+
+		//
+		// Windows version doesn't sync on every write, the flags passed to
+		// CreateFile decide the caching behaviour
+		//
+		void SetSyncOnWrite(bool syncOnWrite)
+		{
+		}
+
+		void Sync()
+		{
+			ASSERT(IsValid());
+			FlushFileBuffers(h);
+		}
+
+		//
+		// memory mapping is not supported on Windows yet,
+		// PagedFile will keep using its own cache
+		//
+		unsigned char* Map(LDB_OFFSET size)
+		{
+			return NULL;
+		}
+
+		void Unmap(unsigned char* view, LDB_OFFSET size)
+		{
+		}
+
+		//
+		// NTFS journals renames, there's nothing to sync
+		//
+		static void SyncDirectory(const std::string& fileName)
+		{
+		}
 	};
 
 #else
@@ -112,10 +160,11 @@ namespace logdb
 	class File
 	{
 		int _file;	
+		bool _syncOnWrite;
 
 	public:
 		File(int flags = 0) 
-			: _file(-1)
+			: _file(-1), _syncOnWrite(true)
 		{}
 
 		bool Create(const char* name)
@@ -126,7 +175,11 @@ namespace logdb
 
 		void Close()
 		{
+			if(_file == -1)
+				return;
+
 			close(_file);
+			_file = -1;
 		}
 
 		bool Open(const char* name)
@@ -143,21 +196,55 @@ namespace logdb
 		DWORD Write(const void* buffer, DWORD size)
 		{
 			DWORD ret = write(_file, buffer, size);
+
+			if(_syncOnWrite)
+				Sync();
+
+			return ret;
+		}
+
+		//
+		// When sync on write is disabled, caller must call Sync() 
+		// to make the written data durable
+		//
+		void SetSyncOnWrite(bool syncOnWrite)
+		{
+			_syncOnWrite = syncOnWrite;
+		}
+
+		void Sync()
+		{
 		#ifdef __APPLE__
 			// MACOSX doesn't support fdatasync
 			fsync(_file);
 		#else
 			fdatasync(_file);
 		#endif
-			return ret;
 		}
 
-		void SetPointer(DWORD offset)
+		void SetPointer(LDB_OFFSET offset)
+		{
+			lseek(_file, static_cast<off_t>(offset), SEEK_SET);
+		}
+
+		//
+		// maps the first size bytes of the file for reading. Returns NULL on failure
+		//
+		unsigned char* Map(LDB_OFFSET size)
+		{
+			if(size != static_cast<size_t>(size))
+				return NULL;
+
+			void* view = mmap(NULL, static_cast<size_t>(size), PROT_READ, MAP_SHARED, _file, 0);
+			return view == MAP_FAILED ? NULL : static_cast<unsigned char*>(view);
+		}
+
+		void Unmap(unsigned char* view, LDB_OFFSET size)
 		{
-			lseek(_file, offset, SEEK_SET);
+			munmap(view, static_cast<size_t>(size));
 		}
 
-		DWORD GetFileSize()
+		LDB_OFFSET GetFileSize()
 		{
 			struct stat s;
 
@@ -173,8 +260,24 @@ namespace logdb
 		
 		bool IsValid()
 		{
-			return false;
-			
+			return _file != -1;
+		}
+
+		//
+		// a rename is only durable after the directory that
+		// has the file is synced
+		//
+		static void SyncDirectory(const std::string& fileName)
+		{
+			std::string directory = boost::filesystem::path(fileName).parent_path().string();
+
+			int dir = open(directory.empty() ? "." : directory.c_str(), O_RDONLY);
+
+			if(dir == -1)
+				return;
+
+			fsync(dir);
+			close(dir);
 		}
 	};
 #endif // _WIN32
@@ -184,7 +287,6 @@ namespace logdb
 	class PagedFile
 	{
 		DWORD _pageSize;
-		DWORD _fileSize;
 		File _file;
 
 		typedef std::map<DWORD, unsigned char*> CacheMap;
@@ -195,6 +297,76 @@ namespace logdb
 
 		DWORD _cacheMaxPages, _cacheInMegabytes;
 
+		//
+		// write back mode: written pages are kept dirty in cache
+		// and only go to disk on Flush(), with a single sync
+		//
+		bool _writeBack;
+		bool _needsSync;
+
+		typedef std::set<DWORD> DirtyPagesSet;
+		DirtyPagesSet _dirtyPages;
+
+		//
+		// memory mapped mode: the whole file is mapped and the kernel
+		// does the caching. Page cache above is not used
+		//
+		bool _memoryMapped;
+		unsigned char* _view;
+		LDB_OFFSET _viewSize;
+
+		void MapView()
+		{
+			UnmapView();
+
+			if(!_memoryMapped)
+				return;
+
+			//
+			// pages cached before the file was mapped would be stale
+			//
+			WriteDirtyPages();
+			ClearCache();
+
+			LDB_OFFSET size = _file.GetFileSize();
+
+			if(size == 0)
+				return;
+
+			_view = _file.Map(size);
+
+			if(_view)
+				_viewSize = size;
+		}
+
+		void UnmapView()
+		{
+			if(!_view)
+				return;
+
+			_file.Unmap(_view, _viewSize);
+			_view = NULL;
+			_viewSize = 0;
+		}
+
+		//
+		// Writes don't go through the view. After each sync the kernel write protects
+		// the mapped pages again, and the page faults on the next writes made group
+		// commit a lot slower than plain write() calls. The view shares the OS cache
+		// with the file, so it sees the change right away
+		//
+		void WriteToFile(LDB_OFFSET offset, const void* buffer, DWORD size)
+		{
+			_file.SetPointer(offset);
+			_file.Write(buffer, size);
+
+			if(_writeBack)
+				_needsSync = true;
+
+			if(offset + size > _viewSize)
+				MapView();
+		}
+
 		void* GetPage(DWORD page)
 		{
 			CacheMap::const_iterator i = _cache.find(page);
@@ -202,7 +374,7 @@ namespace logdb
 			if(i != _cache.end())
 				return i->second;
 
-			DWORD offset = page * _pageSize;
+			LDB_OFFSET offset = static_cast<LDB_OFFSET>(page) * _pageSize;
 			unsigned char* buffer;
 
 			//
@@ -214,6 +386,13 @@ namespace logdb
 
 				ASSERT(i != _cache.end());
 
+				//
+				// dirty page must go to the file before we reuse the buffer.
+				// It will only be synced on next Flush()
+				//
+				if(_dirtyPages.erase(i->first))
+					FlushPage(i->first);
+
 				buffer = i->second;
 
 				_currentCachePagesList.pop_front();
@@ -238,20 +417,28 @@ namespace logdb
 			if(i == _cache.end())
 				return;
 
-			DWORD offset = page * _pageSize;
+			LDB_OFFSET offset = static_cast<LDB_OFFSET>(page) * _pageSize;
 
 			_file.SetPointer(offset);
 			_file.Write(i->second, _pageSize);
+
+			if(_writeBack)
+				_needsSync = true;
 		}
 
-		DWORD PageByOffset(DWORD offset)
+		DWORD PageByOffset(LDB_OFFSET offset)
 		{
-			return offset / _pageSize;
+			return static_cast<DWORD>(offset / _pageSize);
 		}
 	public:
 		PagedFile()  
 		{
 			_cacheInMegabytes = 4;
+			_writeBack = false;
+			_needsSync = false;
+			_memoryMapped = false;
+			_view = NULL;
+			_viewSize = 0;
 			SetPageSize(4096);
 		}
 
@@ -260,7 +447,7 @@ namespace logdb
 			Close();
 		}
 
-		void FreeCache()
+		void ClearCache()
 		{
 			for(CacheMap::iterator i = _cache.begin() ; i != _cache.end() ; ++i)
 				delete i->second;
@@ -269,7 +456,13 @@ namespace logdb
 			_currentCachePagesList.clear();
 		}
 
-		DWORD GetFileSize()
+		void FreeCache()
+		{
+			Flush();
+			ClearCache();
+		}
+
+		LDB_OFFSET GetFileSize()
 		{
 			return _file.GetFileSize();
 		}
@@ -288,12 +481,22 @@ namespace logdb
 
 		bool Create(const char* name)
 		{
-			return _file.Create(name);
+			if(!_file.Create(name))
+				return false;
+
+			MapView();
+
+			return true;
 		}
 
 		bool Open(const char* name)
 		{
-			return _file.Open(name);
+			if(!_file.Open(name))
+				return false;
+
+			MapView();
+
+			return true;
 		}
 
 		bool IsValid()
@@ -303,24 +506,95 @@ namespace logdb
 
 		void Close()
 		{
-			_file.Close();
 			FreeCache();
+			UnmapView();
+			_file.Close();
+		}
+
+		void Swap(PagedFile& other)
+		{
+			std::swap(_pageSize, other._pageSize);
+			std::swap(_file, other._file);
+			_cache.swap(other._cache);
+			_currentCachePagesList.swap(other._currentCachePagesList);
+			std::swap(_cacheMaxPages, other._cacheMaxPages);
+			std::swap(_cacheInMegabytes, other._cacheInMegabytes);
+			std::swap(_writeBack, other._writeBack);
+			std::swap(_needsSync, other._needsSync);
+			_dirtyPages.swap(other._dirtyPages);
+			std::swap(_memoryMapped, other._memoryMapped);
+			std::swap(_view, other._view);
+			std::swap(_viewSize, other._viewSize);
+		}
+
+		//
+		// Must be called before Create/Open. If the OS can't map the file
+		// we keep using the page cache
+		//
+		void SetMemoryMapped(bool memoryMapped)
+		{
+			_memoryMapped = memoryMapped;
+		}
+
+		bool IsMemoryMapped()
+		{
+			return _view != NULL;
+		}
+
+		void SetWriteBack(bool writeBack)
+		{
+			if(!writeBack)
+				Flush();
+
+			_writeBack = writeBack;
+			_file.SetSyncOnWrite(!writeBack);
+		}
+
+		bool IsDirty()
+		{
+			return !_dirtyPages.empty() || _needsSync;
+		}
+
+		//
+		// writes dirty pages to the file without syncing it,
+		// data will be in OS cache only
+		//
+		void WriteDirtyPages()
+		{
+			for(DirtyPagesSet::const_iterator i = _dirtyPages.begin() ; i != _dirtyPages.end() ; ++i)
+				FlushPage(*i);
+
+			_dirtyPages.clear();
+		}
+
+		//
+		// writes all dirty pages and syncs the file once
+		//
+		void Flush()
+		{
+			WriteDirtyPages();
+
+			if(!_needsSync)
+				return;
+
+			_file.Sync();
+			_needsSync = false;
 		}
 
 		template <class T>
-		DWORD Read(DWORD offset, T& structBuffer)
+		DWORD Read(LDB_OFFSET offset, T& structBuffer)
 		{
 			return Read(offset, &structBuffer, sizeof(structBuffer));
 		}
 
 		template <class T>
-		DWORD Write(DWORD offset, const T& structBuffer)
+		DWORD Write(LDB_OFFSET offset, const T& structBuffer)
 		{
 			return Write(offset, &structBuffer, sizeof(structBuffer));
 		}
 
 		template <class T>
-		DWORD Write(DWORD offset, T* structBuffer)
+		DWORD Write(LDB_OFFSET offset, T* structBuffer)
 		{
 			//
 			// GCC doesn't like it, he'll validate this even if this template
@@ -330,11 +604,23 @@ namespace logdb
 #endif
 		}
 
-		DWORD Read(DWORD offset, void* buffer, DWORD size)
+		DWORD Read(LDB_OFFSET offset, void* buffer, DWORD size)
 		{
+			if(_view)
+			{
+				if(offset >= _viewSize)
+					return 0;
+
+				if(_viewSize - offset < size)
+					size = static_cast<DWORD>(_viewSize - offset);
+
+				memcpy(buffer, _view + offset, size);
+				return size;
+			}
+
 			DWORD remaining = size;
 			DWORD pageNumber = PageByOffset(offset);
-			DWORD pageOffset = offset % _pageSize;
+			DWORD pageOffset = static_cast<DWORD>(offset % _pageSize);
 			unsigned char* ucharBuffer = (unsigned char*)buffer;
 
 			while(remaining > 0)
@@ -359,11 +645,17 @@ namespace logdb
 			return size - remaining;
 		}
 
-		DWORD Write(DWORD offset, const void* buffer, DWORD size)
+		DWORD Write(LDB_OFFSET offset, const void* buffer, DWORD size)
 		{
+			if(_view)
+			{
+				WriteToFile(offset, buffer, size);
+				return size;
+			}
+
 			DWORD remaining = size;
 			DWORD pageNumber = PageByOffset(offset);
-			DWORD pageOffset = offset % _pageSize;
+			DWORD pageOffset = static_cast<DWORD>(offset % _pageSize);
 			unsigned char* ucharBuffer = (unsigned char*)buffer;
 
 			while(remaining > 0)
@@ -375,7 +667,10 @@ namespace logdb
 
 				memcpy(pageBuffer, ucharBuffer, toWrite);
 
-				FlushPage(pageNumber);
+				if(_writeBack)
+					_dirtyPages.insert(pageNumber);
+				else
+					FlushPage(pageNumber);
 
 				remaining -= toWrite;
 
@@ -404,33 +699,41 @@ namespace logdb
 			delete[] buffer;
 
 			_file.FlushMetadata();
+
+			if(_memoryMapped)
+				MapView();
 		}
 	};
 
+	//
+	// 64 bit fields are kept 8 byte aligned, so the layout is the
+	// same on every compiler
+	//
 	struct LDB_FILE_HEADER
 	{
 		DWORD magic;
 		DWORD version;
 		DWORD flags;
-		DWORD tableBlockOffset;
+		DWORD reserved;
+		LDB_OFFSET tableBlockOffset;
 	};
 
 	struct LDB_BLOCK_HEADER
 	{
 		DWORD size;
 		DWORD usedCount;
-		DWORD nextBlockOffset;
+		LDB_OFFSET nextBlockOffset;
 	};
 
 	struct LDB_BLOCK_HEADER_INFO
 	{
 		LDB_BLOCK_HEADER blockHeader;
-		DWORD offset;
+		LDB_OFFSET offset;
 	};
 
 	struct LDB_LOG_RECORD_FIELD
 	{
-		DWORD dataOffset;
+		LDB_OFFSET dataOffset;
 		DWORD dataSize;
 		DWORD hash;
 	};
@@ -440,12 +743,89 @@ namespace logdb
 		DWORD operation;
 		DWORD recordIndex;
 		DWORD recordID;
+		DWORD reserved;
 		LDB_LOG_RECORD_FIELD key;
 		LDB_LOG_RECORD_FIELD value;
 		LDB_LOG_RECORD_FIELD metadata;
 	};
 
+	//
+	// format version 1, with 32 bit offsets. Only used to
+	// convert old files, see LdbV1Migrator
+	//
+	struct LDB_V1_FILE_HEADER
+	{
+		DWORD magic;
+		DWORD version;
+		DWORD flags;
+		DWORD tableBlockOffset;
+	};
+
+	struct LDB_V1_BLOCK_HEADER
+	{
+		DWORD size;
+		DWORD usedCount;
+		DWORD nextBlockOffset;
+	};
+
+	struct LDB_V1_LOG_RECORD_FIELD
+	{
+		DWORD dataOffset;
+		DWORD dataSize;
+		DWORD hash;
+	};
+
+	struct LDB_V1_LOG_RECORD
+	{
+		DWORD operation;
+		DWORD recordIndex;
+		DWORD recordID;
+		LDB_V1_LOG_RECORD_FIELD key;
+		LDB_V1_LOG_RECORD_FIELD value;
+		LDB_V1_LOG_RECORD_FIELD metadata;
+	};
+
+	//
+	// Checkpoint file: record index of every table and the position of the
+	// last log record of each table. Startup loads it and replays only the
+	// log records written after it. Layout is
+	//
+	//   LDB_CHECKPOINT_HEADER
+	//   LDB_CHECKPOINT_TABLE, name, records (metatable first, with no name)
+	//   LDB_CHECKPOINT_TABLE, name, records
+	//   ...
+	//
+	// Tables that were not loaded have no records, recordCount is just
+	// the record count in this case. With LDB_CHECKPOINT_TABLE_LOG_RECORDS
+	// it's a log record count, the table was never loaded
+	//
+	struct LDB_CHECKPOINT_HEADER
+	{
+		DWORD magic;
+		DWORD version;
+		DWORD tableCount;
+		DWORD lastRecordID;
+		LDB_OFFSET nextDataOffset;
+		unsigned long long totalLogRecordCount;
+	};
+
+	struct LDB_CHECKPOINT_TABLE
+	{
+		DWORD nameSize;
+		DWORD lastLogRecordID;
+		LDB_OFFSET firstBlockOffset;
+		LDB_BLOCK_HEADER_INFO lastBlockHeaderInfo;
+		DWORD recordCount;
+		DWORD flags;
+	};
+
+	static const DWORD LDB_CHECKPOINT_TABLE_NOT_LOADED = 1;
+	static const DWORD LDB_CHECKPOINT_TABLE_LOG_RECORDS = 2;
+
 	static const DWORD LDB_MAGIC = '*BDL';
+	static const DWORD LDB_FORMAT_VERSION = 2;
+	static const DWORD LDB_CHECKPOINT_MAGIC = 'PKCL';
+	static const DWORD LDB_CHECKPOINT_VERSION = 3;
 	static const DWORD OPERATION_APPEND	= 1;
 	static const DWORD OPERATION_INSERT = 2;
 	static const DWORD OPERATION_SET = 3;
@@ -529,879 +909,2945 @@ namespace logdb
 		}
 	};
 
-	static const DWORD LDB_INVALID_RECNO = 0xFFFFFFFF;
-
-	class Ldb
+	enum LdbCachePolicy
 	{
-	public:
-		PagedFile _file;
-
-		LDB_FILE_HEADER _header;
-
-		DWORD _nextDataOffset;
-		DWORD _growPagesStep;
-		DWORD _defaultBlockSize;
-
-		DWORD _totalRecordCount;
-		DWORD _totalLogRecordCount;
-		DWORD _lastRecordID;
+		cachePolicyClock,
+		cachePolicyLru
+	};
 
-		struct TABLE_INFO
+	//
+	// Cache of field data by file offset. Data is never overwritten in a logdb
+	// file, so entries can't get stale, they only must be dropped when the file
+	// is replaced. Memory is limited by a byte budget. CLOCK eviction only sets
+	// a flag on hits, LRU moves the entry to the front of the list
+	//
+	class LdbValueCache
+	{
+		struct ENTRY
 		{
-			typedef std::vector<LDB_LOG_RECORD> RecordsVector;
-
-			std::string name;
-			LDB_BLOCK_HEADER_INFO lastBlockHeaderInfo;
-			RecordsVector records;
+			LDB_OFFSET offset;
+			std::string data;
+			bool referenced;
 		};
 
-		TABLE_INFO _metatable;
-
-		typedef std::map< std::string, TABLE_INFO > TableMap;
-		TableMap _tables;
+		typedef std::list<ENTRY> EntryList;
+		typedef std::unordered_map<LDB_OFFSET, EntryList::iterator> EntryMap;
 
 		//
-		// no copy
+		// LRU: most recent first. CLOCK: circular, starting at _hand
 		//
-		Ldb(const Ldb&);
-		Ldb& operator=(const Ldb&);
+		EntryList _entries;
+		EntryMap _entryMap;
+		EntryList::iterator _hand;
 
-		DWORD LoadAllBlocks(TABLE_INFO* tableInfo)
-		{
-			DWORD nextTableOffset = tableInfo->lastBlockHeaderInfo.offset;
+		LdbCachePolicy _policy;
+		size_t _maxBytes, _usedBytes;
+		unsigned long long _hits, _misses, _evictions;
 
-			ASSERT(nextTableOffset);
+		static size_t EntrySize(size_t dataSize)
+		{
+			//
+			// list node + hash map node
+			//
+			return dataSize + sizeof(ENTRY) + 6 * sizeof(void*);
+		}
 
-			DWORD a;
+		void Evict()
+		{
+			EntryList::iterator victim;
 
-			for(a = 0 ; nextTableOffset != 0 ;a++)
+			if(_policy == cachePolicyLru)
+				victim = --_entries.end();
+			else
 			{
-				tableInfo->lastBlockHeaderInfo.offset = nextTableOffset;
-
-				LoadBlock(tableInfo);
+				//
+				// second chance for entries used since the hand passed by
+				//
+				for(;;)
+				{
+					if(_hand == _entries.end())
+						_hand = _entries.begin();
 
-				ASSERT(tableInfo->lastBlockHeaderInfo.blockHeader.nextBlockOffset == 0 || 
-					tableInfo->lastBlockHeaderInfo.blockHeader.nextBlockOffset > 
-					nextTableOffset + tableInfo->lastBlockHeaderInfo.blockHeader.size);
+					if(!_hand->referenced)
+						break;
 
-				nextTableOffset = tableInfo->lastBlockHeaderInfo.blockHeader.nextBlockOffset;
+					_hand->referenced = false;
+					++_hand;
+				}
 
+				victim = _hand++;
 			}
 
-			return a;
+			_usedBytes -= EntrySize(victim->data.size());
+			_entryMap.erase(victim->offset);
+			_entries.erase(victim);
+			_evictions++;
 		}
 
-		void CheckUnitialized(DWORD offset, DWORD size)
+	public:
+		LdbValueCache() :
+			_hand(_entries.end()),
+			_policy(cachePolicyClock),
+			_maxBytes(0),
+			_usedBytes(0),
+			_hits(0),
+			_misses(0),
+			_evictions(0)
 		{
-#ifdef _DEBUG
-			unsigned char* buffer = new unsigned char[size];
+		}
 
-			DWORD read = _file.Read(offset, buffer, size);
-			
-			for(DWORD a = 0 ; a < read ; a++)
-				ASSERT(buffer[a] == 0xEE);
+		void SetLimit(size_t maxBytes, LdbCachePolicy policy)
+		{
+			Clear();
+			_maxBytes = maxBytes;
+			_policy = policy;
+		}
 
-			delete buffer;
-#endif //_DEBUG
+		void Clear()
+		{
+			_entries.clear();
+			_entryMap.clear();
+			_hand = _entries.end();
+			_usedBytes = 0;
 		}
 
-		void LoadTables()
+		bool Get(LDB_OFFSET offset, DWORD size, LdbData* data)
 		{
-			_nextDataOffset = 0;
-			_totalRecordCount = 0;
-			_totalLogRecordCount = 0;
+			if(_maxBytes == 0)
+				return false;
 
-			LoadAllBlocks(&_metatable);
+			EntryMap::iterator i = _entryMap.find(offset);
 
-			for(TABLE_INFO::RecordsVector::iterator i = _metatable.records.begin() ; 
-				i != _metatable.records.end() ;
-				++i)
+			if(i == _entryMap.end() || i->second->data.size() != size)
 			{
-				LDB_LOG_RECORD& record = *i;
-				LdbData key;
+				_misses++;
+				return false;
+			}
 
-				TABLE_INFO tableInfo;
+			_hits++;
 
-				ASSERT(record.key.dataOffset != 0 && record.value.dataSize != 0);
+			ENTRY& entry = *i->second;
 
-				ReadField(&record.key, &key);
-				ASSERT(key.GetSize());
+			if(_policy == cachePolicyLru)
+				_entries.splice(_entries.begin(), _entries, i->second);
+			else
+				entry.referenced = true;
 
-				//
-				// only fill the offset, LoadAllBlocks function will
-				// load it
-				//
-				ASSERT(record.value.dataSize > sizeof(LDB_BLOCK_HEADER));
-				tableInfo.lastBlockHeaderInfo.offset = record.value.dataOffset;
+			memcpy(data->Alloc(size), entry.data.data(), size);
+
+			return true;
+		}
+
+		void Put(LDB_OFFSET offset, const void* buffer, DWORD size)
+		{
+			//
+			// big values would evict too many small ones
+			//
+			if(size == 0 || EntrySize(size) > _maxBytes / 8)
+				return;
 
-				tableInfo.name = std::string((char*)key.GetBuffer(), key.GetSize());
+			if(_entryMap.find(offset) != _entryMap.end())
+				return;
 
-				LoadAllBlocks(&tableInfo);
+			while(_usedBytes + EntrySize(size) > _maxBytes && !_entries.empty())
+				Evict();
+
+			ENTRY entry;
+			entry.offset = offset;
+			entry.referenced = false;
 
-				_tables[tableInfo.name] = tableInfo;
-			}
-			
 			//
-			// Can't check it here. If process crashes in the middle of a record write,
-			// the last bytes will have parts of the written record (but it will not
-			// be marked as valid). So, we can't assure the last bytes will be 0xEE
+			// new CLOCK entries go right behind the hand, so they're the last to be checked
 			//
-			//CheckUnitialized(_nextDataOffset, 200);
+			EntryList::iterator inserted = _entries.insert(_policy == cachePolicyLru ? _entries.begin() : _hand, entry);
+			inserted->data.assign(static_cast<const char*>(buffer), size);
+
+			_entryMap[offset] = inserted;
+			_usedBytes += EntrySize(size);
 		}
 
-		bool LoadBlock(LDB_BLOCK_HEADER_INFO* blockHeaderInfo)
+		unsigned long long GetHits() const
 		{
-			_file.Read(blockHeaderInfo->offset, blockHeaderInfo->blockHeader);
+			return _hits;
 		}
 
-		std::vector<std::string> GetTableList()
+		unsigned long long GetMisses() const
 		{
-			std::vector<std::string> ret;
-
-			for(TableMap::const_iterator i = _tables.begin() ; i != _tables.end() ; ++i)
-			{
-				ret.push_back(i->first);
-			}
-
-			return ret;
+			return _misses;
 		}
 
-
-		TABLE_INFO* OpenTable(const std::string& name)
+		unsigned long long GetEvictions() const
 		{
-			TableMap::iterator i = _tables.find(name);
+			return _evictions;
+		}
 
-			return i == _tables.end() ? NULL : &i->second;
+		size_t GetEntryCount() const
+		{
+			return _entries.size();
 		}
 
-		void WriteBlockToFile(const LDB_BLOCK_HEADER_INFO& blockHeaderInfo)
+		size_t GetUsedBytes() const
 		{
-			ASSERT(blockHeaderInfo.offset && blockHeaderInfo.blockHeader.size 
-				&& blockHeaderInfo.offset < _file.GetFileSize());
+			return _usedBytes;
+		}
 
-			_file.Write(blockHeaderInfo.offset, blockHeaderInfo.blockHeader);
+		size_t GetMaxBytes() const
+		{
+			return _maxBytes;
 		}
+	};
 
+	static const DWORD LDB_INVALID_RECNO = 0xFFFFFFFF;
 
-		bool InitializeFile()
-		{	
-			_header.magic = LDB_MAGIC;
-			_header.version = 1;
-			_header.flags = 0;
-			_header.tableBlockOffset = sizeof(LDB_FILE_HEADER);
+	//
+	// in memory index entry. It's the log record without the operation
+	// fields, those only matter while the log is being replayed
+	//
+	struct LDB_RECORD
+	{
+		LDB_LOG_RECORD_FIELD key;
+		LDB_LOG_RECORD_FIELD value;
+		LDB_LOG_RECORD_FIELD metadata;
+	};
 
-			_metatable.lastBlockHeaderInfo.offset = _header.tableBlockOffset;
-			_metatable.lastBlockHeaderInfo.blockHeader.size = _defaultBlockSize;
-			_metatable.lastBlockHeaderInfo.blockHeader.usedCount = 0;
-			_metatable.lastBlockHeaderInfo.blockHeader.nextBlockOffset = 0;
+	inline LDB_RECORD MakeRecord(const LDB_LOG_RECORD& logRecord)
+	{
+		LDB_RECORD record;
 
-			_nextDataOffset = _metatable.lastBlockHeaderInfo.offset +
-				_metatable.lastBlockHeaderInfo.blockHeader.size;
+		record.key = logRecord.key;
+		record.value = logRecord.value;
+		record.metadata = logRecord.metadata;
 
-			LeaveRoom(_nextDataOffset + _file.GetPageSize());
+		return record;
+	}
 
-			//
-			// we'll write the first block before the file header, so the file will not
-			// be valid until we have one block
-			//
-			WriteBlockToFile(_metatable.lastBlockHeaderInfo);
-			_file.Write(0, _header);
+	//
+	// Record index of a table. Records are kept in chunks of at most MAX_CHUNK_SIZE,
+	// so inserting or deleting in the middle (or popping the front of a big list)
+	// only moves the records of one chunk. The first record index of each chunk
+	// is calculated lazily, and positional lookup is a binary search over them
+	//
+	class LdbRecordList
+	{
+		static const size_t MAX_CHUNK_SIZE = 512;
 
-			return true;
-		}
+		typedef std::vector<LDB_RECORD> Chunk;
+		typedef std::vector<Chunk> ChunkVector;
+
+		ChunkVector _chunks;
+		size_t _size;
+
+		//
+		// _chunkStarts is only valid for the first _validChunkStarts chunks
+		//
+		mutable std::vector<size_t> _chunkStarts;
+		mutable size_t _validChunkStarts;
 
-		std::auto_ptr<LDB_LOG_RECORD> LoadLogRecords(const LDB_BLOCK_HEADER_INFO& blockHeaderInfo)
+		void Locate(size_t index, size_t* chunk, size_t* offset) const
 		{
-			if(blockHeaderInfo.blockHeader.usedCount == 0)
-				return std::auto_ptr<LDB_LOG_RECORD>();
+			ASSERT(index < _size);
 
-			DWORD recordBufferSize = blockHeaderInfo.blockHeader.usedCount * sizeof(LDB_LOG_RECORD);
-			std::auto_ptr<LDB_LOG_RECORD> logRecords(new LDB_LOG_RECORD[blockHeaderInfo.blockHeader.usedCount]);
+			while(_validChunkStarts < _chunks.size())
+			{
+				size_t end = _validChunkStarts == 0 ? 0 : 
+					_chunkStarts[_validChunkStarts - 1] + _chunks[_validChunkStarts - 1].size();
 
-			memset(logRecords.get(), 0, recordBufferSize);
+				if(index < end)
+					break;
+
+				_chunkStarts[_validChunkStarts] = end;
+				_validChunkStarts++;
+			}
 
-			_file.Read(blockHeaderInfo.offset +  sizeof(LDB_BLOCK_HEADER), logRecords.get(), recordBufferSize);
+			*chunk = (std::upper_bound(_chunkStarts.begin(), _chunkStarts.begin() + _validChunkStarts, index) - _chunkStarts.begin()) - 1;
+			*offset = index - _chunkStarts[*chunk];
 
-			return logRecords;
+			ASSERT(*offset < _chunks[*chunk].size());
 		}
 
-		bool DeleteTable(TABLE_INFO* tableInfo)
+		void InvalidateChunkStarts(size_t firstInvalid)
 		{
-			DWORD index = static_cast<DWORD>(FindKey(&_metatable, 0, 
-				LdbData(tableInfo->name.c_str(), static_cast<DWORD>(tableInfo->name.size()), LdbData::dontCopyBuffer)));
-
-			if(index == LDB_INVALID_RECNO)
-				return false;
-			
-			DeleteByIndex(&_metatable, index);
+			if(firstInvalid < _validChunkStarts)
+				_validChunkStarts = firstInvalid;
+		}
 
-			_tables.erase(tableInfo->name);
+		void InsertChunk(size_t chunk)
+		{
+			_chunks.insert(_chunks.begin() + chunk, Chunk());
+			_chunkStarts.insert(_chunkStarts.begin() + chunk, 0);
+			InvalidateChunkStarts(chunk);
+		}
 
-			return true;
+		void EraseChunk(size_t chunk)
+		{
+			_chunks.erase(_chunks.begin() + chunk);
+			_chunkStarts.erase(_chunkStarts.begin() + chunk);
+			InvalidateChunkStarts(chunk);
 		}
 
-		TABLE_INFO* CreateTable(const std::string& name)
+	public:
+		template<typename ListType, typename ValueType>
+		class iterator_base
 		{
-			TableMap::iterator i = _tables.find(name);
+			template<typename, typename> friend class iterator_base;
 
-			if(i != _tables.end())
+			ListType* _list;
+			size_t _chunk, _offset;
+
+		public:
+			iterator_base(ListType* list, size_t chunk, size_t offset) :
+				_list(list), _chunk(chunk), _offset(offset)
+			{}
+
+			//
+			// iterator to const_iterator
+			//
+			template<typename OtherListType, typename OtherValueType>
+			iterator_base(const iterator_base<OtherListType, OtherValueType>& other) :
+				_list(other._list), _chunk(other._chunk), _offset(other._offset)
+			{}
+
+			ValueType& operator*() const
 			{
-				ASSERT(FindKey(&_metatable, 0, 
-					LdbData(name.c_str(), (DWORD)name.size(), LdbData::dontCopyBuffer)) != LDB_INVALID_RECNO);
-				return &i->second;
+				return _list->_chunks[_chunk][_offset];
 			}
-			else
+
+			ValueType* operator->() const
 			{
-				ASSERT(FindKey(&_metatable, 0, 
-					LdbData(name.c_str(), (DWORD)name.size(), LdbData::dontCopyBuffer)) == LDB_INVALID_RECNO);
+				return &_list->_chunks[_chunk][_offset];
 			}
 
-			TABLE_INFO& tableInfo = _tables[name];
+			iterator_base& operator++()
+			{
+				if(++_offset == _list->_chunks[_chunk].size())
+				{
+					_chunk++;
+					_offset = 0;
+				}
 
-			tableInfo.name = name;
-			tableInfo.lastBlockHeaderInfo.blockHeader.nextBlockOffset = 0;
-			tableInfo.lastBlockHeaderInfo.blockHeader.size = _defaultBlockSize;
-			tableInfo.lastBlockHeaderInfo.blockHeader.usedCount = 0;
+				return *this;
+			}
 
-			std::auto_ptr<unsigned char> buffer(new unsigned char[_defaultBlockSize]);
-			memset(buffer.get(), LOGDB_UNINITIALIZED_BYTE, _defaultBlockSize);
-			*((LDB_BLOCK_HEADER*)buffer.get()) = tableInfo.lastBlockHeaderInfo.blockHeader;
+			bool operator==(const iterator_base& other) const
+			{
+				return _chunk == other._chunk && _offset == other._offset;
+			}
 
-			LdbData key(name.c_str(), (DWORD)name.size(), LdbData::dontCopyBuffer);
-			LdbData value(buffer.get(), _defaultBlockSize, LdbData::dontCopyBuffer);
+			bool operator!=(const iterator_base& other) const
+			{
+				return !(*this == other);
+			}
+		};
 
-			DWORD index = Append(&_metatable, &key, &value, NULL);
-			ASSERT(index < _metatable.records.size());
+		typedef iterator_base<LdbRecordList, LDB_RECORD> iterator;
+		typedef iterator_base<const LdbRecordList, const LDB_RECORD> const_iterator;
 
-			tableInfo.lastBlockHeaderInfo.offset = _metatable.records[index].value.dataOffset;
-			ASSERT(tableInfo.lastBlockHeaderInfo.offset > 0 && tableInfo.lastBlockHeaderInfo.offset < _file.GetFileSize());
+		LdbRecordList() :
+			_size(0),
+			_validChunkStarts(0)
+		{
+		}
 
-			return &tableInfo;
+		size_t size() const
+		{
+			return _size;
 		}
 
-		
+		bool empty() const
+		{
+			return _size == 0;
+		}
 
-		void LoadBlock(TABLE_INFO* tableInfo)
+		iterator begin()
 		{
-			//
-			// read block to memory
-			//
-			_file.Read(tableInfo->lastBlockHeaderInfo.offset, tableInfo->lastBlockHeaderInfo.blockHeader);
+			return iterator(this, 0, 0);
+		}
 
-			DWORD afterBlockHeaderOffset = 
-				tableInfo->lastBlockHeaderInfo.offset + tableInfo->lastBlockHeaderInfo.blockHeader.size;
-			
-			if(afterBlockHeaderOffset > _nextDataOffset)
-				_nextDataOffset = afterBlockHeaderOffset;
+		iterator end()
+		{
+			return iterator(this, _chunks.size(), 0);
+		}
 
-			if(tableInfo->lastBlockHeaderInfo.blockHeader.usedCount == 0)
-				return;
-			//
-			// read log records to memory
-			//
-			std::auto_ptr<LDB_LOG_RECORD> logRecords = LoadLogRecords(tableInfo->lastBlockHeaderInfo);
+		const_iterator begin() const
+		{
+			return const_iterator(this, 0, 0);
+		}
 
-			LDB_LOG_RECORD* logRecord = NULL;
+		const_iterator end() const
+		{
+			return const_iterator(this, _chunks.size(), 0);
+		}
 
-			//
-			// do the action specified by the log record
-			//
-			for(DWORD a = 0 ; a < tableInfo->lastBlockHeaderInfo.blockHeader.usedCount ; a++)
-			{
-				logRecord = &logRecords.get()[a];
-				_totalLogRecordCount++;
+		LDB_RECORD& operator[](size_t index)
+		{
+			size_t chunk, offset;
+			Locate(index, &chunk, &offset);
+			return _chunks[chunk][offset];
+		}
 
-				switch(logRecord->operation)
-				{
-				case OPERATION_APPEND:
-					_totalRecordCount++;
-					tableInfo->records.push_back(*logRecord);
-					break;
+		const LDB_RECORD& operator[](size_t index) const
+		{
+			size_t chunk, offset;
+			Locate(index, &chunk, &offset);
+			return _chunks[chunk][offset];
+		}
 
-				case OPERATION_SET:
-					if(logRecord->recordIndex < tableInfo->records.size())
-						tableInfo->records[logRecord->recordIndex] = *logRecord;
-					break;
+		void push_back(const LDB_RECORD& record)
+		{
+			if(_chunks.empty() || _chunks.back().size() >= MAX_CHUNK_SIZE)
+				InsertChunk(_chunks.size());
 
-				case OPERATION_CLEAR:
-					_totalRecordCount -= tableInfo->records.size();
-					tableInfo->records.clear();
-					break;
+			_chunks.back().push_back(record);
+			_size++;
+		}
 
-				case OPERATION_INSERT:
-					if(logRecord->recordIndex == tableInfo->records.size())
-					{
-						_totalRecordCount++;
-						tableInfo->records.push_back(*logRecord);
-					}
-					if(logRecord->recordIndex < tableInfo->records.size())
-					{
-						tableInfo->records.insert(tableInfo->records.begin() + logRecord->recordIndex, *logRecord);
-						_totalRecordCount++;
-					}
-					break;
+		void insert(size_t index, const LDB_RECORD& record)
+		{
+			if(index == _size)
+			{
+				push_back(record);
+				return;
+			}
 
-				case OPERATION_DELETE:
-					if(logRecord->recordIndex < tableInfo->records.size())
-					{
-						tableInfo->records.erase(tableInfo->records.begin() + logRecord->recordIndex);
-						_totalRecordCount--;
-					}
-					break;
-				default:
-					;
-					//ASSERT(false);
-				}
+			size_t chunk, offset;
+			Locate(index, &chunk, &offset);
 
-				//
-				// is this the last record?
+			Chunk& current = _chunks[chunk];
 
-				if(logRecord->recordID > _lastRecordID)
-					_lastRecordID = logRecord->recordID;
+			current.insert(current.begin() + offset, record);
+			_size++;
 
-				DWORD next = 0;
+			InvalidateChunkStarts(chunk + 1);
 
-				//
-				// find the last written field, to calculate how many bytes
-				// we must walk until the next record
-				//
-				if(logRecord->key.dataOffset > logRecord->value.dataOffset)
-					if(logRecord->key.dataOffset > logRecord->metadata.dataOffset)
-						next = logRecord->key.dataOffset + logRecord->key.dataSize;
-					else
-						next = logRecord->metadata.dataOffset + logRecord->metadata.dataSize;
-				else
-					if(logRecord->value.dataOffset > logRecord->metadata.dataOffset)
-						next = logRecord->value.dataOffset + logRecord->value.dataSize;
-					else
-						next = logRecord->metadata.dataOffset + logRecord->metadata.dataSize;
+			//
+			// split full chunks in half
+			//
+			if(current.size() > MAX_CHUNK_SIZE)
+			{
+				InsertChunk(chunk + 1);
 
-				ASSERT(
-					logRecord->operation == OPERATION_DELETE ||
-					logRecord->operation == OPERATION_CLEAR  ||
-					next != 0);
+				Chunk& first = _chunks[chunk];
+				Chunk& second = _chunks[chunk + 1];
+				size_t half = first.size() / 2;
 
-				if(next > _nextDataOffset)
-					_nextDataOffset = next;				
+				second.assign(first.begin() + half, first.end());
+				first.resize(half);
 			}
+		}
 
-			return;
+		void erase(size_t index)
+		{
+			size_t chunk, offset;
+			Locate(index, &chunk, &offset);
+
+			Chunk& current = _chunks[chunk];
+
+			current.erase(current.begin() + offset);
+			_size--;
+
+			if(current.empty())
+				EraseChunk(chunk);
+			else
+				InvalidateChunkStarts(chunk + 1);
 		}
 
+		void clear()
+		{
+			_chunks.clear();
+			_chunkStarts.clear();
+			_validChunkStarts = 0;
+			_size = 0;
+		}
 
-		bool LoadFile()
+		void swap(LdbRecordList& other)
 		{
-			Clear();
+			_chunks.swap(other._chunks);
+			_chunkStarts.swap(other._chunkStarts);
+			std::swap(_size, other._size);
+			std::swap(_validChunkStarts, other._validChunkStarts);
+		}
 
-			//
-			// read file header
-			//
-			_file.Read(0, &_header, sizeof(_header));
+		//
+		// raw access to the chunks, to read and write the
+		// records as arrays (used by checkpoint)
+		//
+		void append(const void* records, size_t count)
+		{
+			const LDB_RECORD* record = static_cast<const LDB_RECORD*>(records);
 
-			if(_header.magic != LDB_MAGIC)
+			while(count)
 			{
-				ASSERT(false);
-				_file.Close();
-				return false;
-			}
-
-			_metatable.lastBlockHeaderInfo.offset = _header.tableBlockOffset;
-
-			DWORD currentPageSize = _file.GetPageSize();
+				if(_chunks.empty() || _chunks.back().size() >= MAX_CHUNK_SIZE)
+					InsertChunk(_chunks.size());
 
-			//
-			// using 4MB page size for load will make it *much* faster
-			//
-			_file.SetPageSize(1024 * 1024 * 4);
+				Chunk& chunk = _chunks.back();
+				size_t toCopy = MAX_CHUNK_SIZE - chunk.size();
 
-			LoadTables();
+				if(toCopy > count)
+					toCopy = count;
 
-			_file.SetPageSize(currentPageSize);
+				size_t oldSize = chunk.size();
+				chunk.resize(oldSize + toCopy);
+				memcpy(&chunk[oldSize], record, toCopy * sizeof(LDB_RECORD));
 
-			return true;
+				record += toCopy;
+				count -= toCopy;
+				_size += toCopy;
+			}
 		}
 
-		DWORD DoHash(const LdbData& data)
+		size_t GetChunkCount() const
 		{
-			return DoHash(data.GetBuffer(), data.GetSize());
+			return _chunks.size();
 		}
 
-		DWORD DoHash(const void* buf, DWORD size)
+		const LDB_RECORD* GetChunk(size_t chunk, size_t* count) const
 		{
-			DWORD hash = 2;
-			unsigned char* buffer = (unsigned char*) buf;
+			*count = _chunks[chunk].size();
+			return &_chunks[chunk][0];
+		}
+	};
 
-			for(DWORD a = 0 ; a < size ; a++)
-				hash ^= buffer[a];
+	class Ldb
+	{
+	public:
+		PagedFile _file;
+
+		LDB_FILE_HEADER _header;
+
+		LDB_OFFSET _nextDataOffset;
+		DWORD _growPagesStep;
+		DWORD _defaultBlockSize;
+
+		DWORD _totalRecordCount;
+		unsigned long long _totalLogRecordCount;
+
+		//
+		// log records of tables never loaded. We don't know how many of
+		// them are live, so they're left out of both sides of NeedsCompaction
+		//
+		unsigned long long _unloadedLogRecordCount;
+		DWORD _lastRecordID;
+
+		//
+		// compaction can't handle tables being deleted while it runs
+		//
+		DWORD _tableDeleteCount;
+
+		std::string _checkpointFileName;
+		bool _loadedFromCheckpoint;
+
+		LdbValueCache _valueCache;
+
+		//
+		// with lazy load, only table names and block positions are loaded
+		// with the file. The records are loaded by LoadTable()
+		//
+		bool _lazyLoad;
+
+		struct TABLE_INFO
+		{
+			typedef LdbRecordList RecordList;
+
+			std::string name;
+			LDB_OFFSET firstBlockOffset;
+			LDB_BLOCK_HEADER_INFO lastBlockHeaderInfo;
+			RecordList records;
+
+			//
+			// record count of a table that is not loaded. If it was
+			// never loaded, logRecordCount of it are log records
+			//
+			bool loaded;
+			DWORD recordCount;
+			DWORD logRecordCount;
+
+			TABLE_INFO() : 
+				firstBlockOffset(0),
+				loaded(true),
+				recordCount(0),
+				logRecordCount(0)
+			{
+			}
+		};
+
+		TABLE_INFO _metatable;
+
+		typedef std::map< std::string, TABLE_INFO > TableMap;
+		TableMap _tables;
+
+		//
+		// Group commit. Writes stay in the page cache and block headers are
+		// kept here until Commit(). Block headers are what make log records
+		// visible, so they are only written after the records are on disk
+		//
+		bool _groupCommit;
+
+		struct PENDING_BLOCK_HEADER
+		{
+			LDB_BLOCK_HEADER blockHeader;
+			const TABLE_INFO* tableInfo;
+		};
+
+		typedef std::map<LDB_OFFSET, PENDING_BLOCK_HEADER> PendingBlockHeadersMap;
+		PendingBlockHeadersMap _pendingBlockHeaders;
+
+		//
+		// no copy
+		//
+		Ldb(const Ldb&);
+		Ldb& operator=(const Ldb&);
+
+		//
+		// What loading tables found out about the file. Tables are loaded by many
+		// threads, each one with its own state, added to the Ldb by MergeLoadState
+		//
+		struct LOAD_STATE
+		{
+			PagedFile* file;
+			LDB_OFFSET nextDataOffset;
+			DWORD lastRecordID;
+			unsigned long long logRecordCount;
+			unsigned long long unloadedLogRecordCount;
+			long long recordCount;
+			bool failed;
+
+			explicit LOAD_STATE(PagedFile* file) :
+				file(file),
+				nextDataOffset(0),
+				lastRecordID(0),
+				logRecordCount(0),
+				unloadedLogRecordCount(0),
+				recordCount(0),
+				failed(false)
+			{
+			}
+		};
+
+		void MergeLoadState(const LOAD_STATE& state)
+		{
+			if(state.nextDataOffset > _nextDataOffset)
+				_nextDataOffset = state.nextDataOffset;
+
+			if(state.lastRecordID > _lastRecordID)
+				_lastRecordID = state.lastRecordID;
+
+			_totalLogRecordCount += state.logRecordCount;
+			_unloadedLogRecordCount += state.unloadedLogRecordCount;
+			_totalRecordCount = static_cast<DWORD>(_totalRecordCount + state.recordCount);
+		}
+
+		//
+		// takes a table that is not loaded out of the counters
+		//
+		void RemoveUnloadedTableCounts(TABLE_INFO* tableInfo)
+		{
+			_totalRecordCount -= tableInfo->recordCount - tableInfo->logRecordCount;
+			_unloadedLogRecordCount -= tableInfo->logRecordCount;
+		}
+
+		struct TABLE_LOAD_JOB
+		{
+			TABLE_INFO* tableInfo;
+			DWORD firstRecord;
+			bool metadataOnly;
+			unsigned int microseconds;
+
+			TABLE_LOAD_JOB(TABLE_INFO* tableInfo, DWORD firstRecord, bool metadataOnly) :
+				tableInfo(tableInfo),
+				firstRecord(firstRecord),
+				metadataOnly(metadataOnly),
+				microseconds(0)
+			{
+			}
+		};
+
+		typedef std::vector<TABLE_LOAD_JOB> TableLoadJobs;
+
+		//
+		// slowest tables of the last load, in microseconds
+		//
+		typedef std::vector< std::pair<std::string, unsigned int> > TableLoadTimes;
+		static const size_t MAX_TABLE_LOAD_TIMES = 5;
+		TableLoadTimes _tableLoadTimes;
+
+		typedef std::function<void (size_t loadedTables, size_t tableCount)> LoadProgressCallback;
+		LoadProgressCallback _loadProgressCallback;
+		unsigned int _loadThreads;
+
+		std::string _fileName;
+
+		static void LoadTablesThread(LOAD_STATE* state, TableLoadJobs* jobs, std::atomic<size_t>* nextJob, std::atomic<size_t>* doneJobs)
+		{
+			try
+			{
+				for(;;)
+				{
+					size_t index = (*nextJob)++;
+
+					if(index >= jobs->size())
+						break;
+
+					TABLE_LOAD_JOB& job = (*jobs)[index];
+					boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+					if(job.metadataOnly)
+						LoadTableMetadata(state, job.tableInfo, job.firstRecord);
+					else
+						LoadAllBlocks(state, job.tableInfo, job.firstRecord);
+
+					job.microseconds = static_cast<unsigned int>(
+						(boost::posix_time::microsec_clock::universal_time() - start).total_microseconds());
+
+					(*doneJobs)++;
+				}
+			}
+			catch(std::exception&)
+			{
+				state->failed = true;
+				*nextJob = jobs->size();
+			}
+		}
+
+		//
+		// Block chains of different tables are independent, so tables are
+		// loaded by a thread pool, each thread reading with its own file handle.
+		// Progress callback is called every second from the caller thread
+		//
+		void LoadTables(TableLoadJobs* jobs)
+		{
+			if(jobs->empty())
+				return;
+
+			size_t threadCount = _loadThreads ? _loadThreads : 1;
+
+			if(threadCount > jobs->size())
+				threadCount = jobs->size();
+
+			std::atomic<size_t> nextJob(0), doneJobs(0);
+
+			std::vector< std::shared_ptr<PagedFile> > files;
+			std::vector<LOAD_STATE> states;
+			std::vector< std::shared_ptr<boost::thread> > threads;
+
+			for(size_t a = 0 ; a < threadCount ; a++)
+			{
+				std::shared_ptr<PagedFile> file(new PagedFile());
+
+				//
+				// big pages make load faster, but each thread has its own cache
+				//
+				file->SetPageSize(1024 * 1024);
+
+				if(!file->Open(_fileName.c_str()))
+					throw std::runtime_error("error opening logdb file for loading");
+
+				files.push_back(file);
+				states.push_back(LOAD_STATE(file.get()));
+			}
+
+			for(size_t a = 0 ; a < threadCount ; a++)
+			{
+				threads.push_back(std::shared_ptr<boost::thread>(
+					new boost::thread(boost::bind(&Ldb::LoadTablesThread, &states[a], jobs, &nextJob, &doneJobs))));
+			}
+
+			for(size_t a = 0 ; a < threadCount ; a++)
+			{
+				while(!threads[a]->timed_join(boost::posix_time::seconds(1)))
+				{
+					if(_loadProgressCallback)
+						_loadProgressCallback(doneJobs, jobs->size());
+				}
+			}
+
+			for(size_t a = 0 ; a < threadCount ; a++)
+			{
+				if(states[a].failed)
+					throw std::runtime_error("error loading logdb tables");
+
+				MergeLoadState(states[a]);
+			}
+
+			_tableLoadTimes.clear();
+
+			for(TableLoadJobs::const_iterator i = jobs->begin() ; i != jobs->end() ; ++i)
+				_tableLoadTimes.push_back(std::make_pair(i->tableInfo->name, i->microseconds));
+
+			size_t timesToKeep = MAX_TABLE_LOAD_TIMES < _tableLoadTimes.size() ? MAX_TABLE_LOAD_TIMES : _tableLoadTimes.size();
+
+			std::partial_sort(_tableLoadTimes.begin(), _tableLoadTimes.begin() + timesToKeep, _tableLoadTimes.end(),
+				[](const TableLoadTimes::value_type& l, const TableLoadTimes::value_type& r) { return l.second > r.second; });
+
+			_tableLoadTimes.resize(timesToKeep);
+		}
+
+		//
+		// firstRecord is the first log record of the first block to be loaded,
+		// used to replay only what was written after a checkpoint
+		//
+		static DWORD LoadAllBlocks(LOAD_STATE* state, TABLE_INFO* tableInfo, DWORD firstRecord = 0)
+		{
+			LDB_OFFSET nextTableOffset = tableInfo->lastBlockHeaderInfo.offset;
+
+			ASSERT(nextTableOffset);
+
+			DWORD a;
+
+			for(a = 0 ; nextTableOffset != 0 ;a++)
+			{
+				tableInfo->lastBlockHeaderInfo.offset = nextTableOffset;
+
+				LoadBlock(state, tableInfo, a == 0 ? firstRecord : 0);
+
+				//
+				// next block can start right after this one
+				//
+				ASSERT(tableInfo->lastBlockHeaderInfo.blockHeader.nextBlockOffset == 0 || 
+					tableInfo->lastBlockHeaderInfo.blockHeader.nextBlockOffset >= 
+					nextTableOffset + tableInfo->lastBlockHeaderInfo.blockHeader.size);
+
+				nextTableOffset = tableInfo->lastBlockHeaderInfo.blockHeader.nextBlockOffset;
+
+			}
+
+			return a;
+		}
+
+		void CheckUnitialized(LDB_OFFSET offset, DWORD size)
+		{
+#ifdef _DEBUG
+			unsigned char* buffer = new unsigned char[size];
+
+			DWORD read = _file.Read(offset, buffer, size);
+			
+			for(DWORD a = 0 ; a < read ; a++)
+				ASSERT(buffer[a] == 0xEE);
+
+			delete buffer;
+#endif //_DEBUG
+		}
+
+		void LoadTables()
+		{
+			_nextDataOffset = 0;
+			_totalRecordCount = 0;
+			_totalLogRecordCount = 0;
+			_unloadedLogRecordCount = 0;
+
+			LOAD_STATE state(&_file);
+			LoadAllBlocks(&state, &_metatable);
+			MergeLoadState(state);
+
+			TableLoadJobs jobs;
+
+			for(TABLE_INFO::RecordList::iterator i = _metatable.records.begin() ; 
+				i != _metatable.records.end() ;
+				++i)
+			{
+				LDB_RECORD& record = *i;
+				LdbData key;
+
+				ASSERT(record.key.dataOffset != 0 && record.value.dataSize != 0);
+
+				ReadField(&record.key, &key);
+				ASSERT(key.GetSize());
+
+				std::string name((char*)key.GetBuffer(), key.GetSize());
+				TABLE_INFO& tableInfo = _tables[name];
+
+				//
+				// only fill the offset, load jobs will load it
+				//
+				ASSERT(record.value.dataSize > sizeof(LDB_BLOCK_HEADER));
+				tableInfo.name = name;
+				tableInfo.firstBlockOffset = record.value.dataOffset;
+				tableInfo.lastBlockHeaderInfo.offset = record.value.dataOffset;
+
+				jobs.push_back(TABLE_LOAD_JOB(&tableInfo, 0, _lazyLoad));
+			}
+
+			LoadTables(&jobs);
+			
+			//
+			// Can't check it here. If process crashes in the middle of a record write,
+			// the last bytes will have parts of the written record (but it will not
+			// be marked as valid). So, we can't assure the last bytes will be 0xEE
+			//
+			//CheckUnitialized(_nextDataOffset, 200);
+		}
+
+		bool LoadBlock(LDB_BLOCK_HEADER_INFO* blockHeaderInfo)
+		{
+			_file.Read(blockHeaderInfo->offset, blockHeaderInfo->blockHeader);
+		}
+
+		std::vector<std::string> GetTableList()
+		{
+			std::vector<std::string> ret;
+
+			for(TableMap::const_iterator i = _tables.begin() ; i != _tables.end() ; ++i)
+			{
+				ret.push_back(i->first);
+			}
+
+			return ret;
+		}
+
+
+		TABLE_INFO* OpenTable(const std::string& name)
+		{
+			TableMap::iterator i = _tables.find(name);
+
+			return i == _tables.end() ? NULL : &i->second;
+		}
+
+		void WriteBlockToFile(const LDB_BLOCK_HEADER_INFO& blockHeaderInfo)
+		{
+			ASSERT(blockHeaderInfo.offset && blockHeaderInfo.blockHeader.size 
+				&& blockHeaderInfo.offset < _file.GetFileSize());
+
+			_file.Write(blockHeaderInfo.offset, blockHeaderInfo.blockHeader);
+		}
+
+
+		bool InitializeFile()
+		{	
+			_header.magic = LDB_MAGIC;
+			_header.version = LDB_FORMAT_VERSION;
+			_header.flags = 0;
+			_header.reserved = 0;
+			_header.tableBlockOffset = sizeof(LDB_FILE_HEADER);
+
+			_metatable.lastBlockHeaderInfo.offset = _header.tableBlockOffset;
+			_metatable.lastBlockHeaderInfo.blockHeader.size = _defaultBlockSize;
+			_metatable.lastBlockHeaderInfo.blockHeader.usedCount = 0;
+			_metatable.lastBlockHeaderInfo.blockHeader.nextBlockOffset = 0;
+
+			_nextDataOffset = _metatable.lastBlockHeaderInfo.offset +
+				_metatable.lastBlockHeaderInfo.blockHeader.size;
+
+			LeaveRoom(_nextDataOffset + _file.GetPageSize());
+
+			//
+			// we'll write the first block before the file header, so the file will not
+			// be valid until we have one block
+			//
+			WriteBlockToFile(_metatable.lastBlockHeaderInfo);
+			_file.Write(0, _header);
+
+			return true;
+		}
+
+		static std::auto_ptr<LDB_LOG_RECORD> LoadLogRecords(PagedFile& file, const LDB_BLOCK_HEADER_INFO& blockHeaderInfo)
+		{
+			if(blockHeaderInfo.blockHeader.usedCount == 0)
+				return std::auto_ptr<LDB_LOG_RECORD>();
+
+			DWORD recordBufferSize = blockHeaderInfo.blockHeader.usedCount * sizeof(LDB_LOG_RECORD);
+			std::auto_ptr<LDB_LOG_RECORD> logRecords(new LDB_LOG_RECORD[blockHeaderInfo.blockHeader.usedCount]);
+
+			memset(logRecords.get(), 0, recordBufferSize);
+
+			file.Read(blockHeaderInfo.offset +  sizeof(LDB_BLOCK_HEADER), logRecords.get(), recordBufferSize);
+
+			return logRecords;
+		}
+
+		bool DeleteTable(TABLE_INFO* tableInfo)
+		{
+			DWORD index = static_cast<DWORD>(FindKey(&_metatable, 0, 
+				LdbData(tableInfo->name.c_str(), static_cast<DWORD>(tableInfo->name.size()), LdbData::dontCopyBuffer)));
+
+			if(index == LDB_INVALID_RECNO)
+				return false;
+			
+			DeleteByIndex(&_metatable, index);
+
+			if(tableInfo->loaded)
+				_totalRecordCount -= static_cast<DWORD>(tableInfo->records.size());
+			else
+				RemoveUnloadedTableCounts(tableInfo);
+
+			_tableDeleteCount++;
+
+			_tables.erase(tableInfo->name);
+
+			return true;
+		}
+
+		TABLE_INFO* CreateTable(const std::string& name)
+		{
+			TableMap::iterator i = _tables.find(name);
+
+			if(i != _tables.end())
+			{
+				ASSERT(FindKey(&_metatable, 0, 
+					LdbData(name.c_str(), (DWORD)name.size(), LdbData::dontCopyBuffer)) != LDB_INVALID_RECNO);
+				return &i->second;
+			}
+			else
+			{
+				ASSERT(FindKey(&_metatable, 0, 
+					LdbData(name.c_str(), (DWORD)name.size(), LdbData::dontCopyBuffer)) == LDB_INVALID_RECNO);
+			}
+
+			TABLE_INFO& tableInfo = _tables[name];
+
+			tableInfo.name = name;
+			tableInfo.lastBlockHeaderInfo.blockHeader.nextBlockOffset = 0;
+			tableInfo.lastBlockHeaderInfo.blockHeader.size = _defaultBlockSize;
+			tableInfo.lastBlockHeaderInfo.blockHeader.usedCount = 0;
+
+			std::auto_ptr<unsigned char> buffer(new unsigned char[_defaultBlockSize]);
+			memset(buffer.get(), LOGDB_UNINITIALIZED_BYTE, _defaultBlockSize);
+			*((LDB_BLOCK_HEADER*)buffer.get()) = tableInfo.lastBlockHeaderInfo.blockHeader;
+
+			LdbData key(name.c_str(), (DWORD)name.size(), LdbData::dontCopyBuffer);
+			LdbData value(buffer.get(), _defaultBlockSize, LdbData::dontCopyBuffer);
+
+			DWORD index = Append(&_metatable, &key, &value, NULL);
+			ASSERT(index < _metatable.records.size());
+
+			tableInfo.firstBlockOffset = _metatable.records[index].value.dataOffset;
+			tableInfo.lastBlockHeaderInfo.offset = tableInfo.firstBlockOffset;
+			ASSERT(tableInfo.lastBlockHeaderInfo.offset > 0 && tableInfo.lastBlockHeaderInfo.offset < _file.GetFileSize());
+
+			return &tableInfo;
+		}
+
+		
+
+		//
+		// does the action specified by the log record, returns how
+		// many records were added (or removed, if negative)
+		//
+		static int ReplayLogRecord(TABLE_INFO::RecordList* records, const LDB_LOG_RECORD& logRecord)
+		{
+			switch(logRecord.operation)
+			{
+			case OPERATION_APPEND:
+				records->push_back(MakeRecord(logRecord));
+				return 1;
+
+			case OPERATION_SET:
+				if(logRecord.recordIndex < records->size())
+					(*records)[logRecord.recordIndex] = MakeRecord(logRecord);
+				return 0;
+
+			case OPERATION_CLEAR:
+				{
+					int removed = static_cast<int>(records->size());
+					records->clear();
+					return -removed;
+				}
+
+			case OPERATION_INSERT:
+				if(logRecord.recordIndex <= records->size())
+				{
+					records->insert(logRecord.recordIndex, MakeRecord(logRecord));
+					return 1;
+				}
+				return 0;
+
+			case OPERATION_DELETE:
+				if(logRecord.recordIndex < records->size())
+				{
+					records->erase(logRecord.recordIndex);
+					return -1;
+				}
+				return 0;
+
+			default:
+				//ASSERT(false);
+				return 0;
+			}
+		}
+
+		static void LoadBlock(LOAD_STATE* state, TABLE_INFO* tableInfo, DWORD firstRecord = 0)
+		{
+			//
+			// read block to memory
+			//
+			state->file->Read(tableInfo->lastBlockHeaderInfo.offset, tableInfo->lastBlockHeaderInfo.blockHeader);
+
+			LDB_OFFSET afterBlockHeaderOffset = 
+				tableInfo->lastBlockHeaderInfo.offset + tableInfo->lastBlockHeaderInfo.blockHeader.size;
+			
+			if(afterBlockHeaderOffset > state->nextDataOffset)
+				state->nextDataOffset = afterBlockHeaderOffset;
+
+			if(tableInfo->lastBlockHeaderInfo.blockHeader.usedCount == 0)
+				return;
+			//
+			// read log records to memory
+			//
+			std::auto_ptr<LDB_LOG_RECORD> logRecords = LoadLogRecords(*state->file, tableInfo->lastBlockHeaderInfo);
+
+			LDB_LOG_RECORD* logRecord = NULL;
+
+			//
+			// do the action specified by the log record
+			//
+			for(DWORD a = firstRecord ; a < tableInfo->lastBlockHeaderInfo.blockHeader.usedCount ; a++)
+			{
+				logRecord = &logRecords.get()[a];
+				state->logRecordCount++;
+
+				state->recordCount += ReplayLogRecord(&tableInfo->records, *logRecord);
+
+				UpdateFilePosition(state, *logRecord);
+			}
+
+			return;
+		}
+
+		static void UpdateFilePosition(LOAD_STATE* state, const LDB_LOG_RECORD& logRecord)
+		{
+			if(logRecord.recordID > state->lastRecordID)
+				state->lastRecordID = logRecord.recordID;
+
+			LDB_OFFSET next = 0;
+
+			//
+			// find the last written field, to calculate how many bytes
+			// we must walk until the next record
+			//
+			if(logRecord.key.dataOffset > logRecord.value.dataOffset)
+				if(logRecord.key.dataOffset > logRecord.metadata.dataOffset)
+					next = logRecord.key.dataOffset + logRecord.key.dataSize;
+				else
+					next = logRecord.metadata.dataOffset + logRecord.metadata.dataSize;
+			else
+				if(logRecord.value.dataOffset > logRecord.metadata.dataOffset)
+					next = logRecord.value.dataOffset + logRecord.value.dataSize;
+				else
+					next = logRecord.metadata.dataOffset + logRecord.metadata.dataSize;
+
+			ASSERT(
+				logRecord.operation == OPERATION_DELETE ||
+				logRecord.operation == OPERATION_CLEAR  ||
+				next != 0);
+
+			if(next > state->nextDataOffset)
+				state->nextDataOffset = next;
+		}
+
+		//
+		// Lazy load. Walks the block chain reading only the block headers, to find
+		// the last block. Records are written in order, and a new block is created
+		// before the data of its first record, so the last block has everything
+		// needed to know where the file ends. Log records are kept apart from the
+		// record count until the table is loaded
+		//
+		static void LoadTableMetadata(LOAD_STATE* state, TABLE_INFO* tableInfo, DWORD firstRecord = 0)
+		{
+			LDB_OFFSET blockOffset = tableInfo->lastBlockHeaderInfo.offset;
+			DWORD logRecordCount = 0;
+
+			ASSERT(blockOffset);
+
+			for(DWORD a = 0 ; blockOffset != 0 ; a++)
+			{
+				LDB_BLOCK_HEADER& blockHeader = tableInfo->lastBlockHeaderInfo.blockHeader;
+
+				tableInfo->lastBlockHeaderInfo.offset = blockOffset;
+				state->file->Read(blockOffset, blockHeader);
+
+				if(blockOffset + blockHeader.size > state->nextDataOffset)
+					state->nextDataOffset = blockOffset + blockHeader.size;
+
+				logRecordCount += blockHeader.usedCount - (a == 0 ? firstRecord : 0);
+
+				blockOffset = blockHeader.nextBlockOffset;
+			}
+
+			std::auto_ptr<LDB_LOG_RECORD> logRecords = LoadLogRecords(*state->file, tableInfo->lastBlockHeaderInfo);
+
+			for(DWORD a = 0 ; a < tableInfo->lastBlockHeaderInfo.blockHeader.usedCount ; a++)
+				UpdateFilePosition(state, logRecords.get()[a]);
+
+			state->logRecordCount += logRecordCount;
+			state->unloadedLogRecordCount += logRecordCount;
+
+			tableInfo->loaded = false;
+			tableInfo->recordCount += logRecordCount;
+			tableInfo->logRecordCount += logRecordCount;
+		}
+
+
+		bool LoadFile()
+		{
+			Clear();
+
+			//
+			// read file header
+			//
+			_file.Read(0, &_header, sizeof(_header));
+
+			//
+			// version 1 files must be converted by LdbV1Migrator first
+			//
+			if(_header.magic != LDB_MAGIC || _header.version != LDB_FORMAT_VERSION)
+			{
+				ASSERT(false);
+				_file.Close();
+				return false;
+			}
+
+			_metatable.lastBlockHeaderInfo.offset = _header.tableBlockOffset;
+
+			DWORD currentPageSize = _file.GetPageSize();
+
+			//
+			// using 4MB page size for load will make it *much* faster
+			//
+			_file.SetPageSize(1024 * 1024 * 4);
+
+			_loadedFromCheckpoint = !_checkpointFileName.empty() && LoadCheckpoint();
+
+			if(!_loadedFromCheckpoint)
+				LoadTables();
+
+			_file.SetPageSize(currentPageSize);
+
+			return true;
+		}
+
+		struct CHECKPOINT_TABLE_INFO
+		{
+			LDB_CHECKPOINT_TABLE checkpointTable;
+			TABLE_INFO tableInfo;
+		};
+
+		static bool ReadFileToBuffer(const std::string& fileName, std::vector<char>* buffer)
+		{
+			File file(0);
+
+			if(!file.Open(fileName.c_str()))
+				return false;
+
+			buffer->resize(file.GetFileSize());
+
+			DWORD read = 0;
+
+			while(read < buffer->size())
+			{
+				DWORD ret = file.Read(&(*buffer)[read], static_cast<DWORD>(buffer->size() - read));
+
+				if(ret == 0 || ret == static_cast<DWORD>(-1))
+					break;
+
+				read += ret;
+			}
+
+			file.Close();
+
+			return read == buffer->size();
+		}
+
+		DWORD GetLastLogRecordID(const LDB_BLOCK_HEADER_INFO& blockHeaderInfo)
+		{
+			if(blockHeaderInfo.blockHeader.usedCount == 0)
+				return 0;
+
+			LDB_LOG_RECORD logRecord;
+
+			_file.Read(blockHeaderInfo.offset + sizeof(LDB_BLOCK_HEADER) + 
+				((blockHeaderInfo.blockHeader.usedCount - 1) * sizeof(LDB_LOG_RECORD)), logRecord);
+
+			return logRecord.recordID;
+		}
+
+		//
+		// checkpoint is only valid if the blocks it points to are still
+		// there, with the same log records
+		//
+		bool ValidateCheckpointTable(const LDB_CHECKPOINT_TABLE& checkpointTable)
+		{
+			const LDB_BLOCK_HEADER_INFO& checkpointBlock = checkpointTable.lastBlockHeaderInfo;
+			LDB_BLOCK_HEADER blockHeader;
+
+			if(checkpointBlock.offset == 0 || checkpointBlock.offset + sizeof(blockHeader) > _file.GetFileSize())
+				return false;
+
+			_file.Read(checkpointBlock.offset, blockHeader);
+
+			if(blockHeader.size != checkpointBlock.blockHeader.size ||
+				blockHeader.usedCount < checkpointBlock.blockHeader.usedCount)
+				return false;
+
+			return GetLastLogRecordID(checkpointBlock) == checkpointTable.lastLogRecordID;
+		}
+
+		bool LoadCheckpoint()
+		{
+			std::vector<char> buffer;
+
+			if(!ReadFileToBuffer(_checkpointFileName, &buffer))
+				return false;
+
+			const char* current = buffer.empty() ? NULL : &buffer[0];
+			const char* end = current + buffer.size();
+
+			LDB_CHECKPOINT_HEADER checkpointHeader;
+
+			if(end - current < (ptrdiff_t)sizeof(checkpointHeader))
+				return false;
+
+			memcpy(&checkpointHeader, current, sizeof(checkpointHeader));
+			current += sizeof(checkpointHeader);
+
+			if(checkpointHeader.magic != LDB_CHECKPOINT_MAGIC || checkpointHeader.version != LDB_CHECKPOINT_VERSION || 
+				checkpointHeader.tableCount == 0)
+				return false;
+
+			//
+			// first one is the metatable
+			//
+			std::vector<CHECKPOINT_TABLE_INFO> checkpointTables(checkpointHeader.tableCount);
+
+			for(DWORD a = 0 ; a < checkpointHeader.tableCount ; a++)
+			{
+				CHECKPOINT_TABLE_INFO& info = checkpointTables[a];
+				LDB_CHECKPOINT_TABLE& checkpointTable = info.checkpointTable;
+
+				if(end - current < (ptrdiff_t)sizeof(checkpointTable))
+					return false;
+
+				memcpy(&checkpointTable, current, sizeof(checkpointTable));
+				current += sizeof(checkpointTable);
+
+				bool loaded = (checkpointTable.flags & LDB_CHECKPOINT_TABLE_NOT_LOADED) == 0;
+				size_t recordsSize = loaded ? checkpointTable.recordCount * sizeof(LDB_RECORD) : 0;
+
+				if((size_t)(end - current) < checkpointTable.nameSize + recordsSize)
+					return false;
+
+				info.tableInfo.name.assign(current, checkpointTable.nameSize);
+				current += checkpointTable.nameSize;
+
+				info.tableInfo.lastBlockHeaderInfo = checkpointTable.lastBlockHeaderInfo;
+				info.tableInfo.loaded = loaded;
+
+				if(loaded)
+					info.tableInfo.records.append(current, checkpointTable.recordCount);
+				else
+				{
+					info.tableInfo.recordCount = checkpointTable.recordCount;
+
+					if(checkpointTable.flags & LDB_CHECKPOINT_TABLE_LOG_RECORDS)
+						info.tableInfo.logRecordCount = checkpointTable.recordCount;
+				}
+
+				current += recordsSize;
+
+				if(!ValidateCheckpointTable(checkpointTable))
+					return false;
+			}
+
+			std::map<std::string, CHECKPOINT_TABLE_INFO*> checkpointTablesByName;
+
+			for(DWORD a = 1 ; a < checkpointHeader.tableCount ; a++)
+				checkpointTablesByName[checkpointTables[a].tableInfo.name] = &checkpointTables[a];
+
+			//
+			// checkpoint is good, now we replay the log records written after it
+			//
+			_nextDataOffset = checkpointHeader.nextDataOffset;
+			_lastRecordID = checkpointHeader.lastRecordID;
+			_totalLogRecordCount = checkpointHeader.totalLogRecordCount;
+			_unloadedLogRecordCount = 0;
+
+			_metatable.records.swap(checkpointTables[0].tableInfo.records);
+			_metatable.lastBlockHeaderInfo = checkpointTables[0].tableInfo.lastBlockHeaderInfo;
+
+			LOAD_STATE state(&_file);
+			LoadAllBlocks(&state, &_metatable, checkpointTables[0].checkpointTable.lastBlockHeaderInfo.blockHeader.usedCount);
+			MergeLoadState(state);
+
+			_totalRecordCount = static_cast<DWORD>(_metatable.records.size());
+
+			//
+			// record counts of the tables at checkpoint time are added here,
+			// the load jobs add what changed after it
+			//
+			TableLoadJobs jobs;
+
+			for(TABLE_INFO::RecordList::iterator i = _metatable.records.begin() ; 
+				i != _metatable.records.end() ;
+				++i)
+			{
+				LdbData key;
+
+				ReadField(&i->key, &key);
+
+				std::string name((char*)key.GetBuffer(), key.GetSize());
+				TABLE_INFO& tableInfo = _tables[name];
+
+				std::map<std::string, CHECKPOINT_TABLE_INFO*>::iterator checkpointTable = checkpointTablesByName.find(name);
+
+				//
+				// if table was created after the checkpoint, we need to load all blocks
+				//
+				tableInfo.name = name;
+				tableInfo.firstBlockOffset = i->value.dataOffset;
+
+				if(checkpointTable != checkpointTablesByName.end() && 
+					checkpointTable->second->checkpointTable.firstBlockOffset == i->value.dataOffset)
+				{
+					TABLE_INFO& checkpointTableInfo = checkpointTable->second->tableInfo;
+					DWORD firstRecord = checkpointTable->second->checkpointTable.lastBlockHeaderInfo.blockHeader.usedCount;
+
+					tableInfo.lastBlockHeaderInfo = checkpointTableInfo.lastBlockHeaderInfo;
+
+					//
+					// tables loaded when the checkpoint was written are the
+					// working set, they're loaded now even with lazy load
+					//
+					if(checkpointTableInfo.loaded)
+					{
+						tableInfo.records.swap(checkpointTableInfo.records);
+						_totalRecordCount += static_cast<DWORD>(tableInfo.records.size());
+
+						jobs.push_back(TABLE_LOAD_JOB(&tableInfo, firstRecord, false));
+					}
+					else if(_lazyLoad)
+					{
+						tableInfo.recordCount = checkpointTableInfo.recordCount;
+						tableInfo.logRecordCount = checkpointTableInfo.logRecordCount;
+						_totalRecordCount += tableInfo.recordCount - tableInfo.logRecordCount;
+						_unloadedLogRecordCount += tableInfo.logRecordCount;
+
+						jobs.push_back(TABLE_LOAD_JOB(&tableInfo, firstRecord, true));
+					}
+					else
+					{
+						//
+						// not loaded in the checkpoint, everything must be read
+						//
+						tableInfo.lastBlockHeaderInfo.offset = i->value.dataOffset;
+
+						jobs.push_back(TABLE_LOAD_JOB(&tableInfo, 0, false));
+					}
+				}
+				else
+				{
+					tableInfo.lastBlockHeaderInfo.offset = i->value.dataOffset;
+
+					jobs.push_back(TABLE_LOAD_JOB(&tableInfo, 0, _lazyLoad));
+				}
+			}
+
+			LoadTables(&jobs);
+
+			return true;
+		}
+
+		DWORD DoHash(const LdbData& data)
+		{
+			return DoHash(data.GetBuffer(), data.GetSize());
+		}
+
+		DWORD DoHash(const void* buf, DWORD size)
+		{
+			DWORD hash = 2;
+			unsigned char* buffer = (unsigned char*) buf;
+
+			for(DWORD a = 0 ; a < size ; a++)
+				hash ^= buffer[a];
+
+			return hash;
+		}
+
+		void Clear()
+		{
+			zero(_header);
+			zero(_metatable.lastBlockHeaderInfo);
+
+			_metatable.records.clear();
+			_tables.clear();
+			_pendingBlockHeaders.clear();
+			_valueCache.Clear();
+			_nextDataOffset = 0;
+			_totalRecordCount = 0;
+			_totalLogRecordCount = 0;
+			_unloadedLogRecordCount = 0;
+			_lastRecordID = 0;
+
+		}
+
+		void LeaveRoom(LDB_OFFSET size)
+		{
+			DWORD pages = static_cast<DWORD>(size / _file.GetPageSize()) + 1;
+
+			if(pages < _growPagesStep)
+				pages = _growPagesStep;
+
+			_file.GrowFile(pages);
+		}
+
+		void EnsureSpace(DWORD size)
+		{
+			LDB_OFFSET space = _file.GetFileSize() - _nextDataOffset;
+
+			if(space < size)
+				LeaveRoom(size - space);
+		}
+
+		void WriteLdbData(const LdbData* ldbData, LDB_LOG_RECORD_FIELD* logRecordField, bool cache)
+		{
+			if(!ldbData)
+				return;
+
+			logRecordField->dataOffset = _nextDataOffset;
+			logRecordField->dataSize = ldbData->GetSize();
+			logRecordField->hash = DoHash(*ldbData);
+
+			EnsureSpace(logRecordField->dataSize);
+
+			ASSERT(_nextDataOffset && _nextDataOffset < _file.GetFileSize());
+
+			DWORD size = ldbData->GetSize();
+
+			_file.Write(_nextDataOffset, ldbData->GetBuffer(), size);
+
+			if(cache)
+				_valueCache.Put(_nextDataOffset, ldbData->GetBuffer(), size);
+
+			_nextDataOffset += logRecordField->dataSize;
+		}
+
+		bool AppendLogRecord(TABLE_INFO* tableInfo, DWORD operation, DWORD recordIndex, 
+			const LdbData* key, const LdbData* value, const LdbData* metadata)
+		{
+			LDB_LOG_RECORD logRecord;
+			LDB_BLOCK_HEADER_INFO* blockHeaderInfo = &tableInfo->lastBlockHeaderInfo;
+			TABLE_INFO::RecordList& records = tableInfo->records;
+
+			ASSERT(tableInfo->loaded);
+			ASSERT(
+				operation == OPERATION_CLEAR || 
+				(operation == OPERATION_INSERT && recordIndex == 0) ||
+				operation == OPERATION_APPEND || 
+				CheckIndex(tableInfo, recordIndex));
+
+			zero(logRecord);
+
+			logRecord.operation = operation;
+			logRecord.recordIndex = recordIndex;
+			logRecord.recordID = ++_lastRecordID;
+
+			LDB_BLOCK_HEADER_INFO newBlockHeaderInfo;
+			bool hasNewBlock;
+
+			hasNewBlock = CreateNewBlockIfNeeded(blockHeaderInfo, &newBlockHeaderInfo);
+
+			//
+			// values just written are likely to be read soon. Except for
+			// the metatable, whose values are table blocks
+			//
+			bool cache = (tableInfo != &_metatable);
+
+			if(key)
+				WriteLdbData(key, &logRecord.key, cache);
+
+			if(value)
+				WriteLdbData(value, &logRecord.value, cache);
+
+			if(metadata)
+				WriteLdbData(metadata, &logRecord.metadata, cache);
+
+			if(operation == OPERATION_SET)
+			{
+				//
+				// caller can keep fields passing NULL
+				//
+				LDB_RECORD& setRecord = records[recordIndex];
+
+				if(key == NULL)
+					logRecord.key = setRecord.key;
+				if(value == NULL)
+					logRecord.value = setRecord.value;
+				if(metadata== NULL)
+					logRecord.metadata = setRecord.metadata;
+			}
+
+			LDB_BLOCK_HEADER_INFO* currentBlockHeaderInfo = hasNewBlock ? &newBlockHeaderInfo : blockHeaderInfo;
+
+			LDB_OFFSET logRecordOffset = currentBlockHeaderInfo->offset + sizeof(LDB_BLOCK_HEADER) +
+				(sizeof(LDB_LOG_RECORD) * currentBlockHeaderInfo->blockHeader.usedCount);
+
+			currentBlockHeaderInfo->blockHeader.usedCount++;
+
+			ASSERT(logRecordOffset && currentBlockHeaderInfo->offset &&
+				logRecordOffset < _file.GetFileSize() && currentBlockHeaderInfo->offset < _file.GetFileSize());
+
+			CheckUnitialized(logRecordOffset, sizeof(logRecord));
+			_file.Write(logRecordOffset, logRecord);
+
+			WriteBlockHeader(tableInfo, *currentBlockHeaderInfo);
+
+			if(hasNewBlock)
+			{
+				ASSERT(blockHeaderInfo->offset && blockHeaderInfo->offset < _file.GetFileSize());
+
+				WriteBlockHeader(tableInfo, *blockHeaderInfo);
+
+				*blockHeaderInfo = newBlockHeaderInfo;
+			}
+
+			switch(operation)
+			{
+			case OPERATION_APPEND:
+				_totalRecordCount++;
+				records.push_back(MakeRecord(logRecord));
+				break;
+			case OPERATION_SET:
+				records[recordIndex] = MakeRecord(logRecord);
+				break;
+			case OPERATION_INSERT:
+				_totalRecordCount++;
+				records.insert(recordIndex, MakeRecord(logRecord));
+				break;
+			case OPERATION_DELETE:
+				_totalRecordCount--;
+				records.erase(recordIndex);
+				break;
+			case OPERATION_CLEAR:
+				_totalRecordCount-= records.size();
+				records.clear();
+				break;
+			}
+
+			_totalLogRecordCount++;
+
+			return true;
+		}
+
+		void WriteBlockHeader(const TABLE_INFO* tableInfo, const LDB_BLOCK_HEADER_INFO& blockHeaderInfo)
+		{
+			if(_groupCommit)
+			{
+				PENDING_BLOCK_HEADER& pending = _pendingBlockHeaders[blockHeaderInfo.offset];
+				pending.blockHeader = blockHeaderInfo.blockHeader;
+				pending.tableInfo = tableInfo;
+			}
+			else
+				_file.Write(blockHeaderInfo.offset, blockHeaderInfo.blockHeader);
+		}
+
+		DWORD CalculateAddedFieldPos(const LdbData* data, LDB_LOG_RECORD_FIELD* field)
+		{
+			if(!data || data->GetSize() == 0)
+			{
+				field->dataOffset = 0;
+				field->dataSize = 0;
+				field->hash = 0;
+				return 0;
+			}
+
+			field->dataOffset = _nextDataOffset;
+			field->dataSize = data->GetSize();
+			field->hash = DoHash(*data);
+			_nextDataOffset += field->dataSize;
+
+			return field->dataSize;
+		}
+
+		void WriteLogRecordFieldData(LDB_LOG_RECORD_FIELD* field, const void* buffer)
+		{
+			if(!buffer || field->dataSize == 0)
+				return;
+
+			ASSERT(field->dataOffset != 0 && field->dataOffset < _file.GetFileSize());
+
+			_file.Write(field->dataOffset, buffer, field->dataSize);
+
+			_nextDataOffset += field->dataSize;
+		}
+
+		bool CheckNeedForNewBlock(const LDB_BLOCK_HEADER& currentBlock)
+		{
+			DWORD nextRecordOffset = sizeof(LDB_FILE_HEADER) + (currentBlock.usedCount * sizeof(LDB_LOG_RECORD));
+			DWORD spaceLeftInThisBlock = currentBlock.size - nextRecordOffset;
+			return spaceLeftInThisBlock < sizeof(LDB_LOG_RECORD);
+		}
+
+
+		bool CreateNewBlockIfNeeded(LDB_BLOCK_HEADER_INFO* currentBlockHeaderInfo, LDB_BLOCK_HEADER_INFO* newBlockHeaderInfo)
+		{
+			if(!CheckNeedForNewBlock(currentBlockHeaderInfo->blockHeader))
+				return false;
+
+			LDB_BLOCK_HEADER* currentBlock = &currentBlockHeaderInfo->blockHeader;
+			LDB_BLOCK_HEADER* newBlock = &newBlockHeaderInfo->blockHeader;
+
+			EnsureSpace(currentBlock->size);
+
+			newBlock->nextBlockOffset = 0;
+			newBlock->size = currentBlock->size;
+			newBlock->usedCount = 0;
+
+			ASSERT(_nextDataOffset && _nextDataOffset < _file.GetFileSize());
+
+			CheckUnitialized(_nextDataOffset, sizeof(*newBlock));
+			_file.Write(_nextDataOffset, *newBlock);
+
+			newBlockHeaderInfo->offset = _nextDataOffset;
+			currentBlock->nextBlockOffset = newBlockHeaderInfo->offset;
+
+			_nextDataOffset += newBlock->size;
+
+			return true;
+		}
+
+		//
+		// metatable values are table blocks, that are changed in place. They're
+		// never read with ReadField, so everything read here can be cached
+		//
+		void ReadField(const LDB_LOG_RECORD_FIELD* field, LdbData* data)
+		{
+			ASSERT(field && data);
+
+			if(_valueCache.Get(field->dataOffset, field->dataSize, data))
+				return;
+
+			_file.Read(field->dataOffset, data->Alloc(field->dataSize), field->dataSize);
+
+			_valueCache.Put(field->dataOffset, data->GetBuffer(), field->dataSize);
+		}
+
+
+	public:
+
+		Ldb()
+		{
+			_totalRecordCount = 0;
+			_totalLogRecordCount = 0;
+			_unloadedLogRecordCount = 0;
+			_defaultBlockSize = 4096;
+			_growPagesStep = (4 * 1024 * 1024) / _file.GetPageSize();
+			_lastRecordID = 0;
+			_tableDeleteCount = 0;
+			_groupCommit = false;
+			_loadedFromCheckpoint = false;
+			_lazyLoad = false;
+			_loadThreads = 1;
+		}
+
+		~Ldb()
+		{
+			Close();
+		}
+
+		bool Create(const char* fileName)
+		{
+			_fileName = fileName;
+
+			bool b = _file.Create(fileName);
+
+			if(!b)
+				return false;
+
+			if(_file.GetFileSize() < sizeof(LDB_FILE_HEADER))
+				return InitializeFile();
+			else
+				return LoadFile();
+		}
+
+		bool Open(const char* fileName)
+		{
+			_fileName = fileName;
+
+			bool b = _file.Open(fileName);
+
+			if(!b)
+				return false;
+
+			return LoadFile();
+		}
+
+		void Close()
+		{
+			Commit();
+			_file.Close();
+			Clear();
+		}
+
+		//
+		// When group commit is enabled, changes are only durable
+		// after Commit() is called
+		//
+		//
+		// must be called before Create/Open. If checkpoint file exists and
+		// matches the log file, loading will only replay the log records
+		// written after it
+		//
+		void SetCheckpointFile(const std::string& checkpointFileName)
+		{
+			_checkpointFileName = checkpointFileName;
+		}
+
+		const std::string& GetCheckpointFile()
+		{
+			return _checkpointFileName;
+		}
+
+		bool LoadedFromCheckpoint()
+		{
+			return _loadedFromCheckpoint;
+		}
+
+		//
+		// must be called before Create()
+		//
+		void SetLazyLoad(bool lazyLoad)
+		{
+			_lazyLoad = lazyLoad;
+		}
+
+		//
+		// tables are loaded by this many threads
+		//
+		void SetLoadThreads(unsigned int loadThreads)
+		{
+			_loadThreads = loadThreads;
+		}
+
+		void SetLoadProgressCallback(const LoadProgressCallback& loadProgressCallback)
+		{
+			_loadProgressCallback = loadProgressCallback;
+		}
+
+		const TableLoadTimes& GetSlowestTableLoads()
+		{
+			return _tableLoadTimes;
+		}
+
+		//
+		// loads the records of a table that was not loaded with the file
+		//
+		void LoadTable(TABLE_INFO* tableInfo)
+		{
+			if(tableInfo->loaded)
+				return;
+
+			RemoveUnloadedTableCounts(tableInfo);
+
+			LOAD_STATE state(&_file);
+
+			tableInfo->lastBlockHeaderInfo.offset = tableInfo->firstBlockOffset;
+			LoadAllBlocks(&state, tableInfo);
+
+			//
+			// log records were already counted by LoadTableMetadata
+			//
+			state.logRecordCount = 0;
+			MergeLoadState(state);
+
+			tableInfo->loaded = true;
+			tableInfo->recordCount = 0;
+			tableInfo->logRecordCount = 0;
+		}
+
+		//
+		// Frees the records of a table, they'll be loaded again by LoadTable().
+		// Block headers waiting for commit are newer than the file, so it
+		// only works after a Commit()
+		//
+		bool UnloadTable(TABLE_INFO* tableInfo)
+		{
+			if(!tableInfo->loaded || tableInfo == &_metatable || !_pendingBlockHeaders.empty())
+				return false;
+
+			tableInfo->recordCount = static_cast<DWORD>(tableInfo->records.size());
+			TABLE_INFO::RecordList().swap(tableInfo->records);
+			tableInfo->loaded = false;
+
+			return true;
+		}
+
+		void SetValueCache(size_t maxBytes, LdbCachePolicy policy)
+		{
+			_valueCache.SetLimit(maxBytes, policy);
+		}
+
+		const LdbValueCache& GetValueCache()
+		{
+			return _valueCache;
+		}
+
+		//
+		// must be called before Create/Open
+		//
+		void SetMemoryMapped(bool memoryMapped)
+		{
+			_file.SetMemoryMapped(memoryMapped);
+		}
+
+		bool IsMemoryMapped()
+		{
+			return _file.IsMemoryMapped();
+		}
+
+		void SetGroupCommit(bool groupCommit)
+		{
+			if(!groupCommit)
+				Commit();
+
+			_groupCommit = groupCommit;
+			_file.SetWriteBack(groupCommit);
+		}
+
+		bool IsGroupCommit()
+		{
+			return _groupCommit;
+		}
+
+		bool HasPendingCommit()
+		{
+			return !_pendingBlockHeaders.empty() || _file.IsDirty();
+		}
+
+		void Commit()
+		{
+			//
+			// data and log records first, then the block headers
+			// that point to them. So we need two syncs per commit,
+			// no matter how many operations are being committed
+			//
+			_file.Flush();
+
+			if(_pendingBlockHeaders.empty())
+				return;
+
+			for(PendingBlockHeadersMap::const_iterator i = _pendingBlockHeaders.begin() ; i != _pendingBlockHeaders.end() ; ++i)
+				_file.Write(i->first, i->second.blockHeader);
+
+			_pendingBlockHeaders.clear();
+
+			_file.Flush();
+		}
+
+		//
+		// Sends everything to the OS without syncing. Survives a process
+		// crash, but an OS crash can lose these changes. Commit() will
+		// sync them later.
+		// Headers of other tables can be waiting for a group commit, and
+		// their data must reach the disk first. In that case we sync
+		// the data before writing them
+		//
+		void WriteBack(const TABLE_INFO* tableInfo)
+		{
+			bool othersPending = false;
+
+			for(PendingBlockHeadersMap::const_iterator i = _pendingBlockHeaders.begin() ; i != _pendingBlockHeaders.end() ; ++i)
+			{
+				if(i->second.tableInfo != tableInfo)
+				{
+					othersPending = true;
+					break;
+				}
+			}
+
+			if(othersPending)
+				_file.Flush();
+			else
+				_file.WriteDirtyPages();
+
+			for(PendingBlockHeadersMap::const_iterator i = _pendingBlockHeaders.begin() ; i != _pendingBlockHeaders.end() ; ++i)
+				_file.Write(i->first, i->second.blockHeader);
+
+			_pendingBlockHeaders.clear();
+
+			_file.WriteDirtyPages();
+		}
+
+		DWORD GetRecordCount(TABLE_INFO* tableInfo)
+		{
+			return static_cast<DWORD>(tableInfo->records.size());
+		}
+
+		bool CheckIndex(TABLE_INFO* tableInfo, DWORD index)
+		{
+			return index < tableInfo->records.size();
+		}
+
+		DWORD FindKey(TABLE_INFO* tableInfo, DWORD startIndex, const LdbData& key)
+		{
+			if(!CheckIndex(tableInfo, startIndex))
+				return LDB_INVALID_RECNO;
+
+			DWORD recordCount = static_cast<DWORD>(tableInfo->records.size());
+			DWORD keyHash = DoHash(key);
+
+			for(DWORD a = startIndex ; a < recordCount ; a++)
+			{
+				const LDB_RECORD& record = tableInfo->records[a];
+
+				if(record.key.dataSize != key.GetSize() || record.key.hash != keyHash)
+					continue;
+
+				LdbData keyFromDb;
+
+				DWORD index = GetByIndex(tableInfo, a, &keyFromDb, NULL, NULL);
+
+				ASSERT(index == a && keyFromDb.GetSize() == key.GetSize());
+
+				// should not happen
+				if(keyFromDb.GetSize() != key.GetSize())
+					continue;
+
+				bool isEqual = (memcmp(key.GetBuffer(), keyFromDb.GetBuffer(), key.GetSize()) == 0);
+
+				if(isEqual)
+					return a;
+			}
+
+			return LDB_INVALID_RECNO;
+		}
+
+		DWORD Append(TABLE_INFO* tableInfo, const LdbData* key, const LdbData* value, const LdbData* metadata)
+		{
+			DWORD index = static_cast<DWORD>(tableInfo->records.size());
+
+			bool b = AppendLogRecord(tableInfo, OPERATION_APPEND, index, key, value, metadata);
+
+			if(!b)
+			{
+				ASSERT(index == static_cast<DWORD>(tableInfo->records.size()));
+				return LDB_INVALID_RECNO;
+			}
+
+			return index;
+		}
+
+		void ClearAllRecords(TABLE_INFO* tableInfo)
+		{
+			bool b = AppendLogRecord(tableInfo, OPERATION_CLEAR, 0, NULL, NULL, NULL);
+
+			ASSERT(b);
+		}
+
+		DWORD Set(TABLE_INFO* tableInfo, DWORD startIndex, const LdbData& key, const LdbData* value, const LdbData* metadata)
+		{
+			DWORD index = FindKey(tableInfo, startIndex, key);
+
+			if(index == LDB_INVALID_RECNO)
+				return Append(tableInfo, &key, value, metadata);
+			else
+				return SetByIndex(tableInfo, index, &key, value, metadata);
+		}
+
+		DWORD SetByIndex(TABLE_INFO* tableInfo, DWORD index, const LdbData* key, const LdbData* value, const LdbData* metadata)
+		{
+			if(!CheckIndex(tableInfo, index))
+				return LDB_INVALID_RECNO;
+
+			bool b = AppendLogRecord(tableInfo, OPERATION_SET, index, key, value, metadata);
+
+			if(!b)
+				return LDB_INVALID_RECNO;
+
+			return index;
+		}
+
+		DWORD Delete(TABLE_INFO* tableInfo, DWORD startIndex, const LdbData& key)
+		{
+			DWORD index = FindKey(tableInfo, startIndex, key);
+
+			if(index == LDB_INVALID_RECNO)
+				return index;
+
+			return DeleteByIndex(tableInfo, index);
+		}
+
+		DWORD DeleteByIndex(TABLE_INFO* tableInfo, DWORD index)
+		{
+			if(!CheckIndex(tableInfo, index))
+				return LDB_INVALID_RECNO;
+
+			bool b = AppendLogRecord(tableInfo, OPERATION_DELETE, index, NULL, NULL, NULL);
+
+			if(!b)
+				return LDB_INVALID_RECNO;
+
+			return index;
+		}
+
+		DWORD InsertByIndex(TABLE_INFO* tableInfo, DWORD index, LdbData* key, LdbData* value, LdbData* metadata)
+		{
+			if(index != 0 && !CheckIndex(tableInfo, index))
+				return LDB_INVALID_RECNO;
+
+			bool b = AppendLogRecord(tableInfo, OPERATION_INSERT, index, key, value, metadata);
+
+			if(!b)
+				return LDB_INVALID_RECNO;
+
+			return index;
+		}
+
+
+		void GetRecordSizes(TABLE_INFO* tableInfo, DWORD index, DWORD* keySize, DWORD* valueSize, DWORD* metadataSize)
+		{
+			if(index + 1 < tableInfo->records.size())
+				return;
+
+			if(keySize)
+				*keySize = tableInfo->records[index].key.dataSize;
+
+			if(valueSize)
+				*valueSize = tableInfo->records[index].value.dataSize;
 
-			return hash;
+			if(metadataSize)
+				*metadataSize = tableInfo->records[index].metadata.dataSize;
 		}
 
-		void Clear()
+		DWORD GetByIndex(TABLE_INFO* tableInfo, DWORD index, LdbData* key, LdbData* value, LdbData* metadata)
 		{
-			zero(_header);
-			zero(_metatable.lastBlockHeaderInfo);
+			if(index + 1 > tableInfo->records.size())
+				return LDB_INVALID_RECNO;
 
-			_metatable.records.clear();
-			_tables.clear();
-			_nextDataOffset = 0;
-			_totalRecordCount = 0;
-			_totalLogRecordCount = 0;
-			_lastRecordID = 0;
+			const LDB_RECORD& record = tableInfo->records[index];
 
+			if(key && record.key.dataSize)
+				ReadField(&record.key, key);
+			if(value && record.value.dataSize)
+				ReadField(&record.value, value);
+			if(metadata && record.metadata.dataSize)
+				ReadField(&record.metadata, metadata);
+
+			return index;
 		}
 
-		void LeaveRoom(DWORD size)
+		DWORD Get(TABLE_INFO* tableInfo, DWORD startIndex, const LdbData& key, LdbData* value, LdbData* metadata)
 		{
-			DWORD pages = (size / _file.GetPageSize()) + 1;
+			DWORD index = FindKey(tableInfo, startIndex, key);
 
-			if(pages < _growPagesStep)
-				pages = _growPagesStep;
+			if(index == LDB_INVALID_RECNO)
+				return index;
 
-			_file.GrowFile(pages);
+			index = GetByIndex(tableInfo, index, NULL, value, metadata);
+
+			ASSERT(index != LDB_INVALID_RECNO);
+
+			return index;
 		}
 
-		void EnsureSpace(DWORD size)
+		DWORD GetPageSize()
 		{
-			DWORD space = _file.GetFileSize() - _nextDataOffset;
+			return _file.GetPageSize();
+		}
 
-			if(space < size)
-				LeaveRoom(size - space);
+		//
+		// block headers can be waiting for group commit
+		//
+		void ReadBlockHeader(LDB_OFFSET offset, LDB_BLOCK_HEADER* blockHeader)
+		{
+			PendingBlockHeadersMap::const_iterator i = _pendingBlockHeaders.find(offset);
+
+			if(i != _pendingBlockHeaders.end())
+				*blockHeader = i->second.blockHeader;
+			else
+				_file.Read(offset, *blockHeader);
 		}
 
-		void WriteLdbData(const LdbData* ldbData, LDB_LOG_RECORD_FIELD* logRecordField)
+		//
+		// if more than half of the log records are not live anymore,
+		// it's worth to compact. Only loaded tables are counted, we
+		// don't know how many log records of the others are live
+		//
+		bool NeedsCompaction(LDB_OFFSET minFileSize)
 		{
-			if(!ldbData)
-				return;
+			return _file.GetFileSize() >= minFileSize && 
+				_totalLogRecordCount > _unloadedLogRecordCount + _totalRecordCount * 2ULL;
+		}
 
-			logRecordField->dataOffset = _nextDataOffset;
-			logRecordField->dataSize = ldbData->GetSize();
-			logRecordField->hash = DoHash(*ldbData);
+		LDB_OFFSET GetFileSize()
+		{
+			return _file.GetFileSize();
+		}
 
-			EnsureSpace(logRecordField->dataSize);
+		//
+		// Replaces the file with a compacted copy with the same tables and records.
+		// TABLE_INFO pointers stay valid
+		//
+		void TakeOver(Ldb& other)
+		{
+			//
+			// offsets are different in the new file
+			//
+			_valueCache.Clear();
 
-			ASSERT(_nextDataOffset && _nextDataOffset < _file.GetFileSize());
+			_file.Swap(other._file);
+			_file.SetWriteBack(_groupCommit);
 
-			DWORD size = ldbData->GetSize();
+			std::swap(_header, other._header);
+			std::swap(_nextDataOffset, other._nextDataOffset);
+			std::swap(_totalRecordCount, other._totalRecordCount);
+			std::swap(_totalLogRecordCount, other._totalLogRecordCount);
+			std::swap(_unloadedLogRecordCount, other._unloadedLogRecordCount);
+			std::swap(_metatable, other._metatable);
 
-			_file.Write(_nextDataOffset, ldbData->GetBuffer(), size);
+			if(other._lastRecordID > _lastRecordID)
+				_lastRecordID = other._lastRecordID;
 
-			_nextDataOffset += logRecordField->dataSize;
+			for(TableMap::iterator i = _tables.begin() ; i != _tables.end() ; ++i)
+			{
+				TABLE_INFO* otherTableInfo = other.OpenTable(i->first);
+				ASSERT(otherTableInfo);
+
+				i->second.records.swap(otherTableInfo->records);
+				std::swap(i->second.firstBlockOffset, otherTableInfo->firstBlockOffset);
+				std::swap(i->second.lastBlockHeaderInfo, otherTableInfo->lastBlockHeaderInfo);
+
+				//
+				// compaction loaded it, but it should stay unloaded
+				//
+				if(!i->second.loaded)
+				{
+					i->second.recordCount = static_cast<DWORD>(i->second.records.size());
+					i->second.logRecordCount = 0;
+					TABLE_INFO::RecordList().swap(i->second.records);
+				}
+			}
+
+			//
+			// pending headers belong to the old file
+			//
+			_pendingBlockHeaders.swap(other._pendingBlockHeaders);
 		}
 
-		bool AppendLogRecord(TABLE_INFO* tableInfo, DWORD operation, DWORD recordIndex, 
-			const LdbData* key, const LdbData* value, const LdbData* metadata)
+		DWORD GetBlockSize()
 		{
-			LDB_LOG_RECORD logRecord;
-			LDB_BLOCK_HEADER_INFO* blockHeaderInfo = &tableInfo->lastBlockHeaderInfo;
-			TABLE_INFO::RecordsVector& records = tableInfo->records;
+			return _defaultBlockSize;
+		}
 
-			ASSERT(
-				operation == OPERATION_CLEAR || 
-				(operation == OPERATION_INSERT && recordIndex == 0) ||
-				operation == OPERATION_APPEND || 
-				CheckIndex(tableInfo, recordIndex));
+		DWORD GetGrowStep()
+		{
+			return _growPagesStep * GetPageSize();
+		}
 
-			zero(logRecord);
+		void SetGrowStep(DWORD bytes)
+		{
+			DWORD pageSize = GetPageSize();
+			_growPagesStep = (bytes / pageSize) + 1;
+		}
+	};
+	
+	//
+	// Online compaction. A background thread copies the live records to a new
+	// file, reading the current file with its own handle. It's safe because
+	// data is never overwritten. Changes made after the snapshot are replayed
+	// on the caller thread by Finish(), and then the new file replaces the old one
+	//
+	class LdbCompactor
+	{
+		struct TABLE_SNAPSHOT
+		{
+			std::string name;
+			Ldb::TABLE_INFO::RecordList records;
+			bool loaded;
+			LDB_OFFSET firstBlockOffset;
+			LDB_BLOCK_HEADER_INFO lastBlockHeaderInfo;
+		};
 
-			logRecord.operation = operation;
-			logRecord.recordIndex = recordIndex;
-			logRecord.recordID = ++_lastRecordID;
+		typedef std::vector<TABLE_SNAPSHOT> Snapshot;
 
-			LDB_BLOCK_HEADER_INFO newBlockHeaderInfo;
-			bool hasNewBlock;
+		Ldb& _source;
+		std::string _sourceFileName, _destFileName;
 
-			hasNewBlock = CreateNewBlockIfNeeded(blockHeaderInfo, &newBlockHeaderInfo);
+		Ldb _dest;
+		File _reader;
+		Snapshot _snapshot;
+		DWORD _tableDeleteCount;
 
-			if(key)
-				WriteLdbData(key, &logRecord.key);
+		boost::thread _thread;
+		std::atomic<bool> _done;
+		bool _succeeded;
 
-			if(value)
-				WriteLdbData(value, &logRecord.value);
+		void ReadField(File& file, const LDB_LOG_RECORD_FIELD& field, LdbData* data)
+		{
+			if(field.dataSize == 0)
+				return;
 
-			if(metadata)
-				WriteLdbData(metadata, &logRecord.metadata);
+			file.SetPointer(field.dataOffset);
+			
+			if(file.Read(data->Alloc(field.dataSize), field.dataSize) != field.dataSize)
+				throw std::runtime_error("error reading logdb file");
+		}
 
-			if(operation == OPERATION_SET)
+		//
+		// tables not loaded in the source are loaded here, following the
+		// block chain until the snapshot position
+		//
+		void LoadRecords(TABLE_SNAPSHOT* tableSnapshot)
+		{
+			LDB_OFFSET blockOffset = tableSnapshot->firstBlockOffset;
+
+			for(;;)
 			{
-				//
-				// caller can keep fields passing NULL
-				//
-				LDB_LOG_RECORD& setRecord = records[recordIndex];
+				LDB_BLOCK_HEADER blockHeader;
 
-				if(key == NULL)
-					logRecord.key = setRecord.key;
-				if(value == NULL)
-					logRecord.value = setRecord.value;
-				if(metadata== NULL)
-					logRecord.metadata = setRecord.metadata;
-			}
+				_reader.SetPointer(blockOffset);
 
-			LDB_BLOCK_HEADER_INFO* currentBlockHeaderInfo = hasNewBlock ? &newBlockHeaderInfo : blockHeaderInfo;
+				if(_reader.Read(&blockHeader, sizeof(blockHeader)) != sizeof(blockHeader))
+					throw std::runtime_error("error reading logdb file");
 
-			DWORD logRecordOffset = currentBlockHeaderInfo->offset + sizeof(LDB_BLOCK_HEADER) +
-				(sizeof(LDB_LOG_RECORD) * currentBlockHeaderInfo->blockHeader.usedCount);
+				bool isLast = (blockOffset == tableSnapshot->lastBlockHeaderInfo.offset);
+				DWORD usedCount = isLast ? tableSnapshot->lastBlockHeaderInfo.blockHeader.usedCount : blockHeader.usedCount;
 
-			currentBlockHeaderInfo->blockHeader.usedCount++;
+				if(usedCount)
+				{
+					std::vector<LDB_LOG_RECORD> logRecords(usedCount);
+					DWORD size = usedCount * sizeof(LDB_LOG_RECORD);
 
-			ASSERT(logRecordOffset && currentBlockHeaderInfo->offset &&
-				logRecordOffset < _file.GetFileSize() && currentBlockHeaderInfo->offset < _file.GetFileSize());
+					if(_reader.Read(&logRecords[0], size) != size)
+						throw std::runtime_error("error reading logdb file");
 
-			CheckUnitialized(logRecordOffset, sizeof(logRecord));
-			_file.Write(logRecordOffset, logRecord);
+					for(DWORD a = 0 ; a < usedCount ; a++)
+						Ldb::ReplayLogRecord(&tableSnapshot->records, logRecords[a]);
+				}
+
+				if(isLast)
+					break;
 
-			_file.Write(currentBlockHeaderInfo->offset, currentBlockHeaderInfo->blockHeader);
+				if(blockHeader.nextBlockOffset == 0)
+					throw std::runtime_error("invalid logdb block chain");
 
-			if(hasNewBlock)
+				blockOffset = blockHeader.nextBlockOffset;
+			}
+		}
+
+		void CopySnapshot()
+		{
+			try
 			{
-				ASSERT(blockHeaderInfo->offset && blockHeaderInfo->offset < _file.GetFileSize());
+				for(Snapshot::iterator i = _snapshot.begin() ; i != _snapshot.end() ; ++i)
+				{
+					Ldb::TABLE_INFO* tableInfo = _dest.CreateTable(i->name);
 
-				_file.Write(blockHeaderInfo->offset, blockHeaderInfo->blockHeader);
+					if(!i->loaded)
+						LoadRecords(&*i);
 
-				*blockHeaderInfo = newBlockHeaderInfo;
-			}
+					for(Ldb::TABLE_INFO::RecordList::const_iterator r = i->records.begin() ; r != i->records.end() ; ++r)
+					{
+						LdbData key, value, metadata;
 
-			switch(operation)
+						ReadField(_reader, r->key, &key);
+						ReadField(_reader, r->value, &value);
+						ReadField(_reader, r->metadata, &metadata);
+
+						_dest.Append(tableInfo, 
+							r->key.dataSize ? &key : NULL,
+							r->value.dataSize ? &value : NULL,
+							r->metadata.dataSize ? &metadata : NULL);
+					}
+				}
+
+				_dest.Commit();
+
+				_succeeded = true;
+			}
+			catch(std::exception&)
 			{
-			case OPERATION_APPEND:
-				_totalRecordCount++;
-				records.push_back(logRecord);
-				break;
-			case OPERATION_SET:
-				records[recordIndex] = logRecord;
-				break;
-			case OPERATION_INSERT:
-				_totalRecordCount++;
-				if(recordIndex == records.size())
-					records.push_back(logRecord);
-				else
-					records.insert(records.begin() + recordIndex, logRecord);
-				break;
-			case OPERATION_DELETE:
-				_totalRecordCount--;
-				records.erase(records.begin() + recordIndex);
-				break;
-			case OPERATION_CLEAR:
-				_totalRecordCount-= records.size();
-				records.clear();
-				break;
+				_succeeded = false;
 			}
 
-			_totalLogRecordCount++;
+			_done = true;
+		}
 
-			return true;
+		void ApplyLogRecord(Ldb::TABLE_INFO* tableInfo, const LDB_LOG_RECORD& logRecord)
+		{
+			LdbData key, value, metadata;
+
+			if(logRecord.key.dataSize)
+				_source.ReadField(&logRecord.key, &key);
+			if(logRecord.value.dataSize)
+				_source.ReadField(&logRecord.value, &value);
+			if(logRecord.metadata.dataSize)
+				_source.ReadField(&logRecord.metadata, &metadata);
+
+			_dest.AppendLogRecord(tableInfo, logRecord.operation, logRecord.recordIndex,
+				logRecord.key.dataSize ? &key : NULL,
+				logRecord.value.dataSize ? &value : NULL,
+				logRecord.metadata.dataSize ? &metadata : NULL);
 		}
 
-		DWORD CalculateAddedFieldPos(const LdbData* data, LDB_LOG_RECORD_FIELD* field)
+		//
+		// replays log records written after the snapshot, following the block chain
+		// from the block that was the last one when the snapshot was taken
+		//
+		void ReplayTail(const TABLE_SNAPSHOT& tableSnapshot, Ldb::TABLE_INFO* tableInfo)
 		{
-			if(!data || data->GetSize() == 0)
+			LDB_OFFSET blockOffset = tableSnapshot.lastBlockHeaderInfo.offset;
+			DWORD index = tableSnapshot.lastBlockHeaderInfo.blockHeader.usedCount;
+
+			for(;;)
 			{
-				field->dataOffset = 0;
-				field->dataSize = 0;
-				field->hash = 0;
-				return 0;
+				LDB_BLOCK_HEADER blockHeader;
+				_source.ReadBlockHeader(blockOffset, &blockHeader);
+
+				for( ; index < blockHeader.usedCount ; index++)
+				{
+					LDB_LOG_RECORD logRecord;
+
+					_source._file.Read(blockOffset + sizeof(LDB_BLOCK_HEADER) + (index * sizeof(LDB_LOG_RECORD)), logRecord);
+
+					ApplyLogRecord(tableInfo, logRecord);
+				}
+
+				if(blockHeader.nextBlockOffset == 0)
+					break;
+
+				blockOffset = blockHeader.nextBlockOffset;
+				index = 0;
 			}
+		}
 
-			field->dataOffset = _nextDataOffset;
-			field->dataSize = data->GetSize();
-			field->hash = DoHash(*data);
-			_nextDataOffset += field->dataSize;
+		void Discard()
+		{
+			_reader.Close();
+			_dest.Close();
+			remove(_destFileName.c_str());
+		}
 
-			return field->dataSize;
+	public:
+		LdbCompactor(Ldb& source, const std::string& sourceFileName) :
+			_source(source),
+			_sourceFileName(sourceFileName),
+			_destFileName(sourceFileName + ".compact"),
+			_tableDeleteCount(0),
+			_done(false),
+			_succeeded(false)
+		{
 		}
 
-		void WriteLogRecordFieldData(LDB_LOG_RECORD_FIELD* field, const void* buffer)
+		~LdbCompactor()
 		{
-			if(!buffer || field->dataSize == 0)
-				return;
+			if(_thread.joinable())
+			{
+				_thread.join();
+				Discard();
+			}
+		}
 
-			ASSERT(field->dataOffset != 0 && field->dataOffset < _file.GetFileSize());
+		bool Start()
+		{
+			remove(_destFileName.c_str());
 
-			_file.Write(field->dataOffset, buffer, field->dataSize);
+			_dest.SetMemoryMapped(_source.IsMemoryMapped());
 
-			_nextDataOffset += field->dataSize;
+			if(!_dest.Create(_destFileName.c_str()))
+				return false;
+
+			if(!_reader.Open(_sourceFileName.c_str()))
+			{
+				_dest.Close();
+				remove(_destFileName.c_str());
+				return false;
+			}
+
+			_dest.SetGroupCommit(true);
+
+			//
+			// reader thread uses its own handle, so everything
+			// must be in the file, not in our cache
+			//
+			_source._file.WriteDirtyPages();
+
+			_tableDeleteCount = _source._tableDeleteCount;
+
+			_snapshot.reserve(_source._tables.size());
+
+			for(Ldb::TableMap::const_iterator i = _source._tables.begin() ; i != _source._tables.end() ; ++i)
+			{
+				_snapshot.push_back(TABLE_SNAPSHOT());
+				TABLE_SNAPSHOT& tableSnapshot = _snapshot.back();
+
+				tableSnapshot.name = i->first;
+				tableSnapshot.records = i->second.records;
+				tableSnapshot.loaded = i->second.loaded;
+				tableSnapshot.firstBlockOffset = i->second.firstBlockOffset;
+				tableSnapshot.lastBlockHeaderInfo = i->second.lastBlockHeaderInfo;
+			}
+
+			_thread = boost::thread(boost::bind(&LdbCompactor::CopySnapshot, this));
+
+			return true;
 		}
 
-		bool CheckNeedForNewBlock(const LDB_BLOCK_HEADER& currentBlock)
+		bool IsDone()
 		{
-			DWORD nextRecordOffset = sizeof(LDB_FILE_HEADER) + (currentBlock.usedCount * sizeof(LDB_LOG_RECORD));
-			DWORD spaceLeftInThisBlock = currentBlock.size - nextRecordOffset;
-			return spaceLeftInThisBlock < sizeof(LDB_LOG_RECORD);
+			return _done;
 		}
 
+		//
+		// Must be called from the thread that uses the source Ldb.
+		// Returns false if compaction failed, source file is unchanged
+		//
+		bool Finish()
+		{
+			_thread.join();
+
+			if(!_succeeded || _tableDeleteCount != _source._tableDeleteCount)
+			{
+				Discard();
+				return false;
+			}
+
+			try
+			{
+				std::set<std::string> snapshotTables;
+
+				for(Snapshot::const_iterator i = _snapshot.begin() ; i != _snapshot.end() ; ++i)
+				{
+					Ldb::TABLE_INFO* tableInfo = _source.OpenTable(i->name);
+					ASSERT(tableInfo);
+
+					ReplayTail(*i, _dest.OpenTable(i->name));
+					snapshotTables.insert(i->name);
+				}
+
+				//
+				// tables created after the snapshot
+				//
+				for(Ldb::TableMap::iterator i = _source._tables.begin() ; i != _source._tables.end() ; ++i)
+				{
+					if(snapshotTables.find(i->first) != snapshotTables.end())
+						continue;
+
+					_source.LoadTable(&i->second);
 
-		bool CreateNewBlockIfNeeded(LDB_BLOCK_HEADER_INFO* currentBlockHeaderInfo, LDB_BLOCK_HEADER_INFO* newBlockHeaderInfo)
-		{
-			if(!CheckNeedForNewBlock(currentBlockHeaderInfo->blockHeader))
-				return false;
+					Ldb::TABLE_INFO* tableInfo = _dest.CreateTable(i->first);
 
-			LDB_BLOCK_HEADER* currentBlock = &currentBlockHeaderInfo->blockHeader;
-			LDB_BLOCK_HEADER* newBlock = &newBlockHeaderInfo->blockHeader;
+					for(Ldb::TABLE_INFO::RecordList::const_iterator r = i->second.records.begin() ; r != i->second.records.end() ; ++r)
+					{
+						LDB_LOG_RECORD logRecord;
 
-			EnsureSpace(currentBlock->size);
+						zero(logRecord);
+						logRecord.operation = OPERATION_APPEND;
+						logRecord.recordIndex = _dest.GetRecordCount(tableInfo);
+						logRecord.key = r->key;
+						logRecord.value = r->value;
+						logRecord.metadata = r->metadata;
 
-			newBlock->nextBlockOffset = 0;
-			newBlock->size = currentBlock->size;
-			newBlock->usedCount = 0;
+						ApplyLogRecord(tableInfo, logRecord);
+					}
+				}
 
-			ASSERT(_nextDataOffset && _nextDataOffset < _file.GetFileSize());
+				_dest.Commit();
 
-			CheckUnitialized(_nextDataOffset, sizeof(*newBlock));
-			_file.Write(_nextDataOffset, *newBlock);
+				_reader.Close();
 
-			newBlockHeaderInfo->offset = _nextDataOffset;
-			currentBlock->nextBlockOffset = newBlockHeaderInfo->offset;
+				//
+				// checkpoint points to the old file
+				//
+				if(!_source.GetCheckpointFile().empty())
+					remove(_source.GetCheckpointFile().c_str());
 
-			_nextDataOffset += newBlock->size;
+				//
+				// rename is atomic, we'll have the old or the new file
+				//
+				boost::filesystem::rename(_destFileName, _sourceFileName);
+				File::SyncDirectory(_sourceFileName);
+			}
+			catch(std::exception&)
+			{
+				Discard();
+				return false;
+			}
+
+			_source.TakeOver(_dest);
+
+			//
+			// _dest has the old file now
+			//
+			_dest.Close();
 
 			return true;
 		}
-
-		void ReadField(const LDB_LOG_RECORD_FIELD* field, LdbData* data)
+	};
+	
+	//
+	// Writes a checkpoint file in a background thread. Start() takes a
+	// snapshot of the record index, so everything must be committed before
+	//
+	class LdbCheckpointWriter
+	{
+		struct TABLE_SNAPSHOT
 		{
-			ASSERT(field && data);
+			LDB_CHECKPOINT_TABLE checkpointTable;
+			std::string name;
+			Ldb::TABLE_INFO::RecordList records;
+		};
 
-			_file.Read(field->dataOffset, data->Alloc(field->dataSize), field->dataSize);
-		}
+		typedef std::vector<TABLE_SNAPSHOT> Snapshot;
 
+		std::string _fileName;
+		LDB_CHECKPOINT_HEADER _header;
+		Snapshot _snapshot;
 
-	public:
+		boost::thread _thread;
+		std::atomic<bool> _done;
+		bool _succeeded;
 
-		Ldb()
+		void AddTable(Ldb& ldb, const std::string& name, LDB_OFFSET firstBlockOffset, const Ldb::TABLE_INFO& tableInfo)
 		{
-			_totalRecordCount = 0;
-			_defaultBlockSize = 4096;
-			_growPagesStep = (4 * 1024 * 1024) / _file.GetPageSize();
-			_lastRecordID = 0;
-		}
+			_snapshot.push_back(TABLE_SNAPSHOT());
+			TABLE_SNAPSHOT& tableSnapshot = _snapshot.back();
 
-		~Ldb()
-		{
-			Close();
-		}
+			tableSnapshot.name = name;
+			tableSnapshot.records = tableInfo.records;
 
-		bool Create(const char* fileName)
-		{
-			bool b = _file.Create(fileName);
+			LDB_CHECKPOINT_TABLE& checkpointTable = tableSnapshot.checkpointTable;
+			zero(checkpointTable);
 
-			if(!b)
-				return false;
+			checkpointTable.nameSize = static_cast<DWORD>(name.size());
+			checkpointTable.firstBlockOffset = firstBlockOffset;
+			checkpointTable.lastBlockHeaderInfo = tableInfo.lastBlockHeaderInfo;
+			checkpointTable.lastLogRecordID = ldb.GetLastLogRecordID(tableInfo.lastBlockHeaderInfo);
 
-			if(_file.GetFileSize() < sizeof(LDB_FILE_HEADER))
-				return InitializeFile();
+			if(tableInfo.loaded)
+				checkpointTable.recordCount = static_cast<DWORD>(tableInfo.records.size());
 			else
-				return LoadFile();
+			{
+				checkpointTable.recordCount = tableInfo.recordCount;
+				checkpointTable.flags = LDB_CHECKPOINT_TABLE_NOT_LOADED;
+
+				//
+				// part of it may be a real record count, but it's
+				// simpler to handle it all as log records
+				//
+				if(tableInfo.logRecordCount)
+					checkpointTable.flags |= LDB_CHECKPOINT_TABLE_LOG_RECORDS;
+			}
 		}
 
-		bool Open(const char* fileName)
+		void WriteFile()
 		{
-			bool b = _file.Open(fileName);
+			std::string tempFileName = _fileName + ".tmp";
 
-			if(!b)
-				return false;
+			try
+			{
+				remove(tempFileName.c_str());
 
-			return LoadFile();
-		}
+				File file(0);
 
-		void Close()
-		{
-			_file.Close();
-			Clear();
+				if(!file.Create(tempFileName.c_str()))
+					throw std::runtime_error("error creating checkpoint file");
+
+				file.SetSyncOnWrite(false);
+
+				file.Write(&_header, sizeof(_header));
+
+				for(Snapshot::const_iterator i = _snapshot.begin() ; i != _snapshot.end() ; ++i)
+				{
+					file.Write(&i->checkpointTable, sizeof(i->checkpointTable));
+					file.Write(i->name.c_str(), static_cast<DWORD>(i->name.size()));
+
+					for(size_t chunk = 0 ; chunk < i->records.GetChunkCount() ; chunk++)
+					{
+						size_t count;
+						const LDB_RECORD* records = i->records.GetChunk(chunk, &count);
+
+						file.Write(records, static_cast<DWORD>(count * sizeof(LDB_RECORD)));
+					}
+				}
+
+				file.Sync();
+				file.Close();
+
+				boost::filesystem::rename(tempFileName, _fileName);
+				File::SyncDirectory(_fileName);
+
+				_succeeded = true;
+			}
+			catch(std::exception&)
+			{
+				remove(tempFileName.c_str());
+				_succeeded = false;
+			}
+
+			_done = true;
 		}
 
-		DWORD GetRecordCount(TABLE_INFO* tableInfo)
+	public:
+		LdbCheckpointWriter() :
+			_done(false),
+			_succeeded(false)
 		{
-			return static_cast<DWORD>(tableInfo->records.size());
 		}
 
-		bool CheckIndex(TABLE_INFO* tableInfo, DWORD index)
+		~LdbCheckpointWriter()
 		{
-			return index < tableInfo->records.size();
+			if(_thread.joinable())
+				_thread.join();
 		}
 
-		DWORD FindKey(TABLE_INFO* tableInfo, DWORD startIndex, const LdbData& key)
+		void Start(Ldb& ldb)
 		{
-			if(!CheckIndex(tableInfo, startIndex))
-				return LDB_INVALID_RECNO;
+			ASSERT(!ldb.HasPendingCommit());
 
-			DWORD recordCount = static_cast<DWORD>(tableInfo->records.size());
-			DWORD keyHash = DoHash(key);
-
-			for(DWORD a = startIndex ; a < recordCount ; a++)
-			{
-				LDB_LOG_RECORD& logRecord = tableInfo->records[a];
+			_fileName = ldb.GetCheckpointFile();
 
-				if(logRecord.key.dataSize != key.GetSize() || logRecord.key.hash != keyHash)
-					continue;
+			zero(_header);
+			_header.magic = LDB_CHECKPOINT_MAGIC;
+			_header.version = LDB_CHECKPOINT_VERSION;
+			_header.tableCount = static_cast<DWORD>(ldb._tables.size() + 1);
+			_header.nextDataOffset = ldb._nextDataOffset;
+			_header.lastRecordID = ldb._lastRecordID;
+			_header.totalLogRecordCount = ldb._totalLogRecordCount;
 
-				LdbData keyFromDb;
+			_snapshot.reserve(_header.tableCount);
 
-				DWORD index = GetByIndex(tableInfo, a, &keyFromDb, NULL, NULL);
+			AddTable(ldb, std::string(), 0, ldb._metatable);
 
-				ASSERT(index == a && keyFromDb.GetSize() == key.GetSize());
+			for(Ldb::TABLE_INFO::RecordList::const_iterator i = ldb._metatable.records.begin() ; i != ldb._metatable.records.end() ; ++i)
+			{
+				LdbData key;
+				ldb.ReadField(&i->key, &key);
 
-				// should not happen
-				if(keyFromDb.GetSize() != key.GetSize())
-					continue;
+				std::string name((const char*)key.GetBuffer(), key.GetSize());
 
-				bool isEqual = (memcmp(key.GetBuffer(), keyFromDb.GetBuffer(), key.GetSize()) == 0);
+				Ldb::TABLE_INFO* tableInfo = ldb.OpenTable(name);
+				ASSERT(tableInfo);
 
-				if(isEqual)
-					return a;
+				if(tableInfo)
+					AddTable(ldb, name, i->value.dataOffset, *tableInfo);
 			}
 
-			return LDB_INVALID_RECNO;
+			_header.tableCount = static_cast<DWORD>(_snapshot.size());
+
+			_thread = boost::thread(boost::bind(&LdbCheckpointWriter::WriteFile, this));
 		}
 
-		DWORD Append(TABLE_INFO* tableInfo, const LdbData* key, const LdbData* value, const LdbData* metadata)
+		bool IsDone()
 		{
-			DWORD index = static_cast<DWORD>(tableInfo->records.size());
+			return _done;
+		}
 
-			bool b = AppendLogRecord(tableInfo, OPERATION_APPEND, index, key, value, metadata);
+		bool Finish()
+		{
+			_thread.join();
+			return _succeeded;
+		}
+	};
 
-			if(!b)
-			{
-				ASSERT(index == static_cast<DWORD>(tableInfo->records.size()));
-				return LDB_INVALID_RECNO;
-			}
+	//
+	// Converts a format version 1 file (32 bit offsets) to the current
+	// format. Live records of every table are copied to a new file, and
+	// the old one is kept as <name>.v1
+	//
+	class LdbV1Migrator
+	{
+		std::string _fileName, _destFileName;
+		File _source;
 
-			return index;
+		void Read(LDB_OFFSET offset, void* buffer, DWORD size)
+		{
+			_source.SetPointer(offset);
+
+			if(_source.Read(buffer, size) != size)
+				throw std::runtime_error("error reading logdb v1 file");
 		}
 
-		void ClearAllRecords(TABLE_INFO* tableInfo)
+		void ReadField(const LDB_LOG_RECORD_FIELD& field, LdbData* data)
 		{
-			bool b = AppendLogRecord(tableInfo, OPERATION_CLEAR, 0, NULL, NULL, NULL);
+			if(field.dataSize == 0)
+				return;
 
-			ASSERT(b);
+			Read(field.dataOffset, data->Alloc(field.dataSize), field.dataSize);
 		}
 
-		DWORD Set(TABLE_INFO* tableInfo, DWORD startIndex, const LdbData& key, const LdbData* value, const LdbData* metadata)
+		static void ConvertField(const LDB_V1_LOG_RECORD_FIELD& v1Field, LDB_LOG_RECORD_FIELD* field)
 		{
-			DWORD index = FindKey(tableInfo, startIndex, key);
-
-			if(index == LDB_INVALID_RECNO)
-				return Append(tableInfo, &key, value, metadata);
-			else
-				return SetByIndex(tableInfo, index, &key, value, metadata);
+			field->dataOffset = v1Field.dataOffset;
+			field->dataSize = v1Field.dataSize;
+			field->hash = v1Field.hash;
 		}
 
-		DWORD SetByIndex(TABLE_INFO* tableInfo, DWORD index, const LdbData* key, const LdbData* value, const LdbData* metadata)
+		static LDB_LOG_RECORD ConvertLogRecord(const LDB_V1_LOG_RECORD& v1LogRecord)
 		{
-			if(!CheckIndex(tableInfo, index))
-				return LDB_INVALID_RECNO;
+			LDB_LOG_RECORD logRecord;
 
-			bool b = AppendLogRecord(tableInfo, OPERATION_SET, index, key, value, metadata);
+			zero(logRecord);
 
-			if(!b)
-				return LDB_INVALID_RECNO;
+			logRecord.operation = v1LogRecord.operation;
+			logRecord.recordIndex = v1LogRecord.recordIndex;
+			logRecord.recordID = v1LogRecord.recordID;
 
-			return index;
+			ConvertField(v1LogRecord.key, &logRecord.key);
+			ConvertField(v1LogRecord.value, &logRecord.value);
+			ConvertField(v1LogRecord.metadata, &logRecord.metadata);
+
+			return logRecord;
 		}
 
-		DWORD Delete(TABLE_INFO* tableInfo, DWORD startIndex, const LdbData& key)
+		//
+		// same replay Ldb does on load, over the v1 block chain
+		//
+		void LoadAllBlocks(DWORD blockOffset, Ldb::TABLE_INFO::RecordList* records)
 		{
-			DWORD index = FindKey(tableInfo, startIndex, key);
+			while(blockOffset != 0)
+			{
+				LDB_V1_BLOCK_HEADER blockHeader;
 
-			if(index == LDB_INVALID_RECNO)
-				return index;
+				Read(blockOffset, &blockHeader, sizeof(blockHeader));
 
-			return DeleteByIndex(tableInfo, index);
-		}
+				if(blockHeader.usedCount)
+				{
+					std::vector<LDB_V1_LOG_RECORD> logRecords(blockHeader.usedCount);
 
-		DWORD DeleteByIndex(TABLE_INFO* tableInfo, DWORD index)
-		{
-			if(!CheckIndex(tableInfo, index))
-				return LDB_INVALID_RECNO;
+					Read(blockOffset + sizeof(blockHeader), &logRecords[0], 
+						static_cast<DWORD>(logRecords.size() * sizeof(LDB_V1_LOG_RECORD)));
 
-			bool b = AppendLogRecord(tableInfo, OPERATION_DELETE, index, NULL, NULL, NULL);
+					for(std::vector<LDB_V1_LOG_RECORD>::const_iterator i = logRecords.begin() ; i != logRecords.end() ; ++i)
+						Ldb::ReplayLogRecord(records, ConvertLogRecord(*i));
+				}
 
-			if(!b)
-				return LDB_INVALID_RECNO;
+				ASSERT(blockHeader.nextBlockOffset == 0 || blockHeader.nextBlockOffset > blockOffset);
 
-			return index;
+				blockOffset = blockHeader.nextBlockOffset;
+			}
 		}
 
-		DWORD InsertByIndex(TABLE_INFO* tableInfo, DWORD index, LdbData* key, LdbData* value, LdbData* metadata)
+		void CopyTables(DWORD tableBlockOffset)
 		{
-			if(index != 0 && !CheckIndex(tableInfo, index))
-				return LDB_INVALID_RECNO;
+			Ldb dest;
+			Ldb::TABLE_INFO::RecordList metatable;
 
-			bool b = AppendLogRecord(tableInfo, OPERATION_INSERT, index, key, value, metadata);
+			LoadAllBlocks(tableBlockOffset, &metatable);
 
-			if(!b)
-				return LDB_INVALID_RECNO;
+			remove(_destFileName.c_str());
 
-			return index;
-		}
+			if(!dest.Create(_destFileName.c_str()))
+				throw std::runtime_error("error creating logdb file");
 
+			dest.SetGroupCommit(true);
 
-		void GetRecordSizes(TABLE_INFO* tableInfo, DWORD index, DWORD* keySize, DWORD* valueSize, DWORD* metadataSize)
-		{
-			if(index + 1 < tableInfo->records.size())
-				return;
+			for(Ldb::TABLE_INFO::RecordList::const_iterator t = metatable.begin() ; t != metatable.end() ; ++t)
+			{
+				LdbData name;
+				Ldb::TABLE_INFO::RecordList records;
 
-			if(keySize)
-				*keySize = tableInfo->records[index].key.dataSize;
+				ReadField(t->key, &name);
+				LoadAllBlocks(static_cast<DWORD>(t->value.dataOffset), &records);
 
-			if(valueSize)
-				*valueSize = tableInfo->records[index].value.dataSize;
+				Ldb::TABLE_INFO* tableInfo = dest.CreateTable(std::string((const char*)name.GetBuffer(), name.GetSize()));
 
-			if(metadataSize)
-				*metadataSize = tableInfo->records[index].metadata.dataSize;
+				for(Ldb::TABLE_INFO::RecordList::const_iterator r = records.begin() ; r != records.end() ; ++r)
+				{
+					LdbData key, value, metadata;
+
+					ReadField(r->key, &key);
+					ReadField(r->value, &value);
+					ReadField(r->metadata, &metadata);
+
+					dest.Append(tableInfo, 
+						r->key.dataSize ? &key : NULL,
+						r->value.dataSize ? &value : NULL,
+						r->metadata.dataSize ? &metadata : NULL);
+				}
+			}
+
+			dest.Close();
 		}
 
-		DWORD GetByIndex(TABLE_INFO* tableInfo, DWORD index, LdbData* key, LdbData* value, LdbData* metadata)
+	public:
+		LdbV1Migrator(const std::string& fileName) :
+			_fileName(fileName),
+			_destFileName(fileName + ".v2"),
+			_source(0)
 		{
-			if(index + 1 > tableInfo->records.size())
-				return LDB_INVALID_RECNO;
+		}
+
+		//
+		// Migrate swaps the files with two renames. If we crashed between them,
+		// there's no file under the real name: the converted file is still .v2
+		// and the old one is .v1. The .v2 file is complete, since the first
+		// rename only happens after it was closed, so we finish the swap. With
+		// no .v2 file, the old one is put back and will be migrated again
+		//
+		static void Recover(const std::string& fileName)
+		{
+			std::string v1FileName = fileName + ".v1", v2FileName = fileName + ".v2";
 
-			const LDB_LOG_RECORD& logRecord = tableInfo->records[index];
+			if(boost::filesystem::exists(fileName) || !boost::filesystem::exists(v1FileName))
+				return;
 
-			if(key && logRecord.key.dataSize)
-				ReadField(&logRecord.key, key);
-			if(value && logRecord.value.dataSize)
-				ReadField(&logRecord.value, value);
-			if(metadata && logRecord.metadata.dataSize)
-				ReadField(&logRecord.metadata, metadata);
+			if(boost::filesystem::exists(v2FileName))
+			{
+				std::cout << "finishing the interrupted conversion of " << fileName << std::endl;
+				boost::filesystem::rename(v2FileName, fileName);
+			}
+			else
+			{
+				std::cout << "rolling back the interrupted conversion of " << fileName << std::endl;
+				boost::filesystem::rename(v1FileName, fileName);
+			}
 
-			return index;
+			File::SyncDirectory(fileName);
 		}
 
-		DWORD Get(TABLE_INFO* tableInfo, DWORD startIndex, const LdbData& key, LdbData* value, LdbData* metadata)
+		static bool NeedsMigration(const std::string& fileName)
 		{
-			DWORD index = FindKey(tableInfo, startIndex, key);
+			File file(0);
+			LDB_V1_FILE_HEADER header;
 
-			if(index == LDB_INVALID_RECNO)
-				return index;
+			if(!file.Open(fileName.c_str()))
+				return false;
 
-			index = GetByIndex(tableInfo, index, NULL, value, metadata);
+			bool isV1 = file.GetFileSize() >= sizeof(header) &&
+				file.Read(&header, sizeof(header)) == sizeof(header) &&
+				header.magic == LDB_MAGIC && header.version == 1;
 
-			ASSERT(index != LDB_INVALID_RECNO);
+			file.Close();
 
-			return index;
+			return isV1;
 		}
 
-		DWORD GetPageSize()
+		bool Migrate()
 		{
-			return _file.GetPageSize();
-		}
+			try
+			{
+				LDB_V1_FILE_HEADER header;
 
-		DWORD GetBlockSize()
-		{
-			return _defaultBlockSize;
-		}
+				if(!_source.Open(_fileName.c_str()))
+					return false;
 
-		DWORD GetGrowStep()
-		{
-			return _growPagesStep * GetPageSize();
-		}
+				Read(0, &header, sizeof(header));
 
-		void SetGrowStep(DWORD bytes)
-		{
-			DWORD pageSize = GetPageSize();
-			_growPagesStep = (bytes / pageSize) + 1;
+				if(header.magic != LDB_MAGIC || header.version != 1)
+					throw std::runtime_error("not a logdb v1 file");
+
+				CopyTables(header.tableBlockOffset);
+
+				_source.Close();
+
+				//
+				// the new file must exist on disk before we rename the old one,
+				// Recover counts on it
+				//
+				File::SyncDirectory(_destFileName);
+
+				boost::filesystem::rename(_fileName, _fileName + ".v1");
+				boost::filesystem::rename(_destFileName, _fileName);
+
+				File::SyncDirectory(_fileName);
+
+				return true;
+			}
+			catch(std::exception&)
+			{
+				_source.Close();
+				remove(_destFileName.c_str());
+				return false;
+			}
 		}
 	};
-	
+
 } // namespace logdb
 
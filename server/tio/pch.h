@@ -56,6 +56,7 @@ Copyright 2010 Rodrigo Strauss (http://www.1bit.com.br)
   #define min(x,y) (x<y?x:y)
   #include <sys/types.h>
   #include <sys/stat.h>
+  #include <sys/mman.h>
   #include <unistd.h>
 //  #include <google/profiler.h>
 #endif
@@ -96,6 +97,7 @@ Copyright 2010 Rodrigo Strauss (http://www.1bit.com.br)
 #include <queue>
 #include <deque>
 #include <limits>
+#include <charconv>
 
 //
 // macros are evil, you know?
@@ -21,8 +21,15 @@ Copyright 2010 Rodrigo Strauss (http://www.1bit.com.br)
 #include "MemoryStorage.h"
 //#include "BdbStorage.h"
 #include "LogDbStorage.h"
+#include "BTreeStorage.h"
+#include "LsmStorage.h"
+#include "TioPlugin.h"
 #include "../../client/cpp/tioclient.hpp"
 
+#ifndef _WIN32
+#include <dlfcn.h>
+#endif
+
 #if TIO_PYTHON_PLUGIN_SUPPORT
 #include "TioPython.h"
 #endif
@@ -35,13 +42,21 @@ using std::cout;
 using std::endl;
 using std::queue;
 
-void LoadStorageTypes(ContainerManager* containerManager, const string& dataPath)
+void LoadStorageTypes(ContainerManager* containerManager, const string& dataPath,
+	const tio::LogDbStorage::LOGDB_CONFIG& logdbConfig, const tio::BTreeStorage::BTREE_CONFIG& btreeConfig,
+	const tio::LsmStorage::LSM_CONFIG& lsmConfig)
 {
 	shared_ptr<ITioStorageManager> mem = 
 		shared_ptr<ITioStorageManager>(new tio::MemoryStorage::MemoryStorageManager());
 	
 	shared_ptr<ITioStorageManager> ldb = 
-		shared_ptr<ITioStorageManager>(new tio::LogDbStorage::LogDbStorageManager(dataPath));
+		shared_ptr<ITioStorageManager>(new tio::LogDbStorage::LogDbStorageManager(dataPath, logdbConfig));
+
+	shared_ptr<ITioStorageManager> btree = 
+		shared_ptr<ITioStorageManager>(new tio::BTreeStorage::BTreeStorageManager(dataPath, btreeConfig));
+
+	shared_ptr<ITioStorageManager> lsm = 
+		shared_ptr<ITioStorageManager>(new tio::LsmStorage::LsmStorageManager(dataPath, lsmConfig));
 
 	containerManager->RegisterFundamentalStorageManagers(mem, mem);
 
@@ -50,14 +65,21 @@ void LoadStorageTypes(ContainerManager* containerManager, const string& dataPath
 
 	containerManager->RegisterStorageManager("persistent_list", ldb);
 	containerManager->RegisterStorageManager("persistent_map", ldb);
+
+	containerManager->RegisterStorageManager("btree_map", btree);
+
+	containerManager->RegisterStorageManager("lsm_map", lsm);
 }
 
 void SetupContainerManager(
 	tio::ContainerManager* manager, 
 	const string& dataPath,
+	const tio::LogDbStorage::LOGDB_CONFIG& logdbConfig,
+	const tio::BTreeStorage::BTREE_CONFIG& btreeConfig,
+	const tio::LsmStorage::LSM_CONFIG& lsmConfig,
 	const vector< pair<string, string> >& aliases)
 {
-	LoadStorageTypes(manager, dataPath);
+	LoadStorageTypes(manager, dataPath, logdbConfig, btreeConfig, lsmConfig);
 
 	pair<string, string> p;
 	BOOST_FOREACH(p, aliases)
@@ -67,9 +89,12 @@ void SetupContainerManager(
 }
 
 void RunServer(tio::ContainerManager* manager,
+			   boost::asio::io_service& io_service,
 			   unsigned short port, 
 			   const vector< pair<string, string> >& users,
-			   const string& logFilePath)
+			   const tio::TRANSACTION_LOG_CONFIG& logConfig,
+			   const tio::REPLICATION_CONFIG& replicationConfig,
+			   unsigned int lastCommandSampling)
 {
 	namespace asio = boost::asio;
 	using namespace boost::asio::ip;
@@ -78,7 +103,6 @@ void RunServer(tio::ContainerManager* manager,
 	//ProfilerStart("/tmp/tio.prof");
 #endif
 
-	asio::io_service io_service;
 	tcp::endpoint e(tcp::v4(), port);
 
 	//
@@ -95,10 +119,22 @@ void RunServer(tio::ContainerManager* manager,
 		}
 	}
 
-	tio::TioTcpServer tioServer(*manager, io_service, e, logFilePath);
+	tio::TioTcpServer tioServer(*manager, io_service, e, logConfig);
+
+	tioServer.SetLastCommandSampling(lastCommandSampling);
 
 	tioServer.Start();
 
+	std::unique_ptr<tio::ReplicationFollower> replicationFollower;
+
+	if(!replicationConfig.primaryHost.empty())
+	{
+		cout << "Replicating from " << replicationConfig.primaryHost << ":" << replicationConfig.primaryPort << endl;
+
+		replicationFollower.reset(new tio::ReplicationFollower(io_service, *manager, replicationConfig));
+		replicationFollower->Start();
+	}
+
 	cout << "Up and running!" << endl;
 
 	io_service.run();
@@ -282,6 +318,7 @@ protected:
 			return -1;
 
 		container->SetProperty(key->string_, value->string_);
+		containerManager_.OnOutsideWrite();
 
 		return 0;
 	}
@@ -293,6 +330,7 @@ protected:
 		try
 		{
 			container->PushBack(c2cpp(key), c2cpp(value), c2cpp(metadata));
+			containerManager_.OnOutsideWrite();
 		}
 		catch(std::exception&)
 		{
@@ -309,6 +347,7 @@ protected:
 		try
 		{
 			container->PushFront(c2cpp(key), c2cpp(value), c2cpp(metadata));
+			containerManager_.OnOutsideWrite();
 		}
 		catch(std::exception&)
 		{
@@ -325,6 +364,7 @@ protected:
 		try
 		{
 			container->PopBack(c2cpp(key).outptr(), c2cpp(value).outptr(), c2cpp(metadata).outptr());
+			containerManager_.OnOutsideWrite();
 		}
 		catch(std::exception&)
 		{
@@ -341,6 +381,7 @@ protected:
 		try
 		{
 			container->PopFront(c2cpp(key).outptr(), c2cpp(value).outptr(), c2cpp(metadata).outptr());
+			containerManager_.OnOutsideWrite();
 		}
 		catch(std::exception&)
 		{
@@ -357,6 +398,7 @@ protected:
 		try
 		{
 			container->Set(c2cpp(key), c2cpp(value), c2cpp(metadata));
+			containerManager_.OnOutsideWrite();
 		}
 		catch(std::exception&)
 		{
@@ -373,6 +415,7 @@ protected:
 		try
 		{
 			container->Insert(c2cpp(key), c2cpp(value), c2cpp(metadata));
+			containerManager_.OnOutsideWrite();
 		}
 		catch(std::exception&)
 		{
@@ -389,6 +432,7 @@ protected:
 		try
 		{
 			container->Clear();
+			containerManager_.OnOutsideWrite();
 		}
 		catch(std::exception&)
 		{
@@ -405,6 +449,7 @@ protected:
 		try
 		{
 			container->Delete(c2cpp(key));
+			containerManager_.OnOutsideWrite();
 		}
 		catch(std::exception&)
 		{
@@ -581,50 +626,73 @@ protected:
 	}
 };
 
-class PluginThread
+#ifdef _WIN32	
+void* OpenPluginLibrary(const string& path)
 {
-	tio_plugin_start_t func_;
-	tio::IContainerManager* containerManager_;
-	queue<std::function<void()> > eventQueue_;
-	boost::condition_variable hasWork_;
-
-public:
-	PluginThread(tio_plugin_start_t func, tio::IContainerManager* containerManager) : func_(func), containerManager_(containerManager)
+	HMODULE hdll = LoadLibrary(path.c_str());
+	
+	if(!hdll)
 	{
-
+		stringstream str;
+		str << "error loading plugin \"" << path << "\": Win32 error " << GetLastError();
+		throw std::runtime_error(str.str());
 	}
 
-	void AnyThreadCallback(EventSink sink, const string& eventName, const TioData& key, const TioData& value, const TioData& metadata)
-	{
+	return hdll;
+}
 
-	}
+void* GetPluginFunction(void* library, const char* name)
+{
+	return (void*)GetProcAddress((HMODULE)library, name);
+}
+#else
+void* OpenPluginLibrary(const string& path)
+{
+	void* library = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
 
-	void start()
+	if(!library)
 	{
-		
-		
+		stringstream str;
+		str << "error loading plugin \"" << path << "\": " << dlerror();
+		throw std::runtime_error(str.str());
 	}
-};
 
-#ifdef _WIN32	
-void LoadPlugin(const string path, tio::IContainerManager* containerManager, const map<string, string>& pluginParameters)
+	return library;
+}
+
+void* GetPluginFunction(void* library, const char* name)
 {
-	tio_plugin_start_t pluginStartFunction = NULL;
+	return dlsym(library, name);
+}
+#endif //_WIN32
 
-	HMODULE hdll = LoadLibrary(path.c_str());
-	
-	if(!hdll)
+//
+// v2 plugins run on their own thread (see TioPlugin.h), v1 plugins
+// are started right here
+//
+void LoadPlugin(const string path, LocalContainerManager* localContainerManager, tio::ContainerManager* containerManager,
+				boost::asio::io_service& io_service, const map<string, string>& pluginParameters,
+				vector< shared_ptr<tio::NativePlugin> >* nativePlugins)
+{
+	void* library = OpenPluginLibrary(path);
+
+	tio_plugin_start_v2_t pluginStartFunctionV2 = (tio_plugin_start_v2_t)GetPluginFunction(library, "tio_plugin_start_v2");
+
+	if(pluginStartFunctionV2)
 	{
-		stringstream str;
-		str << "error loading plugin \"" << path << "\": Win32 error " << GetLastError();
-		throw std::runtime_error(str.str());
+		shared_ptr<tio::NativePlugin> plugin(
+			new tio::NativePlugin(pluginStartFunctionV2, *containerManager, io_service, pluginParameters));
+
+		plugin->Start();
+		nativePlugins->push_back(plugin);
+		return;
 	}
 
-	pluginStartFunction = (tio_plugin_start_t)GetProcAddress(hdll, "tio_plugin_start");
+	tio_plugin_start_t pluginStartFunction = (tio_plugin_start_t)GetPluginFunction(library, "tio_plugin_start");
 
 	if(!pluginStartFunction)
 	{
-		throw std::runtime_error("plugin doesn't export the \"tio_plugin_start\"");
+		throw std::runtime_error("plugin doesn't export the \"tio_plugin_start\" or \"tio_plugin_start_v2\"");
 	}
 
 	scoped_array<KEY_AND_VALUE> kv(new KEY_AND_VALUE[pluginParameters.size() + 1]);
@@ -639,22 +707,16 @@ void LoadPlugin(const string path, tio::IContainerManager* containerManager, con
 	// last one must have key = NULL
 	kv[pluginParameters.size()].key = NULL;
 
-	pluginStartFunction(containerManager, kv.get());
+	pluginStartFunction(static_cast<tio::IContainerManager*>(localContainerManager), kv.get());
 }
-#else
-void LoadPlugin(const string path, tio::IContainerManager* containerManager, const map<string, string>& pluginParameters)
-{
-//nada
-//
-}
-
-#endif //_WIN32
 
-void LoadPlugins(const std::vector<std::string>& plugins, const map<string, string>& pluginParameters, tio::IContainerManager* containerManager)
+void LoadPlugins(const std::vector<std::string>& plugins, const map<string, string>& pluginParameters, 
+				 LocalContainerManager* localContainerManager, tio::ContainerManager* containerManager,
+				 boost::asio::io_service& io_service, vector< shared_ptr<tio::NativePlugin> >* nativePlugins)
 {
 	BOOST_FOREACH(const string& pluginPath, plugins)
 	{
-		LoadPlugin(pluginPath, containerManager, pluginParameters);
+		LoadPlugin(pluginPath, localContainerManager, containerManager, io_service, pluginParameters, nativePlugins);
 	}
 }
 
@@ -679,7 +741,22 @@ int main(int argc, char* argv[])
 			("port", po::value<unsigned short>(), "listening port. If not informed, 2605")
 			("threads", po::value<unsigned short>(), "number of running threads")
 			("log-path", po::value<string>(), "transaction log file path. It must be a full file path, not just the directory. Ex: c:\\data\\tio.log")
-			("data-path", po::value<string>(), "sets data path");
+			("log-flush-interval", po::value<unsigned int>(), "milliseconds between transaction log writes. Records are buffered in memory until then. If not informed, 100")
+			("log-format", po::value<string>(), "transaction log format, text or binary. Binary logs can be replayed by tiologreplay, their file names end with _binary. If not informed, text")
+			("replicate-from", po::value<string>(), "run as a replica of another tio, using syntax host:port. All its containers are copied and kept up to date")
+			("last-command-sampling", po::value<unsigned int>(), "updates __meta__/session_last_command every N commands of each session. Zero disables it. The last commands of a session can always be read with the last_commands command. If not informed, 0")
+			("journal-size", po::value<unsigned int>(), "number of events each container keeps in memory, so journal subscriptions can be resumed without a snapshot. If not informed, 10000")
+			("journal-keep-open-timeout", po::value<unsigned int>(), "seconds a container with journal subscriptions stays open after its last handle is closed, so they can be resumed. If not informed, 300")
+			("data-path", po::value<string>(), "sets data path")
+			("logdb-mmap", "memory map the persistent containers file instead of using logdb page cache")
+			("logdb-shards", po::value<unsigned int>(), "number of logdb files new persistent containers are spread over. If not informed, 1")
+			("logdb-cache-size", po::value<unsigned int>(), "persistent containers value cache size, in megabytes. Zero disables the cache. If not informed, 64")
+			("logdb-cache-policy", po::value<string>(), "value cache eviction policy, clock or lru. If not informed, clock")
+			("logdb-load-threads", po::value<unsigned int>(), "number of threads used to load persistent containers at startup. If not informed, one per core")
+			("logdb-eager-load", "load records of all persistent containers at startup, instead of when they're opened")
+			("logdb-idle-timeout", po::value<unsigned int>(), "seconds a persistent container can stay unopened before its records are unloaded from memory. Zero keeps them loaded. If not informed, 300")
+			("btree-cache-size", po::value<unsigned int>(), "btree_map containers node cache size, in megabytes. If not informed, 64")
+			("lsm-memtable-size", po::value<unsigned int>(), "lsm_map containers memtable size, in megabytes. It's written to a new segment file when it gets bigger than this. If not informed, 32");
 
 		po::variables_map vm;
 		po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -725,6 +802,8 @@ int main(int argc, char* argv[])
 			cout << "Starting infrastructure... " << endl;
 			tio::ContainerManager containerManager;
 			LocalContainerManager localContainerManager(containerManager);
+			boost::asio::io_service io_service;
+			vector< shared_ptr<tio::NativePlugin> > nativePlugins;
 
 			string dataPath =
 				vm.count("data-path") == 0 ?
@@ -733,7 +812,43 @@ int main(int argc, char* argv[])
 
 			cout << "Saving files to " << dataPath << endl;
 			
-			SetupContainerManager(&containerManager, dataPath, aliases);
+			tio::LogDbStorage::LOGDB_CONFIG logdbConfig;
+
+			logdbConfig.memoryMapped = vm.count("logdb-mmap") != 0;
+			logdbConfig.lazyLoad = vm.count("logdb-eager-load") == 0;
+
+			if(vm.count("logdb-load-threads"))
+				logdbConfig.loadThreads = vm["logdb-load-threads"].as<unsigned int>();
+
+			if(vm.count("logdb-idle-timeout"))
+				logdbConfig.idleTableTimeout = vm["logdb-idle-timeout"].as<unsigned int>();
+
+			if(vm.count("logdb-shards"))
+				logdbConfig.shardCount = vm["logdb-shards"].as<unsigned int>();
+
+			if(vm.count("logdb-cache-size"))
+				logdbConfig.valueCacheSize = static_cast<size_t>(vm["logdb-cache-size"].as<unsigned int>()) * 1024 * 1024;
+
+			if(vm.count("logdb-cache-policy"))
+				logdbConfig.valueCachePolicy = tio::LogDbStorage::ParseCachePolicy(vm["logdb-cache-policy"].as<string>());
+
+			tio::BTreeStorage::BTREE_CONFIG btreeConfig;
+
+			if(vm.count("btree-cache-size"))
+				btreeConfig.cacheSize = static_cast<size_t>(vm["btree-cache-size"].as<unsigned int>()) * 1024 * 1024;
+
+			tio::LsmStorage::LSM_CONFIG lsmConfig;
+
+			if(vm.count("lsm-memtable-size"))
+				lsmConfig.memTableSize = static_cast<size_t>(vm["lsm-memtable-size"].as<unsigned int>()) * 1024 * 1024;
+
+			containerManager.SetJournalSize(
+				vm.count("journal-size") ? vm["journal-size"].as<unsigned int>() : 10000);
+
+			if(vm.count("journal-keep-open-timeout"))
+				containerManager.SetJournalKeepOpenTimeout(vm["journal-keep-open-timeout"].as<unsigned int>());
+
+			SetupContainerManager(&containerManager, dataPath, logdbConfig, btreeConfig, lsmConfig, aliases);
 
 			//
 			// Parse plugin parameters
@@ -759,7 +874,8 @@ int main(int argc, char* argv[])
 			if(vm.count("plugin"))
 			{
 				cout << "Loading plugins... " << endl;
-				LoadPlugins(vm["plugin"].as< vector<string> >(), pluginParameters, &localContainerManager);
+				LoadPlugins(vm["plugin"].as< vector<string> >(), pluginParameters, &localContainerManager, 
+					&containerManager, io_service, &nativePlugins);
 			}
 
 #if TIO_PYTHON_PLUGIN_SUPPORT
@@ -780,25 +896,58 @@ int main(int argc, char* argv[])
 
 			cout << "Listening on port " << port << endl;
 
-			string logFilePath;
+			tio::TRANSACTION_LOG_CONFIG logConfig;
 
 			if (vm.count("log-path"))
 			{
-				logFilePath = vm["log-path"].as<string>();
+				logConfig.filePath = vm["log-path"].as<string>();
+
+				cout << "Saving transaction log to " << logConfig.filePath << endl;
+			}
+
+			if(vm.count("log-flush-interval"))
+				logConfig.flushInterval = vm["log-flush-interval"].as<unsigned int>();
+
+			if(vm.count("log-format"))
+			{
+				string logFormat = vm["log-format"].as<string>();
+
+				if(logFormat == "binary")
+					logConfig.binary = true;
+				else if(logFormat != "text")
+					throw std::invalid_argument("invalid log format, should be text or binary");
+			}
+		
+			tio::REPLICATION_CONFIG replicationConfig;
+
+			if(vm.count("replicate-from"))
+			{
+				string primary = vm["replicate-from"].as<string>();
+				string::size_type sep = primary.rfind(':');
 
-				cout << "Saving transaction log to " << logFilePath << endl;
+				replicationConfig.primaryHost = primary.substr(0, sep);
+
+				if(sep != string::npos)
+					replicationConfig.primaryPort = lexical_cast<unsigned short>(primary.substr(sep + 1));
 			}
 		
 			RunServer(
 				&containerManager,
+				io_service,
 				port,
 				users,
-				logFilePath);
+				logConfig,
+				replicationConfig,
+				vm.count("last-command-sampling") ? vm["last-command-sampling"].as<unsigned int>() : 0);
+
+			for(vector< shared_ptr<tio::NativePlugin> >::iterator i = nativePlugins.begin() ; i != nativePlugins.end() ; ++i)
+				(*i)->Stop();
 		}
 	}
 	catch(std::exception& ex)
 	{
 		cout << "error: " << ex.what() << endl;
+		return 1;
 	}
 
 	return 0;
@@ -0,0 +1,507 @@
+/*
+Tio: The Information Overlord
+Copyright 2010 Rodrigo Strauss (http://www.1bit.com.br)
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+//
+// Replays a binary transaction log (tiodb --log-format binary) against a
+// server, as fast as possible or scaled to the original timing. Commands
+// are pipelined in batches, reports throughput and batch latency.
+//
+// Text logs are replayed by tiologreplay.py
+//
+
+#include "../../client/c/tioclient.h"
+#include "../../server/tio/TioBinaryLog.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using std::string;
+using std::vector;
+using std::cout;
+using std::endl;
+
+typedef std::chrono::steady_clock Clock;
+
+struct REPLAY_CONFIG
+{
+	string host;
+	unsigned short port;
+	string fileName;
+
+	//
+	// zero is as fast as possible, 1 is the original timing, 2 is twice as fast
+	//
+	double speed;
+
+	//
+	// commands sent before waiting for the answers
+	//
+	unsigned int batchSize;
+
+	//
+	// containers starting with "__" are skipped by default
+	//
+	bool includeMetaContainers;
+
+	REPLAY_CONFIG() :
+		host("localhost"),
+		port(TIO_DEFAULT_PORT),
+		speed(0),
+		batchSize(100),
+		includeMetaContainers(false)
+	{
+	}
+};
+
+class TioDataHolder
+{
+	TIO_DATA data_;
+
+public:
+	TioDataHolder()
+	{
+		tiodata_init(&data_);
+	}
+
+	~TioDataHolder()
+	{
+		tiodata_free(&data_);
+	}
+
+	TIO_DATA* get()
+	{
+		return &data_;
+	}
+
+	string AsString() const
+	{
+		if(data_.data_type != TIO_DATA_TYPE_STRING)
+			return string();
+
+		return string(data_.string_, data_.string_size_);
+	}
+};
+
+struct LOG_ENTRY
+{
+	TIO_BINARY_LOG_RECORD header;
+	TioDataHolder key, value, metadata;
+};
+
+class BinaryLogReader
+{
+	FILE* file_;
+	vector<char> buffer_;
+
+	static const char* ReadField(const char* current, const char* end, TIO_DATA* data)
+	{
+		TIO_BINARY_LOG_FIELD field;
+
+		if(end - current < static_cast<ptrdiff_t>(sizeof(field)))
+			throw std::runtime_error("corrupted record");
+
+		memcpy(&field, current, sizeof(field));
+		current += sizeof(field);
+
+		if(end - current < static_cast<ptrdiff_t>(field.size))
+			throw std::runtime_error("corrupted record");
+
+		switch(field.data_type)
+		{
+		case TIO_DATA_TYPE_STRING:
+			tiodata_set_string_and_size(data, current, field.size);
+			break;
+		case TIO_DATA_TYPE_INT:
+			{
+				int value;
+				if(field.size != sizeof(value))
+					throw std::runtime_error("corrupted record");
+				memcpy(&value, current, sizeof(value));
+				tiodata_set_int(data, value);
+			}
+			break;
+		case TIO_DATA_TYPE_DOUBLE:
+			{
+				double value;
+				if(field.size != sizeof(value))
+					throw std::runtime_error("corrupted record");
+				memcpy(&value, current, sizeof(value));
+				tiodata_set_double(data, value);
+			}
+			break;
+		default:
+			tiodata_set_as_none(data);
+		}
+
+		return current + field.size;
+	}
+
+public:
+	BinaryLogReader(const string& fileName)
+	{
+		char magic[TIO_BINARY_LOG_MAGIC_SIZE];
+
+		file_ = fopen(fileName.c_str(), "rb");
+
+		if(!file_)
+			throw std::runtime_error("error opening " + fileName);
+
+		setvbuf(file_, NULL, _IOFBF, 1024 * 1024);
+
+		if(fread(magic, 1, sizeof(magic), file_) != sizeof(magic) ||
+			memcmp(magic, TIO_BINARY_LOG_MAGIC, sizeof(magic)) != 0)
+		{
+			fclose(file_);
+			throw std::runtime_error(fileName + " is not a binary transaction log");
+		}
+	}
+
+	~BinaryLogReader()
+	{
+		fclose(file_);
+	}
+
+	//
+	// returns false at the end of the log. An incomplete last record
+	// (server was writing it) is the end of the log too
+	//
+	bool Read(LOG_ENTRY* entry)
+	{
+		if(fread(&entry->header, 1, sizeof(entry->header), file_) != sizeof(entry->header))
+			return false;
+
+		if(entry->header.size < sizeof(entry->header))
+			throw std::runtime_error("corrupted record");
+
+		buffer_.resize(entry->header.size - sizeof(entry->header));
+
+		if(!buffer_.empty() && fread(&buffer_[0], 1, buffer_.size(), file_) != buffer_.size())
+			return false;
+
+		const char* current = buffer_.data();
+		const char* end = current + buffer_.size();
+
+		current = ReadField(current, end, entry->key.get());
+		current = ReadField(current, end, entry->value.get());
+		current = ReadField(current, end, entry->metadata.get());
+
+		return true;
+	}
+};
+
+class LogReplayer
+{
+	const REPLAY_CONFIG& config_;
+	TIO_CONNECTION* connection_;
+
+	//
+	// global handle from the log. NULL if the container is skipped
+	//
+	std::unordered_map<unsigned int, TIO_CONTAINER*> containers_;
+
+	unsigned int pendingCommands_;
+	Clock::time_point batchStart_;
+	vector<double> latencies_;
+
+	unsigned long long records_, commands_, errors_, skipped_;
+
+	void CheckResult(int result)
+	{
+		if(TIO_FAILED(result))
+			errors_++;
+	}
+
+	void BeginCommand()
+	{
+		if(pendingCommands_ == 0)
+		{
+			batchStart_ = Clock::now();
+
+			if(config_.batchSize > 1)
+				tio_begin_network_batch(connection_);
+		}
+
+		pendingCommands_++;
+	}
+
+	void FinishBatch()
+	{
+		if(pendingCommands_ == 0)
+			return;
+
+		if(config_.batchSize > 1)
+			errors_ += tio_finish_network_batch(connection_);
+
+		latencies_.push_back(std::chrono::duration<double, std::micro>(Clock::now() - batchStart_).count());
+
+		commands_ += pendingCommands_;
+		pendingCommands_ = 0;
+	}
+
+	void CreateContainer(LOG_ENTRY& entry)
+	{
+		string name = entry.key.AsString(), type = entry.value.AsString();
+		TIO_CONTAINER* container = NULL;
+
+		if(config_.includeMetaContainers || name.compare(0, 2, "__") != 0)
+		{
+			int result = tio_create(connection_, name.c_str(), type.c_str(), &container);
+
+			if(TIO_FAILED(result))
+			{
+				cout << "error creating container \"" << name << "\" (" << type << "), its records will be skipped" << endl;
+				container = NULL;
+			}
+		}
+
+		containers_[entry.header.handle] = container;
+	}
+
+	void Replay(LOG_ENTRY& entry)
+	{
+		switch(entry.header.command)
+		{
+		case TIO_COMMAND_CREATE:
+			FinishBatch();
+			CreateContainer(entry);
+			return;
+		case TIO_COMMAND_GROUP_ADD:
+			FinishBatch();
+			CheckResult(tio_group_add(connection_, entry.key.AsString().c_str(), entry.value.AsString().c_str()));
+			return;
+		}
+
+		TIO_CONTAINER* container = containers_[entry.header.handle];
+
+		if(!container)
+		{
+			skipped_++;
+			return;
+		}
+
+		BeginCommand();
+
+		switch(entry.header.command)
+		{
+		case TIO_COMMAND_PUSH_BACK:
+			CheckResult(tio_container_push_back(container, entry.key.get(), entry.value.get(), entry.metadata.get()));
+			break;
+		case TIO_COMMAND_PUSH_FRONT:
+			CheckResult(tio_container_push_front(container, entry.key.get(), entry.value.get(), entry.metadata.get()));
+			break;
+		case TIO_COMMAND_POP_BACK:
+			CheckResult(tio_container_pop_back(container, NULL, NULL, NULL));
+			break;
+		case TIO_COMMAND_POP_FRONT:
+			CheckResult(tio_container_pop_front(container, NULL, NULL, NULL));
+			break;
+		case TIO_COMMAND_SET:
+			CheckResult(tio_container_set(container, entry.key.get(), entry.value.get(), entry.metadata.get()));
+			break;
+		case TIO_COMMAND_INSERT:
+			CheckResult(tio_container_insert(container, entry.key.get(), entry.value.get(), entry.metadata.get()));
+			break;
+		case TIO_COMMAND_DELETE:
+			CheckResult(tio_container_delete(container, entry.key.get()));
+			break;
+		case TIO_COMMAND_CLEAR:
+			CheckResult(tio_container_clear(container));
+			break;
+		case TIO_COMMAND_PROPSET:
+			CheckResult(tio_container_propset(container, entry.key.get(), entry.value.get()));
+			break;
+		default:
+			pendingCommands_--;
+			skipped_++;
+			return;
+		}
+
+		if(pendingCommands_ >= config_.batchSize)
+			FinishBatch();
+	}
+
+	double GetPercentile(double percentile)
+	{
+		if(latencies_.empty())
+			return 0;
+
+		size_t index = static_cast<size_t>(percentile / 100 * (latencies_.size() - 1));
+		std::nth_element(latencies_.begin(), latencies_.begin() + index, latencies_.end());
+		return latencies_[index];
+	}
+
+public:
+	LogReplayer(const REPLAY_CONFIG& config) :
+		config_(config),
+		connection_(NULL),
+		pendingCommands_(0),
+		records_(0),
+		commands_(0),
+		errors_(0),
+		skipped_(0)
+	{
+		tio_initialize();
+
+		if(TIO_FAILED(tio_connect(config_.host.c_str(), config_.port, &connection_)))
+			throw std::runtime_error("error connecting to " + config_.host + ":" + std::to_string(config_.port));
+	}
+
+	~LogReplayer()
+	{
+		tio_disconnect(connection_);
+	}
+
+	void Run()
+	{
+		BinaryLogReader reader(config_.fileName);
+		LOG_ENTRY entry;
+
+		Clock::time_point start = Clock::now(), lastReport = start;
+		unsigned long long firstTimestamp = 0, lastReportCommands = 0;
+		long long elapsed = 0;
+
+		while(reader.Read(&entry))
+		{
+			if(records_ == 0)
+				firstTimestamp = entry.header.timestamp;
+
+			//
+			// timestamps come from the server wall clock, that can step backwards.
+			// When it does, we replay the record right after the previous one
+			//
+			elapsed = std::max(elapsed, static_cast<long long>(entry.header.timestamp) - static_cast<long long>(firstTimestamp));
+
+			//
+			// wait for the record time, scaled. Commands already sent must
+			// be answered before, since we're going to wait anyway
+			//
+			if(config_.speed > 0)
+			{
+				Clock::time_point when = start + std::chrono::microseconds(
+					static_cast<long long>(elapsed / config_.speed));
+
+				if(when > Clock::now())
+				{
+					FinishBatch();
+					std::this_thread::sleep_until(when);
+				}
+			}
+
+			Replay(entry);
+			records_++;
+
+			Clock::time_point now = Clock::now();
+
+			if(now - lastReport >= std::chrono::seconds(1))
+			{
+				double seconds = std::chrono::duration<double>(now - lastReport).count();
+
+				cout << records_ << " records, " << commands_ << " commands, "
+					<< static_cast<unsigned long long>((commands_ - lastReportCommands) / seconds) << " commands/s" << endl;
+
+				lastReport = now;
+				lastReportCommands = commands_;
+			}
+		}
+
+		FinishBatch();
+
+		double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+		cout << endl
+			<< "records: " << records_ << endl
+			<< "commands: " << commands_ << endl
+			<< "errors: " << errors_ << endl
+			<< "skipped: " << skipped_ << endl
+			<< "seconds: " << seconds << endl
+			<< "commands/s: " << static_cast<unsigned long long>(seconds > 0 ? commands_ / seconds : 0) << endl
+			<< "batch latency (us), " << latencies_.size() << " batches: "
+			<< "p50=" << GetPercentile(50)
+			<< " p90=" << GetPercentile(90)
+			<< " p99=" << GetPercentile(99)
+			<< " p99.9=" << GetPercentile(99.9)
+			<< " max=" << GetPercentile(100) << endl;
+	}
+};
+
+void Usage()
+{
+	cout << "usage: tiologreplay [options] log_file" << endl
+		<< "  --host host      server host. If not informed, localhost" << endl
+		<< "  --port port      server port. If not informed, " << TIO_DEFAULT_PORT << endl
+		<< "  --speed factor   replay with the original timing scaled by factor (2 is twice as fast)." << endl
+		<< "                   If not informed, replays as fast as possible" << endl
+		<< "  --batch count    commands sent before waiting for the answers. If not informed, 100" << endl
+		<< "  --include-meta   replay containers starting with \"__\" too" << endl;
+}
+
+int main(int argc, char* argv[])
+{
+	REPLAY_CONFIG config;
+
+	try
+	{
+		for(int a = 1 ; a < argc ; a++)
+		{
+			string arg = argv[a];
+			bool hasValue = a + 1 < argc;
+
+			if(arg == "--host" && hasValue)
+				config.host = argv[++a];
+			else if(arg == "--port" && hasValue)
+				config.port = static_cast<unsigned short>(std::stoi(argv[++a]));
+			else if(arg == "--speed" && hasValue)
+				config.speed = std::stod(argv[++a]);
+			else if(arg == "--batch" && hasValue)
+				config.batchSize = std::max(1, std::stoi(argv[++a]));
+			else if(arg == "--include-meta")
+				config.includeMetaContainers = true;
+			else if(arg.compare(0, 2, "--") != 0 && config.fileName.empty())
+				config.fileName = arg;
+			else
+			{
+				Usage();
+				return 1;
+			}
+		}
+
+		if(config.fileName.empty())
+		{
+			Usage();
+			return 1;
+		}
+
+		LogReplayer replayer(config);
+		replayer.Run();
+	}
+	catch(std::exception& ex)
+	{
+		cout << "error: " << ex.what() << endl;
+		return 1;
+	}
+
+	return 0;
+}